@@ -0,0 +1,111 @@
+#!/bin/bash
+
+# Times full likelihood evaluations (benchmark option) of the 32-taxon tree in gtrg-32taxa.tre
+# for the two protein-coding genes of S1679.nex that have no stop codons in frame 1 under the
+# invertebrate mitochondrial code (COI, sites 1-774, and COII, sites 775-1476: 492 codons),
+# each a codon subset with 4 rate categories and 62 states (the invertebrate mitochondrial
+# code has two stop codons). The remaining sites (tRNA, ATPase8 and ATPase6) form a
+# nucleotide subset, which costs little next to the codon subsets. This is the data set used
+# to compare BeagleLib with the native backend's tiled codon kernel (native_engine.hpp).
+#
+# Data::storeData gives every site in a characters block the data type of the block's first
+# site, and codon subsets are numbered in codons, so S1679.nex (a single block of 2152
+# nucleotides) is first split into three characters blocks (COI, COII and the rest). In the
+# split file COI is codons 1-258, COII is codons 259-492 and the rest is sites 493-1168.
+#
+# Usage: ./benchmark-codon.sh [path to lorad executable] [number of evaluations]
+
+LORAD=$(cd "$(dirname "${1:-../src/lorad}")" && pwd)/$(basename "${1:-../src/lorad}")
+NEVALS=${2:-100}
+HERE=$(pwd)
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+# Split the matrix of S1679.nex into three characters blocks (ambiguity codes such as {AG}
+# count as one site)
+awk '
+    /^MATRIX/ { inmatrix = 1; next }
+    inmatrix && /^;/ { inmatrix = 0 }
+    inmatrix && NF == 2 {
+        ntax++
+        name[ntax] = $1
+        n = 0
+        seq = $2
+        while (length(seq) > 0) {
+            if (substr(seq, 1, 1) == "{") {
+                k = index(seq, "}")
+                site[ntax, ++n] = substr(seq, 1, k)
+                seq = substr(seq, k + 1)
+            }
+            else {
+                site[ntax, ++n] = substr(seq, 1, 1)
+                seq = substr(seq, 2)
+            }
+        }
+        if (n != 2152) {
+            print "expected 2152 sites for " $1 " but found " n > "/dev/stderr"
+            exit 1
+        }
+    }
+    function block(first, last,    t, j, row) {
+        print "BEGIN CHARACTERS;"
+        print "    DIMENSIONS NCHAR=" (last - first + 1) ";"
+        print "    FORMAT DATATYPE=DNA MISSING=? GAP=-;"
+        print "    MATRIX"
+        for (t = 1; t <= ntax; t++) {
+            row = ""
+            for (j = first; j <= last; j++)
+                row = row site[t, j]
+            print "        " name[t] " " row
+        }
+        print "    ;"
+        print "END;"
+    }
+    END {
+        print "#NEXUS"
+        print "BEGIN TAXA;"
+        print "    DIMENSIONS NTAX=" ntax ";"
+        printf "    TAXLABELS"
+        for (t = 1; t <= ntax; t++)
+            printf " %s", name[t]
+        print ";"
+        print "END;"
+        block(1, 774)
+        block(775, 1476)
+        block(1477, 2152)
+    }
+' "$HERE/S1679.nex" > "$WORKDIR/S1679-split.nex" || exit 1
+
+cat > "$WORKDIR/lorad.conf" <<END
+datafile         = $WORKDIR/S1679-split.nex
+treefile         = $HERE/gtrg-32taxa.tre
+tree             = default:[1]
+subset           = COI[codon,invertmito]:1-258
+subset           = COII[codon,invertmito]:259-492
+subset           = rest[nucleotide]:493-1168
+statefreq        = default:equal
+omega            = default:0.1
+ncateg           = default:4
+pinvar           = default:[0.0]
+relrate          = default:equal
+nchains          = 1
+burnin           = 0
+niter            = 1
+samplefreq       = 1
+printfreq        = 1
+seed             = 13579
+usedata          = yes
+gpu              = no
+ambigmissing     = yes
+underflowscaling = yes
+allowpolytomies  = no
+resclassprior    = yes
+topopriorC       = 1.0
+END
+
+cd "$WORKDIR"
+for run in "beagle single" "beagle double" "native double"; do
+    set -- $run
+    echo "=== backend = $1, precision = $2"
+    "$LORAD" --backend=$1 --precision=$2 --benchmark=$NEVALS | grep -E "^  (backend|precision|log-likelihood|time per evaluation):"
+done
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <atomic>
+
+namespace lorad {
+
+    // Counts calls to the global operator new (the replacement operators defined in main.cpp
+    // call increment). Used to verify that MCMC iterations do not allocate heap memory.
+    // The count stays at zero unless LORAD_COUNT_ALLOCS is defined at compile time.
+    class AllocCounter {
+        public:
+            static unsigned long                getCount();
+            static void                         increment();
+
+        private:
+
+            static std::atomic<unsigned long>   _count;
+    };
+
+    inline unsigned long AllocCounter::getCount() {
+        return _count.load(std::memory_order_relaxed);
+    }
+
+    inline void AllocCounter::increment() {
+        _count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+}
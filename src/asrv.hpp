@@ -77,12 +77,15 @@ namespace lorad {
             const double *                      getRates() const;
             const double *                      getProbs() const;
 
+            unsigned long                       getVersion() const;
+
         private:
         
             virtual void                        recalcASRV();
 
             unsigned                            _num_categ;
             bool                                _invar_model;
+            unsigned long                       _version;
         
 #if defined(HOLDER_ETAL_PRIOR)
             bool                                _shape_fixed;
@@ -106,6 +109,9 @@ namespace lorad {
     };
     
     inline ASRV::ASRV() {
+        // Version 0 is never assigned, so anything recorded as version 0
+        // is known to be out of date
+        _version = 1;
         clear();
     }
 
@@ -210,6 +216,11 @@ namespace lorad {
         return &_probs[0];
     }
 
+    inline unsigned long ASRV::getVersion() const {
+        // Incremented every time rates and probs are recalculated
+        return _version;
+    }
+
     inline bool ASRV::getIsInvarModel() const {
         return _invar_model;
     }
@@ -254,6 +265,9 @@ namespace lorad {
         // and the mean rate will be 1/(1 - _pinvar) rather than 1; the rest of the invariable
         // sites component of the model is handled outside the ASRV class.
         
+        // Invalidate copies of the rates and probs held by BeagleLib
+        ++_version;
+
         // _num_categ, _rate_var, and _pinvar must all have been assigned in order to compute rates and probs
 #if defined(HOLDER_ETAL_PRIOR)
         if ( (!_shape) || (!_num_categ) || (!_pinvar) )
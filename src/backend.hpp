@@ -0,0 +1,106 @@
+#pragma once
+
+#include <string>
+#include "libhmsbeagle/beagle.h"
+#include "native_engine.hpp"
+
+namespace lorad {
+
+    // Table of the BeagleLib functions used by Likelihood and Model. Every entry has the
+    // signature of the BeagleLib function of the same name, so the table can point either at
+    // BeagleLib itself or at NativeEngine.
+    struct Backend {
+        std::string                                                 name;
+        decltype(&beagleCreateInstance)                             createInstance;
+        decltype(&beagleFinalizeInstance)                           finalizeInstance;
+        decltype(&beagleSetTipStates)                               setTipStates;
+        decltype(&beagleSetTipPartials)                             setTipPartials;
+        decltype(&beagleSetPatternWeights)                          setPatternWeights;
+        decltype(&beagleSetPatternPartitions)                       setPatternPartitions;
+        decltype(&beagleSetEigenDecomposition)                      setEigenDecomposition;
+        decltype(&beagleSetStateFrequencies)                        setStateFrequencies;
+        decltype(&beagleSetCategoryWeights)                         setCategoryWeights;
+        decltype(&beagleSetCategoryRatesWithIndex)                  setCategoryRatesWithIndex;
+        decltype(&beagleSetTransitionMatrix)                        setTransitionMatrix;
+        decltype(&beagleUpdateTransitionMatrices)                   updateTransitionMatrices;
+        decltype(&beagleUpdateTransitionMatricesWithMultipleModels) updateTransitionMatricesWithMultipleModels;
+        decltype(&beagleUpdatePartials)                             updatePartials;
+        decltype(&beagleUpdatePartialsByPartition)                  updatePartialsByPartition;
+        decltype(&beagleAccumulateScaleFactors)                     accumulateScaleFactors;
+        decltype(&beagleAccumulateScaleFactorsByPartition)          accumulateScaleFactorsByPartition;
+        decltype(&beagleRemoveScaleFactors)                         removeScaleFactors;
+        decltype(&beagleRemoveScaleFactorsByPartition)              removeScaleFactorsByPartition;
+        decltype(&beagleResetScaleFactors)                          resetScaleFactors;
+        decltype(&beagleResetScaleFactorsByPartition)               resetScaleFactorsByPartition;
+        decltype(&beagleCalculateEdgeLogLikelihoods)                calculateEdgeLogLikelihoods;
+        decltype(&beagleCalculateEdgeLogLikelihoodsByPartition)     calculateEdgeLogLikelihoodsByPartition;
+        decltype(&beagleGetSiteLogLikelihoods)                      getSiteLogLikelihoods;
+        decltype(&beagleGetSiteDerivatives)                         getSiteDerivatives;
+
+        static Backend                                              beagleLib();
+        static Backend                                              native();
+    };
+
+    inline Backend Backend::beagleLib() {
+        Backend b;
+        b.name                                          = "beagle";
+        b.createInstance                                = &beagleCreateInstance;
+        b.finalizeInstance                              = &beagleFinalizeInstance;
+        b.setTipStates                                  = &beagleSetTipStates;
+        b.setTipPartials                                = &beagleSetTipPartials;
+        b.setPatternWeights                             = &beagleSetPatternWeights;
+        b.setPatternPartitions                          = &beagleSetPatternPartitions;
+        b.setEigenDecomposition                         = &beagleSetEigenDecomposition;
+        b.setStateFrequencies                           = &beagleSetStateFrequencies;
+        b.setCategoryWeights                            = &beagleSetCategoryWeights;
+        b.setCategoryRatesWithIndex                     = &beagleSetCategoryRatesWithIndex;
+        b.setTransitionMatrix                           = &beagleSetTransitionMatrix;
+        b.updateTransitionMatrices                      = &beagleUpdateTransitionMatrices;
+        b.updateTransitionMatricesWithMultipleModels    = &beagleUpdateTransitionMatricesWithMultipleModels;
+        b.updatePartials                                = &beagleUpdatePartials;
+        b.updatePartialsByPartition                     = &beagleUpdatePartialsByPartition;
+        b.accumulateScaleFactors                        = &beagleAccumulateScaleFactors;
+        b.accumulateScaleFactorsByPartition             = &beagleAccumulateScaleFactorsByPartition;
+        b.removeScaleFactors                            = &beagleRemoveScaleFactors;
+        b.removeScaleFactorsByPartition                 = &beagleRemoveScaleFactorsByPartition;
+        b.resetScaleFactors                             = &beagleResetScaleFactors;
+        b.resetScaleFactorsByPartition                  = &beagleResetScaleFactorsByPartition;
+        b.calculateEdgeLogLikelihoods                   = &beagleCalculateEdgeLogLikelihoods;
+        b.calculateEdgeLogLikelihoodsByPartition        = &beagleCalculateEdgeLogLikelihoodsByPartition;
+        b.getSiteLogLikelihoods                         = &beagleGetSiteLogLikelihoods;
+        b.getSiteDerivatives                            = &beagleGetSiteDerivatives;
+        return b;
+    }
+
+    inline Backend Backend::native() {
+        Backend b;
+        b.name                                          = "native";
+        b.createInstance                                = &NativeEngine::createInstance;
+        b.finalizeInstance                              = &NativeEngine::finalizeInstance;
+        b.setTipStates                                  = &NativeEngine::setTipStates;
+        b.setTipPartials                                = &NativeEngine::setTipPartials;
+        b.setPatternWeights                             = &NativeEngine::setPatternWeights;
+        b.setPatternPartitions                          = &NativeEngine::setPatternPartitions;
+        b.setEigenDecomposition                         = &NativeEngine::setEigenDecomposition;
+        b.setStateFrequencies                           = &NativeEngine::setStateFrequencies;
+        b.setCategoryWeights                            = &NativeEngine::setCategoryWeights;
+        b.setCategoryRatesWithIndex                     = &NativeEngine::setCategoryRatesWithIndex;
+        b.setTransitionMatrix                           = &NativeEngine::setTransitionMatrix;
+        b.updateTransitionMatrices                      = &NativeEngine::updateTransitionMatrices;
+        b.updateTransitionMatricesWithMultipleModels    = &NativeEngine::updateTransitionMatricesWithMultipleModels;
+        b.updatePartials                                = &NativeEngine::updatePartials;
+        b.updatePartialsByPartition                     = &NativeEngine::updatePartialsByPartition;
+        b.accumulateScaleFactors                        = &NativeEngine::accumulateScaleFactors;
+        b.accumulateScaleFactorsByPartition             = &NativeEngine::accumulateScaleFactorsByPartition;
+        b.removeScaleFactors                            = &NativeEngine::removeScaleFactors;
+        b.removeScaleFactorsByPartition                 = &NativeEngine::removeScaleFactorsByPartition;
+        b.resetScaleFactors                             = &NativeEngine::resetScaleFactors;
+        b.resetScaleFactorsByPartition                  = &NativeEngine::resetScaleFactorsByPartition;
+        b.calculateEdgeLogLikelihoods                   = &NativeEngine::calculateEdgeLogLikelihoods;
+        b.calculateEdgeLogLikelihoodsByPartition        = &NativeEngine::calculateEdgeLogLikelihoodsByPartition;
+        b.getSiteLogLikelihoods                         = &NativeEngine::getSiteLogLikelihoods;
+        b.getSiteDerivatives                            = &NativeEngine::getSiteDerivatives;
+        return b;
+    }
+
+}
@@ -0,0 +1,327 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+#include <boost/format.hpp>
+
+namespace lorad {
+
+    // Decides when burn-in can end. Burn-in iterations are divided into windows and each
+    // window is compared with the one before it. The chains are considered to have stabilized
+    // when, for every chain,
+    //   1. the mean log-likelihood and mean log-prior did not change significantly (a Geweke-style
+    //      z test in which the variance of each window mean is estimated from batch means, so
+    //      that autocorrelation within the window is accounted for),
+    //   2. no updater's tuning parameter changed by more than a factor of exp(_lambda_tolerance)
+    //      over the window, and
+    //   3. no updater's acceptance rate changed significantly (two-proportion z test; updaters
+    //      attempted fewer than _min_attempts times in either window are not tested),
+    // and this has been true for _nstable_required successive windows. Everything is sized by
+    // init, so recording and closing windows never allocate.
+    class BurninMonitor {
+
+        public:
+
+            typedef std::shared_ptr< BurninMonitor > SharedPtr;
+
+                                        BurninMonitor();
+                                        ~BurninMonitor();
+
+            void                        clear();
+            void                        init(unsigned nchains, unsigned window_size, const std::vector<std::string> & names);
+
+            void                        recordState(unsigned chain_index, double log_likelihood, double log_prior);
+            bool                        isWindowFull() const;
+            void                        recordLambdas(unsigned chain_index, const std::vector<double> & lambdas);
+            void                        recordAcceptances(unsigned chain_position, unsigned chain_index, const std::vector<unsigned> & naccepts, const std::vector<unsigned> & nupdates);
+            bool                        closeWindow();
+
+            unsigned                    getNumWindows() const;
+            std::string                 getUnstableReason() const;
+
+        private:
+
+            // Why the chains were not (yet) considered stable at the last window; the reason is
+            // only formatted when asked for, so that closing a window does not allocate
+            enum UnstableCause {
+                CAUSE_NONE,
+                CAUSE_ONE_WINDOW,
+                CAUSE_LOG_LIKELIHOOD,
+                CAUSE_LOG_PRIOR,
+                CAUSE_LAMBDA,
+                CAUSE_ACCEPTANCE,
+                CAUSE_TOO_FEW_STABLE
+            };
+
+            struct WindowSummary {
+                WindowSummary() : _mean(0.0), _var_mean(0.0) {}
+                double _mean;
+                double _var_mean;       // estimated variance of _mean
+            };
+
+            // Everything is indexed by chain index, which follows the heating power when chains swap
+            struct ChainState {
+                std::vector<double>     _log_likelihoods;       // this window
+                std::vector<double>     _log_priors;            // this window
+                WindowSummary           _prev_log_likelihood;   // previous window
+                WindowSummary           _prev_log_prior;        // previous window
+                std::vector<double>     _prev_lambdas;          // at the end of the previous window
+                std::vector<double>     _lambdas;               // at the end of this window
+                std::vector<unsigned>   _nupdates;              // attempts during this window
+                std::vector<unsigned>   _naccepts;              // acceptances during this window
+                std::vector<double>     _prev_accept_rates;     // during the previous window (negative if too few attempts)
+                std::vector<unsigned>   _prev_window_nupdates;  // attempts during the previous window
+            };
+
+            // Acceptance counts stay with the Chain object when chains swap, so they are
+            // remembered for each position and the counts made since are credited to the chain
+            // index the position held while making them
+            struct ChainPosition {
+                ChainPosition() : _chain_index(0), _recorded(false) {}
+                unsigned                _chain_index;           // held while making the updates since the last record
+                bool                    _recorded;              // false until the first record
+                std::vector<unsigned>   _nupdates;              // cumulative, at the last record
+                std::vector<unsigned>   _naccepts;              // cumulative, at the last record
+            };
+
+            WindowSummary               summarize(const std::vector<double> & v) const;
+            bool                        isSameMean(const WindowSummary & prev, const WindowSummary & curr) const;
+            void                        setUnstableCause(UnstableCause cause, unsigned chain_index, unsigned updater, double from, double to);
+
+            unsigned                    _window_size;
+            unsigned                    _nwindows;
+            unsigned                    _nstable;               // number of successive stable windows
+            std::vector<ChainState>     _chain_states;
+            std::vector<ChainPosition>  _chain_positions;
+            std::vector<std::string>    _names;                 // of the updaters (the same in every chain)
+            UnstableCause               _unstable_cause;
+            unsigned                    _unstable_chain;
+            unsigned                    _unstable_updater;
+            double                      _unstable_from;
+            double                      _unstable_to;
+
+            static const unsigned       _nbatches;              // batches per window used to estimate the variance of a window mean
+            static const unsigned       _nstable_required;
+            static const unsigned       _min_attempts;
+            static const double         _z_threshold;
+            static const double         _lambda_tolerance;
+    };
+
+    inline BurninMonitor::BurninMonitor() {
+        clear();
+    }
+
+    inline BurninMonitor::~BurninMonitor() {
+    }
+
+    inline void BurninMonitor::clear() {
+        _window_size = 0;
+        _nwindows = 0;
+        _nstable = 0;
+        _chain_states.clear();
+        _chain_positions.clear();
+        _names.clear();
+        _unstable_cause = CAUSE_NONE;
+        _unstable_chain = 0;
+        _unstable_updater = 0;
+        _unstable_from = 0.0;
+        _unstable_to = 0.0;
+    }
+
+    inline void BurninMonitor::init(unsigned nchains, unsigned window_size, const std::vector<std::string> & names) {
+        clear();
+        _window_size = std::max(window_size, _nbatches);
+        _names = names;
+        unsigned nupdaters = (unsigned)names.size();
+        _chain_states.resize(nchains);
+        _chain_positions.resize(nchains);
+        for (auto & cs : _chain_states) {
+            cs._log_likelihoods.reserve(_window_size);
+            cs._log_priors.reserve(_window_size);
+            cs._prev_lambdas.assign(nupdaters, 0.0);
+            cs._lambdas.assign(nupdaters, 0.0);
+            cs._nupdates.assign(nupdaters, 0);
+            cs._naccepts.assign(nupdaters, 0);
+            cs._prev_accept_rates.assign(nupdaters, -1.0);
+            cs._prev_window_nupdates.assign(nupdaters, 0);
+        }
+        for (auto & cp : _chain_positions) {
+            cp._nupdates.assign(nupdaters, 0);
+            cp._naccepts.assign(nupdaters, 0);
+        }
+    }
+
+    inline void BurninMonitor::recordState(unsigned chain_index, double log_likelihood, double log_prior) {
+        assert(chain_index < _chain_states.size());
+        ChainState & cs = _chain_states[chain_index];
+        cs._log_likelihoods.push_back(log_likelihood);
+        cs._log_priors.push_back(log_prior);
+    }
+
+    inline bool BurninMonitor::isWindowFull() const {
+        assert(_chain_states.size() > 0);
+        return _chain_states[0]._log_likelihoods.size() >= _window_size;
+    }
+
+    inline void BurninMonitor::recordLambdas(unsigned chain_index, const std::vector<double> & lambdas) {
+        assert(chain_index < _chain_states.size());
+        ChainState & cs = _chain_states[chain_index];
+        assert(lambdas.size() == cs._lambdas.size());
+        std::copy(lambdas.begin(), lambdas.end(), cs._lambdas.begin());
+    }
+
+    inline void BurninMonitor::recordAcceptances(unsigned chain_position, unsigned chain_index, const std::vector<unsigned> & naccepts, const std::vector<unsigned> & nupdates) {
+        // Called every iteration, after chains have swapped, with the counts made since tuning
+        // began. The updates made since the last call are credited to the chain index the
+        // position held before the swap; chain_index is the one it holds from now on.
+        assert(chain_position < _chain_positions.size());
+        assert(chain_index < _chain_states.size());
+        ChainPosition & cp = _chain_positions[chain_position];
+        unsigned nupdaters = (unsigned)cp._nupdates.size();
+        assert(naccepts.size() == nupdaters && nupdates.size() == nupdaters);
+        if (cp._recorded) {
+            ChainState & cs = _chain_states[cp._chain_index];
+            for (unsigned i = 0; i < nupdaters; i++) {
+                cs._nupdates[i] += nupdates[i] - cp._nupdates[i];
+                cs._naccepts[i] += naccepts[i] - cp._naccepts[i];
+            }
+        }
+        std::copy(nupdates.begin(), nupdates.end(), cp._nupdates.begin());
+        std::copy(naccepts.begin(), naccepts.end(), cp._naccepts.begin());
+        cp._chain_index = chain_index;
+        cp._recorded = true;
+    }
+
+    inline BurninMonitor::WindowSummary BurninMonitor::summarize(const std::vector<double> & v) const {
+        WindowSummary s;
+        unsigned n = (unsigned)v.size();
+        assert(n >= _nbatches);
+        unsigned batch_size = n/_nbatches;
+        unsigned m = batch_size*_nbatches;
+        for (unsigned i = 0; i < m; i++)
+            s._mean += v[i];
+        s._mean /= m;
+
+        // Deviations are taken from the mean (rather than using the sum of squares) because
+        // log-likelihoods are large compared to their variation
+        double ss = 0.0;
+        for (unsigned b = 0; b < _nbatches; b++) {
+            double batch_mean = 0.0;
+            for (unsigned i = b*batch_size; i < (b + 1)*batch_size; i++)
+                batch_mean += v[i];
+            batch_mean /= batch_size;
+            ss += (batch_mean - s._mean)*(batch_mean - s._mean);
+        }
+        s._var_mean = ss/(_nbatches - 1)/_nbatches;
+        return s;
+    }
+
+    inline bool BurninMonitor::isSameMean(const WindowSummary & prev, const WindowSummary & curr) const {
+        double diff = std::fabs(curr._mean - prev._mean);
+        double sd = std::sqrt(prev._var_mean + curr._var_mean);
+        if (sd == 0.0)
+            return diff == 0.0;
+        return diff/sd < _z_threshold;
+    }
+
+    inline bool BurninMonitor::closeWindow() {
+        // Returns true if burn-in can end
+        _nwindows++;
+        bool stable = (_nwindows > 1);
+        _unstable_cause = (stable ? CAUSE_NONE : CAUSE_ONE_WINDOW);
+        for (unsigned k = 0; k < _chain_states.size(); k++) {
+            ChainState & cs = _chain_states[k];
+
+            // Compare mean log-likelihood and log-prior with the previous window
+            WindowSummary log_likelihood = summarize(cs._log_likelihoods);
+            WindowSummary log_prior = summarize(cs._log_priors);
+            if (_nwindows > 1) {
+                if (stable && !isSameMean(cs._prev_log_likelihood, log_likelihood)) {
+                    stable = false;
+                    setUnstableCause(CAUSE_LOG_LIKELIHOOD, k, 0, cs._prev_log_likelihood._mean, log_likelihood._mean);
+                }
+                if (stable && !isSameMean(cs._prev_log_prior, log_prior)) {
+                    stable = false;
+                    setUnstableCause(CAUSE_LOG_PRIOR, k, 0, cs._prev_log_prior._mean, log_prior._mean);
+                }
+            }
+            cs._prev_log_likelihood = log_likelihood;
+            cs._prev_log_prior = log_prior;
+            cs._log_likelihoods.clear();
+            cs._log_priors.clear();
+
+            // Compare tuning parameters with those at the end of the previous window
+            // (stable implies that there was a previous window)
+            unsigned nupdaters = (unsigned)cs._lambdas.size();
+            for (unsigned i = 0; stable && i < nupdaters; i++) {
+                if (std::fabs(std::log(cs._lambdas[i]/cs._prev_lambdas[i])) > _lambda_tolerance) {
+                    stable = false;
+                    setUnstableCause(CAUSE_LAMBDA, k, i, cs._prev_lambdas[i], cs._lambdas[i]);
+                }
+            }
+            std::copy(cs._lambdas.begin(), cs._lambdas.end(), cs._prev_lambdas.begin());
+
+            // Compare acceptance rates with those of the previous window
+            for (unsigned i = 0; i < nupdaters; i++) {
+                unsigned n = cs._nupdates[i];
+                double rate = (n >= _min_attempts ? (double)cs._naccepts[i]/n : -1.0);
+                double prev_rate = cs._prev_accept_rates[i];
+                unsigned prev_n = cs._prev_window_nupdates[i];
+                if (stable && rate >= 0.0 && prev_rate >= 0.0) {
+                    double pooled = (rate*n + prev_rate*prev_n)/(n + prev_n);
+                    double sd = std::sqrt(pooled*(1.0 - pooled)*(1.0/n + 1.0/prev_n));
+                    bool same = (sd == 0.0 ? rate == prev_rate : std::fabs(rate - prev_rate)/sd < _z_threshold);
+                    if (!same) {
+                        stable = false;
+                        setUnstableCause(CAUSE_ACCEPTANCE, k, i, prev_rate, rate);
+                    }
+                }
+                cs._prev_accept_rates[i] = rate;
+                cs._prev_window_nupdates[i] = n;
+            }
+            std::fill(cs._nupdates.begin(), cs._nupdates.end(), 0);
+            std::fill(cs._naccepts.begin(), cs._naccepts.end(), 0);
+        }
+
+        _nstable = (stable ? _nstable + 1 : 0);
+        if (stable && _nstable < _nstable_required)
+            _unstable_cause = CAUSE_TOO_FEW_STABLE;
+        return _nstable >= _nstable_required;
+    }
+
+    inline void BurninMonitor::setUnstableCause(UnstableCause cause, unsigned chain_index, unsigned updater, double from, double to) {
+        _unstable_cause = cause;
+        _unstable_chain = chain_index;
+        _unstable_updater = updater;
+        _unstable_from = from;
+        _unstable_to = to;
+    }
+
+    inline unsigned BurninMonitor::getNumWindows() const {
+        return _nwindows;
+    }
+
+    inline std::string BurninMonitor::getUnstableReason() const {
+        switch (_unstable_cause) {
+            case CAUSE_ONE_WINDOW:
+                return "only one window completed";
+            case CAUSE_LOG_LIKELIHOOD:
+                return boost::str(boost::format("mean log-likelihood of chain %d changed from %.5f to %.5f") % _unstable_chain % _unstable_from % _unstable_to);
+            case CAUSE_LOG_PRIOR:
+                return boost::str(boost::format("mean log-prior of chain %d changed from %.5f to %.5f") % _unstable_chain % _unstable_from % _unstable_to);
+            case CAUSE_LAMBDA:
+                return boost::str(boost::format("tuning parameter of the %s updater of chain %d changed from %.6f to %.6f") % _names[_unstable_updater] % _unstable_chain % _unstable_from % _unstable_to);
+            case CAUSE_ACCEPTANCE:
+                return boost::str(boost::format("acceptance rate of the %s updater of chain %d changed from %.3f to %.3f") % _names[_unstable_updater] % _unstable_chain % _unstable_from % _unstable_to);
+            case CAUSE_TOO_FEW_STABLE:
+                return boost::str(boost::format("stable for %d of %d windows") % _nstable % _nstable_required);
+            default:
+                return "";
+        }
+    }
+
+}
@@ -5,6 +5,7 @@
 #include "conditionals.hpp"
 
 #include <memory>
+#include <chrono>
 #include <boost/format.hpp>
 #include "lot.hpp"
 #include "data.hpp"
@@ -20,7 +21,10 @@
 #include "subset_relrate_updater.hpp"
 #include "tree_updater.hpp"
 #include "polytomy_updater.hpp"
+#include "subtree_regraft_updater.hpp"
 #include "tree_length_updater.hpp"
+#include "edge_length_hmc_updater.hpp"
+#include "model_block_updater.hpp"
 #if defined(HOLDER_ETAL_PRIOR)
 #   include "gamma_shape_updater.hpp"
 #   include "edge_length_updater.hpp"
@@ -29,6 +33,7 @@
 #   include "edge_proportion_updater.hpp"
 #endif
 #include "conditional_clade_store.hpp"
+#include "weight_balancer.hpp"
 
 namespace lorad {
 
@@ -50,11 +55,17 @@ namespace lorad {
             void                                    stopTuning();
 
             void                                    setTreeFromNewick(std::string & newick);
+            void                                    setEdgeLengthHMC(double weight, unsigned max_leapfrog_steps);
+            void                                    setModelBlockWeight(double weight);
+            void                                    setSubtreeRegraft(double spr_weight, unsigned spr_radius, double tbr_weight, unsigned tbr_radius);
+            void                                    setDelayedAcceptance(const std::vector<std::string> & updater_names);
+            void                                    setPriorCheckInterval(unsigned interval);
             unsigned                                createUpdaters(Model::SharedPtr model, Lot::SharedPtr lot, Likelihood::SharedPtr likelihood, ConditionalCladeStore::SharedPtr conditional_clade_store);
 
             TreeManip::SharedPtr                    getTreeManip();
             Model::SharedPtr                        getModel();
             double                                  getLogLikelihood() const;
+            double                                  getLogJointPrior() const;
 
 
             void                                    setHeatingPower(double p);
@@ -71,8 +82,25 @@ namespace lorad {
             std::vector<std::string>                getUpdaterNames() const;
             std::vector<double>                     getAcceptPercentages() const;
             std::vector<unsigned>                   getNumUpdates() const;
+            void                                    getAcceptanceCounts(std::vector<unsigned> & naccepts, std::vector<unsigned> & nupdates) const;
             std::vector<double>                     getLambdas() const;
+            void                                    getLambdas(std::vector<double> & v) const;
+            std::vector<bool>                       getDelayedAcceptance() const;
+            std::vector<double>                     getScreenedPercentages() const;
+            std::vector<SubtreeRegraftUpdater::SharedPtr> getSubtreeRegraftUpdaters() const;
             void                                    setLambdas(std::vector<double> & v);
+            std::vector<double>                     getWeights() const;
+            void                                    setWeights(const std::vector<double> & v);
+            std::vector<unsigned>                   getNumTuningUpdates() const;
+            void                                    setTuningOffsets(const std::vector<unsigned> & v);
+            std::vector< std::vector<double> >      getAdaptations() const;
+            bool                                    setAdaptations(const std::vector< std::vector<double> > & v);
+
+            void                                    setUpdateTiming(bool on);
+            std::vector<double>                     getSecondsPerUpdate() const;
+            void                                    startWeightBalancing();
+            bool                                    balanceWeights(double & ess_rate_before, double & ess_rate_after);
+            void                                    swapLambdas(Chain & other);
 
             double                                  calcLogLikelihood() const;
             double                                  calcLogJointPrior(int verbose = 0) const;
@@ -81,12 +109,19 @@ namespace lorad {
 
             std::string                             saveReferenceDistributions(Partition::SharedPtr partition);
 
+            unsigned                                findPosteriorMode(unsigned max_rounds, double tolerance, double & start_log_likelihood, double & log_likelihood);
             void                                    start();
             void                                    stop();
             void                                    nextStep(int iteration);
 
         private:
 
+            double                                  calcModePriorPower() const;
+            double                                  calcLogModeObjective(double log_likelihood);
+            static double                           calcNewtonStep(double d1, double d2);
+            void                                    checkLogJointPrior(const Updater::SharedPtr & updater);
+            void                                    gatherBalanceParameters();
+
             Model::SharedPtr                        _model;
             Lot::SharedPtr                          _lot;
             TreeManip::SharedPtr                    _tree_manipulator;
@@ -104,6 +139,22 @@ namespace lorad {
             std::vector<double>                     _ss_logrefdists;
             unsigned                                _ss_mode;
             double                                  _log_likelihood;
+            double                                  _log_joint_prior;       // kept current by adding the change in log prior made by each update
+            unsigned                                _prior_check_interval;  // recalculate _log_joint_prior from scratch every this many steps (0 means never)
+            double                                  _hmc_weight;            // weight of the HMC edge length updater (0 means not used)
+            unsigned                                _hmc_leapfrog_steps;
+            double                                  _model_block_weight;    // weight of the adaptive block updater of model parameters (0 means not used)
+            double                                  _spr_weight;            // weight of the SPR updater (0 means not used)
+            unsigned                                _spr_radius;            // maximum regraft distance of SPR moves (0 means no limit)
+            double                                  _tbr_weight;            // weight of the bounded TBR updater (0 means not used)
+            unsigned                                _tbr_radius;            // maximum regraft and reroot distance of TBR moves
+            bool                                    _time_updates;          // if true, accumulate the wall time taken by each updater
+            std::vector<double>                     _update_seconds;        // per updater
+            std::vector<unsigned>                   _update_counts;         // per updater (not reset when tuning starts or stops)
+            bool                                    _weight_balancing;      // if true, the weight balancer is measuring mixing and cost
+            WeightBalancer                          _weight_balancer;
+            std::vector<double>                     _balance_params;        // workspace
+            std::vector<double>                     _balance_edgelens;      // workspace
     };
     
     inline Chain::Chain() {
@@ -115,6 +166,8 @@ namespace lorad {
 
     inline void Chain::clear() {
         _log_likelihood = 0.0;
+        _log_joint_prior = 0.0;
+        _prior_check_interval = 0;
         _updaters.clear();
         _chain_index = 0;
         setHeatingPower(1.0);
@@ -123,16 +176,28 @@ namespace lorad {
         _ss_logpriors.clear();
         _ss_logrefdists.clear();
         _ss_mode = 0;
+        _hmc_weight = 0.0;
+        _hmc_leapfrog_steps = 10;
+        _model_block_weight = 0.0;
+        _spr_weight = 0.0;
+        _spr_radius = 0;
+        _tbr_weight = 0.0;
+        _tbr_radius = 3;
+        _time_updates = false;
+        _update_seconds.clear();
+        _update_counts.clear();
+        _weight_balancing = false;
+        _weight_balancer.clear();
         startTuning();
     }
 
     inline void Chain::startTuning() {
-        for (auto u : _updaters)
+        for (auto & u : _updaters)
             u->setTuning(true);
     }
 
     inline void Chain::stopTuning() {
-        for (auto u : _updaters)
+        for (auto & u : _updaters)
             u->setTuning(false);
     }
 
@@ -141,10 +206,57 @@ namespace lorad {
         if (!_tree_manipulator)
             _tree_manipulator.reset(new TreeManip);
         _tree_manipulator->buildFromNewick(newick, /*rooted*/ false, /*allow_polytomies*/ true); 
-        for (auto u : _updaters)
+        for (auto & u : _updaters)
             u->setTreeManip(_tree_manipulator);
     }
 
+    inline void Chain::setEdgeLengthHMC(double weight, unsigned max_leapfrog_steps) {
+        // Must be called before createUpdaters
+        _hmc_weight = weight;
+        _hmc_leapfrog_steps = max_leapfrog_steps;
+    }
+
+    inline void Chain::setModelBlockWeight(double weight) {
+        // Must be called before createUpdaters
+        _model_block_weight = weight;
+    }
+
+    inline void Chain::setSubtreeRegraft(double spr_weight, unsigned spr_radius, double tbr_weight, unsigned tbr_radius) {
+        // Must be called before createUpdaters
+        _spr_weight = spr_weight;
+        _spr_radius = spr_radius;
+        _tbr_weight = tbr_weight;
+        _tbr_radius = tbr_radius;
+    }
+
+    inline void Chain::setPriorCheckInterval(unsigned interval) {
+        _prior_check_interval = interval;
+    }
+
+    inline void Chain::setDelayedAcceptance(const std::vector<std::string> & updater_names) {
+        // Must be called after createUpdaters. Each name selects all updaters with that name
+        // (e.g. the state frequency updaters of every subset); "all" selects every updater
+        // except the HMC edge length updater, which makes its own proposals and decisions.
+        for (auto & name : updater_names) {
+            unsigned nfound = 0;
+            for (auto & u : _updaters) {
+                bool hmc = (bool)std::dynamic_pointer_cast<EdgeLengthHMCUpdater>(u);
+                if (name == "all" && !hmc) {
+                    u->setDelayedAcceptance(true);
+                    nfound++;
+                }
+                else if (u->getUpdaterName() == name) {
+                    if (hmc)
+                        throw XLorad(boost::format("Delayed acceptance cannot be used with the \"%s\" updater") % name);
+                    u->setDelayedAcceptance(true);
+                    nfound++;
+                }
+            }
+            if (nfound == 0)
+                throw XLorad(boost::format("Delayed acceptance was requested for \"%s\" but there is no updater with that name") % name);
+        }
+    }
+
     inline unsigned Chain::createUpdaters(Model::SharedPtr model, Lot::SharedPtr lot, Likelihood::SharedPtr likelihood, ConditionalCladeStore::SharedPtr conditional_clade_store) {
         _model = model;
         _lot = lot;
@@ -175,6 +287,7 @@ namespace lorad {
             u->setTargetAcceptanceRate(0.3);
             u->setPriorParameters(std::vector<double>(statefreq_shptr->getStateFreqsSharedPtr()->size(), 1.0));
             u->setRefDistParameters(statefreq_shptr->getStateFreqRefDistParamsVect());
+            u->setSubsets(_model->getStateFreqSubsets(statefreq_shptr));
             u->setWeight(wstd); sum_weights += wstd;
             _updaters.push_back(u);
             _prior_calculators.push_back(u);
@@ -190,6 +303,7 @@ namespace lorad {
             u->setTargetAcceptanceRate(0.3);
             u->setPriorParameters({1.0, 1.0, 1.0, 1.0, 1.0, 1.0});
             u->setRefDistParameters(exchangeability_shptr->getExchangeabilityRefDistParamsVect());
+            u->setSubsets(_model->getExchangeabilitySubsets(exchangeability_shptr));
             u->setWeight(wstd); sum_weights += wstd;
             _updaters.push_back(u);
             _prior_calculators.push_back(u);
@@ -206,6 +320,7 @@ namespace lorad {
             u->setTargetAcceptanceRate(0.3);
             u->setPriorParameters({1.0, 1.0});
             u->setRefDistParameters(shape_shptr->getShapeRefDistParamsVect());
+            u->setSubsets(_model->getShapeSubsets(shape_shptr));
             u->setWeight(wstd); sum_weights += wstd;
             _updaters.push_back(u);
             _prior_calculators.push_back(u);
@@ -221,6 +336,7 @@ namespace lorad {
             u->setTargetAcceptanceRate(0.3);
             u->setPriorParameters({1.0, 1.0});
             u->setRefDistParameters(ratevar_shptr->getRateVarRefDistParamsVect());
+            u->setSubsets(_model->getRateVarSubsets(ratevar_shptr));
             u->setWeight(wstd); sum_weights += wstd;
             _updaters.push_back(u);
             _prior_calculators.push_back(u);
@@ -237,6 +353,7 @@ namespace lorad {
             u->setTargetAcceptanceRate(0.3);
             u->setPriorParameters({1.0, 1.0});
             u->setRefDistParameters(pinvar_shptr->getPinvarRefDistParamsVect());
+            u->setSubsets(_model->getPinvarSubsets(pinvar_shptr));
             u->setWeight(wstd); sum_weights += wstd;
             _updaters.push_back(u);
             _prior_calculators.push_back(u);
@@ -253,6 +370,7 @@ namespace lorad {
             u->setPriorParameters({1.0, 1.0});
             throw XLorad("Omega parameter not yet fully implemented");
 //            u->setRefDistParameters(omega_shptr->getOmegaRefDistParamsVect());
+            u->setSubsets(_model->getOmegaSubsets(omega_shptr));
             u->setWeight(wstd); sum_weights += wstd;
             _updaters.push_back(u);
             _prior_calculators.push_back(u);
@@ -271,6 +389,20 @@ namespace lorad {
             _updaters.push_back(u);
             _prior_calculators.push_back(u);
         }
+
+        // Add the block updater of all model parameters to _updaters (the updaters added so
+        // far calculate its prior, so it is not itself a prior calculator)
+        if (_model_block_weight > 0.0 && !_prior_calculators.empty()) {
+            if (_model->hasLinkedParameters())
+                throw XLorad("The block updater of model parameters cannot be used if parameters are linked across subsets");
+            Updater::SharedPtr u = ModelBlockUpdater::SharedPtr(new ModelBlockUpdater(_model, _prior_calculators));
+            u->setLikelihood(likelihood);
+            u->setLot(lot);
+            u->setLambda(1.0);
+            u->setTargetAcceptanceRate(0.234);
+            u->setWeight(_model_block_weight); sum_weights += _model_block_weight;
+            _updaters.push_back(u);
+        }
         
         // Add tree updater and tree length updater to _updaters
 #if defined(HOLDER_ETAL_PRIOR)
@@ -302,6 +434,25 @@ namespace lorad {
         uu->setWeight(wedgelengths); sum_weights += wedgelengths;
         _updaters.push_back(uu);
 #endif
+
+        if (_hmc_weight > 0.0) {
+            if (_model->isAllowPolytomies())
+                throw XLorad("The HMC edge length updater cannot be used if polytomies are allowed");
+            EdgeLengthHMCUpdater::SharedPtr hmc = EdgeLengthHMCUpdater::SharedPtr(new EdgeLengthHMCUpdater());
+            hmc->setMaxLeapfrogSteps(_hmc_leapfrog_steps);
+            Updater::SharedPtr u = hmc;
+            u->setLikelihood(likelihood);
+            u->setLot(lot);
+            u->setLambda(0.05);
+            u->setTargetAcceptanceRate(0.7);
+#if defined(HOLDER_ETAL_PRIOR)
+            u->setPriorParameters({edgelen_exponential_rate});
+#else
+            u->setPriorParameters({tree_length_shape, tree_length_scale, dirichlet_param});
+#endif
+            u->setWeight(_hmc_weight); sum_weights += _hmc_weight;
+            _updaters.push_back(u);
+        }
         
         if (!_model->isFixedTree()) {
             Updater::SharedPtr u = TreeUpdater::SharedPtr(new TreeUpdater());
@@ -334,6 +485,30 @@ namespace lorad {
                 u->setWeight(wpolytomy); sum_weights += wpolytomy;
                 _updaters.push_back(u);
             }
+
+            // Add SPR and bounded TBR updaters, which complement the local moves of the tree updater
+            for (unsigned k = 0; k < 2; k++) {
+                bool tbr = (k == 1);
+                double w = (tbr ? _tbr_weight : _spr_weight);
+                if (w <= 0.0)
+                    continue;
+                if (_model->isAllowPolytomies())
+                    throw XLorad("The SPR and TBR updaters cannot be used if polytomies are allowed");
+                Updater::SharedPtr u = SubtreeRegraftUpdater::SharedPtr(new SubtreeRegraftUpdater(tbr, tbr ? _tbr_radius : _spr_radius));
+                u->setConditionalCladeStore(conditional_clade_store);
+                u->setLikelihood(likelihood);
+                u->setLot(lot);
+                u->setLambda(1.0);
+                u->setTargetAcceptanceRate(0.3);
+#if defined(HOLDER_ETAL_PRIOR)
+                u->setPriorParameters({edgelen_exponential_rate});
+#else
+                u->setPriorParameters({tree_length_shape, tree_length_scale, dirichlet_param});
+#endif
+                u->setTopologyPriorOptions(_model->isResolutionClassTopologyPrior(), _model->getTopologyPriorC());
+                u->setWeight(w); sum_weights += w;
+                _updaters.push_back(u);
+            }
         }
         
         Updater::SharedPtr u = TreeLengthUpdater::SharedPtr(new TreeLengthUpdater());
@@ -356,7 +531,7 @@ namespace lorad {
         _updaters.push_back(u);
         _prior_calculators.push_back(u);
         
-        for (auto u : _updaters) {
+        for (auto & u : _updaters) {
             u->calcProb(sum_weights);
         }
         
@@ -377,7 +552,7 @@ namespace lorad {
 
     inline void Chain::setHeatingPower(double p) {
         _heating_power = p;
-        for (auto u : _updaters) {
+        for (auto & u : _updaters) {
             u->setHeatingPower(p);
 
 #if defined(SINGLE_CHAIN_POWER)
@@ -395,7 +570,7 @@ namespace lorad {
         //   0: no steppingstone
         //   1: steppingstone (Xie et al. 2011)
         //   2: generalized steppingstone (Fan et al. 2011)
-        for (auto u : _updaters)
+        for (auto & u : _updaters)
             u->setSteppingstoneMode(_ss_mode);
         _next_heating_power = p;
     }
@@ -405,7 +580,7 @@ namespace lorad {
         _ss_loglikes.push_back(logLike);
         if (_ss_mode == 2) {
             //   2: generalized steppingstone (Fan et al. 2011)
-            double logPrior = calcLogJointPrior();
+            double logPrior = getLogJointPrior();
             _ss_logpriors.push_back(logPrior);
             double logRefDist = calcLogReferenceDensity();
             _ss_logrefdists.push_back(logRefDist);
@@ -469,7 +644,7 @@ namespace lorad {
         
     inline Updater::SharedPtr Chain::findUpdaterByName(std::string name) {
         Updater::SharedPtr retval = nullptr;
-        for (auto u : _updaters) {
+        for (auto & u : _updaters) {
             if (u->getUpdaterName() == name) {
                 retval = u;
                 break;
@@ -481,40 +656,205 @@ namespace lorad {
 
     inline std::vector<std::string> Chain::getUpdaterNames() const {
         std::vector<std::string> v;
-        for (auto u : _updaters)
+        for (auto & u : _updaters)
             v.push_back(u->getUpdaterName());
         return v;
     }
 
     inline std::vector<double> Chain::getAcceptPercentages() const {
         std::vector<double> v;
-        for (auto u : _updaters)
+        for (auto & u : _updaters)
             v.push_back(u->getAcceptPct());
         return v;
     }
 
     inline std::vector<unsigned> Chain::getNumUpdates() const {
         std::vector<unsigned> v;
-        for (auto u : _updaters)
+        for (auto & u : _updaters)
             v.push_back(u->getNumUpdates());
         return v;
     }
 
+    inline void Chain::getAcceptanceCounts(std::vector<unsigned> & naccepts, std::vector<unsigned> & nupdates) const {
+        // Fills naccepts and nupdates, which do not allocate once they have been sized for the updaters
+        naccepts.resize(_updaters.size());
+        nupdates.resize(_updaters.size());
+        unsigned index = 0;
+        for (auto & u : _updaters) {
+            naccepts[index] = u->getNumAccepts();
+            nupdates[index] = (unsigned)u->getNumUpdates();
+            index++;
+        }
+    }
+
+    inline std::vector<bool> Chain::getDelayedAcceptance() const {
+        std::vector<bool> v;
+        for (auto & u : _updaters)
+            v.push_back(u->isDelayedAcceptance());
+        return v;
+    }
+
+    inline std::vector<double> Chain::getScreenedPercentages() const {
+        std::vector<double> v;
+        for (auto & u : _updaters)
+            v.push_back(u->getScreenedPct());
+        return v;
+    }
+
+    inline std::vector<SubtreeRegraftUpdater::SharedPtr> Chain::getSubtreeRegraftUpdaters() const {
+        std::vector<SubtreeRegraftUpdater::SharedPtr> v;
+        for (auto & u : _updaters) {
+            SubtreeRegraftUpdater::SharedPtr sru = std::dynamic_pointer_cast<SubtreeRegraftUpdater>(u);
+            if (sru)
+                v.push_back(sru);
+        }
+        return v;
+    }
+
     inline std::vector<double> Chain::getLambdas() const {
         std::vector<double> v;
-        for (auto u : _updaters)
+        for (auto & u : _updaters)
             v.push_back(u->getLambda());
         return v;
     }
 
+    inline void Chain::getLambdas(std::vector<double> & v) const {
+        // Fills v, which does not allocate once it has been sized for the updaters
+        v.resize(_updaters.size());
+        unsigned index = 0;
+        for (auto & u : _updaters)
+            v[index++] = u->getLambda();
+    }
+
     inline void Chain::setLambdas(std::vector<double> & v) {
         assert(v.size() == _updaters.size());
         unsigned index = 0;
-        for (auto u : _updaters) {
+        for (auto & u : _updaters) {
             u->setLambda(v[index++]);
         }
     }
     
+    inline std::vector<double> Chain::getWeights() const {
+        std::vector<double> v;
+        for (auto & u : _updaters)
+            v.push_back(u->getWeight());
+        return v;
+    }
+
+    inline void Chain::setWeights(const std::vector<double> & v) {
+        // Updater probabilities are recalculated from the new weights
+        assert(v.size() == _updaters.size());
+        double sum_weights = 0.0;
+        unsigned index = 0;
+        for (auto & u : _updaters) {
+            u->setWeight(v[index++]);
+            sum_weights += u->getWeight();
+        }
+        for (auto & u : _updaters)
+            u->calcProb(sum_weights);
+    }
+
+    inline std::vector<unsigned> Chain::getNumTuningUpdates() const {
+        std::vector<unsigned> v;
+        for (auto & u : _updaters)
+            v.push_back(u->getNumTuningUpdates());
+        return v;
+    }
+
+    inline void Chain::setTuningOffsets(const std::vector<unsigned> & v) {
+        assert(v.size() == _updaters.size());
+        unsigned index = 0;
+        for (auto & u : _updaters)
+            u->setTuningOffset(v[index++]);
+    }
+
+    inline std::vector< std::vector<double> > Chain::getAdaptations() const {
+        std::vector< std::vector<double> > v(_updaters.size());
+        unsigned index = 0;
+        for (auto & u : _updaters)
+            u->getAdaptation(v[index++]);
+        return v;
+    }
+
+    inline bool Chain::setAdaptations(const std::vector< std::vector<double> > & v) {
+        // Returns false if some updater could not use its state (its lambda should then not be loaded)
+        assert(v.size() == _updaters.size());
+        bool ok = true;
+        unsigned index = 0;
+        for (auto & u : _updaters)
+            ok = u->setAdaptation(v[index++]) && ok;
+        return ok;
+    }
+
+    inline void Chain::setUpdateTiming(bool on) {
+        // Must be called after createUpdaters
+        _time_updates = on;
+        _update_seconds.assign(_updaters.size(), 0.0);
+        _update_counts.assign(_updaters.size(), 0);
+    }
+
+    inline std::vector<double> Chain::getSecondsPerUpdate() const {
+        std::vector<double> v;
+        for (unsigned i = 0; i < _update_counts.size(); i++)
+            v.push_back(_update_counts[i] > 0 ? _update_seconds[i]/_update_counts[i] : 0.0);
+        return v;
+    }
+
+    inline void Chain::gatherBalanceParameters() {
+        // Log-transformed model parameters followed by the log tree length and, if the topology
+        // is fixed (so that edges keep their identity), the transformed edge lengths
+        _balance_params.clear();
+        _model->logTransformParameters(_balance_params);
+        _balance_params.push_back(log(_tree_manipulator->calcTreeLength()));
+        if (_model->isFixedTree()) {
+            _tree_manipulator->logTransformEdgeLengths(_balance_edgelens);
+            _balance_params.insert(_balance_params.end(), _balance_edgelens.begin() + 1, _balance_edgelens.end());
+        }
+    }
+
+    inline void Chain::startWeightBalancing() {
+        // Starts (or restarts) measuring how well and how fast each updater mixes
+        assert(_time_updates);
+        _weight_balancing = true;
+        gatherBalanceParameters();
+        _weight_balancer.init((unsigned)_updaters.size(), _balance_params);
+    }
+
+    inline bool Chain::balanceWeights(double & ess_rate_before, double & ess_rate_after) {
+        // Ends the measurement window and sets new weights; the predicted smallest ESS per second
+        // before and after is returned. Topology moves keep their probabilities because their
+        // benefit is not reflected in the continuous parameters.
+        assert(_weight_balancing);
+        _weight_balancing = false;
+        std::vector<double> probs;
+        std::vector<bool> fixed;
+        double sum_weights = 0.0;
+        for (auto & u : _updaters) {
+            probs.push_back(u->getProb());
+            fixed.push_back(std::dynamic_pointer_cast<TreeUpdater>(u) || std::dynamic_pointer_cast<PolytomyUpdater>(u) || std::dynamic_pointer_cast<SubtreeRegraftUpdater>(u));
+            sum_weights += u->getWeight();
+        }
+        std::vector<double> new_probs;
+        bool balanced = _weight_balancer.balance(probs, fixed, new_probs);
+        ess_rate_before = _weight_balancer.calcMinESSPerSecond(probs);
+        ess_rate_after = _weight_balancer.calcMinESSPerSecond(new_probs);
+        if (!balanced)
+            return false;
+
+        // Weights stay on the same scale as before
+        std::vector<double> weights(new_probs.size());
+        for (unsigned i = 0; i < new_probs.size(); i++)
+            weights[i] = new_probs[i]*sum_weights;
+        setWeights(weights);
+        return true;
+    }
+
+    inline void Chain::swapLambdas(Chain & other) {
+        assert(other._updaters.size() == _updaters.size());
+        for (unsigned i = 0; i < _updaters.size(); i++)
+            _updaters[i]->swapLambda(*other._updaters[i]);
+    }
+    
     inline double Chain::calcLogLikelihood() const {
         return _updaters[0]->calcLogLikelihood();
     }
@@ -525,8 +865,8 @@ namespace lorad {
         // verbose == 2: show how each prior is calculated
         assert(verbose == 0 || verbose == 1 || verbose == 2);
         double lnP = 0.0;
-        for (auto u : _prior_calculators) {
-            std::string this_name = u->getUpdaterName();
+        for (auto & u : _prior_calculators) {
+            const std::string & this_name = u->_name;
             if (this_name == "Tree Length") {
 #if defined(HOLDER_ETAL_PRIOR)
                 double edgelen_prior = u->calcLogEdgeLengthPrior();
@@ -581,7 +921,7 @@ namespace lorad {
         double lnP = 0.0;
 #if defined(POLTMPPRIOR)
         ::om.outputConsole("\nChain::calcLogReferenceDensity():\n");
-        for (auto u : _updaters) {
+        for (auto & u : _updaters) {
             assert(u->_name != "Polytomies");
             if (u->_name == "Polytomies") {
                 throw XLorad("Generalized stepping-stone marginal likelihood estimation cannot be performed if polytomies are allowed");
@@ -592,7 +932,7 @@ namespace lorad {
         }
         ::om.outputConsole(boost::format("%12.5f <-- joint log reference density\n") % lnP);
 #else
-        for (auto u : _updaters) {
+        for (auto & u : _updaters) {
             assert(u->_name != "Polytomies");
             if (u->_name == "Polytomies") {
                 throw XLorad("Generalized stepping-stone marginal likelihood estimation cannot be performed if polytomies are allowed");
@@ -616,7 +956,7 @@ namespace lorad {
         // Specify reference distribution parameters in relevant updaters
         // This is necessary if GHM will be used to estimate marginal likelihoods
         // from the reference distributions just calculated
-        for (auto u : _updaters) {
+        for (auto & u : _updaters) {
             if (refdist_map.find(u->_name) != refdist_map.end()) {
                 // u has a reference distribution
                 u->setRefDistParameters(refdist_map[u->_name]);
@@ -634,10 +974,166 @@ namespace lorad {
         _ss_mode = mode;
     }
 
+    inline double Chain::calcModePriorPower() const {
+        // Power of the prior in the distribution the chain samples (see
+        // Updater::calcLogAcceptanceRatio): Xie et al. (2011) steppingstone heats only the likelihood
+        return (_ss_mode == 1 ? 1.0 : _heating_power);
+    }
+
+    inline double Chain::calcLogModeObjective(double log_likelihood) {
+        // The (heated) log posterior, up to a constant, as a function of the edge lengths
+        Updater::SharedPtr u = findUpdaterByName("Tree Length");
+#if defined(HOLDER_ETAL_PRIOR)
+        double log_prior = u->calcLogEdgeLengthPrior();
+#else
+        auto edgelen_prior = u->calcLogEdgeLengthPrior();
+        double log_prior = edgelen_prior.first + edgelen_prior.second;
+#endif
+        return _heating_power*log_likelihood + calcModePriorPower()*log_prior;
+    }
+
+    inline double Chain::calcNewtonStep(double d1, double d2) {
+        // Newton-Raphson step for maximizing a function with derivatives d1 and d2 with respect
+        // to log x; if the function is not concave there, step as far as allowed uphill
+        const double max_step = 2.0;
+        double step = (d2 < 0.0 ? -d1/d2 : (d1 > 0.0 ? max_step : -max_step));
+        return std::max(-max_step, std::min(max_step, step));
+    }
+
+    inline unsigned Chain::findPosteriorMode(unsigned max_rounds, double tolerance, double & start_log_likelihood, double & log_likelihood) {
+        // Moves the edge lengths of the starting tree towards the mode of the (heated) posterior
+        // so that burn-in has less distance to cover. Each round takes a Newton-Raphson step in
+        // the log of each edge length in turn (using the derivatives the likelihood computes at
+        // that edge), then one in the log of the tree length; a step that does not increase the
+        // posterior is halved until it does or is abandoned. Rounds stop once the log posterior
+        // improves by less than tolerance. The topology and model parameters are not changed.
+        // Returns the number of rounds performed.
+        assert(_tree_manipulator);
+        assert(_updaters.size() > 0);
+        Likelihood::SharedPtr likelihood = _updaters[0]->_likelihood;
+        Tree::SharedPtr tree = _tree_manipulator->getTree();
+        const unsigned max_halvings = 5;
+        const double prior_power = calcModePriorPower();
+        
+        _tree_manipulator->selectAllPartials();
+        _tree_manipulator->selectAllTMatrices();
+        log_likelihood = likelihood->calcLogLikelihood(tree);
+        _tree_manipulator->deselectAllPartials();
+        _tree_manipulator->deselectAllTMatrices();
+        start_log_likelihood = log_likelihood;
+        if (!likelihood->usingStoredData())
+            return 0;
+        
+        // The tree length step needs the derivatives at every edge
+        bool all_edges = true;
+        for (auto nd : tree->_preorder) {
+            if (!likelihood->canCalcEdgeLengthDerivatives(nd))
+                all_edges = false;
+        }
+        
+        double log_posterior = calcLogModeObjective(log_likelihood);
+        std::vector<double> saved_edge_lengths(tree->_nodes.size(), 0.0);
+        unsigned round = 0;
+        while (round < max_rounds) {
+            ++round;
+            double prev_log_posterior = log_posterior;
+            
+            for (auto nd : tree->_preorder) {
+                if (!likelihood->canCalcEdgeLengthDerivatives(nd))
+                    continue;
+                double d1 = 0.0;
+                double d2 = 0.0;
+                double p1 = 0.0;
+                double p2 = 0.0;
+                _tree_manipulator->deselectAllPartials();
+                _tree_manipulator->deselectAllTMatrices();
+                likelihood->calcEdgeLengthDerivatives(tree, nd, d1, d2);
+                double t = nd->getEdgeLength();
+                findUpdaterByName("Tree Length")->calcEdgeLengthPriorDerivatives(t, _tree_manipulator->calcTreeLength(), p1, p2);
+                double f1 = t*(_heating_power*d1 + prior_power*p1);
+                double f2 = t*t*(_heating_power*d2 + prior_power*p2) + f1;
+                double step = calcNewtonStep(f1, f2);
+                
+                for (unsigned k = 0; k < max_halvings; k++, step *= 0.5) {
+                    _tree_manipulator->deselectAllPartials();
+                    _tree_manipulator->deselectAllTMatrices();
+                    nd->setEdgeLength(t*exp(step));
+                    _tree_manipulator->selectPartialsHereToRoot(nd->getParent());
+                    nd->selectTMatrix();
+                    _tree_manipulator->flipPartialsAndTMatrices();
+                    double proposed_log_likelihood = likelihood->calcLogLikelihoodAtEdge(tree, nd);
+                    double proposed_log_posterior = calcLogModeObjective(proposed_log_likelihood);
+                    bool accept = (proposed_log_posterior > log_posterior);
+                    if (accept) {
+                        log_likelihood = proposed_log_likelihood;
+                        log_posterior = proposed_log_posterior;
+                    }
+                    else {
+                        nd->setEdgeLength(t);
+                        _tree_manipulator->flipPartialsAndTMatrices();
+                    }
+                    likelihood->releaseSavedPartials();
+                    if (accept)
+                        break;
+                }
+            }
+            
+            if (all_edges) {
+                double d1 = 0.0;
+                double d2 = 0.0;
+                double p1 = 0.0;
+                double p2 = 0.0;
+                _tree_manipulator->deselectAllPartials();
+                _tree_manipulator->deselectAllTMatrices();
+                likelihood->calcTreeLengthDerivatives(tree, d1, d2);
+                double TL = _tree_manipulator->calcTreeLength();
+                findUpdaterByName("Tree Length")->calcTreeLengthPriorDerivatives(TL, p1, p2);
+                double f1 = TL*(_heating_power*d1 + prior_power*p1);
+                double f2 = TL*TL*(_heating_power*d2 + prior_power*p2) + f1;
+                double step = calcNewtonStep(f1, f2);
+                for (auto nd : tree->_preorder)
+                    saved_edge_lengths[nd->getNumber()] = nd->getEdgeLength();
+                
+                for (unsigned k = 0; k < max_halvings; k++, step *= 0.5) {
+                    _tree_manipulator->deselectAllPartials();
+                    _tree_manipulator->deselectAllTMatrices();
+                    _tree_manipulator->scaleAllEdgeLengths(exp(step));
+                    _tree_manipulator->selectAllPartials();
+                    _tree_manipulator->selectAllTMatrices();
+                    _tree_manipulator->flipPartialsAndTMatrices();
+                    double proposed_log_likelihood = likelihood->calcLogLikelihood(tree);
+                    double proposed_log_posterior = calcLogModeObjective(proposed_log_likelihood);
+                    bool accept = (proposed_log_posterior > log_posterior);
+                    if (accept) {
+                        log_likelihood = proposed_log_likelihood;
+                        log_posterior = proposed_log_posterior;
+                    }
+                    else {
+                        for (auto nd : tree->_preorder)
+                            nd->setEdgeLength(saved_edge_lengths[nd->getNumber()]);
+                        _tree_manipulator->flipPartialsAndTMatrices();
+                    }
+                    likelihood->releaseSavedPartials();
+                    if (accept)
+                        break;
+                }
+            }
+            
+            if (log_posterior - prev_log_posterior < tolerance)
+                break;
+        }
+        _tree_manipulator->deselectAllPartials();
+        _tree_manipulator->deselectAllTMatrices();
+        return round;
+    }
+
     inline void Chain::start() {
+        for (auto & u : _updaters)
+            u->reserveWorkspace();
         _tree_manipulator->selectAllPartials();
         _tree_manipulator->selectAllTMatrices();
         _log_likelihood = calcLogLikelihood();
+        _log_joint_prior = calcLogJointPrior();
     }
 
     inline void Chain::stop() { 
@@ -648,7 +1144,7 @@ namespace lorad {
         double u = _lot->uniform();
         double cumprob = 0.0;
         unsigned i = 0;
-        for (auto updater : _updaters) {
+        for (auto & updater : _updaters) {
             cumprob += updater->_prob;
             if (u <= cumprob)
                 break;
@@ -658,11 +1154,40 @@ namespace lorad {
         //if (_updaters[i]->getUpdaterName() == "Subset Relative Rates") {
         //    std::cerr << "Updating Subset Relative Rates" << std::endl;
         //}
-        _log_likelihood = _updaters[i]->update(_log_likelihood);
+        if (_time_updates) {
+            auto start = std::chrono::steady_clock::now();
+            _log_likelihood = _updaters[i]->update(_log_likelihood);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            _update_seconds[i] += elapsed.count();
+            _update_counts[i]++;
+            if (_weight_balancing) {
+                gatherBalanceParameters();
+                _weight_balancer.recordStep(i, elapsed.count(), _balance_params);
+            }
+        }
+        else
+            _log_likelihood = _updaters[i]->update(_log_likelihood);
+        _log_joint_prior += _updaters[i]->getLogPriorDelta();
+        if (_prior_check_interval > 0 && iteration % _prior_check_interval == 0)
+            checkLogJointPrior(_updaters[i]);
     } 
 
+    inline void Chain::checkLogJointPrior(const Updater::SharedPtr & updater) {
+        // Debugging aid: an updater whose change in log prior is wrong shows up as a
+        // discrepancy right after its own update (rounding error is small and is discarded)
+        double log_joint_prior = calcLogJointPrior();
+        double discrepancy = std::fabs(log_joint_prior - _log_joint_prior);
+        if (discrepancy > 1.0e-6*std::max(1.0, std::fabs(log_joint_prior)))
+            throw XLorad(boost::format("Log joint prior maintained incrementally (%.9f) differs from the recalculated value (%.9f) after an update by the \"%s\" updater") % _log_joint_prior % log_joint_prior % updater->getUpdaterName());
+        _log_joint_prior = log_joint_prior;
+    }
+
     inline double Chain::getLogLikelihood() const {
         return _log_likelihood;
     }
 
+    inline double Chain::getLogJointPrior() const {
+        return _log_joint_prior;
+    }
+
 }
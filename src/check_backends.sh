@@ -0,0 +1,28 @@
+#!/bin/bash
+
+# Fixed-tree comparison of the native likelihood backend with BeagleLib. The starting tree
+# in rbcl10.tre is scored (using the model in lorad.conf) by each backend in double precision,
+# and the check fails if the two log-likelihoods differ by more than 1e-6 (relative).
+# Run from the install directory, or set LORAD to the path of the lorad executable.
+
+LORAD=${LORAD:-./lorad}
+
+lnL() {
+    $LORAD --datafile=rbcl10.nex --treefile=rbcl10.tre --backend=$1 --precision=double --benchmark=1 | awk '/^  log-likelihood:/ {print $2}'
+}
+
+beagle_lnL=$(lnL beagle)
+native_lnL=$(lnL native)
+echo "beagle log-likelihood: $beagle_lnL"
+echo "native log-likelihood: $native_lnL"
+if [ -z "$beagle_lnL" ] || [ -z "$native_lnL" ]; then
+    echo "FAILED: a backend did not report a log-likelihood"
+    exit 1
+fi
+
+awk -v a="$beagle_lnL" -v b="$native_lnL" 'BEGIN {
+    d = a - b; if (d < 0) d = -d;
+    t = 1.0e-6*(a < 0 ? -a : a);
+    if (d <= t) { printf("passed: difference %g (tolerance %g)\n", d, t); exit 0 }
+    printf("FAILED: difference %g (tolerance %g)\n", d, t); exit 1
+}'
@@ -0,0 +1,91 @@
+// Checks LoRaDMonitor (used by the mcsetarget option) on a target whose normalizing constant is
+// known: a correlated 6-dimensional Gaussian, sampled by an autocorrelated AR(1) chain, whose
+// log kernel is the log density plus a constant log_marginal_likelihood. Over 30 replicate
+// chains, the mean LoRaD estimate should be within 3 standard errors of that constant, and the
+// mean MCSE reported by the monitor should be close to (or a little above) the standard deviation
+// of the estimates across replicates.
+//
+// The meson build compiles this as check_lorad_monitor and runs it with "meson test". To build
+// and run it by hand from this directory (adjust the Eigen and Boost include paths as necessary):
+//
+//   g++ -std=c++11 -O2 -I. -I/usr/include/eigen3 check_lorad_monitor.cpp -o check_lorad_monitor
+//   ./check_lorad_monitor
+
+#include <cstdio>
+#include <random>
+#include "lorad_monitor.hpp"
+
+using namespace lorad;
+
+const unsigned LoRaDMonitor::_min_batch_size = 100;
+
+int main() {
+    const unsigned dim = 6;
+    const unsigned nreps = 30;
+    const unsigned nsamples = 20000;
+    const unsigned nbatches = 10;
+    const double coverage = 0.5;
+    const double phi = 0.8;     // autocorrelation of the chain
+    const double log_marginal_likelihood = -1234.5;
+
+    std::vector<double> estimates;
+    std::vector<double> mcses;
+    for (unsigned rep = 0; rep < nreps; rep++) {
+        std::mt19937 rng(rep + 1);
+        std::normal_distribution<double> normal(0.0, 1.0);
+        LoRaDMonitor monitor;
+        std::vector<double> z(dim, 0.0);
+        std::vector<double> x(dim, 0.0);
+        for (unsigned i = 0; i < nsamples; i++) {
+            // Each z[k] is an AR(1) chain with a standard normal stationary distribution, and x is
+            // a triangular (hence correlated) transformation of z with Jacobian prod(sd)
+            double log_density = 0.0;
+            for (unsigned k = 0; k < dim; k++) {
+                z[k] = phi*z[k] + sqrt(1.0 - phi*phi)*normal(rng);
+                double mu = k;
+                double sd = 0.5 + k;
+                x[k] = mu + 0.5*(k > 0 ? x[k-1] : 0.0) + sd*z[k];
+                log_density += -0.5*z[k]*z[k] - 0.5*log(2.0*M_PI) - log(sd);
+            }
+            monitor.addSample(x, log_density + log_marginal_likelihood);
+        }
+        double estimate = 0.0;
+        double mcse = 0.0;
+        if (!monitor.estimate(coverage, nbatches, estimate, mcse)) {
+            std::printf("FAILED: replicate %d did not produce an estimate\n", rep + 1);
+            return 1;
+        }
+        estimates.push_back(estimate);
+        mcses.push_back(mcse);
+    }
+
+    double mean_estimate = 0.0;
+    double mean_mcse = 0.0;
+    for (unsigned rep = 0; rep < nreps; rep++) {
+        mean_estimate += estimates[rep]/nreps;
+        mean_mcse += mcses[rep]/nreps;
+    }
+    double ss = 0.0;
+    for (double estimate : estimates)
+        ss += (estimate - mean_estimate)*(estimate - mean_estimate);
+    double sd = sqrt(ss/(nreps - 1));
+    double bias = mean_estimate - log_marginal_likelihood;
+
+    std::printf("log marginal likelihood:    %.5f\n", log_marginal_likelihood);
+    std::printf("mean LoRaD estimate:        %.5f (bias %.5f)\n", mean_estimate, bias);
+    std::printf("sd of estimates:            %.5f\n", sd);
+    std::printf("mean MCSE from the monitor: %.5f\n", mean_mcse);
+
+    bool passed = true;
+    if (std::fabs(bias) > 3.0*sd/sqrt(nreps)) {
+        std::printf("FAILED: the estimates are biased\n");
+        passed = false;
+    }
+    if (mean_mcse < 0.5*sd || mean_mcse > 2.0*sd) {
+        std::printf("FAILED: the MCSE does not match the spread of the estimates\n");
+        passed = false;
+    }
+    if (passed)
+        std::printf("passed\n");
+    return (passed ? 0 : 1);
+}
@@ -6,6 +6,7 @@
 #include <string>
 #include <vector>
 #include <numeric>
+#include <algorithm>
 #include <limits>
 #include <map>
 #include <boost/format.hpp>
@@ -13,6 +14,7 @@
 #include "datatype.hpp"
 #include "partition.hpp"
 #include "xlorad.hpp"
+#include "lot.hpp"
 #include "ncl/nxsmultiformat.h"
 #include <boost/algorithm/string/join.hpp>
 
@@ -27,6 +29,7 @@ namespace lorad {
             typedef unsigned long long                  state_t;
             typedef std::vector<state_t>                pattern_vect_t;
             typedef std::vector<state_t>                monomorphic_vect_t;
+            typedef std::vector<unsigned>               invariant_vect_t;
             typedef std::vector<int>                    partition_key_t;
             typedef std::map<pattern_vect_t,unsigned>   pattern_map_t;
             typedef std::vector<pattern_vect_t>         data_matrix_t;
@@ -61,8 +64,13 @@ namespace lorad {
             begin_end_pair_t                            getSubsetBeginEnd(unsigned subset) const;
             const pattern_counts_t &                    getPatternCounts() const;
             const monomorphic_vect_t &                  getMonomorphic() const;
+            const invariant_vect_t &                    getInvariantPatterns() const;
+            const invariant_vect_t &                    getInvariantStateBegin() const;
+            const invariant_vect_t &                    getInvariantStates() const;
             const partition_key_t &                     getPartitionKey() const;
 
+            SharedPtr                                   createSubsample(double fraction, Lot::SharedPtr lot) const;
+
             std::string                                 createTaxaBlock() const;
             std::string                                 createTranslateStatement() const;
 
@@ -75,10 +83,14 @@ namespace lorad {
             unsigned                                    buildSubsetSpecificMaps(unsigned ntaxa, unsigned seqlen, unsigned nsubsets);
             void                                        updatePatternMap(Data::pattern_vect_t & pattern, unsigned subset);
             void                                        compressPatterns();
+            void                                        buildInvariantTables();
 
             Partition::SharedPtr                        _partition;
             pattern_counts_t                            _pattern_counts;
             monomorphic_vect_t                          _monomorphic;
+            invariant_vect_t                            _invariant_patterns;        // patterns that could be invariant, in increasing order
+            invariant_vect_t                            _invariant_state_begin;     // _invariant_states index of first state for each element of _invariant_patterns (plus end)
+            invariant_vect_t                            _invariant_states;          // states in which each element of _invariant_patterns could be invariant
             partition_key_t                             _partition_key;
             pattern_map_vect_t                          _pattern_map_vect;
             taxon_names_t                               _taxon_names;
@@ -123,6 +135,18 @@ namespace lorad {
         return _monomorphic;
     }
 
+    inline const Data::invariant_vect_t & Data::getInvariantPatterns() const {
+        return _invariant_patterns;
+    }
+
+    inline const Data::invariant_vect_t & Data::getInvariantStateBegin() const {
+        return _invariant_state_begin;
+    }
+
+    inline const Data::invariant_vect_t & Data::getInvariantStates() const {
+        return _invariant_states;
+    }
+
     inline const Data::taxon_names_t & Data::getTaxonNames() const {
         return _taxon_names;
     }
@@ -143,6 +167,9 @@ namespace lorad {
         _partition_key.clear();
         _pattern_counts.clear();
         _monomorphic.clear();
+        _invariant_patterns.clear();
+        _invariant_state_begin.clear();
+        _invariant_states.clear();
         _pattern_map_vect.clear();
         _taxon_names.clear();
         _data_matrix.clear();
@@ -285,6 +312,82 @@ namespace lorad {
             // so we can now free this memory
             _pattern_map_vect[subset].clear();
         }
+        
+        buildInvariantTables();
+    }
+
+    inline void Data::buildInvariantTables() {
+        // Decode the monomorphic state bit fields once so that the invariable sites model
+        // only needs to visit the few patterns that could be invariant, and for each of
+        // those only the states in which it could be invariant
+        _invariant_patterns.clear();
+        _invariant_state_begin.clear();
+        _invariant_states.clear();
+        
+        state_t one = 1;
+        unsigned nsubsets = getNumSubsets();
+        for (unsigned subset = 0; subset < nsubsets; subset++) {
+            unsigned nstates = getNumStatesForSubset(subset);
+            begin_end_pair_t interval = getSubsetBeginEnd(subset);
+            for (unsigned p = interval.first; p < interval.second; p++) {
+                unsigned first = (unsigned)_invariant_states.size();
+                for (unsigned k = 0; k < nstates; k++) {
+                    if (_monomorphic[p] & (one << k))
+                        _invariant_states.push_back(k);
+                }
+                if (_invariant_states.size() > first) {
+                    _invariant_patterns.push_back(p);
+                    _invariant_state_begin.push_back(first);
+                }
+            }
+        }
+        _invariant_state_begin.push_back((unsigned)_invariant_states.size());
+    }
+
+    inline Data::SharedPtr Data::createSubsample(double fraction, Lot::SharedPtr lot) const {
+        // Returns a copy holding a random sample (without replacement) of the given fraction of
+        // the patterns of each subset. The counts of the sampled patterns are scaled so that each
+        // subset keeps its number of sites, making the log-likelihood of the subsample an
+        // estimate of that of the full data.
+        assert(fraction > 0.0 && fraction <= 1.0);
+        Data::SharedPtr d(new Data());
+        d->_partition = _partition;
+        d->_taxon_names = _taxon_names;
+        unsigned ntaxa = (unsigned)_data_matrix.size();
+        d->_data_matrix.resize(ntaxa);
+
+        unsigned nsubsets = getNumSubsets();
+        std::vector<unsigned> patterns;
+        for (unsigned subset = 0; subset < nsubsets; subset++) {
+            begin_end_pair_t interval = getSubsetBeginEnd(subset);
+            unsigned npatterns = interval.second - interval.first;
+            unsigned nsampled = std::max(1U, std::min(npatterns, (unsigned)std::round(fraction*npatterns)));
+
+            // Partial Fisher-Yates shuffle, then restore the original pattern order
+            patterns.resize(npatterns);
+            std::iota(patterns.begin(), patterns.end(), interval.first);
+            for (unsigned i = 0; i < nsampled; i++)
+                std::swap(patterns[i], patterns[lot->randint(i, npatterns - 1)]);
+            patterns.resize(nsampled);
+            std::sort(patterns.begin(), patterns.end());
+
+            double nsites = std::accumulate(_pattern_counts.begin() + interval.first, _pattern_counts.begin() + interval.second, 0.0);
+            double nsites_sampled = 0.0;
+            for (unsigned p : patterns)
+                nsites_sampled += _pattern_counts[p];
+            double weight = nsites/nsites_sampled;
+
+            for (unsigned p : patterns) {
+                for (unsigned t = 0; t < ntaxa; t++)
+                    d->_data_matrix[t].push_back(_data_matrix[t][p]);
+                d->_pattern_counts.push_back(weight*_pattern_counts[p]);
+                d->_monomorphic.push_back(_monomorphic[p]);
+                d->_partition_key.push_back(_partition_key[p]);
+            }
+            d->_subset_end.push_back((unsigned)d->_pattern_counts.size());
+        }
+        d->buildInvariantTables();
+        return d;
     }
 
     inline unsigned Data::storeTaxonNames(NxsTaxaBlock * taxaBlock, unsigned taxa_block_index) {
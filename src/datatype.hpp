@@ -88,12 +88,14 @@ namespace lorad {
     inline void DataType::setGeneticCodeFromName(std::string genetic_code_name) {
         assert(isCodon());
         _genetic_code = GeneticCode::SharedPtr(new GeneticCode(genetic_code_name));
+        _num_states = _genetic_code->getNumNonStopCodons();
     }
     
     inline void DataType::setGeneticCode(GeneticCode::SharedPtr gcode) {
         assert(isCodon());
         assert(gcode);
         _genetic_code = gcode;
+        _num_states = _genetic_code->getNumNonStopCodons();
     }
 
     inline void DataType::setStandardNumStates(unsigned nstates) {
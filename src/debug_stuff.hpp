@@ -83,7 +83,7 @@ namespace lorad {
             }
             else {
                 unsigned node_number = nd->_number;
-                unsigned tmatrix = node_number + (nd->isAltTMatrix() ? DebugStuff::_tmatrix_offset : 0);
+                unsigned tmatrix = node_number + (nd->isAltTMatrix(0) ? DebugStuff::_tmatrix_offset : 0);
                 unsigned pselected = nd->isSelPartial() ? 1 : 0;
                 unsigned tselected = nd->isSelTMatrix() ? 1 : 0;
 #if 0
@@ -106,8 +106,8 @@ namespace lorad {
                     while (popped && !popped->_right_sib) {
                         node_stack.pop();
                         unsigned node_number = popped->_number;
-                        unsigned partial = node_number + (popped->isAltPartial() ? DebugStuff::_partial_offset : 0);
-                        unsigned tmatrix = node_number + (popped->isAltTMatrix() ? DebugStuff::_tmatrix_offset : 0);
+                        unsigned partial = node_number + (popped->isAltPartial(0) ? DebugStuff::_partial_offset : 0);
+                        unsigned tmatrix = node_number + (popped->isAltTMatrix(0) ? DebugStuff::_tmatrix_offset : 0);
                         unsigned pselected = popped->isSelPartial() ? 1 : 0;
                         unsigned tselected = popped->isSelTMatrix() ? 1 : 0;
 #if 0
@@ -128,8 +128,8 @@ namespace lorad {
                     if (popped && popped->_right_sib) {
                         node_stack.pop();
                         unsigned node_number = popped->_number;
-                        unsigned partial = node_number + (popped->isAltPartial() ? DebugStuff::_partial_offset : 0);
-                        unsigned tmatrix = node_number + (popped->isAltTMatrix() ? DebugStuff::_tmatrix_offset : 0);
+                        unsigned partial = node_number + (popped->isAltPartial(0) ? DebugStuff::_partial_offset : 0);
+                        unsigned tmatrix = node_number + (popped->isAltTMatrix(0) ? DebugStuff::_tmatrix_offset : 0);
                         unsigned pselected = popped->isSelPartial() ? 1 : 0;
                         unsigned tselected = popped->isSelTMatrix() ? 1 : 0;
 #if 0
@@ -26,12 +26,15 @@ namespace lorad {
         
             virtual void                        pullFromModel() = 0;
             virtual void                        pushToModel() = 0;
+            virtual void                        reserveWorkspace();
 
             void                                proposeNewState();
             void                                revert();
         
             point_t                             _curr_point;
             point_t                             _prev_point;
+            point_t                             _forward_params;
+            point_t                             _reverse_params;
     };
     
     inline DirichletUpdater::DirichletUpdater() {
@@ -44,6 +47,16 @@ namespace lorad {
     inline void DirichletUpdater::clear() {
         Updater::clear();
         _prev_point.clear();
+        _forward_params.clear();
+        _reverse_params.clear();
+    }
+    
+    inline void DirichletUpdater::reserveWorkspace() {
+        pullFromModel();
+        unsigned dim = (unsigned)_curr_point.size();
+        _prev_point.reserve(dim);
+        _forward_params.reserve(dim);
+        _reverse_params.reserve(dim);
     }
     
     inline double DirichletUpdater::calcLogRefDist() {
@@ -130,13 +143,13 @@ namespace lorad {
         
         // Determine parameters of Dirichlet forward proposal distribution and, at the same time,
         // draw gamma deviates that will be used to form the proposed point.
-        std::vector<double> forward_params(dim, 0.0);
+        _forward_params.assign(dim, 0.0);
         for (unsigned i = 0; i < dim; ++i) {
             // Calculate ith forward parameter
             double alpha_i = 1.0 + _prev_point[i]/_lambda;
             if (alpha_i < 1.e-12)
                 alpha_i = 1.e-12;
-            forward_params[i] = alpha_i;
+            _forward_params[i] = alpha_i;
             
             // Draw ith gamma deviate
             _curr_point[i] = 0.0;
@@ -145,7 +158,7 @@ namespace lorad {
         }
         
         double sum_gamma_deviates     = std::accumulate(_curr_point.begin(), _curr_point.end(), 0.0);
-        double sum_forward_parameters = std::accumulate(forward_params.begin(), forward_params.end(), 0.0);
+        double sum_forward_parameters = std::accumulate(_forward_params.begin(), _forward_params.end(), 0.0);
 
         // Choose new state by sampling from forward proposal distribution.
         // We've already stored gamma deviates in _curr_point, now just need to normalize them.
@@ -156,24 +169,24 @@ namespace lorad {
         // Determine probability density of the forward proposal
         double log_forward_density = 0.0;
         for (unsigned i = 0; i < dim; ++i) {
-            log_forward_density += (forward_params[i] - 1.0)*std::log(_prev_point[i]);
-            log_forward_density -= std::lgamma(forward_params[i]);
+            log_forward_density += (_forward_params[i] - 1.0)*std::log(_prev_point[i]);
+            log_forward_density -= std::lgamma(_forward_params[i]);
         }
         log_forward_density += std::lgamma(sum_forward_parameters);
         
         // Determine parameters of Dirichlet reverse proposal distribution
-        std::vector<double> reverse_params(dim, 0.0);
+        _reverse_params.assign(dim, 0.0);
         for (unsigned i = 0; i < dim; ++i) {
-            reverse_params[i] = 1.0 + _curr_point[i]/_lambda;
+            _reverse_params[i] = 1.0 + _curr_point[i]/_lambda;
         }
         
-        double sum_reverse_parameters = std::accumulate(reverse_params.begin(), reverse_params.end(), 0.0);
+        double sum_reverse_parameters = std::accumulate(_reverse_params.begin(), _reverse_params.end(), 0.0);
 
         // determine probability density of the reverse proposal
         double log_reverse_density = 0.0;
         for (unsigned i = 0; i < dim; ++i) {
-            log_reverse_density += (reverse_params[i] - 1.0)*std::log(_curr_point[i]);
-            log_reverse_density -= std::lgamma(reverse_params[i]);
+            log_reverse_density += (_reverse_params[i] - 1.0)*std::log(_curr_point[i]);
+            log_reverse_density -= std::lgamma(_reverse_params[i]);
         }
         log_reverse_density += std::lgamma(sum_reverse_parameters);
         
@@ -182,9 +195,10 @@ namespace lorad {
         
         pushToModel();
 
-        // This proposal invalidates all transition matrices and partials
-        _tree_manipulator->selectAllPartials();
-        _tree_manipulator->selectAllTMatrices();
+        // This proposal invalidates all transition matrices and partials of the subsets
+        // that use the parameter
+        _tree_manipulator->selectAllPartials(_subset_mask);
+        _tree_manipulator->selectAllTMatrices(_subset_mask);
     }
     
     inline void DirichletUpdater::revert() {
@@ -0,0 +1,261 @@
+#pragma once
+
+#include "conditionals.hpp"
+#include "updater.hpp"
+
+namespace lorad {
+
+    // Proposes new values for all edge lengths at once using Hamiltonian Monte Carlo on the
+    // log edge lengths. Each proposal follows a trajectory of leapfrog steps (a random number
+    // between 1 and the maximum, so that trajectories do not resonate with the posterior)
+    // driven by the gradient of the log posterior, computed from the likelihood's edge length
+    // derivatives. _lambda is the leapfrog step size and is tuned like any other updater's
+    // boldness. Every edge needs derivatives, so the tree must be bifurcating and the
+    // likelihood must maintain pre-order partials.
+    class EdgeLengthHMCUpdater : public Updater {
+
+        public:
+
+            typedef std::shared_ptr< EdgeLengthHMCUpdater > SharedPtr;
+
+                                        EdgeLengthHMCUpdater();
+                                        ~EdgeLengthHMCUpdater();
+
+            virtual void                clear();
+            virtual double              update(double prev_lnL);
+            virtual double              calcLogPrior();
+            virtual double              calcLogRefDist();
+
+            void                        setMaxLeapfrogSteps(unsigned nsteps);
+
+        protected:
+
+            virtual void                reserveWorkspace();
+            virtual void                proposeNewState();
+            virtual void                revert();
+
+        private:
+
+            double                      calcLogTarget(bool recalculate);
+            double                      calcKineticEnergy() const;
+
+            unsigned                    _max_leapfrog_steps;
+            double                      _log_likelihood;        // at the current point of the trajectory
+            std::vector<double>         _prev_edge_lengths;     // indexed by position in the tree's preorder
+            std::vector<double>         _momentum;
+            std::vector<double>         _gradient;              // of the log target with respect to log edge lengths
+            std::vector<double>         _likelihood_gradient;   // of the log-likelihood with respect to edge lengths, indexed by node number
+    };
+
+    inline EdgeLengthHMCUpdater::EdgeLengthHMCUpdater() {
+        clear();
+        _name = "Edge Lengths (HMC)";
+    }
+
+    inline EdgeLengthHMCUpdater::~EdgeLengthHMCUpdater() {
+    }
+
+    inline void EdgeLengthHMCUpdater::clear() {
+        Updater::clear();
+        _max_leapfrog_steps = 10;
+        _log_likelihood = 0.0;
+        _prev_edge_lengths.clear();
+        _momentum.clear();
+        _gradient.clear();
+        _likelihood_gradient.clear();
+        reset();
+    }
+
+    inline void EdgeLengthHMCUpdater::setMaxLeapfrogSteps(unsigned nsteps) {
+        _max_leapfrog_steps = std::max(nsteps, 1U);
+    }
+
+    inline void EdgeLengthHMCUpdater::reserveWorkspace() {
+        // The number of edges may change if polytomies are allowed (which HMC does not support)
+        // but the number of nodes does not
+        unsigned nnodes = (unsigned)_tree_manipulator->getTree()->_nodes.size();
+        _prev_edge_lengths.reserve(nnodes);
+        _momentum.reserve(nnodes);
+        _gradient.reserve(nnodes);
+        _likelihood_gradient.reserve(nnodes);
+    }
+
+    inline double EdgeLengthHMCUpdater::calcLogPrior() {
+#if defined(HOLDER_ETAL_PRIOR)
+        return Updater::calcLogEdgeLengthPrior();
+#else
+        auto edgelen_prior = Updater::calcLogEdgeLengthPrior();
+        return edgelen_prior.first + edgelen_prior.second;
+#endif
+    }
+
+    inline double EdgeLengthHMCUpdater::calcLogRefDist() {
+        // The edge length reference distribution is provided by the Tree Length
+        // and Edge Length (or Edge Proportions) updaters
+        return 0.0;
+    }
+
+    inline void EdgeLengthHMCUpdater::proposeNewState() {
+        // Proposals are made by update, which follows the whole trajectory itself
+        assert(false);
+    }
+
+    inline void EdgeLengthHMCUpdater::revert() {
+        Tree::SharedPtr tree = _tree_manipulator->getTree();
+        unsigned i = 0;
+        for (auto nd : tree->_preorder)
+            nd->setEdgeLength(_prev_edge_lengths[i++]);
+    }
+
+    inline double EdgeLengthHMCUpdater::calcKineticEnergy() const {
+        double kinetic_energy = 0.0;
+        for (double p : _momentum)
+            kinetic_energy += 0.5*p*p;
+        return kinetic_energy;
+    }
+
+    inline double EdgeLengthHMCUpdater::calcLogTarget(bool recalculate) {
+        // Returns the log of the (heated) posterior density of the log edge lengths, up to a
+        // constant, and fills _gradient with its derivatives. If recalculate is true, edge
+        // lengths have all changed, so every partial and transition matrix is recomputed by
+        // the first evaluation of the gradient; the rest only refresh pre-order partials.
+        Tree::SharedPtr tree = _tree_manipulator->getTree();
+        unsigned nedges = (unsigned)tree->_preorder.size();
+        _gradient.assign(nedges, 0.0);
+
+        _log_likelihood = 0.0;
+        if (_likelihood->usingStoredData()) {
+            if (recalculate) {
+                _tree_manipulator->selectAllPartials();
+                _tree_manipulator->selectAllTMatrices();
+                _tree_manipulator->flipPartialsAndTMatrices();
+            }
+            _log_likelihood = _likelihood->calcEdgeLengthGradient(tree, _likelihood_gradient);
+            unsigned i = 0;
+            for (auto nd : tree->_preorder)
+                _gradient[i++] = _likelihood_gradient[nd->_number];
+            if (recalculate)
+                _likelihood->releaseSavedPartials();
+        }
+
+        // Xie et al. (2011) steppingstone heats only the likelihood
+        double likelihood_power = _heating_power;
+        double prior_power = (_ss_mode == 1 ? 1.0 : _heating_power);
+        double TL = _tree_manipulator->calcTreeLength();
+        double log_target = likelihood_power*_log_likelihood + prior_power*calcLogPrior();
+
+        // The Jacobian of the transformation to log edge lengths is the product of the edge
+        // lengths; with the Gamma-Dirichlet prior, whose density is defined on tree length and
+        // edge length proportions, there is an additional factor of TL^{-(n-1)}
+#if !defined(HOLDER_ETAL_PRIOR)
+        double n = (double)nedges;
+#endif
+        unsigned i = 0;
+        for (auto nd : tree->_preorder) {
+            double t = nd->_edge_length;
+            double p1 = 0.0;
+            double p2 = 0.0;
+            calcEdgeLengthPriorDerivatives(t, TL, p1, p2);
+            double g = t*(likelihood_power*_gradient[i] + prior_power*p1) + 1.0;
+#if !defined(HOLDER_ETAL_PRIOR)
+            g -= (n - 1.0)*t/TL;
+#endif
+            _gradient[i++] = g;
+            log_target += log(t);
+        }
+#if !defined(HOLDER_ETAL_PRIOR)
+        log_target -= (n - 1.0)*log(TL);
+#endif
+        return log_target;
+    }
+
+    inline double EdgeLengthHMCUpdater::update(double prev_lnL) {
+        if (_ss_mode == 2)
+            throw XLorad("The HMC edge length updater cannot be used with generalized steppingstone");
+
+        Tree::SharedPtr tree = _tree_manipulator->getTree();
+        _prev_edge_lengths.clear();
+        for (auto nd : tree->_preorder)
+            _prev_edge_lengths.push_back(nd->_edge_length);
+        unsigned nedges = (unsigned)_prev_edge_lengths.size();
+        double prev_log_prior = calcLogPrior();
+
+        // Gradient at the current state: only pre-order partials need to be calculated
+        unsigned long promotion = _likelihood->getPromotionEvaluation();
+        _tree_manipulator->deselectAllPartials();
+        _tree_manipulator->deselectAllTMatrices();
+        double prev_log_target = calcLogTarget(false);
+
+        _momentum.resize(nedges);
+        for (unsigned i = 0; i < nedges; i++)
+            _momentum[i] = _lot->normal();
+        double prev_kinetic_energy = calcKineticEnergy();
+
+        // Leapfrog steps of size _lambda in the log edge lengths; the trajectory is abandoned
+        // if an edge length leaves the range Node can represent or the likelihood cannot be
+        // computed, in which case the proposal is rejected
+        double epsilon = _lambda;
+        unsigned nsteps = 1 + std::min((unsigned)(_lot->uniform()*_max_leapfrog_steps), _max_leapfrog_steps - 1);
+        double log_target = prev_log_target;
+        bool valid = true;
+        for (unsigned k = 0; valid && k < nsteps; k++) {
+            for (unsigned i = 0; i < nedges; i++)
+                _momentum[i] += 0.5*epsilon*_gradient[i];
+            unsigned i = 0;
+            for (auto nd : tree->_preorder) {
+                double t = nd->_edge_length*exp(epsilon*_momentum[i++]);
+                if (!(t > Node::_smallest_edge_length && t < 1.0e6))
+                    valid = false;
+                nd->setEdgeLength(t);
+            }
+            if (!valid)
+                break;
+            log_target = calcLogTarget(true);
+            if (!std::isfinite(log_target))
+                valid = false;
+            for (unsigned i = 0; i < nedges; i++)
+                _momentum[i] += 0.5*epsilon*_gradient[i];
+        }
+
+        // If the likelihood switched to double precision along the way, the targets at the two
+        // ends of the trajectory are not comparable, so the proposal is rejected and the
+        // starting state rescored (in double precision) below
+        bool promoted = (_likelihood->getPromotionEvaluation() != promotion);
+        bool accept = false;
+        if (valid && !promoted) {
+            double log_R = (log_target - prev_log_target) - (calcKineticEnergy() - prev_kinetic_energy);
+            double logu = _lot->logUniform();
+            accept = (logu <= log_R);
+        }
+
+        double log_likelihood = _log_likelihood;
+        _log_prior_delta = 0.0;
+        if (accept) {
+            _naccepts++;
+            _log_prior_delta = calcLogPrior() - prev_log_prior;
+        }
+        else {
+            // The buffers for the starting state have been overwritten, so its
+            // partials must be recalculated rather than flipped back
+            revert();
+            if (_likelihood->usingStoredData()) {
+                _tree_manipulator->selectAllPartials();
+                _tree_manipulator->selectAllTMatrices();
+                _tree_manipulator->flipPartialsAndTMatrices();
+                double lnL = _likelihood->calcLogLikelihood(tree);
+                _likelihood->releaseSavedPartials();
+                log_likelihood = (_likelihood->getPromotionEvaluation() != promotion ? lnL : prev_lnL);
+            }
+            else
+                log_likelihood = prev_lnL;
+        }
+        _tree_manipulator->deselectAllPartials();
+        _tree_manipulator->deselectAllTMatrices();
+
+        tune(accept);
+        reset();
+
+        return log_likelihood;
+    }
+
+}
@@ -19,6 +19,8 @@ namespace lorad {
             virtual void                proposeNewState();
             virtual void                revert();
             virtual void                reset();
+            virtual Node *              getEvaluationNode() const;
+            virtual bool                providesLogPriorDelta() const;
 
             double                      calcLogRefDist();
 
@@ -58,13 +60,24 @@ namespace lorad {
 
         _log_hastings_ratio = log(m);
 
-        // This proposal invalidates all transition matrices and partials
-        _tree_manipulator->selectAllPartials();
-        _tree_manipulator->selectAllTMatrices();
-        
-        //TODO: try these versions once working
-        //_tree_manipulator->selectPartialsHereToRoot(_focal_node);
-        //_focal_node->selectTMatrix();
+        // Edge lengths have independent Exp(r) priors, so only the focal edge contributes
+        double exponential_rate = _prior_parameters[0];
+        _log_prior_delta = -exponential_rate*(_curr_point - _prev_point);
+
+        // This proposal invalidates only the transition matrices for the focal edge
+        // and the partials of nodes above it (the focal node's own partials do not
+        // depend on the length of the edge beneath it)
+        _tree_manipulator->selectPartialsHereToRoot(_focal_node->getParent());
+        _focal_node->selectTMatrix();
+    }
+
+    inline Node * EdgeLengthUpdater::getEvaluationNode() const {
+        // Score the proposal at the focal edge so that partials above it need not be recomputed
+        return _focal_node;
+    }
+
+    inline bool EdgeLengthUpdater::providesLogPriorDelta() const {
+        return true;
     }
 
     inline void EdgeLengthUpdater::revert() {
@@ -91,7 +104,6 @@ namespace lorad {
 
     inline double EdgeLengthUpdater::calcLogPrior() {
         return Updater::calcLogEdgeLengthPrior();
-        //TODO: just compute prior for this one edge length?
     }
 
     inline double EdgeLengthUpdater::calcLogRefDist() {
@@ -1,11 +1,16 @@
 #pragma once    
 
 #include <map>
+#include <atomic>
+#include <cmath>
+#include <algorithm>
 #include <boost/algorithm/string.hpp>
 #include <boost/format.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/range/adaptor/reversed.hpp>
 #include "libhmsbeagle/beagle.h"
+#include "backend.hpp"
+#include "thread_pool.hpp"
 #include "tree.hpp"
 #include "tree_manip.hpp"   
 #include "data.hpp"
@@ -24,11 +29,28 @@ namespace lorad {
 
             void                                    setRooted(bool is_rooted);
             void                                    setPreferGPU(bool prefer_gpu);
+            void                                    setBackend(std::string backend);
+            void                                    setThreadPool(ThreadPool::SharedPtr pool);
+            void                                    setNumShards(unsigned nshards);
+            unsigned                                getNumShards() const;
+            std::string                             getBackendName() const;
             void                                    setAmbiguityEqualsMissing(bool ambig_equals_missing);
         
             bool                                    usingStoredData() const;
             void                                    useStoredData(bool using_data);
             void                                    useUnderflowScaling(bool do_scaling);
+            void                                    setScalingInterval(unsigned interval);
+            void                                    usePreorderPartials(bool use_preorder);
+            void                                    setPrecision(std::string precision);
+            void                                    setPrecisionCheck(unsigned interval, double tolerance);
+            void                                    stopPrecisionChecks();
+            std::string                             describePrecision() const;
+            unsigned long                           getPromotionEvaluation() const;
+            void                                    setMemoryBudget(double megabytes);
+            void                                    setRevertBuffers(std::string mode);
+            void                                    setBufferPoolSize(unsigned nbuffers);
+            std::string                             describeMemory() const;
+            void                                    releaseSavedPartials();
 
             std::string                             beagleLibVersion() const;
             std::string                             availableResources() const;
@@ -38,9 +60,19 @@ namespace lorad {
             void                                    finalizeBeagleLib(bool use_exceptions);
 
             double                                  calcLogLikelihood(Tree::SharedPtr t);
+            double                                  calcLogLikelihoodAtEdge(Tree::SharedPtr t, Node * nd);
+            bool                                    canCalcEdgeLengthDerivatives(Node * nd) const;
+            double                                  calcEdgeLengthDerivatives(Tree::SharedPtr t, Node * nd, double & d1, double & d2);
+            double                                  calcEdgeLengthGradient(Tree::SharedPtr t, std::vector<double> & gradient);
+            double                                  calcTreeLengthDerivatives(Tree::SharedPtr t, double & d1, double & d2);
 
             Data::SharedPtr                         getData();
             void                                    setData(Data::SharedPtr d);
+            void                                    setSurrogateData(Data::SharedPtr d);
+            bool                                    hasSurrogate() const;
+            double                                  calcSurrogateLogLikelihood(Tree::SharedPtr t);
+            double                                  getCurrentSurrogateLogLikelihood(Tree::SharedPtr t);
+            void                                    setCurrentSurrogateLogLikelihood(double log_likelihood);
 
             Model::SharedPtr                        getModel();
             void                                    setModel(Model::SharedPtr m);
@@ -49,6 +81,12 @@ namespace lorad {
             
             unsigned                                calcNumEdgesInFullyResolvedTree() const;
             unsigned                                calcNumInternalsInFullyResolvedTree() const;
+
+            unsigned long                           getNumModelUploads() const;
+            unsigned long                           getNumModelUploadsSkipped() const;
+            unsigned long                           getNumLikelihoodEvaluations() const;
+            unsigned long                           getNumSurrogateEvaluations() const;
+            unsigned long                           getNumPartialsCalculated() const;
             
         private:
         
@@ -59,66 +97,261 @@ namespace lorad {
                 unsigned nstates;
                 unsigned nratecateg;
                 unsigned npatterns;
+                unsigned shard;                                 // which of nshards slices of the subsets' patterns this instance holds
+                unsigned nshards;
                 unsigned partial_offset;
                 unsigned tmatrix_offset;
+                unsigned preorder_partial_offset;
+                unsigned preorder_scaler_offset;
                 bool invarmodel;
+                bool doubleprecision;
+                double memory;                                  // estimated bytes of BeagleLib buffers
                 std::vector<unsigned> subsets;
+                std::vector<Data::begin_end_pair_t> pattern_ranges; // patterns held for each subset in subsets
+                std::vector<unsigned long> qmatrix_versions;    // QMatrix version last sent to BeagleLib for each subset
+                std::vector<unsigned long> asrv_versions;       // ASRV version last sent to BeagleLib for each subset
+                
+                // Work arenas, reserved to their maximum size in newInstance and
+                // cleared (but never shrunk) before each likelihood calculation
+                std::vector<int> operations;                    // post-order partials operations
+                std::vector<int> preorder_operations;           // pre-order partials operations
+                std::vector<int> pmatrix_index;                 // transition matrices to update
+                std::vector<double> edge_lengths;               // edge lengths for transition matrices in pmatrix_index
+                std::vector<int> eigen_indices;                 // eigen decompositions for transition matrices in pmatrix_index
+                std::vector<int> category_rate_indices;         // category rates for transition matrices in pmatrix_index
+                std::vector<double> identity_matrix;            // transition matrix for zero-length polytomy helper edges
+                std::vector<int> scaler_indices;                // scalers accumulated into the cumulative scaler (the same number for each subset, subset by subset)
+                std::vector<int> subset_indices;                // per-subset arguments for edge log-likelihoods
+                std::vector<int> parent_indices;
+                std::vector<int> child_indices;
+                std::vector<int> tmatrix_indices;
+                std::vector<int> weights_indices;
+                std::vector<int> freqs_indices;
+                std::vector<int> scaling_indices;
+                std::vector<double> subset_log_likelihoods;
+                std::vector<double> site_log_likelihoods;
+                
+                // Edge length derivatives: first and second derivative matrices for each subset
+                // are stored after all the transition matrices, at derivative_offset + 2*subset_index
+                // (+1 for the second derivative)
+                unsigned derivative_offset;
+                std::vector<int> derivative_indices;            // first derivative matrices for each subset, then second derivative matrices
+                std::vector<double> subset_derivatives;         // first derivative for each subset, then second derivative
+                std::vector<double> site_first_derivatives;     // invariable sites model only
+                std::vector<double> site_second_derivatives;
+                double first_derivative;                        // derivatives from the most recent evaluation at _derivative_node
+                double second_derivative;
+                std::vector<double> edge_first_derivatives;     // calcEdgeLengthGradient: derivative for the edge above each node (by node number)
+                
+                // Invariable sites model: only patterns that could be invariant need the mixture
+                // of the invariable and variable site likelihoods; the rest are a weighted sum
+                std::vector<double> pattern_weights;            // pattern counts for this instance's patterns
+                std::vector<double> subset_weights;             // sum of pattern_weights for each subset
+                std::vector<unsigned> invar_patterns;           // index (in this instance) of each pattern that could be invariant
+                std::vector<unsigned> invar_data_index;         // index in Data's invariant tables of each element of invar_patterns
+                std::vector<unsigned> invar_subset_end;         // end of each subset's elements in invar_patterns
+                std::vector<double> invar_log_likes;            // log-likelihood of each element of invar_patterns if site is invariable
+                std::vector<unsigned long> invar_versions;      // QMatrix version used to compute invar_log_likes for each subset
                 
-                InstanceInfo() : handle(-1), resourcenumber(-1), resourcename(""), nstates(0), nratecateg(0), npatterns(0), partial_offset(0), tmatrix_offset(0), invarmodel(false) {}
+                // Dynamic scaling: scale buffers currently summed in the cumulative scaler (index 0)
+                bool cumulative_valid;
+                std::vector<char> in_cumulative;                // indexed by subset index times number of scale buffers plus scale buffer
+                std::vector<char> scaler_marks;
+                std::vector<int> scalers_added;
+                std::vector<int> scalers_removed;
+                double log_likelihood;                          // result of the most recent evaluation
+                
+                InstanceInfo() : handle(-1), resourcenumber(-1), resourcename(""), nstates(0), nratecateg(0), npatterns(0), shard(0), nshards(1), partial_offset(0), tmatrix_offset(0), preorder_partial_offset(0), preorder_scaler_offset(0), invarmodel(false), doubleprecision(false), memory(0.0), derivative_offset(0), first_derivative(0.0), second_derivative(0.0), cumulative_valid(false), log_likelihood(0.0) {}
             };
 
             typedef std::pair<unsigned, int>        instance_pair_t;
 
-            unsigned                                getScalerIndex(Node * nd, InstanceInfo & info) const;
-            unsigned                                getPartialIndex(Node * nd, InstanceInfo & info) const;
+            struct PolytomyScalerGroup {
+                int polytomy_scaler;                            // scale buffer of the polytomous node
+                unsigned subset_bit;                            // subsets (see Node::getSubsetBit) to which the factors apply
+                unsigned first;                                 // index in _polytomy_helper_scalers of the first helper's scaler
+                unsigned nhelpers;
+            };
+
+            struct TraversalStep {
+                Node * nd;
+                Node * lchild;                                  // 0 if nd is a leaf
+                Node * rchild;
+            };
+
+            unsigned                                getScalerIndex(Node * nd, unsigned subset) const;
+            int                                     getRescaleIndex(Node * nd, unsigned subset) const;
+            bool                                    chooseScalers(Node * nd, unsigned subset, bool rescale);
+            void                                    startScaling();
+            unsigned                                getPartialIndex(Node * nd, InstanceInfo & info, unsigned subset_index) const;
             unsigned                                getTMatrixIndex(Node * nd, InstanceInfo & info, unsigned subset_index) const;
+            unsigned                                getPreorderPartialIndex(Node * nd, InstanceInfo & info) const;
+            unsigned                                getPreorderScalerIndex(Node * nd, InstanceInfo & info) const;
+            unsigned                                getPartialSlot(Node * nd, unsigned subset) const;
+            unsigned                                getTMatrixSlot(Node * nd, unsigned subset) const;
+            unsigned                                getPreorderSlot(Node * nd, unsigned subset) const;
+            double                                  calcSubsetRelativeRate(unsigned subset) const;
+            void                                    initGenerations();
             void                                    updateInstanceMap(instance_pair_t & p, unsigned subset);
-            void                                    newInstance(unsigned nstates, int nrates, std::vector<unsigned> & subset_indices);
+            unsigned                                calcNumShards(std::vector<unsigned> & subset_indices) const;
+            unsigned                                calcPatternRanges(std::vector<unsigned> & subset_indices, unsigned shard, unsigned nshards, std::vector<Data::begin_end_pair_t> & pattern_ranges) const;
+            unsigned                                calcNumInternalPartials() const;
+            double                                  calcInstanceMemory(unsigned nstates, unsigned ngammacat, unsigned num_patterns, unsigned num_subsets, bool double_precision, bool preorder, bool pooled) const;
+            double                                  calcTotalMemory(std::map<instance_pair_t, std::vector<unsigned> > & subsets_for_pair, bool double_precision, bool pooled) const;
+            double                                  calcHelperMemory(std::map<instance_pair_t, std::vector<unsigned> > & subsets_for_pair, const Data::SharedPtr & data, bool pooled) const;
+            double                                  calcPlannedMemory(std::map<instance_pair_t, std::vector<unsigned> > & subsets_for_pair, bool pooled) const;
+            void                                    planMemory(std::map<instance_pair_t, std::vector<unsigned> > & subsets_for_pair);
+            void                                    acquirePartialBuffer(Node * nd, unsigned subset);
+            void                                    releasePartialBuffers(Node * nd);
+            void                                    newInstance(unsigned nstates, int nrates, std::vector<unsigned> & subset_indices, unsigned shard, unsigned nshards);
             void                                    setTipStates();
             void                                    setTipPartials();
             void                                    setPatternPartitionAssignments();
             void                                    setPatternWeights();
             void                                    setAmongSiteRateHeterogenetity();
             void                                    setModelRateMatrix();
-            void                                    addOperation(InstanceInfo & info, Node * nd, Node * lchild, Node * rchild, unsigned subset_index);
-            void                                    queuePartialsRecalculation(Node * nd, Node * lchild, Node * rchild, Node * polytomy = 0);   
-            void                                    queueTMatrixRecalculation(Node * nd);
-            void                                    defineOperations(Tree::SharedPtr t);
-            void                                    updateTransitionMatrices();
-            void                                    calculatePartials();
-            double                                  calcInstanceLogLikelihood(InstanceInfo & inst, Tree::SharedPtr t);
-
-
+            void                                    addOperation(InstanceInfo & info, Node * nd, Node * lchild, Node * rchild, unsigned subset_index, int scaler_write, int scaler_read);
+            void                                    queuePartialsRecalculation(Node * nd, Node * lchild, Node * rchild, Node::subset_mask_t subsets, Node * polytomy = 0);   
+            void                                    queueTMatrixRecalculation(Node * nd, Node::subset_mask_t subsets);
+            void                                    queuePreorderRecalculation(Node * nd, Node * parent, Node * sibling, Node::subset_mask_t subsets);
+            void                                    defineOperations(Tree::SharedPtr & t);
+            void                                    defineNodeOperations(Tree::SharedPtr & t, Node * nd, Node * lchild, Node * rchild);
+            Node::subset_mask_t                     calcStaleSubsets(Node * nd) const;
+            void                                    compileTraversalPlan(Tree::SharedPtr & t);
+            void                                    definePreorderOperation(Node * nd);
+            void                                    definePreorderOperations(Node * nd);
+            void                                    updateTransitionMatrices(InstanceInfo & info);
+            void                                    calculatePartials(InstanceInfo & info);
+            void                                    returnPolytomyHelpers(Tree::SharedPtr & t);
+            void                                    calculatePreorderPartials(InstanceInfo & info);
+            double                                  evaluateInstances(Tree::SharedPtr & t, Node * nd);
+            void                                    evaluateInstance(InstanceInfo & info, Tree::SharedPtr & t, Node * nd);
+            double                                  calcInstanceLogLikelihood(InstanceInfo & inst, Tree::SharedPtr & t);
+            double                                  calcInstanceEdgeLogLikelihood(InstanceInfo & info, Tree::SharedPtr & t, Node * nd);
+            int                                     calcInstanceEdge(InstanceInfo & info, Node * nd, bool scaled, bool derivatives, double & log_likelihood);
+            void                                    calcInstanceEdgeDerivatives(InstanceInfo & info, Tree::SharedPtr & t, Node * nd);
+            void                                    calcInstanceGradient(InstanceInfo & info, Tree::SharedPtr & t);
+            double                                  calcInvarModelLogLikelihood(InstanceInfo & info);
+            void                                    updateDerivativeMatrices(InstanceInfo & info, Node * nd);
+            void                                    calcInstanceDerivatives(InstanceInfo & info);
+            void                                    updateInvarLogLikes(InstanceInfo & info, unsigned subset_index);
+            static double                           calcWeightedSum(const double * w, const double * x, unsigned n);
+            void                                    accumulateScalers(InstanceInfo & info, std::vector<int> & scaler_indices);
+            void                                    updateCumulativeScaler(InstanceInfo & info, std::vector<int> & scaler_indices);
+            void                                    markAllStale();
+            bool                                    rangeExceeded(int code);
+            double                                  checkPrecision(Tree::SharedPtr & t, double log_likelihood);
+            void                                    promoteToDoublePrecision(const std::string & reason);
+
+
+            Backend                                 _backend;
             std::vector<InstanceInfo>               _instances;
             std::map<int, std::string>              _beagle_error;
-            std::map<int, std::vector<int> >        _operations;
-            std::map<int, std::vector<int> >        _pmatrix_index;
-            std::map<int, std::vector<double> >     _edge_lengths;
-            std::map<int, std::vector<int> >        _eigen_indices;
-            std::map<int, std::vector<int> >        _category_rate_indices;
             double                                  _relrate_normalizing_constant;
+            unsigned long                           _relrate_version;
+            unsigned long                           _nuploads;
+            unsigned long                           _nuploads_skipped;
+            unsigned long                           _nevaluations;
+            unsigned long                           _npartials_calculated;
+
+            ThreadPool::SharedPtr                   _thread_pool;
+            unsigned                                _nshards;       // 0 means choose automatically
+            bool                                    _beagle_threads;        // BeagleLib may start threads of its own (only one instance, no pool)
 
-            std::vector<int>                        _subset_indices;
-            std::vector<int>                        _parent_indices;
-            std::vector<int>                        _child_indices;
-            std::vector<int>                        _tmatrix_indices;
-            std::vector<int>                        _weights_indices;
-            std::vector<int>                        _freqs_indices;
-            std::vector<int>                        _scaling_indices;
+            static const unsigned                   _min_shard_patterns;
 
             Model::SharedPtr                        _model;
 
             Data::SharedPtr                         _data;
             unsigned                                _ntaxa;
+            unsigned                                _nsubset_bits;  // number of distinct Node::getSubsetBit values in use
             bool                                    _rooted;
             bool                                    _prefer_gpu;
             bool                                    _ambiguity_equals_missing;
             bool                                    _underflow_scaling;
             bool                                    _using_data;
+            bool                                    _preorder_partials;
+            
+            // Dynamic scaling: if _scaling_interval > 0, recomputed partials are divided by the scale
+            // factors their node already has rather than by new ones, so that the cumulative scaler
+            // only changes when factors do. New factors are computed every _scaling_interval
+            // evaluations, and for every recomputed partial if an evaluation underflows.
+            unsigned                                _scaling_interval;
+            bool                                    _rescaling;             // new factors are computed in this evaluation
+            bool                                    _force_rescaling;       // new factors are computed in the next evaluation
+            bool                                    _scalers_written;       // some scale buffer was overwritten in this evaluation
+            std::vector<int>                        _scaler_source;         // scale buffer holding factors for each partial (indexed by getPartialSlot, -1 if none)
+            std::vector<bool>                       _preorder_scaled;       // pre-order scale buffer holds factors (indexed by getPreorderSlot)
+            
+            // Precision: in auto mode, instances start out in single precision and are recreated in
+            // double precision if BeagleLib reports a floating-point range error or if a periodic
+            // comparison with a double-precision shadow likelihood shows too large a discrepancy
+            bool                                    _double_precision;
+            bool                                    _auto_precision;
+            std::atomic<bool>                       _range_exceeded;
+            unsigned                                _precision_check_interval;
+            double                                  _precision_tolerance;
+            unsigned long                           _promotion_evaluation;
+            std::string                             _promotion_reason;
+            std::shared_ptr<Likelihood>             _shadow;
+
+            // Delayed acceptance: a likelihood for a subsample of the patterns, used by updaters
+            // to screen proposals before the full likelihood is calculated. It shares the tree, so
+            // it follows the same node selections and buffer flips and recomputes only what each
+            // proposal changed. Its value for the current state is remembered until the next
+            // evaluation of this likelihood.
+            Data::SharedPtr                         _surrogate_data;
+            std::shared_ptr<Likelihood>             _surrogate;
+            double                                  _surrogate_log_likelihood;
+            unsigned long                           _surrogate_evaluation;  // _nevaluations when _surrogate_log_likelihood was stored
+            bool                                    _surrogate_in_sync;     // surrogate buffers are valid for the current state
+            bool                                    _surrogate_paired;      // surrogate has scored the pending proposal
+            
+            // Memory: partials are double-buffered so that a rejected proposal can be reverted by
+            // flipping buffers. In pooled mode each node instead has a single partials buffer
+            // plus, while a proposal is pending, one taken from a small pool of spares; if the
+            // pool runs out, partials are overwritten in place and recomputed if the proposal
+            // is rejected. Buffers are assigned separately for each subset (bit), as subsets
+            // occupy disjoint patterns of a buffer.
+            double                                  _memory_budget;         // megabytes (0 means no limit)
+            std::string                             _revert_buffers;        // double, pool, or auto (pool only if double exceeds the budget)
+            unsigned                                _buffer_pool_size;      // spare partials buffers in pooled mode (0 means choose from the number of taxa)
+            bool                                    _pooled_partials;
+            unsigned                                _npool;                 // spare partials buffers actually used
+            double                                  _memory_estimate;       // bytes, all instances (with those of the shadow and surrogate)
+            std::vector<int>                        _partial_buffer;        // pooled mode: buffer holding each partial (indexed by getPartialSlot, -1 if none)
+            std::vector< std::vector<int> >         _free_partial_buffers;  // pooled mode: unused buffers for each subset bit
+            std::vector< std::pair<Node *, unsigned> >  _saved_partials;    // pooled mode: (node, subset bit) whose other buffer holds the partials to revert to
+            std::vector<bool>                       _partial_evicted;       // pooled mode: partials whose buffer was taken (indexed by getPartialSlot)
+
+            // Every partials or transition matrix buffer is stamped with a unique generation each
+            // time it is written so that pre-order partials can tell when their inputs have changed.
+            // Buffers are tracked separately for each subset (bit), as subsets are recalculated
+            // independently and each subset's values may be held in either buffer of a node.
+            unsigned long                           _generation;
+            std::vector<unsigned long>              _partial_generation;    // indexed by getPartialSlot
+            std::vector<unsigned long>              _tmatrix_generation;    // indexed by getTMatrixSlot
+            std::vector<bool>                       _partial_stale;         // indexed by getPartialSlot
+            std::vector<bool>                       _tmatrix_stale;         // indexed by getTMatrixSlot
+            std::vector<unsigned long>              _preorder_generation;   // indexed by getPreorderSlot
+            std::vector<unsigned long>              _preorder_inputs;       // 4 input generations per getPreorderSlot
+            std::vector<bool>                       _on_focal_path;         // indexed by node number
+            std::vector<Node *>                     _focal_path;
+            std::vector<Node::subset_mask_t>        _stale_subsets;         // per node: subsets with a stale partials or transition matrix buffer (either buffer)
+            
+            // Fixed topology: the post-order traversal is compiled once for the tree and replayed
+            // by every evaluation, skipping steps whose node is neither selected nor stale. Only
+            // bifurcating trees are compiled; _plan_steps is empty if there is no usable plan.
+            std::weak_ptr<Tree>                     _plan_tree;             // tree for which the plan was compiled
+            std::vector<TraversalStep>              _plan_steps;            // every node, in reverse level order
+            std::vector<Node *>                     _plan_internals;        // internal nodes in preorder (their scalers make up the cumulative scaler)
 
             std::vector<Node *>                     _polytomy_helpers;  
-            std::map<int, std::vector<int> >        _polytomy_map;
-            std::vector<double>                     _identity_matrix;   
+            std::vector<int>                        _polytomy_helper_scalers;   // scalers of polytomy helpers, grouped by polytomy and subset
+            std::vector<PolytomyScalerGroup>        _polytomy_scaler_groups;
+
+            Node *                                  _derivative_node;       // evaluations at this node's edge also compute edge length derivatives
+            std::vector<double>                     _saved_edge_lengths;
 
         public:
             typedef std::shared_ptr< Likelihood >   SharedPtr;
@@ -143,11 +376,32 @@ namespace lorad {
         return (_rooted ? (_ntaxa - 1) : (_ntaxa - 2));
     }
 
+    inline unsigned long Likelihood::getNumModelUploads() const {
+        return _nuploads;
+    }
+
+    inline unsigned long Likelihood::getNumModelUploadsSkipped() const {
+        return _nuploads_skipped;
+    }
+
+    inline unsigned long Likelihood::getNumLikelihoodEvaluations() const {
+        return _nevaluations;
+    }
+
+    inline unsigned long Likelihood::getNumSurrogateEvaluations() const {
+        return (_surrogate ? _surrogate->getNumLikelihoodEvaluations() : 0);
+    }
+
+    inline unsigned long Likelihood::getNumPartialsCalculated() const {
+        // Counts post-order and pre-order partials (including polytomy helpers), not BeagleLib operations
+        return _npartials_calculated;
+    }
+
     inline void Likelihood::finalizeBeagleLib(bool use_exceptions) {
         // Close down all BeagleLib instances if active
-        for (auto info : _instances) {
+        for (auto & info : _instances) {
             if (info.handle >= 0) {
-                int code = beagleFinalizeInstance(info.handle);
+                int code = _backend.finalizeInstance(info.handle);
                 if (code != 0) {
                     if (use_exceptions)
                         throw XLorad(boost::format("Likelihood failed to finalize BeagleLib instance. BeagleLib error code was %d (%s).") % code % _beagle_error[code]);
@@ -162,28 +416,73 @@ namespace lorad {
     inline void Likelihood::clear() {   
         finalizeBeagleLib(true);
         
+        _backend                    = Backend::beagleLib();
+        _nshards                    = 1;
+        _beagle_threads             = false;
         _ntaxa                      = 0;
+        _nsubset_bits               = 1;
         _rooted                     = false;
         _prefer_gpu                 = false;
         _ambiguity_equals_missing   = true;
         _underflow_scaling          = false;
         _using_data                 = true;
+        _preorder_partials          = true;
+        _scaling_interval           = 0;
+        _rescaling                  = true;
+        _force_rescaling            = false;
+        _scalers_written            = false;
+        _scaler_source.clear();
+        _preorder_scaled.clear();
+        _double_precision           = false;
+        _auto_precision             = false;
+        _range_exceeded             = false;
+        _precision_check_interval   = 100;
+        _precision_tolerance        = 0.01;
+        _promotion_evaluation       = 0;
+        _promotion_reason           = "";
+        _shadow                     = nullptr;
+        _surrogate_data             = nullptr;
+        _surrogate                  = nullptr;
+        _surrogate_log_likelihood   = 0.0;
+        _surrogate_evaluation       = std::numeric_limits<unsigned long>::max();
+        _surrogate_in_sync          = false;
+        _surrogate_paired           = false;
         _data                       = nullptr;
+        _memory_budget              = 0.0;
+        _revert_buffers             = "double";
+        _buffer_pool_size           = 0;
+        _pooled_partials            = false;
+        _npool                      = 0;
+        _memory_estimate            = 0.0;
+        _partial_buffer.clear();
+        _free_partial_buffers.clear();
+        _saved_partials.clear();
+        _partial_evicted.clear();
         
-        _operations.clear();
-        _pmatrix_index.clear();
-        _edge_lengths.clear();
-        _eigen_indices.clear();
-        _category_rate_indices.clear();
+        _generation = 0;
+        _partial_generation.clear();
+        _tmatrix_generation.clear();
+        _partial_stale.clear();
+        _tmatrix_stale.clear();
+        _preorder_generation.clear();
+        _preorder_inputs.clear();
+        _on_focal_path.clear();
+        _focal_path.clear();
+        _stale_subsets.clear();
+        _plan_tree.reset();
+        _plan_steps.clear();
+        _plan_internals.clear();
         _relrate_normalizing_constant = 1.0;
-        _subset_indices.assign(1, 0);
-        _parent_indices.assign(1, 0);
-        _child_indices.assign(1, 0);
-        _tmatrix_indices.assign(1, 0);
-        _weights_indices.assign(1, 0);
-        _freqs_indices.assign(1, 0);
-        _scaling_indices.assign(1, 0);
-        _identity_matrix.assign(1, 0.0);    
+        _relrate_version = 0;
+        _nuploads = 0;
+        _nuploads_skipped = 0;
+        _nevaluations = 0;
+        _npartials_calculated = 0;
+        _polytomy_helpers.clear();
+        _polytomy_helper_scalers.clear();
+        _polytomy_scaler_groups.clear();
+        _derivative_node = 0;
+        _saved_edge_lengths.clear();
 
         _model = Model::SharedPtr(new Model());        
 
@@ -223,7 +522,7 @@ namespace lorad {
     inline std::string Likelihood::usedResources() const {
         std::string s;
         for (unsigned i = 0; i < _instances.size(); i++) {
-            s += boost::str(boost::format("  instance %d: %s (resource %d)\n") % _instances[i].handle % _instances[i].resourcename % _instances[i].resourcenumber);
+            s += boost::str(boost::format("  instance %d: %s (resource %d, %s precision, %.1f MB)\n") % _instances[i].handle % _instances[i].resourcename % _instances[i].resourcenumber % (_instances[i].doubleprecision ? "double" : "single") % (_instances[i].memory/1048576.0));
         }
         return s;
     }
@@ -238,6 +537,46 @@ namespace lorad {
         _data = data;
     }
 
+    inline void Likelihood::setSurrogateData(Data::SharedPtr data) {
+        // Must be called before initBeagleLib; data should be a subsample of the data
+        // (see Data::createSubsample)
+        assert(_instances.size() == 0);
+        _surrogate_data = data;
+    }
+
+    inline bool Likelihood::hasSurrogate() const {
+        return (bool)_surrogate;
+    }
+
+    inline double Likelihood::calcSurrogateLogLikelihood(Tree::SharedPtr t) {
+        assert(_surrogate);
+        if (!_using_data)
+            return 0.0;
+        
+        // Only the nodes selected by the proposal are recomputed (into the buffers flipped for
+        // it), unless this likelihood has since scored a state change that the surrogate did not
+        // see (e.g. a proposal by an updater that does not use delayed acceptance), in which
+        // case the surrogate's buffers are out of date and it must start from scratch
+        if (!_surrogate_in_sync)
+            _surrogate->markAllStale();
+        _surrogate_in_sync = true;
+        _surrogate_paired = true;
+        return _surrogate->calcLogLikelihood(t);
+    }
+
+    inline double Likelihood::getCurrentSurrogateLogLikelihood(Tree::SharedPtr t) {
+        // The stored value is for the current state as long as this likelihood has not been
+        // evaluated since (every proposal that is not screened out evaluates it)
+        if (_surrogate_evaluation != _nevaluations)
+            setCurrentSurrogateLogLikelihood(calcSurrogateLogLikelihood(t));
+        return _surrogate_log_likelihood;
+    }
+
+    inline void Likelihood::setCurrentSurrogateLogLikelihood(double log_likelihood) {
+        _surrogate_log_likelihood = log_likelihood;
+        _surrogate_evaluation = _nevaluations;
+    }
+
     inline Model::SharedPtr Likelihood::getModel() {
         return _model;
     }
@@ -264,6 +603,42 @@ namespace lorad {
         _prefer_gpu = prefer_gpu;
     }
     
+    inline void Likelihood::setBackend(std::string backend) {
+        // Can't change backend after initBeagleLib called
+        assert(_instances.size() == 0);
+        if (backend == "beagle")
+            _backend = Backend::beagleLib();
+        else if (backend == "native")
+            _backend = Backend::native();
+        else
+            throw XLorad(boost::format("backend must be beagle or native (found \"%s\")") % backend);
+    }
+    
+    inline void Likelihood::setThreadPool(ThreadPool::SharedPtr pool) {
+        // Instances are evaluated concurrently on pool's threads (if there is more than one instance)
+        _thread_pool = pool;
+    }
+    
+    inline void Likelihood::setNumShards(unsigned nshards) {
+        // Can't change the number of shards after initBeagleLib called
+        assert(_instances.size() == 0);
+        _nshards = nshards;
+    }
+    
+    inline unsigned Likelihood::getNumShards() const {
+        // Largest number of shards used for any nstates-nrates combination
+        unsigned nshards = 1;
+        for (auto & info : _instances) {
+            if (info.nshards > nshards)
+                nshards = info.nshards;
+        }
+        return nshards;
+    }
+    
+    inline std::string Likelihood::getBackendName() const {
+        return _backend.name;
+    }
+    
     inline bool Likelihood::usingStoredData() const {
         return _using_data;
     }
@@ -276,6 +651,93 @@ namespace lorad {
         _underflow_scaling = do_scaling;
     } 
 
+    inline void Likelihood::setScalingInterval(unsigned interval) {
+        // 0 computes new scale factors for every partial in every evaluation
+        _scaling_interval = interval;
+    }
+
+    inline void Likelihood::usePreorderPartials(bool use_preorder) {
+        // Can't change pre-order partials status after initBeagleLib called
+        assert(_instances.size() == 0 || _preorder_partials == use_preorder);
+        _preorder_partials = use_preorder;
+    }
+
+    inline void Likelihood::setPrecision(std::string precision) {
+        // Can't change precision after initBeagleLib called
+        assert(_instances.size() == 0);
+        if (precision == "single") {
+            _double_precision = false;
+            _auto_precision = false;
+        }
+        else if (precision == "double") {
+            _double_precision = true;
+            _auto_precision = false;
+        }
+        else if (precision == "auto") {
+            _double_precision = false;
+            _auto_precision = true;
+        }
+        else
+            throw XLorad(boost::format("precision must be single, double, or auto (found \"%s\")") % precision);
+    }
+
+    inline void Likelihood::setPrecisionCheck(unsigned interval, double tolerance) {
+        _precision_check_interval = interval;
+        _precision_tolerance = tolerance;
+    }
+
+    inline void Likelihood::stopPrecisionChecks() {
+        // Single precision has proven adequate, so the shadow is no longer needed;
+        // floating-point range errors will still trigger a switch to double precision
+        _shadow.reset();
+    }
+
+    inline std::string Likelihood::describePrecision() const {
+        if (!_double_precision)
+            return "single";
+        else if (_promotion_evaluation == 0)
+            return "double";
+        return boost::str(boost::format("double (switched from single after %d evaluations: %s)") % _promotion_evaluation % _promotion_reason);
+    }
+
+    inline unsigned long Likelihood::getPromotionEvaluation() const {
+        // Returns the evaluation at which auto precision switched to double precision (0 if it
+        // has not), so that callers can tell whether a log-likelihood is comparable to an
+        // earlier one
+        return _promotion_evaluation;
+    }
+
+    inline void Likelihood::setMemoryBudget(double megabytes) {
+        assert(_instances.size() == 0);
+        _memory_budget = megabytes;
+    }
+    
+    inline void Likelihood::setRevertBuffers(std::string mode) {
+        // Can't change how partials are buffered after initBeagleLib called
+        assert(_instances.size() == 0);
+        if (mode != "double" && mode != "pool" && mode != "auto")
+            throw XLorad(boost::format("revertbuffers must be double, pool, or auto (found \"%s\")") % mode);
+        _revert_buffers = mode;
+    }
+    
+    inline void Likelihood::setBufferPoolSize(unsigned nbuffers) {
+        assert(_instances.size() == 0);
+        _buffer_pool_size = nbuffers;
+    }
+    
+    inline std::string Likelihood::describeMemory() const {
+        std::string s = boost::str(boost::format("%.1f MB in %d instance%s") % (_memory_estimate/1048576.0) % _instances.size() % (_instances.size() == 1 ? "" : "s"));
+        if (_shadow || _surrogate)
+            s += " (including shadow and surrogate instances)";
+        if (_pooled_partials)
+            s += boost::str(boost::format(", single partials plus a pool of %d") % _npool);
+        else
+            s += ", double-buffered partials";
+        if (_memory_budget > 0.0)
+            s += boost::str(boost::format(" (budget %.1f MB)") % _memory_budget);
+        return s;
+    }
+
     inline void Likelihood::initBeagleLib() {
         assert(_data);
         assert(_model);
@@ -286,6 +748,7 @@ namespace lorad {
         _ntaxa = _data->getNumTaxa();
         
         unsigned nsubsets = _data->getNumSubsets();
+        _nsubset_bits = std::min(nsubsets, Node::_max_subset_bits);
         std::set<instance_pair_t> nstates_ncateg_combinations;
         std::map<instance_pair_t, std::vector<unsigned> > subsets_for_pair;
         for (unsigned subset = 0; subset < nsubsets; subset++) {
@@ -300,13 +763,29 @@ namespace lorad {
             subsets_for_pair[p].push_back(subset);
         }
 
-        // Create one instance for each distinct nstates-nrates combination
+        planMemory(subsets_for_pair);
+
+        // Instances (and shards) evaluated concurrently on the thread pool would each start
+        // BeagleLib's own threads as well, oversubscribing the cores, so BeagleLib only
+        // threads a lone instance that nothing else runs alongside
+        unsigned ninstances = 0;
+        for (auto & p : subsets_for_pair)
+            ninstances += calcNumShards(p.second);
+        _beagle_threads = (!_thread_pool && ninstances == 1);
+
+        // Create one instance for each distinct nstates-nrates combination, or one instance
+        // for each shard if that combination's patterns are split into shards
         _instances.clear();
         for (auto p : nstates_ncateg_combinations) {
-            newInstance(p.first, p.second, subsets_for_pair[p]);
+            unsigned nshards = calcNumShards(subsets_for_pair[p]);
+            for (unsigned shard = 0; shard < nshards; shard++) {
+                newInstance(p.first, p.second, subsets_for_pair[p], shard, nshards);
             
-            InstanceInfo & info = *_instances.rbegin();
-            ::om.outputConsole(boost::format("Created BeagleLib instance %d (%d states, %d rate%s, %d subset%s, %s invar. sites model)\n") % info.handle % info.nstates % info.nratecateg % (info.nratecateg == 1 ? "" : "s") % info.subsets.size() % (info.subsets.size() == 1 ? "" : "s") % (info.invarmodel ? "is" : "not"));
+                InstanceInfo & info = *_instances.rbegin();
+                ::om.outputConsole(boost::format("Created BeagleLib instance %d (%d states, %d rate%s, %d subset%s, %s invar. sites model)\n") % info.handle % info.nstates % info.nratecateg % (info.nratecateg == 1 ? "" : "s") % info.subsets.size() % (info.subsets.size() == 1 ? "" : "s") % (info.invarmodel ? "is" : "not"));
+                if (nshards > 1)
+                    ::om.outputConsole(boost::format("  shard %d of %d (%d patterns)\n") % (shard + 1) % nshards % info.npatterns);
+            }
         }
         
         if (_ambiguity_equals_missing)
@@ -315,9 +794,247 @@ namespace lorad {
             setTipPartials();
         setPatternWeights();
         setPatternPartitionAssignments();
+        initGenerations();
+        
+        // Instances may be double precision even if single was preferred (BeagleLib's choice, or
+        // the native backend); in auto mode there is then nothing to check
+        if (!_double_precision) {
+            bool all_double = true;
+            for (auto & info : _instances) {
+                if (!info.doubleprecision)
+                    all_double = false;
+            }
+            _double_precision = all_double;
+        }
+        
+        // Create a double-precision copy of this likelihood against which single-precision
+        // log-likelihoods are periodically compared
+        if (_auto_precision && !_double_precision && _precision_check_interval > 0) {
+            ::om.outputConsole("Creating double-precision shadow instances for precision checks:\n");
+            _shadow.reset(new Likelihood());
+            _shadow->setRooted(_rooted);
+            _shadow->setPreferGPU(_prefer_gpu);
+            _shadow->setBackend(_backend.name);
+            _shadow->setAmbiguityEqualsMissing(_ambiguity_equals_missing);
+            _shadow->useUnderflowScaling(_underflow_scaling);
+            _shadow->usePreorderPartials(false);
+            _shadow->setRevertBuffers(_pooled_partials ? "pool" : "double");
+            _shadow->setBufferPoolSize(_npool);
+            _shadow->setPrecision("double");
+            _shadow->setData(_data);
+            _shadow->setModel(_model);
+            _shadow->initBeagleLib();
+        }
+        
+        if (_surrogate_data) {
+            ::om.outputConsole(boost::format("Creating surrogate instances for delayed acceptance (%d of %d patterns):\n") % _surrogate_data->getNumPatterns() % _data->getNumPatterns());
+            _surrogate.reset(new Likelihood());
+            _surrogate->setRooted(_rooted);
+            _surrogate->setPreferGPU(_prefer_gpu);
+            _surrogate->setBackend(_backend.name);
+            _surrogate->setAmbiguityEqualsMissing(_ambiguity_equals_missing);
+            _surrogate->useUnderflowScaling(_underflow_scaling);
+            _surrogate->usePreorderPartials(false);
+            _surrogate->setRevertBuffers("double");
+            _surrogate->setPrecision("double");
+            _surrogate->setData(_surrogate_data);
+            _surrogate->setModel(_model);
+            _surrogate->initBeagleLib();
+        }
+        
+        // Size scratch vectors used by calcLogLikelihood so that they never need to grow
+        unsigned num_nodes = _ntaxa + calcNumInternalsInFullyResolvedTree();
+        _polytomy_helpers.reserve(num_nodes);
+        _polytomy_helper_scalers.reserve(num_nodes*_nsubset_bits);
+        _polytomy_scaler_groups.reserve(num_nodes*_nsubset_bits);
+    }
+    
+    inline void Likelihood::initGenerations() {
+        // Give every buffer a distinct starting generation; leaf partials keep theirs for good
+        unsigned num_nodes = _ntaxa + calcNumInternalsInFullyResolvedTree();
+        unsigned num_slots = num_nodes*_nsubset_bits;
+        _generation = 0;
+        _partial_generation.resize(2*num_slots);
+        _tmatrix_generation.resize(2*num_slots);
+        for (unsigned i = 0; i < 2*num_slots; i++) {
+            _partial_generation[i] = ++_generation;
+            _tmatrix_generation[i] = ++_generation;
+        }
+        _partial_stale.assign(2*num_slots, false);
+        _tmatrix_stale.assign(2*num_slots, false);
+        _scaler_source.assign(2*num_slots, -1);
+        _preorder_scaled.assign(num_slots, false);
+        
+        // Generation 0 is never assigned, so every pre-order partial starts out of date
+        _preorder_generation.assign(num_slots, 0);
+        _preorder_inputs.assign(4*num_slots, 0);
+        _on_focal_path.assign(num_nodes, false);
+        _focal_path.clear();
+        _focal_path.reserve(num_nodes);
+        _stale_subsets.assign(num_nodes, 0);
+        
+        // Pooled partials: buffers are handed out as partials are first computed
+        _partial_buffer.clear();
+        _free_partial_buffers.clear();
+        _saved_partials.clear();
+        _partial_evicted.clear();
+        if (_pooled_partials) {
+            int nbuffers = (int)calcNumInternalPartials();
+            _partial_buffer.assign(2*num_slots, -1);
+            _partial_evicted.assign(2*num_slots, false);
+            _free_partial_buffers.resize(_nsubset_bits);
+            for (auto & free_buffers : _free_partial_buffers) {
+                free_buffers.reserve(nbuffers);
+                for (int b = nbuffers - 1; b >= 0; b--)
+                    free_buffers.push_back(b);
+            }
+            _saved_partials.reserve(num_slots);
+        }
+    }
+    
+    inline unsigned Likelihood::calcNumShards(std::vector<unsigned> & subset_indices) const {
+        // Every shard must hold at least one pattern from each subset
+        unsigned num_patterns = 0;
+        unsigned max_shards = 0;
+        for (auto s : subset_indices) {
+            unsigned n = _data->getNumPatternsInSubset(s);
+            num_patterns += n;
+            if (max_shards == 0 || n < max_shards)
+                max_shards = n;
+        }
+        
+        unsigned nshards = _nshards;
+        if (nshards == 0) {
+            // Automatic: give this combination its share of the threads available, but do not
+            // create shards so small that dispatching them costs more than computing them
+            unsigned nthreads = (_thread_pool ? _thread_pool->getNumThreads() : 1);
+            unsigned total_patterns = _data->getNumPatterns();
+            nshards = (unsigned)std::ceil((double)nthreads*num_patterns/total_patterns);
+            nshards = std::min(nshards, num_patterns/_min_shard_patterns);
+        }
+        return std::max(1U, std::min(nshards, max_shards));
+    }
+
+    inline unsigned Likelihood::calcPatternRanges(std::vector<unsigned> & subset_indices, unsigned shard, unsigned nshards, std::vector<Data::begin_end_pair_t> & pattern_ranges) const {
+        // An instance holds the shard-th of nshards contiguous slices of each subset's patterns;
+        // returns the total number of patterns in those slices
+        pattern_ranges.clear();
+        unsigned num_patterns = 0;
+        for (auto s : subset_indices) {
+            auto interval = _data->getSubsetBeginEnd(s);
+            unsigned n = interval.second - interval.first;
+            unsigned first = interval.first + (unsigned)((unsigned long)n*shard/nshards);
+            unsigned last  = interval.first + (unsigned)((unsigned long)n*(shard + 1)/nshards);
+            pattern_ranges.push_back(std::make_pair(first, last));
+            num_patterns += last - first;
+        }
+        return num_patterns;
+    }
+    
+    inline unsigned Likelihood::calcNumInternalPartials() const {
+        // Post-order partials buffers for internal nodes (and polytomy helpers)
+        unsigned num_internals = calcNumInternalsInFullyResolvedTree();
+        return (_pooled_partials ? num_internals + _npool : 2*num_internals);
+    }
+    
+    inline double Likelihood::calcInstanceMemory(unsigned nstates, unsigned ngammacat, unsigned num_patterns, unsigned num_subsets, bool double_precision, bool preorder, bool pooled) const {
+        // Approximate number of bytes BeagleLib allocates for the buffers requested by newInstance
+        unsigned num_internals = calcNumInternalsInFullyResolvedTree();
+        unsigned num_nodes = calcNumEdgesInFullyResolvedTree() + 1;
+        unsigned npreorder = (preorder ? num_nodes : 0);
+        double nbytes = (double_precision || _backend.name == "native" ? 8.0 : 4.0);
+        
+        double ninternal = (pooled ? num_internals + _npool : 2*num_internals);
+        double npartials = ninternal + npreorder + (_ambiguity_equals_missing ? 0 : _ntaxa);
+        double memory = npartials*num_patterns*nstates*ngammacat*nbytes;
+        if (_ambiguity_equals_missing)
+            memory += (double)_ntaxa*num_patterns*sizeof(int);
+        memory += (2.0*num_nodes + 2)*num_subsets*nstates*nstates*ngammacat*nbytes;
+        if (_underflow_scaling)
+            memory += (2.0*num_internals + 1 + npreorder)*num_patterns*nbytes;
+        return memory;
     }
     
-    inline void Likelihood::newInstance(unsigned nstates, int nrates, std::vector<unsigned> & subset_indices) { 
+    inline double Likelihood::calcTotalMemory(std::map<instance_pair_t, std::vector<unsigned> > & subsets_for_pair, bool double_precision, bool pooled) const {
+        // Estimated bytes for all the instances initBeagleLib is about to create
+        double memory = 0.0;
+        std::vector<Data::begin_end_pair_t> pattern_ranges;
+        for (auto & p : subsets_for_pair) {
+            unsigned ngammacat = (unsigned)std::abs(p.first.second);
+            unsigned nshards = calcNumShards(p.second);
+            for (unsigned shard = 0; shard < nshards; shard++) {
+                unsigned num_patterns = calcPatternRanges(p.second, shard, nshards, pattern_ranges);
+                memory += calcInstanceMemory(p.first.first, ngammacat, num_patterns, (unsigned)p.second.size(), double_precision, _preorder_partials, pooled);
+            }
+        }
+        return memory;
+    }
+    
+    inline double Likelihood::calcHelperMemory(std::map<instance_pair_t, std::vector<unsigned> > & subsets_for_pair, const Data::SharedPtr & data, bool pooled) const {
+        // Estimated bytes for the instances of a shadow or surrogate likelihood holding data:
+        // double precision, no pre-order partials and a single shard
+        double memory = 0.0;
+        for (auto & p : subsets_for_pair) {
+            unsigned ngammacat = (unsigned)std::abs(p.first.second);
+            unsigned num_patterns = 0;
+            for (auto subset : p.second)
+                num_patterns += data->getNumPatternsInSubset(subset);
+            memory += calcInstanceMemory(p.first.first, ngammacat, num_patterns, (unsigned)p.second.size(), true, false, pooled);
+        }
+        return memory;
+    }
+    
+    inline double Likelihood::calcPlannedMemory(std::map<instance_pair_t, std::vector<unsigned> > & subsets_for_pair, bool pooled) const {
+        // Estimated bytes for this likelihood's instances and those of its shadow and surrogate.
+        // In auto precision mode the single-precision instances and their double-precision
+        // shadow are replaced by double-precision instances (without a shadow) if the
+        // precision is promoted, so the larger of the two is what must fit.
+        double memory = calcTotalMemory(subsets_for_pair, _double_precision, pooled);
+        if (_auto_precision && !_double_precision) {
+            if (_precision_check_interval > 0)
+                memory += calcHelperMemory(subsets_for_pair, _data, pooled);
+            memory = std::max(memory, calcTotalMemory(subsets_for_pair, true, pooled));
+        }
+        if (_surrogate_data)
+            memory += calcHelperMemory(subsets_for_pair, _surrogate_data, false);
+        return memory;
+    }
+    
+    inline void Likelihood::planMemory(std::map<instance_pair_t, std::vector<unsigned> > & subsets_for_pair) {
+        // Decide how partials are buffered, given the memory budget. Instances recreated in
+        // double precision after a promotion keep the buffering chosen at startup, which
+        // allowed for them, so the budget is not checked again.
+        if (_promotion_evaluation > 0) {
+            _memory_estimate = calcPlannedMemory(subsets_for_pair, _pooled_partials);
+            return;
+        }
+        
+        unsigned num_internals = calcNumInternalsInFullyResolvedTree();
+        _npool = _buffer_pool_size;
+        if (_npool == 0) {
+            // Enough spares for a proposal that changes partials along the path
+            // to the root of a reasonably balanced tree
+            _npool = 4*(unsigned)std::ceil(std::log2((double)std::max(_ntaxa, 2U)));
+        }
+        _npool = std::min(_npool, num_internals);
+        
+        double double_buffered = calcPlannedMemory(subsets_for_pair, false);
+        double pooled = calcPlannedMemory(subsets_for_pair, true);
+        
+        double budget = _memory_budget*1048576.0;
+        if (_revert_buffers == "pool")
+            _pooled_partials = true;
+        else if (_revert_buffers == "auto")
+            _pooled_partials = (budget > 0.0 && double_buffered > budget);
+        else
+            _pooled_partials = false;
+        _memory_estimate = (_pooled_partials ? pooled : double_buffered);
+        
+        if (budget > 0.0 && _memory_estimate > budget)
+            throw XLorad(boost::format("likelihood buffers need an estimated %.1f MB (%.1f MB with revertbuffers = pool), which exceeds the memory budget of %.1f MB") % (_memory_estimate/1048576.0) % (pooled/1048576.0) % _memory_budget);
+    }
+
+    inline void Likelihood::newInstance(unsigned nstates, int nrates, std::vector<unsigned> & subset_indices, unsigned shard, unsigned nshards) { 
         unsigned num_subsets = (unsigned)subset_indices.size();
     
         bool is_invar_model = (nrates < 0 ? true : false);
@@ -327,22 +1044,19 @@ namespace lorad {
         // for polytomies (represents the transition matrix
         // for the zero-length edges inserted to arbitrarily 
         // resolve each polytomy)
-        _identity_matrix.assign(nstates*nstates*ngammacat, 0.0);
+        std::vector<double> identity_matrix(nstates*nstates*ngammacat, 0.0);
         for (unsigned k = 0; k < ngammacat; k++) {
             unsigned offset = k*nstates*nstates;
-            _identity_matrix[0+offset]  = 1.0;
-            _identity_matrix[5+offset]  = 1.0;
-            _identity_matrix[10+offset] = 1.0;
-            _identity_matrix[15+offset] = 1.0;
+            for (unsigned i = 0; i < nstates; i++)
+                identity_matrix[offset + i*nstates + i] = 1.0;
         }   
         
         //...   
         
                 
-        unsigned num_patterns = 0;
-        for (auto s : subset_indices) {
-            num_patterns += _data->getNumPatternsInSubset(s);
-        }
+        // This instance holds the shard-th of nshards contiguous slices of each subset's patterns
+        std::vector<Data::begin_end_pair_t> pattern_ranges;
+        unsigned num_patterns = calcPatternRanges(subset_indices, shard, nshards, pattern_ranges);
         
         unsigned num_internals = calcNumInternalsInFullyResolvedTree();
         
@@ -352,8 +1066,12 @@ namespace lorad {
         unsigned num_transition_probs = num_nodes*num_subsets;
 
         long requirementFlags = 0;
+        if (_double_precision)
+            requirementFlags |= BEAGLE_FLAG_PRECISION_DOUBLE;
 
-        long preferenceFlags = BEAGLE_FLAG_PRECISION_SINGLE | BEAGLE_FLAG_THREADING_CPP;
+        long preferenceFlags = (_beagle_threads ? BEAGLE_FLAG_THREADING_CPP : BEAGLE_FLAG_THREADING_NONE);
+        if (!_double_precision)
+            preferenceFlags |= BEAGLE_FLAG_PRECISION_SINGLE;
         if (_underflow_scaling) {
             preferenceFlags |= BEAGLE_FLAG_SCALING_MANUAL;
             preferenceFlags |= BEAGLE_FLAG_SCALERS_LOG;
@@ -364,24 +1082,26 @@ namespace lorad {
             preferenceFlags |= BEAGLE_FLAG_PROCESSOR_CPU;
         
         BeagleInstanceDetails instance_details;
-        unsigned npartials = num_internals + _ntaxa;
+        unsigned ninternal = calcNumInternalPartials();    // two for every internal node, or one plus the pool
+        unsigned ntips = _ntaxa;
         unsigned nscalers = num_internals;  // one scale buffer for every internal node 
+        unsigned npreorder = (_preorder_partials ? num_nodes : 0);  // one pre-order partial (and scaler) for every node
         unsigned nsequences = 0;
         if (_ambiguity_equals_missing) {
-            npartials -= _ntaxa;
+            ntips = 0;
             nsequences += _ntaxa;
         }
         
-        int inst = beagleCreateInstance(
+        int inst = _backend.createInstance(
              _ntaxa,                        // tips
-             2*npartials,                   // partials
+             ntips + ninternal + npreorder, // partials
              nsequences,                    // sequences
              nstates,                       // states
-             num_patterns,                  // patterns (total across all subsets that use this instance)
+             num_patterns,                  // patterns (total across this shard of all subsets that use this instance)
              num_subsets,                   // models (one for each distinct eigen decomposition)
-             2*num_subsets*num_transition_probs, // transition matrices (one for each edge in each subset)
+             2*num_transition_probs + 2*num_subsets, // transition matrices (two for each edge in each subset, plus derivative matrices)
              ngammacat,                     // rate categories
-             (_underflow_scaling ? 2*nscalers + 1 : 0),  // scale buffers (+1 is for the cumulative scaler at index 0)
+             (_underflow_scaling ? 2*nscalers + 1 + npreorder : 0),  // scale buffers (+1 is for the cumulative scaler at index 0)
              NULL,                          // resource restrictions
              0,                             // length of resource list
              preferenceFlags,               // preferred flags
@@ -402,11 +1122,78 @@ namespace lorad {
         info.nstates        = nstates;
         info.nratecateg     = ngammacat;
         info.invarmodel     = is_invar_model;
+        info.doubleprecision = ((instance_details.flags & BEAGLE_FLAG_PRECISION_DOUBLE) != 0);
         info.subsets        = subset_indices;
+        info.pattern_ranges = pattern_ranges;
         info.npatterns      = num_patterns;
+        info.shard          = shard;
+        info.nshards        = nshards;
+        info.qmatrix_versions.assign(num_subsets, 0);  // 0 means never sent
+        info.asrv_versions.assign(num_subsets, 0);
         info.partial_offset = num_internals;
         info.tmatrix_offset = num_nodes;
+        info.preorder_partial_offset = _ntaxa + ninternal;
+        info.preorder_scaler_offset = 2*nscalers + 1;
+        info.derivative_offset = 2*num_transition_probs;
+        info.identity_matrix = identity_matrix;
+        info.memory         = calcInstanceMemory(nstates, ngammacat, num_patterns, num_subsets, info.doubleprecision, _preorder_partials, _pooled_partials);
         _instances.push_back(info);
+        
+        // Reserve work arenas so that no allocation is needed during MCMC: at most one
+        // operation per internal node (polytomy helpers are drawn from the unused
+        // internal nodes) and one pre-order operation and transition matrix per node.
+        // This is done after the push_back because copying a vector does not preserve
+        // its capacity.
+        InstanceInfo & added = _instances.back();
+        unsigned op_length = (num_subsets > 1 ? 9 : 7);
+        added.operations.reserve(op_length*num_subsets*num_internals);
+        added.preorder_operations.reserve(op_length*num_subsets*num_nodes);
+        added.pmatrix_index.reserve(num_transition_probs);
+        added.edge_lengths.reserve(num_transition_probs);
+        added.eigen_indices.reserve(num_transition_probs);
+        added.category_rate_indices.reserve(num_transition_probs);
+        added.scaler_indices.reserve(2*num_nodes*num_subsets);
+        added.subset_indices.reserve(num_subsets);
+        added.parent_indices.reserve(num_subsets);
+        added.child_indices.reserve(num_subsets);
+        added.tmatrix_indices.reserve(num_subsets);
+        added.weights_indices.reserve(num_subsets);
+        added.freqs_indices.reserve(num_subsets);
+        added.scaling_indices.reserve(num_subsets);
+        added.subset_log_likelihoods.reserve(num_subsets);
+        added.site_log_likelihoods.resize(num_patterns);
+        added.derivative_indices.resize(2*num_subsets);
+        for (unsigned j = 0; j < num_subsets; j++) {
+            added.derivative_indices[j] = added.derivative_offset + 2*j;
+            added.derivative_indices[num_subsets + j] = added.derivative_offset + 2*j + 1;
+        }
+        added.subset_derivatives.reserve(2*num_subsets);
+        if (_underflow_scaling && _scaling_interval > 0) {
+            unsigned nscalebuffers = 2*nscalers + 1 + npreorder;
+            added.in_cumulative.assign(num_subsets*nscalebuffers, 0);
+            added.scaler_marks.assign(num_subsets*nscalebuffers, 0);
+            added.scalers_added.reserve(nscalebuffers);
+            added.scalers_removed.reserve(nscalebuffers);
+        }
+        
+        if (is_invar_model) {
+            // Find this instance's patterns that could be invariant
+            const auto & invariant_patterns = _data->getInvariantPatterns();
+            unsigned first = 0;
+            for (auto & interval : pattern_ranges) {
+                auto it = std::lower_bound(invariant_patterns.begin(), invariant_patterns.end(), interval.first);
+                for (; it != invariant_patterns.end() && *it < interval.second; ++it) {
+                    added.invar_patterns.push_back(first + *it - interval.first);
+                    added.invar_data_index.push_back((unsigned)(it - invariant_patterns.begin()));
+                }
+                added.invar_subset_end.push_back((unsigned)added.invar_patterns.size());
+                first += interval.second - interval.first;
+            }
+            added.invar_log_likes.assign(added.invar_patterns.size(), 0.0);
+            added.invar_versions.assign(num_subsets, 0);    // 0 means never computed
+            added.site_first_derivatives.resize(num_patterns);
+            added.site_second_derivatives.resize(num_patterns);
+        }
     }   
 
     inline void Likelihood::setTipStates() {
@@ -423,10 +1210,9 @@ namespace lorad {
             
                 // Loop through all subsets assigned to this instance
                 unsigned k = 0;
-                for (unsigned s : info.subsets) {
+                for (auto & interval : info.pattern_ranges) {
                 
-                    // Loop through all patterns in this subset
-                    auto interval = _data->getSubsetBeginEnd(s);
+                    // Loop through this instance's patterns in this subset
                     for (unsigned p = interval.first; p < interval.second; p++) {
                     
                         // d is the state for taxon t, pattern p (in subset s)
@@ -465,7 +1251,7 @@ namespace lorad {
                     } // pattern loop
                 }   // subset loop
 
-            int code = beagleSetTipStates(
+            int code = _backend.setTipStates(
                 info.handle,    // Instance number
                 t,              // Index of destination compactBuffer
                 &states[0]);    //  Pointer to compact states vector
@@ -491,10 +1277,9 @@ namespace lorad {
             
                 // Loop through all subsets assigned to this instance
                 unsigned k = 0;
-                for (unsigned s : info.subsets) {
+                for (auto & interval : info.pattern_ranges) {
                 
-                    // Loop through all patterns in this subset
-                    auto interval = _data->getSubsetBeginEnd(s);
+                    // Loop through this instance's patterns in this subset
                     for (unsigned p = interval.first; p < interval.second; p++) {
                     
                         // d is the state for taxon t, pattern p (in subset s)
@@ -516,7 +1301,7 @@ namespace lorad {
                     }
                 }
                 
-            int code = beagleSetTipPartials(
+            int code = _backend.setTipPartials(
                 info.handle,    // Instance number
                 t,              // Index of destination compactBuffer
                 &partials[0]);  // Pointer to compact states vector
@@ -535,7 +1320,7 @@ namespace lorad {
         // beagleSetPatternPartitions does not need to be called if data are unpartitioned
         // (and, in fact, BeagleLib only supports partitioning for 4-state instances if GPU is used,
         // so not calling beagleSetPatternPartitions allows unpartitioned codon model analyses)
-        if (_instances.size() == 1 && _instances[0].subsets.size() == 1)
+        if (_data->getNumSubsets() == 1)
             return;
         
         Data::partition_key_t v;
@@ -548,16 +1333,15 @@ namespace lorad {
 
             // Loop through all subsets assigned to this instance
             unsigned instance_specific_subset_index = 0;
-            for (unsigned s : info.subsets) {
-                // Loop through all patterns in this subset
-                auto interval = _data->getSubsetBeginEnd(s);
+            for (auto & interval : info.pattern_ranges) {
+                // Loop through this instance's patterns in this subset
                 for (unsigned p = interval.first; p < interval.second; p++) {
                     v[pattern_index++] = instance_specific_subset_index;
                 }
                 ++instance_specific_subset_index;
             }
 
-            int code = beagleSetPatternPartitions(
+            int code = _backend.setPatternPartitions(
                info.handle, // instance number
                nsubsets,    // number of data subsets (equals 1 if data are unpartitioned)
                &v[0]);      // vector of subset indices: v[i] = 0 means pattern i is in subset 0
@@ -581,19 +1365,24 @@ namespace lorad {
             unsigned pattern_index = 0;
 
             // Loop through all subsets assigned to this instance
-            for (unsigned s : info.subsets) {
+            for (auto & interval : info.pattern_ranges) {
             
-                // Loop through all patterns in this subset
-                auto interval = _data->getSubsetBeginEnd(s);
+                // Loop through this instance's patterns in this subset
                 for (unsigned p = interval.first; p < interval.second; p++) {
                     v[pattern_index++] = pattern_counts[p];
                 }
             }
 
-            int code = beagleSetPatternWeights(
+            int code = _backend.setPatternWeights(
                info.handle,   // instance number
                &v[0]);        // vector of pattern counts: v[i] = 123 means pattern i was encountered 123 times
 
+            info.pattern_weights = v;
+            info.subset_weights.clear();
+            for (auto & interval : info.pattern_ranges) {
+                info.subset_weights.push_back(std::accumulate(pattern_counts.begin() + interval.first, pattern_counts.begin() + interval.second, 0.0));
+            }
+
             if (code != 0)
                 throw XLorad(boost::format("Failed to set pattern weights for instance %d. BeagleLib error code was %d (%s)") % info.handle % code % _beagle_error[code]);
         }
@@ -609,14 +1398,24 @@ namespace lorad {
             // Loop through all subsets assigned to this instance
             unsigned instance_specific_subset_index = 0;
             for (unsigned s : info.subsets) {
-                code = _model->setBeagleAmongSiteRateVariationRates(info.handle, s, instance_specific_subset_index);
+                // Skip this subset if its rates and probs have not changed since last sent
+                unsigned long version = _model->getASRV(s).getVersion();
+                if (info.asrv_versions[instance_specific_subset_index] == version) {
+                    ++_nuploads_skipped;
+                    ++instance_specific_subset_index;
+                    continue;
+                }
+                
+                code = _model->setBeagleAmongSiteRateVariationRates(_backend, info.handle, s, instance_specific_subset_index);
                 if (code != 0)
                     throw XLorad(boost::str(boost::format("Failed to set category rates for BeagleLib instance %d. BeagleLib error code was %d (%s)") % info.handle % code % _beagle_error[code]));
             
-                code = _model->setBeagleAmongSiteRateVariationProbs(info.handle, s, instance_specific_subset_index);
+                code = _model->setBeagleAmongSiteRateVariationProbs(_backend, info.handle, s, instance_specific_subset_index);
                 if (code != 0)
                     throw XLorad(boost::str(boost::format("Failed to set category probabilities for BeagleLib instance %d. BeagleLib error code was %d (%s)") % info.handle % code % _beagle_error[code]));
                     
+                info.asrv_versions[instance_specific_subset_index] = version;
+                ++_nuploads;
                 ++instance_specific_subset_index;
             }
         }
@@ -629,35 +1428,93 @@ namespace lorad {
             // Loop through all subsets assigned to this instance
             unsigned instance_specific_subset_index = 0;
             for (unsigned s : info.subsets) {
-                int code = _model->setBeagleStateFrequencies(info.handle, s, instance_specific_subset_index);
+                // Skip this subset if its rate matrix has not changed since last sent
+                unsigned long version = _model->getQMatrix(s).getVersion();
+                if (info.qmatrix_versions[instance_specific_subset_index] == version) {
+                    ++_nuploads_skipped;
+                    ++instance_specific_subset_index;
+                    continue;
+                }
+                
+                int code = _model->setBeagleStateFrequencies(_backend, info.handle, s, instance_specific_subset_index);
                 if (code != 0)
                     throw XLorad(boost::str(boost::format("Failed to set state frequencies for BeagleLib instance %d. BeagleLib error code was %d (%s)") % info.handle % code % _beagle_error[code]));
 
-                code = _model->setBeagleEigenDecomposition(info.handle, s, instance_specific_subset_index);
+                code = _model->setBeagleEigenDecomposition(_backend, info.handle, s, instance_specific_subset_index);
                 if (code != 0)
                     throw XLorad(boost::str(boost::format("Failed to set eigen decomposition for BeagleLib instance %d. BeagleLib error code was %d (%s)") % info.handle % code % _beagle_error[code]));
                 
+                info.qmatrix_versions[instance_specific_subset_index] = version;
+                ++_nuploads;
                 ++instance_specific_subset_index;
             }
         }
     }
     
-    inline unsigned Likelihood::getScalerIndex(Node * nd, InstanceInfo & info) const {
+    inline unsigned Likelihood::getScalerIndex(Node * nd, unsigned subset) const {
+        // Scale buffer indices are the same in every instance; each subset's factors occupy
+        // that subset's patterns in the buffer
         unsigned sindex = BEAGLE_OP_NONE;
         if (_underflow_scaling) {
+            if (_scaling_interval > 0) {
+                // Factors may have been inherited from nd's other partials buffer
+                assert(_scaler_source[getPartialSlot(nd, subset)] >= 0);
+                return _scaler_source[getPartialSlot(nd, subset)];
+            }
             sindex = nd->_number - _ntaxa + 1; // +1 to skip the cumulative scaler vector
-            if (nd->isAltPartial())
-                sindex += info.partial_offset;
+            if (nd->isAltPartial(subset))
+                sindex += _instances[0].partial_offset;
         }
         return sindex;
     }
     
-    inline unsigned Likelihood::getPartialIndex(Node * nd, InstanceInfo & info) const {
+    inline int Likelihood::getRescaleIndex(Node * nd, unsigned subset) const {
+        // Dynamic scaling: new factors for nd's current partials buffer go into one of nd's two
+        // scale buffers, but never the one holding the factors used by nd's other partials
+        // buffer, which a rejected proposal may return to
+        unsigned slot = getPartialSlot(nd, subset);
+        int first = nd->_number - _ntaxa + 1;
+        int second = first + _instances[0].partial_offset;
+        int own = (nd->isAltPartial(subset) ? second : first);
+        int other = (nd->isAltPartial(subset) ? first : second);
+        return (_scaler_source[slot ^ 1] == own ? other : own);
+    }
+    
+    inline bool Likelihood::chooseScalers(Node * nd, unsigned subset, bool rescale) {
+        // Dynamic scaling: reuse the factors of nd's other partials buffer unless new
+        // factors are required (or there are none to reuse). Returns true if new factors
+        // are to be computed, false if the partials are to be divided by existing ones.
+        unsigned slot = getPartialSlot(nd, subset);
+        int source = _scaler_source[slot ^ 1];
+        if (rescale || _rescaling || source < 0) {
+            _scaler_source[slot] = getRescaleIndex(nd, subset);
+            _scalers_written = true;
+            return true;
+        }
+        _scaler_source[slot] = source;
+        return false;
+    }
+    
+    inline void Likelihood::startScaling() {
+        // Called at the start of each evaluation
+        if (_scaling_interval > 0) {
+            _rescaling = (_force_rescaling || _nevaluations % _scaling_interval == 0);
+            _force_rescaling = false;
+            _scalers_written = false;
+        }
+    }
+    
+    inline unsigned Likelihood::getPartialIndex(Node * nd, InstanceInfo & info, unsigned subset_index) const {
         // Note: do not be tempted to subtract _ntaxa from pindex: BeagleLib does this itself
         assert(nd->_number >= 0);
         unsigned pindex = nd->_number;
         if (pindex >= _ntaxa) {
-            if (nd->isAltPartial())
+            if (_pooled_partials) {
+                int buffer = _partial_buffer[getPartialSlot(nd, info.subsets[subset_index])];
+                assert(buffer >= 0);
+                return _ntaxa + buffer;
+            }
+            if (nd->isAltPartial(info.subsets[subset_index]))
                 pindex += info.partial_offset;
         }
         return pindex;
@@ -665,90 +1522,268 @@ namespace lorad {
     
     inline unsigned Likelihood::getTMatrixIndex(Node * nd, InstanceInfo & info, unsigned subset_index) const {
         unsigned tindex = 2*subset_index*info.tmatrix_offset + nd->_number;
-        if (nd->isAltTMatrix())
+        if (nd->isAltTMatrix(info.subsets[subset_index]))
             tindex += info.tmatrix_offset;
         return tindex;
     }
     
-    inline void Likelihood::defineOperations(Tree::SharedPtr t) {   
+    inline unsigned Likelihood::getPreorderPartialIndex(Node * nd, InstanceInfo & info) const {
+        // Pre-order partials are not double-buffered: they are stored after all post-order partials
+        assert(_preorder_partials);
+        return info.preorder_partial_offset + nd->_number;
+    }
+    
+    inline unsigned Likelihood::getPreorderScalerIndex(Node * nd, InstanceInfo & info) const {
+        unsigned sindex = BEAGLE_OP_NONE;
+        if (_underflow_scaling) {
+            assert(_preorder_partials);
+            sindex = info.preorder_scaler_offset + nd->_number;
+        }
+        return sindex;
+    }
+    
+    inline unsigned Likelihood::getPartialSlot(Node * nd, unsigned subset) const {
+        assert(nd->_number >= 0);
+        unsigned slot = 2*getPreorderSlot(nd, subset);
+        if (nd->_number >= (int)_ntaxa && nd->isAltPartial(subset))
+            slot += 1;
+        return slot;
+    }
+    
+    inline unsigned Likelihood::getTMatrixSlot(Node * nd, unsigned subset) const {
+        assert(nd->_number >= 0);
+        unsigned slot = 2*getPreorderSlot(nd, subset);
+        if (nd->isAltTMatrix(subset))
+            slot += 1;
+        return slot;
+    }
+    
+    inline unsigned Likelihood::getPreorderSlot(Node * nd, unsigned subset) const {
+        assert(nd->_number >= 0);
+        return nd->_number*_nsubset_bits + Node::getSubsetBit(subset);
+    }
+    
+    inline void Likelihood::defineOperations(Tree::SharedPtr & t) {   
         assert(_instances.size() > 0);
         assert(t);
         assert(t->isRooted() == _rooted);
         assert(_polytomy_helpers.empty());
-        assert(_polytomy_map.empty());
+        assert(_polytomy_scaler_groups.empty());
 
-        _relrate_normalizing_constant = _model->calcNormalizingConstantForSubsetRelRates();
+        // Only recompute the normalizing constant if relative rates have changed
+        unsigned long relrate_version = _model->getSubsetRelRatesVersion();
+        if (relrate_version != _relrate_version) {
+            _relrate_normalizing_constant = _model->calcNormalizingConstantForSubsetRelRates();
+            _relrate_version = relrate_version;
+        }
         
         // Relative rates should be kept normalized at all times
         assert(fabs(_relrate_normalizing_constant - 1.0) < 0.001);
 
         // Start with a clean slate
         for (auto & info : _instances) {
-            _operations[info.handle].clear();
-            _pmatrix_index[info.handle].clear();
-            _edge_lengths[info.handle].clear();
-            _eigen_indices[info.handle].clear();
-            _category_rate_indices[info.handle].clear();
+            info.operations.clear();
+            info.pmatrix_index.clear();
+            info.edge_lengths.clear();
+            info.eigen_indices.clear();
+            info.category_rate_indices.clear();
         }
 
-        // Loop through all nodes in reverse level order
-        for (auto nd : boost::adaptors::reverse(t->_levelorder)) {
-            assert(nd->_number >= 0);
-            if (!nd->_left_child) {
-                // This is a leaf
-                if (nd->isSelTMatrix())
-                    queueTMatrixRecalculation(nd);
+        if (_model->isFixedTree() && _plan_tree.lock() != t)
+            compileTraversalPlan(t);
+            
+        if (!_plan_steps.empty()) {
+            for (auto & step : _plan_steps)
+                defineNodeOperations(t, step.nd, step.lchild, step.rchild);
+        }
+        else {
+            // Loop through all nodes in reverse level order
+            for (auto nd : boost::adaptors::reverse(t->_levelorder)) {
+                Node * lchild = nd->_left_child;
+                defineNodeOperations(t, nd, lchild, lchild ? lchild->_right_sib : 0);
             }
-            else {
-                // This is an internal node
-                if (nd->isSelTMatrix())
-                    queueTMatrixRecalculation(nd);
-
-                // Internal nodes have partials to be calculated, so define
-                // an operation to compute the partials for this node
-                if (nd->isSelPartial()) {
-                    TreeManip tm(t);   
-                    if (tm.isPolytomy(nd)) {
-                        // Internal node is a polytomy
-                        unsigned nchildren = tm.countChildren(nd);
-                        Node * a = nd->_left_child;
-                        Node * b = a->_right_sib;
-                        Node * c = 0;
-                        for (unsigned k = 0; k < nchildren - 2; k++) {
-                            c = tm.getUnusedNode();
-                            c->_left_child = a;
-                            _polytomy_helpers.push_back(c);
-
-                            queuePartialsRecalculation(c, a, b, nd);
-                            
-                            // Tackle next arm of the polytomy
-                            b = b->_right_sib;
-                            a = c;
+        }
+    }   
+
+    inline void Likelihood::defineNodeOperations(Tree::SharedPtr & t, Node * nd, Node * lchild, Node * rchild) {
+        assert(nd->_number >= 0);
+        
+        // Nothing to do unless the proposal selected nd or one of its buffers is stale
+        Node::subset_mask_t candidates = nd->_sel_partials | nd->_sel_tmatrices | _stale_subsets[nd->_number];
+        if (!candidates)
+            return;
+            
+        // Transition matrices (and partials, if nd is an internal node) are recalculated
+        // only for the subsets selected by the proposal or left stale by an earlier one
+        Node::subset_mask_t tmatrix_subsets = 0;
+        Node::subset_mask_t partial_subsets = 0;
+        for (unsigned s = 0; s < _nsubset_bits; s++) {
+            if (nd->isSelTMatrix(s) || _tmatrix_stale[getTMatrixSlot(nd, s)])
+                tmatrix_subsets |= Node::getSubsetMask(s);
+            if (lchild && (nd->isSelPartial(s) || _partial_stale[getPartialSlot(nd, s)]))
+                partial_subsets |= Node::getSubsetMask(s);
+        }
+        
+        if (tmatrix_subsets)
+            queueTMatrixRecalculation(nd, tmatrix_subsets);
+
+        // Internal nodes have partials to be calculated, so define
+        // an operation to compute the partials for this node
+        if (partial_subsets) {
+            if (_on_focal_path[nd->_number]) {
+                // Partials above the focal edge are not needed to score it (its pre-order
+                // partial is used instead), so leave this buffer to be recomputed the next
+                // time the full post-order traversal is needed
+                for (unsigned s = 0; s < _nsubset_bits; s++) {
+                    if (partial_subsets & Node::getSubsetMask(s)) {
+                        unsigned slot = getPartialSlot(nd, s);
+                        _partial_generation[slot] = ++_generation;
+                        _partial_stale[slot] = true;
+                        if (_pooled_partials && _partial_buffer[slot] >= 0) {
+                            // Nothing worth keeping is left in this buffer
+                            _free_partial_buffers[s].push_back(_partial_buffer[slot]);
+                            _partial_buffer[slot] = -1;
                         }
-                        
-                        // Now add operation to compute the partial for the real internal node
-                        queuePartialsRecalculation(nd, a, b);
                     }
-                    else {
-                        // Internal node is not a polytomy
-                        Node * lchild = nd->_left_child;
-                        assert(lchild);
-                        Node * rchild = lchild->_right_sib;
-                        assert(rchild);
-                        queuePartialsRecalculation(nd, lchild, rchild);
-                    }   
+                }
+                _stale_subsets[nd->_number] = calcStaleSubsets(nd);
+                return;
+            }
+            
+            Node * a = lchild;
+            assert(a);
+            Node * b = rchild;
+            assert(b);
+            
+            // If the internal node is a polytomy, resolve it arbitrarily using helper
+            // nodes taken from the tree's unused nodes
+            unsigned nhelpers = 0;
+            while (b->_right_sib) {
+                assert(!t->_unused_nodes.empty());
+                Node * c = t->_unused_nodes.back();
+                t->_unused_nodes.pop_back();
+                c->clearPointers();
+                c->_left_child = a;
+                _polytomy_helpers.push_back(c);
+                ++nhelpers;
+
+                queuePartialsRecalculation(c, a, b, partial_subsets, nd);
+                
+                // Tackle next arm of the polytomy
+                b = b->_right_sib;
+                a = c;
+            }
+            
+            // Now add operation to compute the partial for the real internal node
+            queuePartialsRecalculation(nd, a, b, partial_subsets);
+            
+            // If employing underflow scaling, the scaling factors for the helper nodes need
+            // to be transferred to the polytomous node, as that will be the only node
+            // remaining after the likelihood has been calculated. Save the helpers' scaler
+            // indices, grouped by subset (scaler indices are the same in every instance).
+            if (_underflow_scaling && nhelpers > 0) {
+                unsigned first_helper = (unsigned)_polytomy_helpers.size() - nhelpers;
+                for (unsigned s = 0; s < _nsubset_bits; s++) {
+                    if (!(partial_subsets & Node::getSubsetMask(s)))
+                        continue;
+                    PolytomyScalerGroup g;
+                    g.polytomy_scaler = (int)getScalerIndex(nd, s);
+                    g.subset_bit = s;
+                    g.first = (unsigned)_polytomy_helper_scalers.size();
+                    g.nhelpers = nhelpers;
+                    for (unsigned i = first_helper; i < _polytomy_helpers.size(); i++)
+                        _polytomy_helper_scalers.push_back((int)getScalerIndex(_polytomy_helpers[i], s));
+                    _polytomy_scaler_groups.push_back(g);
                 }
             }
         }
-    }   
+        _stale_subsets[nd->_number] = calcStaleSubsets(nd);
+    }
+    
+    inline Node::subset_mask_t Likelihood::calcStaleSubsets(Node * nd) const {
+        // Either buffer counts, as a revert may make the alternate buffer current again
+        Node::subset_mask_t stale = 0;
+        for (unsigned s = 0; s < _nsubset_bits; s++) {
+            unsigned pslot = getPartialSlot(nd, s);
+            unsigned tslot = getTMatrixSlot(nd, s);
+            if (_partial_stale[pslot] || _partial_stale[pslot^1] || _tmatrix_stale[tslot] || _tmatrix_stale[tslot^1])
+                stale |= Node::getSubsetMask(s);
+        }
+        return stale;
+    }
+    
+    inline void Likelihood::compileTraversalPlan(Tree::SharedPtr & t) {
+        // The topology does not change, so the order in which nodes are visited and the
+        // children of each node are worked out once rather than on every evaluation
+        _plan_tree = t;
+        _plan_steps.clear();
+        _plan_internals.clear();
+        for (auto nd : t->_preorder) {
+            if (nd->_left_child) {
+                Node * rchild = nd->_left_child->_right_sib;
+                if (!rchild || rchild->_right_sib) {
+                    // Polytomies need helper nodes, so leave them to the general traversal
+                    _plan_internals.clear();
+                    return;
+                }
+                _plan_internals.push_back(nd);
+            }
+        }
+        _plan_steps.reserve(t->_levelorder.size());
+        for (auto nd : boost::adaptors::reverse(t->_levelorder)) {
+            TraversalStep step;
+            step.nd = nd;
+            step.lchild = nd->_left_child;
+            step.rchild = (nd->_left_child ? nd->_left_child->_right_sib : 0);
+            _plan_steps.push_back(step);
+        }
+    }
 
-    inline void Likelihood::queuePartialsRecalculation(Node * nd, Node * lchild, Node * rchild, Node * polytomy) {  
+    inline void Likelihood::queuePartialsRecalculation(Node * nd, Node * lchild, Node * rchild, Node::subset_mask_t subsets, Node * polytomy) {  
+        // Scale buffer indices are the same in every instance. Polytomy helpers and polytomous
+        // nodes always get new factors because the helpers' factors are added to the polytomy's.
+        bool is_polytomy = (nd->_left_child->_right_sib && nd->_left_child->_right_sib->_right_sib);
+        Node::subset_mask_t rescale_subsets = 0;
+        for (unsigned s = 0; s < _nsubset_bits; s++) {
+            Node::subset_mask_t m = Node::getSubsetMask(s);
+            if (!(subsets & m))
+                continue;
+                
+            if (_pooled_partials)
+                acquirePartialBuffer(nd, s);
+            
+            unsigned slot = getPartialSlot(nd, s);
+            _partial_generation[slot] = ++_generation;
+            _partial_stale[slot] = false;
+            ++_npartials_calculated;
+            
+            // Partials whose buffer was taken are recomputed only because they are needed
+            // again, so with dynamic scaling they must be divided by the same factors as
+            // before: nd's parent (which is not recomputed) was calculated from them
+            bool evicted = (_pooled_partials && _partial_evicted[slot]);
+            if (evicted)
+                _partial_evicted[slot] = false;
+            bool keep_factors = (evicted && _scaling_interval > 0 && !polytomy && !is_polytomy && _scaler_source[slot] >= 0);
+            if (_underflow_scaling && !keep_factors && (_scaling_interval == 0 || chooseScalers(nd, s, polytomy || is_polytomy)))
+                rescale_subsets |= m;
+            
+            if (polytomy)
+                _tmatrix_generation[getTMatrixSlot(nd, s)] = ++_generation;
+        }
+        
+        if (polytomy) {
+            // Set the edgelength to 0.0 to maintain consistency with the identity transition matrix
+            nd->setEdgeLength(0.0);
+        }
+        
         for (auto & info : _instances) {
             unsigned instance_specific_subset_index = 0;
-            // line below produces warning about s not being used, but this is unavoidable
-            // because values in vector info.subsets may not be sequential
             for (unsigned s : info.subsets) {
-                (void)s;    // to prevent compiler warning about s not being used
+                Node::subset_mask_t m = Node::getSubsetMask(s);
+                if (!(subsets & m)) {
+                    ++instance_specific_subset_index;
+                    continue;
+                }
             
                 if (polytomy) {  
                     // nd has been pulled out of tree's _unused_nodes vector to break up the polytomy
@@ -759,382 +1794,982 @@ namespace lorad {
 
                     // Set the transition matrix for nd to the identity matrix
                     // note: last argument 1 is the value used for ambiguous states (should be 1 for transition matrices)
-                    int code = beagleSetTransitionMatrix(info.handle, tindex, &_identity_matrix[0], 1);
+                    int code = _backend.setTransitionMatrix(info.handle, tindex, &info.identity_matrix[0], 1);
                     if (code != 0)
                         throw XLorad(boost::str(boost::format("Failed to set transition matrix for instance %d. BeagleLib error code was %d (%s)") % info.handle % code % _beagle_error[code]));
-                    
-                    // Set the edgelength to 0.0 to maintain consistency with the transition matrix
-                    nd->setEdgeLength(0.0);
-                    
-                    // If employing underflow scaling, the scaling factors for these fake nodes need to be
-                    // transferred to the polytomous node, as that will be the only node remaining after the
-                    // likelihood has been calculated. Save the scaling factor index, associating it with
-                    // the scaling factor index of the polytomy node.
-                    if (_underflow_scaling) {
-                        // Get the polytomy's scaling factor index
-                        int spolytomy = getScalerIndex(polytomy, info);
-                        
-                        // Get nd's scaling factor index
-                        int snd = getScalerIndex(nd, info);
-                        
-                        // Save nd's index in the vector associated with polytomy's index
-                        _polytomy_map[spolytomy].push_back(snd);
-                    }
-                    
                 }  
                 
-                addOperation(info, nd, lchild, rchild, instance_specific_subset_index);
+                int scaler_write = BEAGLE_OP_NONE;
+                int scaler_read = BEAGLE_OP_NONE;
+                if (_underflow_scaling) {
+                    if (rescale_subsets & m)
+                        scaler_write = getScalerIndex(nd, s);
+                    else
+                        scaler_read = getScalerIndex(nd, s);
+                }
+                
+                addOperation(info, nd, lchild, rchild, instance_specific_subset_index, scaler_write, scaler_read);
                 ++instance_specific_subset_index;
             }
         }
     }   
     
-    inline void Likelihood::queueTMatrixRecalculation(Node * nd) {
-        Model::subset_relrate_vect_t & subset_relrates = _model->getSubsetRelRates();
-#if defined(RELRATE_DIRICHLET_PRIOR)
-        Model::subset_sizes_t & subset_sizes = _model->getSubsetSizes();
-        double nsites = (double)_model->getNumSites();
-#endif
-
+    inline void Likelihood::queueTMatrixRecalculation(Node * nd, Node::subset_mask_t subsets) {
+        for (unsigned s = 0; s < _nsubset_bits; s++) {
+            if (subsets & Node::getSubsetMask(s)) {
+                _tmatrix_generation[getTMatrixSlot(nd, s)] = ++_generation;
+                _tmatrix_stale[getTMatrixSlot(nd, s)] = false;
+            }
+        }
+        
         for (auto & info : _instances) {
             unsigned instance_specific_subset_index = 0;
             for (unsigned s : info.subsets) {
-#               if defined(RELRATE_DIRICHLET_PRIOR)
-                    double subset_relative_rate = subset_relrates[s]/_relrate_normalizing_constant;
-                    subset_relative_rate /= subset_sizes[s]; //POL_2022_09_24 was *=
-                    subset_relative_rate *= nsites;          //POL_2022_09_24 was /=
-#               else
-                    double subset_relative_rate = subset_relrates[s]/_relrate_normalizing_constant;
-#               endif
-
+                if (!(subsets & Node::getSubsetMask(s))) {
+                    ++instance_specific_subset_index;
+                    continue;
+                }
+                
+                double subset_relative_rate = calcSubsetRelativeRate(s);
                 unsigned tindex = getTMatrixIndex(nd, info, instance_specific_subset_index);
-                _pmatrix_index[info.handle].push_back(tindex);
-                _edge_lengths[info.handle].push_back(nd->_edge_length*subset_relative_rate);
-                _eigen_indices[info.handle].push_back(s);
-                _category_rate_indices[info.handle].push_back(s);
+                info.pmatrix_index.push_back(tindex);
+                info.edge_lengths.push_back(nd->_edge_length*subset_relative_rate);
+                info.eigen_indices.push_back(s);
+                info.category_rate_indices.push_back(s);
 
                 ++instance_specific_subset_index;
             }
         }
     }
 
-    inline void Likelihood::addOperation(InstanceInfo & info, Node * nd, Node * lchild, Node * rchild, unsigned subset_index) {
+    inline double Likelihood::calcSubsetRelativeRate(unsigned subset) const {
+        // Factor by which edge lengths are multiplied for the given subset
+        const Model::subset_relrate_vect_t & subset_relrates = _model->getSubsetRelRates();
+#       if defined(RELRATE_DIRICHLET_PRIOR)
+            const Model::subset_sizes_t & subset_sizes = _model->getSubsetSizes();
+            double nsites = (double)_model->getNumSites();
+            double subset_relative_rate = subset_relrates[subset]/_relrate_normalizing_constant;
+            subset_relative_rate /= subset_sizes[subset]; //POL_2022_09_24 was *=
+            subset_relative_rate *= nsites;          //POL_2022_09_24 was /=
+#       else
+            double subset_relative_rate = subset_relrates[subset]/_relrate_normalizing_constant;
+#       endif
+        return subset_relative_rate;
+    }
+
+    inline void Likelihood::addOperation(InstanceInfo & info, Node * nd, Node * lchild, Node * rchild, unsigned subset_index, int scaler_write, int scaler_read) {
         assert(nd);
         assert(lchild);
         assert(rchild);
 
         // 1. destination partial to be calculated
-        int partial_dest = getPartialIndex(nd, info);
-        _operations[info.handle].push_back(partial_dest);
+        int partial_dest = getPartialIndex(nd, info, subset_index);
+        info.operations.push_back(partial_dest);
 
         // 2. destination scaling buffer index to write to
-        int scaler_index = getScalerIndex(nd, info);
-        _operations[info.handle].push_back(scaler_index);
+        info.operations.push_back(scaler_write);
 
         // 3. destination scaling buffer index to read from
-        _operations[info.handle].push_back(BEAGLE_OP_NONE);
+        info.operations.push_back(scaler_read);
 
         // 4. left child partial index
-        int partial_lchild = getPartialIndex(lchild, info);
-        _operations[info.handle].push_back(partial_lchild);
+        int partial_lchild = getPartialIndex(lchild, info, subset_index);
+        info.operations.push_back(partial_lchild);
 
         // 5. left child transition matrix index
         unsigned tindex_lchild = getTMatrixIndex(lchild, info, subset_index);
-        _operations[info.handle].push_back(tindex_lchild);
+        info.operations.push_back(tindex_lchild);
 
         // 6. right child partial index
-        int partial_rchild = getPartialIndex(rchild, info);
-        _operations[info.handle].push_back(partial_rchild);
+        int partial_rchild = getPartialIndex(rchild, info, subset_index);
+        info.operations.push_back(partial_rchild);
 
         // 7. right child transition matrix index
         unsigned tindex_rchild = getTMatrixIndex(rchild, info, subset_index);
-        _operations[info.handle].push_back(tindex_rchild);
+        info.operations.push_back(tindex_rchild);
 
         if (info.subsets.size() > 1) {
             // 8. index of partition subset
-            _operations[info.handle].push_back(subset_index);
+            info.operations.push_back(subset_index);
             
             // 9. cumulative scale index
-            _operations[info.handle].push_back(BEAGLE_OP_NONE); // accumulate in calcInstanceLogLikelihood
+            info.operations.push_back(BEAGLE_OP_NONE); // accumulate in calcInstanceLogLikelihood
         }
     }
     
-    inline void Likelihood::updateTransitionMatrices() {
-        assert(_instances.size() > 0);
-        if (_pmatrix_index.size() == 0)
-            return;
+    inline void Likelihood::queuePreorderRecalculation(Node * nd, Node * parent, Node * sibling, Node::subset_mask_t subsets) {
+        // The pre-order partial for nd combines everything outside the subtree rooted at nd: the
+        // pre-order partial of parent (or the root tip if parent is the subroot) propagated down
+        // parent's edge, and the post-order partial of nd's sibling propagated up its own edge
+        
+        // Pre-order partials are not double-buffered, so with dynamic scaling a pre-order
+        // partial simply reuses the factors already in its own scale buffer
+        Node::subset_mask_t rescale_subsets = 0;
+        for (unsigned s = 0; s < _nsubset_bits; s++) {
+            Node::subset_mask_t m = Node::getSubsetMask(s);
+            if (!(subsets & m))
+                continue;
+            ++_npartials_calculated;
+            unsigned k = getPreorderSlot(nd, s);
+            if (_scaling_interval == 0 || _rescaling || !_preorder_scaled[k]) {
+                rescale_subsets |= m;
+                if (_underflow_scaling) {
+                    _preorder_scaled[k] = true;
+                    _scalers_written = true;
+                }
+            }
+        }
         
-        // Loop through all instances
         for (auto & info : _instances) {
-            int code = 0;
-
             unsigned nsubsets = (unsigned)info.subsets.size();
-            if (nsubsets > 1) {
-                code = beagleUpdateTransitionMatricesWithMultipleModels(
-                    info.handle,                                // Instance number
-                    &_eigen_indices[info.handle][0],            // Index of eigen-decomposition buffer
-                    &_category_rate_indices[info.handle][0],    // category rate indices
-                    &_pmatrix_index[info.handle][0],            // transition probability matrices to update
-                    NULL,                                       // first derivative matrices to update
-                    NULL,                                       // second derivative matrices to update
-                    &_edge_lengths[info.handle][0],             // List of edge lengths
-                    (int)_pmatrix_index[info.handle].size());   // Length of lists
+            for (unsigned subset_index = 0; subset_index < nsubsets; subset_index++) {
+                if (!(subsets & Node::getSubsetMask(info.subsets[subset_index])))
+                    continue;
+                int partial_above = (parent->_parent->_parent ? getPreorderPartialIndex(parent, info) : getPartialIndex(parent->_parent, info, subset_index));
+                bool rescale = (rescale_subsets & Node::getSubsetMask(info.subsets[subset_index])) != 0;
+                std::vector<int> & ops = info.preorder_operations;
+                ops.push_back(getPreorderPartialIndex(nd, info));                  // 1. destination partial
+                int scaler = getPreorderScalerIndex(nd, info);
+                ops.push_back(rescale ? scaler : BEAGLE_OP_NONE);                  // 2. destination scaling buffer to write
+                ops.push_back(rescale ? BEAGLE_OP_NONE : scaler);                  // 3. destination scaling buffer to read
+                ops.push_back(partial_above);                                      // 4. partial above parent
+                ops.push_back(getTMatrixIndex(parent, info, subset_index));        // 5. transition matrix for parent's edge
+                ops.push_back(getPartialIndex(sibling, info, subset_index));       // 6. sibling partial
+                ops.push_back(getTMatrixIndex(sibling, info, subset_index));       // 7. transition matrix for sibling's edge
+                if (nsubsets > 1) {
+                    ops.push_back(subset_index);                                   // 8. index of partition subset
+                    ops.push_back(BEAGLE_OP_NONE);                                 // 9. cumulative scale index
+                }
             }
-            else {
-                code = beagleUpdateTransitionMatrices(
-                    info.handle,                                // Instance number
-                    0,                                          // Index of eigen-decomposition buffer
-                    &_pmatrix_index[info.handle][0],            // transition probability matrices to update
-                    NULL,                                       // first derivative matrices to update
-                    NULL,                                       // second derivative matrices to update
-                    &_edge_lengths[info.handle][0],             // List of edge lengths
-                    (int)_pmatrix_index[info.handle].size());   // Length of lists
+        }
+    }
+    
+    inline void Likelihood::definePreorderOperation(Node * nd) {
+        // Queues the pre-order partial of nd for the subsets in which one of the four buffers it
+        // was computed from has been rewritten since; the pre-order partial of nd's parent (if
+        // the parent is not the subroot) must already be up to date or queued
+        Node * parent = nd->_parent;
+        Node * sibling = (parent->_left_child == nd ? nd->_right_sib : parent->_left_child);
+        assert(sibling);
+        
+        Node::subset_mask_t subsets = 0;
+        for (unsigned s = 0; s < _nsubset_bits; s++) {
+            unsigned long inputs[4];
+            inputs[0] = (parent->_parent->_parent ? _preorder_generation[getPreorderSlot(parent, s)] : _partial_generation[getPartialSlot(parent->_parent, s)]);
+            inputs[1] = _tmatrix_generation[getTMatrixSlot(parent, s)];
+            inputs[2] = _partial_generation[getPartialSlot(sibling, s)];
+            inputs[3] = _tmatrix_generation[getTMatrixSlot(sibling, s)];
+            
+            unsigned k = getPreorderSlot(nd, s);
+            unsigned long * stored = &_preorder_inputs[4*k];
+            if (!std::equal(inputs, inputs + 4, stored)) {
+                std::copy(inputs, inputs + 4, stored);
+                _preorder_generation[k] = ++_generation;
+                subsets |= Node::getSubsetMask(s);
             }
-
-            if (code != 0)
-                throw XLorad(boost::str(boost::format("Failed to update transition matrices for instance %d. BeagleLib error code was %d (%s)") % info.handle % code % _beagle_error[code]));
-                
         }
+        if (subsets)
+            queuePreorderRecalculation(nd, parent, sibling, subsets);
     }
     
-    inline void Likelihood::calculatePartials() {   
-        assert(_instances.size() > 0);
-        if (_operations.size() == 0)
+    inline void Likelihood::definePreorderOperations(Node * nd) {
+        // _focal_path holds the ancestors of nd, from nd's parent up to and including the subroot
+        assert(!_focal_path.empty());
+        for (auto & info : _instances) {
+            info.preorder_operations.clear();
+        }
+        
+        // Visit nodes along the path from the subroot down to nd
+        unsigned n = (unsigned)_focal_path.size();
+        for (unsigned i = n; i > 1; i--)
+            definePreorderOperation(_focal_path[i-2]);
+        definePreorderOperation(nd);
+    }
+    
+    inline void Likelihood::calculatePreorderPartials(InstanceInfo & info) {
+        std::vector<int> & ops = info.preorder_operations;
+        if (ops.empty())
             return;
+            
         int code = 0;
+        if (info.subsets.size() > 1) {
+            code = _backend.updatePartialsByPartition(
+                info.handle,                                // Instance number
+                (BeagleOperationByPartition *) &ops[0],     // BeagleOperation list specifying operations
+                (int)(ops.size()/9));                       // Number of operations
+        }
+        else {
+            code = _backend.updatePartials(
+                info.handle,                                // Instance number
+                (BeagleOperation *) &ops[0],                // BeagleOperation list specifying operations
+                (int)(ops.size()/7),                        // Number of operations
+                BEAGLE_OP_NONE);                            // Index number of scaleBuffer to store accumulated factors
+        }
+        if (code != 0 && !rangeExceeded(code))
+            throw XLorad(boost::format("failed to update pre-order partials. BeagleLib error code was %d (%s)") % code % _beagle_error[code]);
+    }
+    
+    inline void Likelihood::updateTransitionMatrices(InstanceInfo & info) {
+        // Nothing to do if no transition matrices were queued for this instance
+        if (info.pmatrix_index.empty())
+            return;
         
-        // Loop through all instances
-        for (auto & info : _instances) {
-            unsigned nsubsets = (unsigned)info.subsets.size();
+        int code = 0;
 
-            if (nsubsets > 1) {
-                code = beagleUpdatePartialsByPartition(
-                    info.handle,                                                    // Instance number
-                    (BeagleOperationByPartition *) &_operations[info.handle][0],    // BeagleOperation list specifying operations
-                    (int)(_operations[info.handle].size()/9));                      // Number of operations
-                if (code != 0)
-                    throw XLorad(boost::format("failed to update partials. BeagleLib error code was %d (%s)") % code % _beagle_error[code]);
-                
-                if (_underflow_scaling) {   
-                    // Accumulate scaling factors across polytomy helpers and assign them to their parent node
-                    for (auto & m : _polytomy_map) {
-                        for (unsigned subset = 0; subset < nsubsets; subset++) {
-                            code = beagleAccumulateScaleFactorsByPartition(info.handle, &m.second[0], (int)m.second.size(), m.first, subset);
-                            if (code != 0) {
-                                throw XLorad(boost::format("failed to transfer scaling factors to polytomous node. BeagleLib error code was %d (%s)") % code % _beagle_error[code]);
-                            }
-                        }
-                    }
-                }   
-            }
-            else {
-                // no partitioning, just one data subset
-                code = beagleUpdatePartials(
-                    info.handle,                                        // Instance number
-                    (BeagleOperation *) &_operations[info.handle][0],   // BeagleOperation list specifying operations
-                    (int)(_operations[info.handle].size()/7),           // Number of operations
-                    BEAGLE_OP_NONE);                                    // Index number of scaleBuffer to store accumulated factors
-                if (code != 0) 
-                    throw XLorad(boost::format("failed to update partials. BeagleLib error code was %d (%s)") % code % _beagle_error[code]);
-                
-                if (_underflow_scaling) { 
-                    // Accumulate scaling factors across polytomy helpers and assign them to their parent node
-                    for (auto & m : _polytomy_map) {
-                        code = beagleAccumulateScaleFactors(info.handle, &m.second[0], (int)m.second.size(), m.first);
+        unsigned nsubsets = (unsigned)info.subsets.size();
+        if (nsubsets > 1) {
+            code = _backend.updateTransitionMatricesWithMultipleModels(
+                info.handle,                                // Instance number
+                &info.eigen_indices[0],                     // Index of eigen-decomposition buffer
+                &info.category_rate_indices[0],             // category rate indices
+                &info.pmatrix_index[0],                     // transition probability matrices to update
+                NULL,                                       // first derivative matrices to update
+                NULL,                                       // second derivative matrices to update
+                &info.edge_lengths[0],                      // List of edge lengths
+                (int)info.pmatrix_index.size());            // Length of lists
+        }
+        else {
+            code = _backend.updateTransitionMatrices(
+                info.handle,                                // Instance number
+                0,                                          // Index of eigen-decomposition buffer
+                &info.pmatrix_index[0],                     // transition probability matrices to update
+                NULL,                                       // first derivative matrices to update
+                NULL,                                       // second derivative matrices to update
+                &info.edge_lengths[0],                      // List of edge lengths
+                (int)info.pmatrix_index.size());            // Length of lists
+        }
+
+        if (code != 0)
+            throw XLorad(boost::str(boost::format("Failed to update transition matrices for instance %d. BeagleLib error code was %d (%s)") % info.handle % code % _beagle_error[code]));
+    }
+    
+    inline void Likelihood::calculatePartials(InstanceInfo & info) {   
+        unsigned nsubsets = (unsigned)info.subsets.size();
+        
+        // Nothing to do if all partials were already up to date
+        if (info.operations.empty())
+            return;
+
+        int code = 0;
+
+        if (nsubsets > 1) {
+            code = _backend.updatePartialsByPartition(
+                info.handle,                                                    // Instance number
+                (BeagleOperationByPartition *) &info.operations[0],             // BeagleOperation list specifying operations
+                (int)(info.operations.size()/9));                               // Number of operations
+            if (code != 0 && !rangeExceeded(code))
+                throw XLorad(boost::format("failed to update partials. BeagleLib error code was %d (%s)") % code % _beagle_error[code]);
+            
+            if (_underflow_scaling) {   
+                // Accumulate scaling factors across polytomy helpers and assign them to their parent node
+                for (auto & g : _polytomy_scaler_groups) {
+                    for (unsigned subset = 0; subset < nsubsets; subset++) {
+                        if (Node::getSubsetBit(info.subsets[subset]) != g.subset_bit)
+                            continue;
+                        code = _backend.accumulateScaleFactorsByPartition(info.handle, &_polytomy_helper_scalers[g.first], (int)g.nhelpers, g.polytomy_scaler, subset);
                         if (code != 0) {
                             throw XLorad(boost::format("failed to transfer scaling factors to polytomous node. BeagleLib error code was %d (%s)") % code % _beagle_error[code]);
                         }
                     }
-                }   
+                }
             }   
         }
+        else {
+            // no partitioning, just one data subset
+            code = _backend.updatePartials(
+                info.handle,                                        // Instance number
+                (BeagleOperation *) &info.operations[0],            // BeagleOperation list specifying operations
+                (int)(info.operations.size()/7),                    // Number of operations
+                BEAGLE_OP_NONE);                                    // Index number of scaleBuffer to store accumulated factors
+            if (code != 0 && !rangeExceeded(code))
+                throw XLorad(boost::format("failed to update partials. BeagleLib error code was %d (%s)") % code % _beagle_error[code]);
+            
+            if (_underflow_scaling) { 
+                // Accumulate scaling factors across polytomy helpers and assign them to their parent node
+                for (auto & g : _polytomy_scaler_groups) {
+                    if (Node::getSubsetBit(info.subsets[0]) != g.subset_bit)
+                        continue;
+                    code = _backend.accumulateScaleFactors(info.handle, &_polytomy_helper_scalers[g.first], (int)g.nhelpers, g.polytomy_scaler);
+                    if (code != 0) {
+                        throw XLorad(boost::format("failed to transfer scaling factors to polytomous node. BeagleLib error code was %d (%s)") % code % _beagle_error[code]);
+                    }
+                }
+            }   
+        }   
     }   
     
-    inline double Likelihood::calcInstanceLogLikelihood(InstanceInfo & info, Tree::SharedPtr t) {
+    inline void Likelihood::returnPolytomyHelpers(Tree::SharedPtr & t) {
+        for (Node * h : _polytomy_helpers) {
+            if (_pooled_partials)
+                releasePartialBuffers(h);
+            h->clearPointers();
+            t->_unused_nodes.push_back(h);
+        }
+        _polytomy_helpers.clear();
+        _polytomy_helper_scalers.clear();
+        _polytomy_scaler_groups.clear();
+    }
+    
+    inline void Likelihood::acquirePartialBuffer(Node * nd, unsigned subset) {
+        // Pooled mode: makes sure nd's current partials for subset have a buffer to be computed
+        // into. Partials are overwritten in place if they already have one. Otherwise a spare
+        // is used, so that the other buffer keeps the partials a rejected proposal returns to.
+        unsigned s = Node::getSubsetBit(subset);
+        unsigned slot = getPartialSlot(nd, s);
+        if (_partial_buffer[slot] >= 0)
+            return;
+        
+        unsigned other = slot^1;
+        std::vector<int> & free_buffers = _free_partial_buffers[s];
+        if (free_buffers.empty() && _partial_buffer[other] >= 0) {
+            // No spares left: take over the other buffer, whose partials will have to be
+            // recomputed if the proposal is rejected
+            _partial_buffer[slot] = _partial_buffer[other];
+            _partial_buffer[other] = -1;
+            _partial_generation[other] = ++_generation;
+            _partial_stale[other] = true;
+            _partial_evicted[other] = true;
+            _stale_subsets[nd->_number] |= Node::getSubsetMask(s);
+            return;
+        }
+        
+        if (free_buffers.empty()) {
+            // Take the buffer holding another node's partials to revert to (which must then
+            // be recomputed if the proposal is rejected). There is always one, as every
+            // node holds a single buffer except those in _saved_partials.
+            for (unsigned i = (unsigned)_saved_partials.size(); i > 0 && free_buffers.empty(); i--) {
+                Node * a = _saved_partials[i-1].first;
+                if (_saved_partials[i-1].second != s)
+                    continue;
+                unsigned k = getPartialSlot(a, s)^1;
+                if (_partial_buffer[k] >= 0) {
+                    free_buffers.push_back(_partial_buffer[k]);
+                    _partial_buffer[k] = -1;
+                    _partial_generation[k] = ++_generation;
+                    _partial_stale[k] = true;
+                    _partial_evicted[k] = true;
+                    _stale_subsets[a->_number] |= Node::getSubsetMask(s);
+                }
+                _saved_partials.erase(_saved_partials.begin() + (i-1));
+            }
+            if (free_buffers.empty())
+                throw XLorad(boost::format("no partials buffer available for node %d (increase bufferpool)") % nd->_number);
+        }
+        
+        _partial_buffer[slot] = free_buffers.back();
+        free_buffers.pop_back();
+        if (_partial_buffer[other] >= 0)
+            _saved_partials.push_back(std::make_pair(nd, s));
+    }
+    
+    inline void Likelihood::releasePartialBuffers(Node * nd) {
+        // Returns both of nd's buffers for every subset to the pool (used for polytomy helpers,
+        // whose partials are not needed once the likelihood has been computed)
+        for (unsigned s = 0; s < _nsubset_bits; s++) {
+            unsigned slot = 2*getPreorderSlot(nd, s);
+            for (unsigned k = slot; k < slot + 2; k++) {
+                if (_partial_buffer[k] >= 0) {
+                    _free_partial_buffers[s].push_back(_partial_buffer[k]);
+                    _partial_buffer[k] = -1;
+                    _partial_stale[k] = true;
+                    _stale_subsets[nd->_number] |= Node::getSubsetMask(s);
+                }
+            }
+        }
+    }
+    
+    inline void Likelihood::releaseSavedPartials() {
+        // Called once a proposal has been accepted or rejected: in pooled mode, the buffers
+        // holding the partials that were not kept go back to the pool
+        for (auto & saved : _saved_partials) {
+            unsigned k = getPartialSlot(saved.first, saved.second)^1;
+            if (_partial_buffer[k] >= 0) {
+                _free_partial_buffers[saved.second].push_back(_partial_buffer[k]);
+                _partial_buffer[k] = -1;
+            }
+        }
+        _saved_partials.clear();
+        
+        // The next evaluation belongs to a new proposal
+        _surrogate_paired = false;
+    }
+    
+    inline void Likelihood::markAllStale() {
+        // Forces every partials and transition matrix buffer (current and alternate)
+        // to be recomputed the next time it is needed
+        _partial_stale.assign(_partial_stale.size(), true);
+        _tmatrix_stale.assign(_tmatrix_stale.size(), true);
+        _preorder_generation.assign(_preorder_generation.size(), 0);
+        _scaler_source.assign(_scaler_source.size(), -1);
+        _preorder_scaled.assign(_preorder_scaled.size(), false);
+        _partial_evicted.assign(_partial_evicted.size(), false);
+        _stale_subsets.assign(_stale_subsets.size(), Node::_all_subsets);
+        for (auto & info : _instances)
+            info.cumulative_valid = false;
+    }
+    
+    inline bool Likelihood::rangeExceeded(int code) {
+        // In auto precision mode, a floating-point range error in single precision is not
+        // fatal: it is noted here and the likelihood is recomputed in double precision
+        // (and with dynamic scaling the likelihood is first recomputed with new scale factors)
+        bool reused_factors = (_underflow_scaling && _scaling_interval > 0 && !_rescaling);
+        if (code == BEAGLE_ERROR_FLOATING_POINT && ((_auto_precision && !_double_precision) || reused_factors)) {
+            _range_exceeded = true;
+            return true;
+        }
+        return false;
+    }
+    
+    inline double Likelihood::checkPrecision(Tree::SharedPtr & t, double log_likelihood) {
+        assert(_auto_precision && !_double_precision);
+        if (_range_exceeded || !std::isfinite(log_likelihood)) {
+            promoteToDoublePrecision("floating-point range exceeded");
+            return calcLogLikelihood(t);
+        }
+        
+        if (_shadow && _nevaluations % _precision_check_interval == 0) {
+            // The shadow is not kept up to date between checks, so it must start from scratch
+            _shadow->markAllStale();
+            double shadow_log_likelihood = _shadow->calcLogLikelihood(t);
+            double discrepancy = std::fabs(shadow_log_likelihood - log_likelihood);
+            if (discrepancy > _precision_tolerance) {
+                promoteToDoublePrecision(boost::str(boost::format("single and double precision log-likelihoods differed by %g") % discrepancy));
+                return calcLogLikelihood(t);
+            }
+        }
+        return log_likelihood;
+    }
+    
+    inline void Likelihood::promoteToDoublePrecision(const std::string & reason) {
+        _double_precision = true;
+        _range_exceeded = false;
+        _promotion_evaluation = _nevaluations;
+        _promotion_reason = reason;
+        _shadow.reset();
+        ::om.outputConsole(boost::format("\nSwitching to double precision after %d likelihood evaluations (%s)\n") % _nevaluations % reason);
+        
+        // Recreate the instances in double precision; none of the buffers in the new
+        // instances hold valid values yet, including those a revert would return to
+        initBeagleLib();
+        markAllStale();
+    }
+    
+    inline double Likelihood::calcInstanceLogLikelihood(InstanceInfo & info, Tree::SharedPtr & t) {
+        // Create vector of all scaling vector indices in current use, subset by subset
+        info.scaler_indices.clear();
+        if (_underflow_scaling) {
+            for (unsigned s : info.subsets) {
+                if (!_plan_steps.empty()) {
+                    for (auto nd : _plan_internals)
+                        info.scaler_indices.push_back(getScalerIndex(nd, s));
+                }
+                else {
+                    for (auto nd : t->_preorder) {
+                        if (nd->_left_child)
+                            info.scaler_indices.push_back(getScalerIndex(nd, s));
+                    }
+                }
+            }
+        }
+        
+        // Evaluate the likelihood across the subroot's edge, which leads to the root tip
+        Node * subroot = t->_preorder[0];
+        unsigned nsubsets = (unsigned)info.subsets.size();
+        info.parent_indices.resize(nsubsets);
+        info.child_indices.resize(nsubsets);
+        for (unsigned s = 0; s < nsubsets; s++) {
+            info.parent_indices[s] = getPartialIndex(subroot, info, s);
+            info.child_indices[s]  = getPartialIndex(t->_root, info, s);
+        }
+        return calcInstanceEdgeLogLikelihood(info, t, subroot);
+    }
+    
+    inline void Likelihood::accumulateScalers(InstanceInfo & info, std::vector<int> & internal_node_scaler_indices) {
+        // Recomputes the cumulative scaler (index 0) from scratch; internal_node_scaler_indices
+        // holds the same number of scalers for each subset, subset by subset
+        int code = 0;
+        int cumulative_scale_index = 0;
+        unsigned nsubsets = (unsigned)info.subsets.size();
+        unsigned n = (unsigned)internal_node_scaler_indices.size()/nsubsets;
+        if (nsubsets == 1) {
+            code = _backend.resetScaleFactors(info.handle, cumulative_scale_index);
+            if (code != 0)
+                throw XLorad(boost::str(boost::format("failed to reset scale factors in calcInstanceLogLikelihood. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+
+            code = _backend.accumulateScaleFactors(
+                 info.handle,
+                 &internal_node_scaler_indices[0],
+                 (int)internal_node_scaler_indices.size(),
+                 cumulative_scale_index);
+            if (code != 0)
+                throw XLorad(boost::str(boost::format("failed to accumulate scale factors in calcInstanceLogLikelihood. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+        }
+        else {
+            for (unsigned s = 0; s < nsubsets; ++s) {
+                code = _backend.resetScaleFactorsByPartition(info.handle, cumulative_scale_index, s);
+                if (code != 0)
+                    throw XLorad(boost::str(boost::format("failed to reset scale factors for subset %d in calcInstanceLogLikelihood. BeagleLib error code was %d (%s)") % s % code % _beagle_error[code]));
+                    
+                code = _backend.accumulateScaleFactorsByPartition(
+                    info.handle,
+                    &internal_node_scaler_indices[s*n],
+                    (int)n,
+                    cumulative_scale_index,
+                    s);
+                if (code != 0)
+                    throw XLorad(boost::str(boost::format("failed to acccumulate scale factors for subset %d in calcInstanceLogLikelihood. BeagleLib error code was %d (%s)") % s % code % _beagle_error[code]));
+            }
+        }
+        
+        if (_scaling_interval > 0) {
+            unsigned nbuffers = (unsigned)info.in_cumulative.size()/nsubsets;
+            info.in_cumulative.assign(info.in_cumulative.size(), 0);
+            for (unsigned i = 0; i < internal_node_scaler_indices.size(); i++)
+                info.in_cumulative[(i/n)*nbuffers + internal_node_scaler_indices[i]] = 1;
+            info.cumulative_valid = true;
+        }
+    }
+    
+    inline void Likelihood::updateCumulativeScaler(InstanceInfo & info, std::vector<int> & scaler_indices) {
+        // Dynamic scaling: no scale buffer has been overwritten since the cumulative scaler was
+        // last computed, so only buffers entering or leaving each subset's sum need to be added
+        // or removed
+        unsigned nsubsets = (unsigned)info.subsets.size();
+        unsigned n = (unsigned)scaler_indices.size()/nsubsets;
+        unsigned nbuffers = (unsigned)info.in_cumulative.size()/nsubsets;
+        info.scaler_marks.assign(info.scaler_marks.size(), 0);
+        for (unsigned i = 0; i < scaler_indices.size(); i++)
+            info.scaler_marks[(i/n)*nbuffers + scaler_indices[i]] = 1;
+        
         int code = 0;
+        for (unsigned s = 0; s < nsubsets; s++) {
+            const char * marks = &info.scaler_marks[s*nbuffers];
+            const char * in_sum = &info.in_cumulative[s*nbuffers];
+            info.scalers_added.clear();
+            info.scalers_removed.clear();
+            for (unsigned k = 1; k < nbuffers; k++) {
+                if (marks[k] && !in_sum[k])
+                    info.scalers_added.push_back(k);
+                else if (!marks[k] && in_sum[k])
+                    info.scalers_removed.push_back(k);
+            }
+            
+            int nremoved = (int)info.scalers_removed.size();
+            if (nremoved > 0) {
+                if (nsubsets == 1)
+                    code = _backend.removeScaleFactors(info.handle, &info.scalers_removed[0], nremoved, 0);
+                else
+                    code = _backend.removeScaleFactorsByPartition(info.handle, &info.scalers_removed[0], nremoved, 0, s);
+                if (code != 0)
+                    throw XLorad(boost::str(boost::format("failed to remove scale factors in updateCumulativeScaler. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+            }
+            int nadded = (int)info.scalers_added.size();
+            if (nadded > 0) {
+                if (nsubsets == 1)
+                    code = _backend.accumulateScaleFactors(info.handle, &info.scalers_added[0], nadded, 0);
+                else
+                    code = _backend.accumulateScaleFactorsByPartition(info.handle, &info.scalers_added[0], nadded, 0, s);
+                if (code != 0)
+                    throw XLorad(boost::str(boost::format("failed to accumulate scale factors in updateCumulativeScaler. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+            }
+        }
+        info.in_cumulative.swap(info.scaler_marks);
+    }
+    
+    inline double Likelihood::calcInstanceEdgeLogLikelihood(InstanceInfo & info, Tree::SharedPtr & t, Node * nd) {
+        // nd is the node whose transition matrices are used for the edge separating the parent
+        // and child partials, whose indices (one for each subset) are in info.parent_indices and
+        // info.child_indices; info.scaler_indices holds the scalers in use
         unsigned nsubsets = (unsigned)info.subsets.size();
         assert(nsubsets > 0);
 
         // Assuming there are as many transition matrices as there are edge lengths
-        assert(_pmatrix_index[info.handle].size() == _edge_lengths[info.handle].size());
+        assert(info.pmatrix_index.size() == info.edge_lengths.size());
 
+        // Derivatives with respect to the length of this edge are only wanted by calcEdgeLengthDerivatives
+        bool derivatives = (nd == _derivative_node);
+        info.subset_derivatives.assign(2*nsubsets, 0.0);
+        info.first_derivative = 0.0;
+        info.second_derivative = 0.0;
+        
+        if (_underflow_scaling) {
+            if (_scaling_interval > 0 && info.cumulative_valid && !_scalers_written)
+                updateCumulativeScaler(info, info.scaler_indices);
+            else
+                accumulateScalers(info, info.scaler_indices);
+        }
+
+        double log_likelihood = 0.0;
+        int code = calcInstanceEdge(info, nd, _underflow_scaling, derivatives, log_likelihood);
+        if (code != 0 && rangeExceeded(code))
+            return log_likelihood;
+        else if (code != 0) {
+            std::cerr << "Problem computing likelihood for this tree:\n";
+            std::cerr << TreeManip(t).makeNewick(9, true) << std::endl;
+            throw XLorad(boost::str(boost::format("failed to calculate edge log-likelihoods in calcInstanceLogLikelihood. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+        }
+        
+        if (info.invarmodel)
+            log_likelihood = calcInvarModelLogLikelihood(info);
+        if (derivatives)
+            calcInstanceDerivatives(info);
+
+        return log_likelihood;
+    }
+    
+    inline int Likelihood::calcInstanceEdge(InstanceInfo & info, Node * nd, bool scaled, bool derivatives, double & log_likelihood) {
+        // Scores the edge above nd between the partials in info.parent_indices and
+        // info.child_indices, including the cumulative scaler only if scaled is true, and
+        // computes the edge length derivatives (into info.subset_derivatives) if derivatives is
+        // true. Returns the backend's error code.
+        unsigned nsubsets = (unsigned)info.subsets.size();
+        int code = 0;
         int state_frequency_index  = 0;
         int category_weights_index = 0;
-        int cumulative_scale_index = (_underflow_scaling ? 0 : BEAGLE_OP_NONE);
-        int child_partials_index   = getPartialIndex(t->_root, info);
-        int parent_partials_index = getPartialIndex(t->_preorder[0], info);
-        int parent_tmatrix_index = getTMatrixIndex(t->_preorder[0], info, 0);
+        int cumulative_scale_index = (scaled ? 0 : BEAGLE_OP_NONE);
+        int parent_tmatrix_index = getTMatrixIndex(nd, info, 0);
 
         // storage for results of the likelihood calculation
-        std::vector<double> subset_log_likelihoods(nsubsets, 0.0);
-        double log_likelihood = 0.0;
+        info.subset_log_likelihoods.assign(nsubsets, 0.0);
+        log_likelihood = 0.0;
         
-        if (_underflow_scaling) {
-            // Create vector of all scaling vector indices in current use
-            std::vector<int> internal_node_scaler_indices;
-            for (auto nd : t->_preorder) {
-                if (nd->_left_child) {
-                    unsigned s = getScalerIndex(nd, info);
-                    internal_node_scaler_indices.push_back(s);
-                }
-            }
-            
-            if (nsubsets == 1) {
-                code = beagleResetScaleFactors(info.handle, cumulative_scale_index);
-                if (code != 0)
-                    throw XLorad(boost::str(boost::format("failed to reset scale factors in calcInstanceLogLikelihood. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
-
-                code = beagleAccumulateScaleFactors(
-                     info.handle,
-                     &internal_node_scaler_indices[0],
-                     (int)internal_node_scaler_indices.size(),
-                     cumulative_scale_index);
-                if (code != 0)
-                    throw XLorad(boost::str(boost::format("failed to accumulate scale factors in calcInstanceLogLikelihood. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
-            }
-            else {
-                for (unsigned s = 0; s < nsubsets; ++s) {
-                    code = beagleResetScaleFactorsByPartition(info.handle, cumulative_scale_index, s);
-                    if (code != 0)
-                        throw XLorad(boost::str(boost::format("failed to reset scale factors for subset %d in calcInstanceLogLikelihood. BeagleLib error code was %d (%s)") % s % code % _beagle_error[code]));
-                        
-                    code = beagleAccumulateScaleFactorsByPartition(
-                        info.handle,
-                        &internal_node_scaler_indices[0],
-                        (int)internal_node_scaler_indices.size(),
-                        cumulative_scale_index,
-                        s);
-                    if (code != 0)
-                        throw XLorad(boost::str(boost::format("failed to acccumulate scale factors for subset %d in calcInstanceLogLikelihood. BeagleLib error code was %d (%s)") % s % code % _beagle_error[code]));
-                }
-            }
-        }
+        if (derivatives)
+            updateDerivativeMatrices(info, nd);
 
         if (nsubsets > 1) {
-            _parent_indices.assign(nsubsets, parent_partials_index);
-            _child_indices.assign(nsubsets, child_partials_index);
-            _weights_indices.assign(nsubsets, category_weights_index);
-            _scaling_indices.resize(nsubsets);
-            _subset_indices.resize(nsubsets);
-            _freqs_indices.resize(nsubsets);
-            _tmatrix_indices.resize(nsubsets);
+            info.weights_indices.assign(nsubsets, category_weights_index);
+            info.scaling_indices.resize(nsubsets);
+            info.subset_indices.resize(nsubsets);
+            info.freqs_indices.resize(nsubsets);
+            info.tmatrix_indices.resize(nsubsets);
 
             for (unsigned s = 0; s < nsubsets; s++) {
-                _scaling_indices[s]  = (_underflow_scaling ? 0 : BEAGLE_OP_NONE);
-                _subset_indices[s]  = s;
-                _freqs_indices[s]   = s;
-                _tmatrix_indices[s] = getTMatrixIndex(t->_preorder[0], info, s); //index_focal_child + s*tmatrix_skip;
+                info.scaling_indices[s]  = cumulative_scale_index;
+                info.subset_indices[s]  = s;
+                info.freqs_indices[s]   = s;
+                info.tmatrix_indices[s] = getTMatrixIndex(nd, info, s); //index_focal_child + s*tmatrix_skip;
             }
             
-            code = beagleCalculateEdgeLogLikelihoodsByPartition(
+            code = _backend.calculateEdgeLogLikelihoodsByPartition(
                 info.handle,                 // instance number
-                &_parent_indices[0],         // indices of parent partialsBuffers
-                &_child_indices[0],          // indices of child partialsBuffers
-                &_tmatrix_indices[0],        // transition probability matrices for this edge
-                NULL,                        // first derivative matrices
-                NULL,                        // second derivative matrices
-                &_weights_indices[0],        // weights to apply to each partialsBuffer
-                &_freqs_indices[0],          // state frequencies for each partialsBuffer
-                &_scaling_indices[0],        // scaleBuffers containing accumulated factors
-                &_subset_indices[0],         // indices of subsets
+                &info.parent_indices[0],         // indices of parent partialsBuffers
+                &info.child_indices[0],          // indices of child partialsBuffers
+                &info.tmatrix_indices[0],        // transition probability matrices for this edge
+                (derivatives ? &info.derivative_indices[0] : NULL),        // first derivative matrices
+                (derivatives ? &info.derivative_indices[nsubsets] : NULL), // second derivative matrices
+                &info.weights_indices[0],        // weights to apply to each partialsBuffer
+                &info.freqs_indices[0],          // state frequencies for each partialsBuffer
+                &info.scaling_indices[0],        // scaleBuffers containing accumulated factors
+                &info.subset_indices[0],         // indices of subsets
                 nsubsets,                    // partition subset count
                 1,                           // number of distinct eigen decompositions
-                &subset_log_likelihoods[0],  // address of vector of log likelihoods (one for each subset)
+                &info.subset_log_likelihoods[0],  // address of vector of log likelihoods (one for each subset)
                 &log_likelihood,             // destination for resulting log likelihood
-                NULL,                        // destination for vector of first derivatives (one for each subset)
-                NULL,                        // destination for first derivative
-                NULL,                        // destination for vector of second derivatives (one for each subset)
-                NULL);                       // destination for second derivative
+                (derivatives ? &info.subset_derivatives[0] : NULL),          // destination for vector of first derivatives (one for each subset)
+                (derivatives ? &info.first_derivative : NULL),               // destination for first derivative
+                (derivatives ? &info.subset_derivatives[nsubsets] : NULL),   // destination for vector of second derivatives (one for each subset)
+                (derivatives ? &info.second_derivative : NULL));             // destination for second derivative
         }
         else {
-            code = beagleCalculateEdgeLogLikelihoods(
+            code = _backend.calculateEdgeLogLikelihoods(
                 info.handle,                 // instance number
-                &parent_partials_index,      // indices of parent partialsBuffers
-                &child_partials_index,       // indices of child partialsBuffers
+                &info.parent_indices[0],     // indices of parent partialsBuffers
+                &info.child_indices[0],      // indices of child partialsBuffers
                 &parent_tmatrix_index,       // transition probability matrices for this edge
-                NULL,                        // first derivative matrices
-                NULL,                        // second derivative matrices
+                (derivatives ? &info.derivative_indices[0] : NULL),  // first derivative matrices
+                (derivatives ? &info.derivative_indices[1] : NULL),  // second derivative matrices
                 &category_weights_index,     // weights to apply to each partialsBuffer
                 &state_frequency_index,      // state frequencies for each partialsBuffer
                 &cumulative_scale_index,     // scaleBuffers containing accumulated factors
                 1,                           // Number of partialsBuffer
                 &log_likelihood,             // destination for log likelihood
-                NULL,                        // destination for first derivative
-                NULL);                       // destination for second derivative
+                (derivatives ? &info.subset_derivatives[0] : NULL),  // destination for first derivative
+                (derivatives ? &info.subset_derivatives[1] : NULL)); // destination for second derivative
         }
+        return code;
+    }
+    
+    inline void Likelihood::calcInstanceEdgeDerivatives(InstanceInfo & info, Tree::SharedPtr & t, Node * nd) {
+        // Sets info.first_derivative and info.second_derivative for the edge above nd, scored
+        // between nd's pre-order and post-order partials, which must be up to date. Scale
+        // factors cancel in the derivatives of the log-likelihood, so the cumulative scaler is
+        // not needed, and the edge's log-likelihood (which would need it) is not used. The
+        // invariable sites model uses the site log-likelihoods from the last full evaluation,
+        // which are the same at every edge.
+        unsigned nsubsets = (unsigned)info.subsets.size();
+        info.subset_derivatives.assign(2*nsubsets, 0.0);
+        info.first_derivative = 0.0;
+        info.second_derivative = 0.0;
+        info.parent_indices.assign(nsubsets, getPreorderPartialIndex(nd, info));
+        info.child_indices.resize(nsubsets);
+        for (unsigned s = 0; s < nsubsets; s++)
+            info.child_indices[s] = getPartialIndex(nd, info, s);
         
-        // ...
-        
-        if (code != 0) {
-            std::cerr << "Problem computing likelihood for this tree:\n";
+        double log_likelihood = 0.0;
+        int code = calcInstanceEdge(info, nd, false, true, log_likelihood);
+        if (code != 0 && rangeExceeded(code))
+            return;
+        else if (code != 0) {
+            std::cerr << "Problem computing edge length derivatives for this tree:\n";
             std::cerr << TreeManip(t).makeNewick(9, true) << std::endl;
-            throw XLorad(boost::str(boost::format("failed to calculate edge log-likelihoods in calcInstanceLogLikelihood. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+            throw XLorad(boost::str(boost::format("failed to calculate edge length derivatives in calcInstanceEdgeDerivatives. BeagleLib error code was %d (%s)") % code % _beagle_error[code]));
+        }
+        calcInstanceDerivatives(info);
+    }
+    
+    inline void Likelihood::calcInstanceGradient(InstanceInfo & info, Tree::SharedPtr & t) {
+        // Computes the queued pre-order partials in one call, then the derivatives at every edge
+        // except the subroot's (into info.edge_first_derivatives)
+        calculatePreorderPartials(info);
+        info.edge_first_derivatives.assign(t->_nodes.size(), 0.0);
+        for (auto nd : t->_preorder) {
+            if (!nd->_parent->_parent)
+                continue;
+            calcInstanceEdgeDerivatives(info, t, nd);
+            info.edge_first_derivatives[nd->_number] = info.first_derivative;
+        }
+    }
+    
+    inline void Likelihood::updateDerivativeMatrices(InstanceInfo & info, Node * nd) {
+        // Computes the first and second derivatives of the transition matrices of the edge
+        // above nd. The transition matrix arena has been used by the time the edge is scored,
+        // so it is reused here; the transition matrices themselves are recomputed as well
+        // (into the buffers they already occupy) because BeagleLib computes derivative
+        // matrices only along with them.
+        unsigned nsubsets = (unsigned)info.subsets.size();
+        info.pmatrix_index.clear();
+        info.edge_lengths.clear();
+        info.eigen_indices.clear();
+        info.category_rate_indices.clear();
+        for (unsigned j = 0; j < nsubsets; j++) {
+            unsigned s = info.subsets[j];
+            info.pmatrix_index.push_back(getTMatrixIndex(nd, info, j));
+            info.edge_lengths.push_back(nd->_edge_length*calcSubsetRelativeRate(s));
+            info.eigen_indices.push_back(s);
+            info.category_rate_indices.push_back(s);
         }
         
-        if (info.invarmodel) {
-            auto monomorphic = _data->getMonomorphic();
-            auto counts = _data->getPatternCounts();
-            std::vector<double> site_log_likelihoods(info.npatterns, 0.0);
-            double * siteLogLs = &site_log_likelihoods[0];
-
-            beagleGetSiteLogLikelihoods(info.handle, siteLogLs);
+        int code = 0;
+        if (nsubsets > 1) {
+            code = _backend.updateTransitionMatricesWithMultipleModels(
+                info.handle,                                // Instance number
+                &info.eigen_indices[0],                     // Index of eigen-decomposition buffer
+                &info.category_rate_indices[0],             // category rate indices
+                &info.pmatrix_index[0],                     // transition probability matrices to update
+                &info.derivative_indices[0],                // first derivative matrices to update
+                &info.derivative_indices[nsubsets],         // second derivative matrices to update
+                &info.edge_lengths[0],                      // List of edge lengths
+                (int)nsubsets);                             // Length of lists
+        }
+        else {
+            code = _backend.updateTransitionMatrices(
+                info.handle,                                // Instance number
+                0,                                          // Index of eigen-decomposition buffer
+                &info.pmatrix_index[0],                     // transition probability matrices to update
+                &info.derivative_indices[0],                // first derivative matrices to update
+                &info.derivative_indices[1],                // second derivative matrices to update
+                &info.edge_lengths[0],                      // List of edge lengths
+                1);                                         // Length of lists
+        }
+        info.pmatrix_index.clear();
+        info.edge_lengths.clear();
+        info.eigen_indices.clear();
+        info.category_rate_indices.clear();
 
-            // Loop through all subsets assigned to this instance
-            double lnL = 0.0;
-            unsigned i = 0;
-            for (unsigned s : info.subsets) {
-                const ASRV & asrv = _model->getASRV(s);
-                const QMatrix & qmatrix = _model->getQMatrix(s);
-                const double * freq = qmatrix.getStateFreqs();
+        if (code != 0)
+            throw XLorad(boost::str(boost::format("Failed to update derivative matrices for instance %d. BeagleLib error code was %d (%s)") % info.handle % code % _beagle_error[code]));
+    }
+    
+    inline void Likelihood::calcInstanceDerivatives(InstanceInfo & info) {
+        // BeagleLib's derivatives are with respect to the edge length multiplied by the subset's
+        // relative rate, and (for the invariable sites model) are those of variable sites. A
+        // site that could be invariant has likelihood (1 - pinvar) Lv + pinvar Li, so its
+        // derivatives are r g and r (h + g^2) - (r g)^2, where g and h are the variable site
+        // derivatives and r = 1/(1 + exp(x)) is the posterior probability that the site is
+        // variable (x as in calcInvarModelLogLikelihood).
+        unsigned nsubsets = (unsigned)info.subsets.size();
+        if (info.invarmodel) {
+            // Site log-likelihoods were fetched by calcInvarModelLogLikelihood
+            _backend.getSiteDerivatives(info.handle, &info.site_first_derivatives[0], &info.site_second_derivatives[0]);
+            const double * site_lnL = &info.site_log_likelihoods[0];
+            const double * g = &info.site_first_derivatives[0];
+            const double * h = &info.site_second_derivatives[0];
+            const double * weights = &info.pattern_weights[0];
+            for (unsigned j = 0; j < nsubsets; j++) {
+                double pinvar = *(_model->getASRV(info.subsets[j]).getPinvarSharedPtr());
+                if (pinvar <= 0.0)
+                    continue;
+                double log_pinvar = log(pinvar);
+                double log_one_minus_pinvar = log(1.0 - pinvar);
+                unsigned begin = (j == 0 ? 0 : info.invar_subset_end[j-1]);
+                for (unsigned i = begin; i < info.invar_subset_end[j]; i++) {
+                    unsigned p = info.invar_patterns[i];
+                    double x = log_pinvar + info.invar_log_likes[i] - (log_one_minus_pinvar + site_lnL[p]);
+                    double r = (x > 0.0 ? exp(-x)/(1.0 + exp(-x)) : 1.0/(1.0 + exp(x)));
+                    info.subset_derivatives[j] += weights[p]*(r - 1.0)*g[p];
+                    info.subset_derivatives[nsubsets + j] += weights[p]*(r*(h[p] + g[p]*g[p]) - r*r*g[p]*g[p] - h[p]);
+                }
+            }
+        }
+        
+        info.first_derivative = 0.0;
+        info.second_derivative = 0.0;
+        for (unsigned j = 0; j < nsubsets; j++) {
+            double rate = calcSubsetRelativeRate(info.subsets[j]);
+            info.first_derivative += rate*info.subset_derivatives[j];
+            info.second_derivative += rate*rate*info.subset_derivatives[nsubsets + j];
+        }
+    }
+    
+    inline double Likelihood::calcInvarModelLogLikelihood(InstanceInfo & info) {
+        // BeagleLib's site log-likelihoods are those of variable sites. A site that could be
+        // invariant has log-likelihood a + log(1 + exp(b - a)), where a is log(1 - pinvar)
+        // plus the variable site log-likelihood and b is log(pinvar) plus the log-likelihood
+        // if invariable; every other site has log-likelihood a. Summing a over all sites is a
+        // contiguous weighted sum, leaving the (few) patterns that could be invariant.
+        assert(info.site_log_likelihoods.size() >= info.npatterns);
+        _backend.getSiteLogLikelihoods(info.handle, &info.site_log_likelihoods[0]);
+        const double * site_lnL = &info.site_log_likelihoods[0];
+        const double * weights = &info.pattern_weights[0];
+
+        double lnL = 0.0;
+        unsigned first = 0;
+        for (unsigned j = 0; j < info.subsets.size(); j++) {
+            auto interval = info.pattern_ranges[j];
+            unsigned n = interval.second - interval.first;
+            lnL += calcWeightedSum(weights + first, site_lnL + first, n);
+            
+            double pinvar = *(_model->getASRV(info.subsets[j]).getPinvarSharedPtr());
+            assert(pinvar >= 0.0 && pinvar <= 1.0);
+            if (pinvar > 0.0) {
+                updateInvarLogLikes(info, j);
+                double log_pinvar = log(pinvar);
+                double log_one_minus_pinvar = log(1.0 - pinvar);
+                lnL += info.subset_weights[j]*log_one_minus_pinvar;
                 
-                double pinvar = *(asrv.getPinvarSharedPtr());
-                assert(pinvar >= 0.0 && pinvar <= 1.0);
-
-                if (pinvar == 0.0) {
-                    // log likelihood for this subset is equal to the sum of site log-likelihoods
-                    auto interval = _data->getSubsetBeginEnd(s);
-                    for (unsigned p = interval.first; p < interval.second; p++) {
-                        lnL += counts[p]*site_log_likelihoods[i++];
+                unsigned begin = (j == 0 ? 0 : info.invar_subset_end[j-1]);
+                for (unsigned i = begin; i < info.invar_subset_end[j]; i++) {
+                    unsigned p = info.invar_patterns[i];
+                    double x = log_pinvar + info.invar_log_likes[i] - (log_one_minus_pinvar + site_lnL[p]);
+                    lnL += weights[p]*(x > 0.0 ? x + log1p(exp(-x)) : log1p(exp(x)));
+                }
+            }
+            first += n;
+        }
+        return lnL;
+    }
+    
+    inline void Likelihood::updateInvarLogLikes(InstanceInfo & info, unsigned subset_index) {
+        // Invariable site log-likelihoods depend only on the state frequencies, so are
+        // recomputed only when the subset's QMatrix has changed
+        const QMatrix & qmatrix = _model->getQMatrix(info.subsets[subset_index]);
+        unsigned long version = qmatrix.getVersion();
+        if (info.invar_versions[subset_index] == version)
+            return;
+        info.invar_versions[subset_index] = version;
+        
+        const double * freq = qmatrix.getStateFreqs();
+        const auto & state_begin = _data->getInvariantStateBegin();
+        const auto & states = _data->getInvariantStates();
+        unsigned begin = (subset_index == 0 ? 0 : info.invar_subset_end[subset_index-1]);
+        for (unsigned i = begin; i < info.invar_subset_end[subset_index]; i++) {
+            unsigned d = info.invar_data_index[i];
+            double invar_like = 0.0;
+            for (unsigned k = state_begin[d]; k < state_begin[d+1]; k++)
+                invar_like += freq[states[k]];
+            info.invar_log_likes[i] = log(invar_like);
+        }
+    }
+    
+    inline double Likelihood::calcWeightedSum(const double * w, const double * x, unsigned n) {
+        // Four independent partial sums let the compiler vectorize this loop without
+        // being allowed to reassociate floating-point additions
+        double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+        unsigned i = 0;
+        for (; i + 4 <= n; i += 4) {
+            s0 += w[i]*x[i];
+            s1 += w[i+1]*x[i+1];
+            s2 += w[i+2]*x[i+2];
+            s3 += w[i+3]*x[i+3];
+        }
+        for (; i < n; i++)
+            s0 += w[i]*x[i];
+        return (s0 + s1) + (s2 + s3);
+    }
+    
+    inline double Likelihood::evaluateInstances(Tree::SharedPtr & t, Node * nd) {
+        // Once the operations are defined, each instance's pipeline is independent of the
+        // others, so instances are evaluated concurrently if a thread pool has been supplied.
+        // The sum is always taken in instance order so that the result does not depend on
+        // the number of threads.
+        auto task = [this, &t, nd](unsigned i) {
+            evaluateInstance(_instances[i], t, nd);
+        };
+        if (_thread_pool)
+            _thread_pool->run((unsigned)_instances.size(), task);
+        else {
+            for (unsigned i = 0; i < _instances.size(); i++)
+                task(i);
+        }
+        
+        double log_likelihood = 0.0;
+        for (auto & info : _instances) {
+            log_likelihood += info.log_likelihood;
+        }
+        return log_likelihood;
+    }
+    
+    inline void Likelihood::evaluateInstance(InstanceInfo & info, Tree::SharedPtr & t, Node * nd) {
+        // Computes info.log_likelihood at the subroot edge (nd is 0) or at the edge above nd
+        // (using nd's pre-order partial). Touches only info and data that are read-only
+        // while instances are being evaluated.
+        updateTransitionMatrices(info);
+        calculatePartials(info);
+        if (!nd) {
+            info.log_likelihood = calcInstanceLogLikelihood(info, t);
+            return;
+        }
+        
+        calculatePreorderPartials(info);
+        
+        // Scalers for post-order partials not on the focal path, plus those for the
+        // pre-order partials of nd and every ancestor below the subroot
+        info.scaler_indices.clear();
+        if (_underflow_scaling) {
+            for (unsigned s : info.subsets) {
+                if (!_plan_steps.empty()) {
+                    for (auto a : _plan_internals) {
+                        if (!_on_focal_path[a->_number])
+                            info.scaler_indices.push_back(getScalerIndex(a, s));
                     }
                 }
                 else {
-                    // Loop through all patterns in this subset
-                    double log_pinvar = log(pinvar);
-                    double log_one_minus_pinvar = log(1.0 - pinvar);
-                    auto interval = _data->getSubsetBeginEnd(s);
-                    for (unsigned p = interval.first; p < interval.second; p++) {
-                        // Loop through all states for this pattern
-                        double invar_like = 0.0;
-                        if (monomorphic[p] > 0) {
-                            for (unsigned k = 0; k < info.nstates; ++k) {
-                                Data::state_t x = (Data::state_t)1 << k;
-                                double condlike = (x & monomorphic[p] ? 1.0 : 0.0);
-                                double basefreq = freq[k];
-                                invar_like += condlike*basefreq;
-                            }
-                        }
-                        double site_lnL = site_log_likelihoods[i++];
-                        double log_like_term = log_one_minus_pinvar + site_lnL;
-                        if (invar_like > 0.0) {
-                            double log_invar_term = log_pinvar + log(invar_like);
-                            double site_log_like = (log_like_term + log(1.0 + exp(log_invar_term - log_like_term)));
-                            lnL += counts[p]*site_log_like;
-                        }
-                        else {
-                            lnL += counts[p]*log_like_term;
-                        }
+                    for (auto a : t->_preorder) {
+                        if (a->_left_child && !_on_focal_path[a->_number])
+                            info.scaler_indices.push_back(getScalerIndex(a, s));
                     }
                 }
+                info.scaler_indices.push_back(getPreorderScalerIndex(nd, info));
+                for (unsigned i = 0; i + 1 < _focal_path.size(); i++)
+                    info.scaler_indices.push_back(getPreorderScalerIndex(_focal_path[i], info));
             }
-            log_likelihood = lnL;
         }
-
-        return log_likelihood;
+        
+        unsigned nsubsets = (unsigned)info.subsets.size();
+        info.parent_indices.assign(nsubsets, getPreorderPartialIndex(nd, info));
+        info.child_indices.resize(nsubsets);
+        for (unsigned s = 0; s < nsubsets; s++)
+            info.child_indices[s] = getPartialIndex(nd, info, s);
+        info.log_likelihood = calcInstanceEdgeLogLikelihood(info, t, nd);
     }
     
     inline double Likelihood::calcLogLikelihood(Tree::SharedPtr t) {    
         assert(_instances.size() > 0);
         
+        // A state change scored without the surrogate leaves the surrogate's buffers out of date
+        if (!_surrogate_paired)
+            _surrogate_in_sync = false;
+        
         if (!_using_data)
             return 0.0;
         
@@ -1148,27 +2783,273 @@ namespace lorad {
         // Assuming "root" is leaf 0
         assert(t->_root->_number == 0 && t->_root->_left_child == t->_preorder[0] && !t->_preorder[0]->_right_sib);
 
+        ++_nevaluations;
+        startScaling();
+
+        // Send model parameters to BeagleLib (only for subsets in
+        // which parameters have changed since they were last sent)
         setModelRateMatrix();
         setAmongSiteRateHeterogenetity();
         defineOperations(t);
-        updateTransitionMatrices();
-        calculatePartials();
-        
-        double log_likelihood = 0.0;
-        for (auto & info : _instances) {
-            log_likelihood += calcInstanceLogLikelihood(info, t);
-        }
+        double log_likelihood = evaluateInstances(t, 0);
 
         // We no longer need the internal nodes brought out of storage  
         // and used to compute partials for polytomies
-        TreeManip tm(t);
-        for (Node * h : _polytomy_helpers) {
-            tm.putUnusedNode(h);
+        returnPolytomyHelpers(t);
+        
+        if (_underflow_scaling && _scaling_interval > 0 && !_rescaling && (_range_exceeded || !std::isfinite(log_likelihood))) {
+            // Reused scale factors were not adequate: start again, computing new ones everywhere
+            _range_exceeded = false;
+            _force_rescaling = true;
+            markAllStale();
+            return calcLogLikelihood(t);
         }
-        _polytomy_helpers.clear();
-        _polytomy_map.clear();  
+        
+        if (_auto_precision && !_double_precision)
+            log_likelihood = checkPrecision(t, log_likelihood);
                 
         return log_likelihood;
     }   
 
+    inline double Likelihood::calcLogLikelihoodAtEdge(Tree::SharedPtr t, Node * nd) {
+        // Computes the same log-likelihood as calcLogLikelihood, but scores the edge above nd
+        // using the pre-order partial for nd rather than the subroot edge. Post-order partials
+        // of nd's ancestors are not recomputed: only the pre-order partials along the path
+        // from the subroot down to nd are refreshed (and only if their inputs have changed),
+        // so a proposal that modifies only the edge above nd costs a single edge evaluation.
+        assert(_instances.size() > 0);
+        
+        // A state change scored without the surrogate leaves the surrogate's buffers out of date
+        if (!_surrogate_paired)
+            _surrogate_in_sync = false;
+        
+        if (!_using_data)
+            return 0.0;
+            
+        // Fall back on the full calculation if pre-order partials are not being maintained
+        // or if nd is the subroot (or root tip), whose edge is the one calcLogLikelihood uses anyway
+        if (!_preorder_partials || !nd || !nd->_parent || !nd->_parent->_parent)
+            return calcLogLikelihood(t);
+        
+        // Must call setData and setModel before calcLogLikelihoodAtEdge
+        assert(_data);
+        assert(_model);
+
+        if (t->_is_rooted)
+            throw XLorad("This version of the program can only compute likelihoods for unrooted trees");
+
+        // Assuming "root" is leaf 0
+        assert(t->_root->_number == 0 && t->_root->_left_child == t->_preorder[0] && !t->_preorder[0]->_right_sib);
+        
+        // Pre-order partials are only defined for bifurcating ancestors, so fall
+        // back on the full calculation if a polytomy lies between nd and the root tip
+        _focal_path.clear();
+        for (Node * a = nd->_parent; a->_parent; a = a->_parent) {
+            Node * rchild = a->_left_child->_right_sib;
+            if (!rchild || rchild->_right_sib) {
+                _focal_path.clear();
+                return calcLogLikelihood(t);
+            }
+            _focal_path.push_back(a);
+        }
+        
+        ++_nevaluations;
+        startScaling();
+        
+        // Send model parameters to BeagleLib (only for subsets in
+        // which parameters have changed since they were last sent)
+        setModelRateMatrix();
+        setAmongSiteRateHeterogenetity();
+        
+        // Post-order partials are brought up to date everywhere except along the focal path
+        for (Node * a : _focal_path)
+            _on_focal_path[a->_number] = true;
+        defineOperations(t);
+        definePreorderOperations(nd);
+        double log_likelihood = evaluateInstances(t, nd);
+        
+        for (Node * a : _focal_path)
+            _on_focal_path[a->_number] = false;
+        _focal_path.clear();
+
+        // We no longer need the internal nodes brought out of storage
+        // and used to compute partials for polytomies
+        returnPolytomyHelpers(t);
+        
+        if (_underflow_scaling && _scaling_interval > 0 && !_rescaling && (_range_exceeded || !std::isfinite(log_likelihood))) {
+            // Reused scale factors were not adequate: start again, computing new ones everywhere
+            _range_exceeded = false;
+            _force_rescaling = true;
+            markAllStale();
+            return calcLogLikelihoodAtEdge(t, nd);
+        }
+        
+        if (_auto_precision && !_double_precision)
+            log_likelihood = checkPrecision(t, log_likelihood);
+        
+        return log_likelihood;
+    }
+
+
+    inline bool Likelihood::canCalcEdgeLengthDerivatives(Node * nd) const {
+        // Derivatives are computed while scoring the edge above nd, which must therefore be the
+        // edge calcLogLikelihoodAtEdge scores: either the subroot's edge, or an edge whose
+        // ancestors below the root tip are bifurcating and have pre-order partials
+        if (!_using_data || !nd || !nd->_parent)
+            return false;
+        if (!nd->_parent->_parent)
+            return true;
+        if (!_preorder_partials)
+            return false;
+        for (Node * a = nd->_parent; a->_parent; a = a->_parent) {
+            Node * rchild = a->_left_child->_right_sib;
+            if (!rchild || rchild->_right_sib)
+                return false;
+        }
+        return true;
+    }
+
+    inline double Likelihood::calcEdgeLengthDerivatives(Tree::SharedPtr t, Node * nd, double & d1, double & d2) {
+        // Returns the log-likelihood (as calcLogLikelihoodAtEdge would) and sets d1 and d2 to its
+        // first and second derivatives with respect to the length of the edge above nd
+        if (!canCalcEdgeLengthDerivatives(nd))
+            throw XLorad(boost::format("edge length derivatives are not available for node %d") % nd->_number);
+        
+        // Switching precision recreates the instances and recalculates the log-likelihood at
+        // the subroot edge, so the calculation is repeated if that happens
+        bool double_precision = _double_precision;
+        _derivative_node = nd;
+        double log_likelihood = 0.0;
+        try {
+            log_likelihood = (nd->_parent->_parent ? calcLogLikelihoodAtEdge(t, nd) : calcLogLikelihood(t));
+            if (_double_precision != double_precision)
+                log_likelihood = (nd->_parent->_parent ? calcLogLikelihoodAtEdge(t, nd) : calcLogLikelihood(t));
+        }
+        catch (...) {
+            _derivative_node = 0;
+            throw;
+        }
+        _derivative_node = 0;
+        
+        d1 = 0.0;
+        d2 = 0.0;
+        for (auto & info : _instances) {
+            d1 += info.first_derivative;
+            d2 += info.second_derivative;
+        }
+        return log_likelihood;
+    }
+    
+    inline double Likelihood::calcEdgeLengthGradient(Tree::SharedPtr t, std::vector<double> & gradient) {
+        // Returns the log-likelihood and fills gradient with its derivative with respect to the
+        // length of the edge above each node (indexed by node number). One full evaluation at the
+        // subroot edge (which counts as the only likelihood evaluation) recalculates the partials
+        // and transition matrices selected for recalculation, after which the selection is
+        // cleared. A single pre-order sweep then refreshes every stale pre-order partial, and
+        // each remaining edge needs only its derivative matrices and an edge calculation.
+        for (auto nd : t->_preorder) {
+            if (!canCalcEdgeLengthDerivatives(nd))
+                throw XLorad(boost::format("edge length derivatives are not available for node %d") % nd->_number);
+        }
+        
+        gradient.assign(t->_nodes.size(), 0.0);
+        Node * subroot = t->_preorder[0];
+        double d2 = 0.0;
+        double log_likelihood = calcEdgeLengthDerivatives(t, subroot, gradient[subroot->_number], d2);
+        for (auto & a : t->_nodes) {
+            a.deselectPartial();
+            a.deselectTMatrix();
+        }
+        if (t->_preorder.size() == 1)
+            return log_likelihood;
+        
+        // Pre-order partials are queued in preorder, so each one's parent is computed first
+        for (auto & info : _instances)
+            info.preorder_operations.clear();
+        for (auto nd : t->_preorder) {
+            if (nd->_parent->_parent)
+                definePreorderOperation(nd);
+        }
+        
+        auto task = [this, &t](unsigned i) {
+            calcInstanceGradient(_instances[i], t);
+        };
+        if (_thread_pool)
+            _thread_pool->run((unsigned)_instances.size(), task);
+        else {
+            for (unsigned i = 0; i < _instances.size(); i++)
+                task(i);
+        }
+        
+        bool finite = true;
+        for (auto & info : _instances) {
+            for (auto nd : t->_preorder) {
+                if (nd != subroot)
+                    gradient[nd->_number] += info.edge_first_derivatives[nd->_number];
+            }
+        }
+        for (double g : gradient)
+            finite = finite && std::isfinite(g);
+        
+        if (_underflow_scaling && _scaling_interval > 0 && !_rescaling && (_range_exceeded || !finite)) {
+            // Reused scale factors were not adequate: start again, computing new ones everywhere
+            _range_exceeded = false;
+            _force_rescaling = true;
+            markAllStale();
+            return calcEdgeLengthGradient(t, gradient);
+        }
+        
+        if (_auto_precision && !_double_precision && (_range_exceeded || !finite)) {
+            promoteToDoublePrecision("floating-point range exceeded");
+            return calcEdgeLengthGradient(t, gradient);
+        }
+        return log_likelihood;
+    }
+    
+    inline double Likelihood::calcTreeLengthDerivatives(Tree::SharedPtr t, double & d1, double & d2) {
+        // Returns the log-likelihood and sets d1 and d2 to its first and second derivatives
+        // with respect to the tree length, all edge length proportions held fixed. Scaling
+        // every edge by a changes the log-likelihood at rate S(a) = sum of t_e g_e(a t), where
+        // g_e is the derivative with respect to edge e; S(1) is exact, and dS/da is a central
+        // difference of S, which avoids needing the off-diagonal second derivatives. Edge
+        // lengths are changed temporarily and every buffer is recalculated, so no proposal
+        // may be pending.
+        for (auto nd : t->_preorder) {
+            if (!canCalcEdgeLengthDerivatives(nd))
+                throw XLorad(boost::format("tree length derivatives are not available because edge length derivatives are not available for node %d") % nd->_number);
+        }
+        
+        std::vector<double> gradient;
+        _saved_edge_lengths.resize(t->_nodes.size());
+        double tree_length = 0.0;
+        for (auto nd : t->_preorder) {
+            _saved_edge_lengths[nd->_number] = nd->_edge_length;
+            tree_length += nd->_edge_length;
+        }
+        
+        const double h = 1.0e-4;
+        double S[3] = {0.0, 0.0, 0.0};
+        double scale[3] = {1.0, 1.0 + h, 1.0 - h};
+        double log_likelihood = 0.0;
+        for (unsigned k = 0; k < 3; k++) {
+            if (k > 0) {
+                for (auto nd : t->_preorder)
+                    nd->_edge_length = scale[k]*_saved_edge_lengths[nd->_number];
+                markAllStale();
+            }
+            calcEdgeLengthGradient(t, gradient);
+            for (auto nd : t->_preorder)
+                S[k] += _saved_edge_lengths[nd->_number]*gradient[nd->_number];
+        }
+        
+        for (auto nd : t->_preorder)
+            nd->_edge_length = _saved_edge_lengths[nd->_number];
+        markAllStale();
+        log_likelihood = calcLogLikelihood(t);
+        
+        d1 = S[0]/tree_length;
+        d2 = (S[1] - S[2])/(2.0*h*tree_length*tree_length);
+        return log_likelihood;
+    }
+
 }
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <Eigen/Dense>
+#include "likelihood.hpp"
+#include "tree_manip.hpp"
+#include "thread_pool.hpp"
+#include "xlorad.hpp"
+
+namespace lorad {
+
+    // Computes the log-likelihoods of many (tree, parameter vector) states. Each worker is a
+    // Likelihood with its own Model and BeagleLib instances, so workers can score different
+    // states at the same time; states are handed out to workers as they become free and the
+    // results are returned in the order the states were supplied.
+    class LikelihoodBatch {
+        public:
+            struct State {
+                std::string                         newick;         // tree, including edge lengths
+                Eigen::VectorXd                     param_vect;     // model parameters as produced by Model::logTransformParameters (empty to leave the model as it is)
+            };
+
+                                                    LikelihoodBatch();
+                                                    ~LikelihoodBatch();
+
+            void                                    clear();
+            void                                    addWorker(Likelihood::SharedPtr likelihood);
+            void                                    setThreadPool(ThreadPool::SharedPtr pool);
+            unsigned                                getNumWorkers() const;
+
+            void                                    calcLogLikelihoods(std::vector<State> & states, std::vector<double> & log_likelihoods);
+
+        private:
+
+            struct Worker {
+                Likelihood::SharedPtr               likelihood;
+                TreeManip::SharedPtr                tree_manip;
+            };
+
+            double                                  calcStateLogLikelihood(Worker & w, State & state);
+
+            std::vector<Worker>                     _workers;
+            ThreadPool::SharedPtr                   _thread_pool;
+
+        public:
+            typedef std::shared_ptr< LikelihoodBatch >  SharedPtr;
+    };
+
+    inline LikelihoodBatch::LikelihoodBatch() {
+        clear();
+    }
+
+    inline LikelihoodBatch::~LikelihoodBatch() {
+    }
+
+    inline void LikelihoodBatch::clear() {
+        _workers.clear();
+        _thread_pool = nullptr;
+    }
+
+    inline void LikelihoodBatch::addWorker(Likelihood::SharedPtr likelihood) {
+        // The worker's likelihood must already have its data and a fully specified model, and
+        // initBeagleLib must have been called. Workers are themselves run on the thread pool,
+        // so a worker's instances are evaluated one after another.
+        assert(likelihood);
+        likelihood->setThreadPool(nullptr);
+        Worker w;
+        w.likelihood = likelihood;
+        w.tree_manip = TreeManip::SharedPtr(new TreeManip());
+        _workers.push_back(w);
+    }
+
+    inline void LikelihoodBatch::setThreadPool(ThreadPool::SharedPtr pool) {
+        _thread_pool = pool;
+    }
+
+    inline unsigned LikelihoodBatch::getNumWorkers() const {
+        return (unsigned)_workers.size();
+    }
+
+    inline void LikelihoodBatch::calcLogLikelihoods(std::vector<State> & states, std::vector<double> & log_likelihoods) {
+        if (_workers.empty())
+            throw XLorad("LikelihoodBatch has no workers");
+
+        log_likelihoods.assign(states.size(), 0.0);
+        std::atomic<unsigned> next(0);
+        auto task = [this, &states, &log_likelihoods, &next](unsigned i) {
+            Worker & w = _workers[i];
+            for (unsigned k = next++; k < states.size(); k = next++)
+                log_likelihoods[k] = calcStateLogLikelihood(w, states[k]);
+        };
+        if (_thread_pool)
+            _thread_pool->run((unsigned)_workers.size(), task);
+        else
+            task(0);
+    }
+
+    inline double LikelihoodBatch::calcStateLogLikelihood(Worker & w, State & state) {
+        w.tree_manip->buildFromNewick(state.newick, /*rooted*/ false, /*allow_polytomies*/ true);
+        if (state.param_vect.rows() > 0) {
+            Model::SharedPtr m = w.likelihood->getModel();
+            m->setParametersFromLogTransformed(state.param_vect, 0, (unsigned)state.param_vect.rows());
+        }
+
+        // Nothing computed for the previous state can be reused
+        w.tree_manip->selectAllPartials();
+        w.tree_manip->selectAllTMatrices();
+        return w.likelihood->calcLogLikelihood(w.tree_manip->getTree());
+    }
+
+}
@@ -3,14 +3,20 @@
 #include "conditionals.hpp"
 
 #include <iostream>
+#include <chrono>
 #include "data.hpp"
 #include "likelihood.hpp"
+#include "likelihood_batch.hpp"
 #include "conditional_clade_store.hpp"
 #include "tree_summary.hpp"
 #include "partition.hpp"
 #include "lot.hpp"
 #include "chain.hpp"
 #include "output_manager.hpp"
+#include "alloc_counter.hpp"
+#include "burnin_monitor.hpp"
+#include "lorad_monitor.hpp"
+#include "tuning_cache.hpp"
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string/split.hpp>
@@ -113,21 +119,36 @@ namespace lorad {
             void                                    readTrees();
             void                                    showPartitionInfo();
             void                                    showBeagleInfo();
+            void                                    checkBackend();
+            void                                    benchmarkLikelihood();
+            void                                    scoreTrees();
             void                                    showMCMCInfo();
             void                                    calcHeatingPowers();
             void                                    calcMarginalLikelihood();
             void                                    initConditionalCladeStore();
             void                                    initChains();
+            void                                    initLikelihood(Likelihood::SharedPtr likelihood, bool show_model);
             void                                    openParamAndTreeFiles();
             void                                    closeParamAndTreeFiles();
             void                                    saveReferenceDistributions();
+            void                                    loadTuningCache();
+            void                                    saveTuningCache();
+            void                                    startWeightBalancing();
+            void                                    balanceChainWeights();
             void                                    startTuningChains();
             void                                    stopTuningChains();
+            void                                    startBurninMonitor();
+            bool                                    monitorBurnin(unsigned iteration);
+            bool                                    monitorMCSE(unsigned iteration);
             void                                    stepChains(unsigned iteration, bool sampling);
             void                                    swapChains();
+            void                                    checkAllocations(unsigned long nallocs_before, const char * where) const;
             void                                    stopChains();
             void                                    swapSummary() const;
             void                                    showChainTuningInfo() const;
+            void                                    showUpdaterWeights() const;
+            void                                    showTopologyMoveInfo() const;
+            void                                    showModelUploadInfo() const;
 
 #if 0
             void                                    saveLogtransformedParameterNames(Model::SharedPtr model, TreeManip::SharedPtr tm);
@@ -160,6 +181,8 @@ namespace lorad {
 
             Data::SharedPtr                         _data;
             std::vector<Likelihood::SharedPtr>      _likelihoods;
+            std::vector<Likelihood::SharedPtr>      _batch_likelihoods;     // workers used by scoreTrees
+            ThreadPool::SharedPtr                   _thread_pool;
             TreeSummary::SharedPtr                  _tree_summary;
             Lot::SharedPtr                          _lot;
             
@@ -193,6 +216,52 @@ namespace lorad {
             std::vector<unsigned>                   _swaps;
 
             bool                                    _use_underflow_scaling;
+            unsigned                                _scaling_interval;
+            bool                                    _use_preorder_partials;
+            double                                  _memory_budget;
+            std::string                             _revert_buffers;
+            unsigned                                _buffer_pool_size;
+            bool                                    _check_allocs;
+            std::string                             _precision;
+            std::string                             _backend;
+            bool                                    _check_backend;
+            unsigned                                _nbenchmark;
+            bool                                    _score_trees;
+            unsigned                                _find_mode_rounds;
+            double                                  _find_mode_tolerance;
+            double                                  _hmc_weight;
+            unsigned                                _hmc_leapfrog_steps;
+            double                                  _model_block_weight;
+            double                                  _spr_weight;
+            unsigned                                _spr_radius;
+            double                                  _tbr_weight;
+            unsigned                                _tbr_radius;
+            std::vector<std::string>                _delayed_acceptance_updaters;
+            double                                  _surrogate_fraction;
+            Data::SharedPtr                         _surrogate_data;
+            unsigned                                _nthreads;
+            unsigned                                _nshards;
+            unsigned                                _precision_check_interval;
+            double                                  _precision_tolerance;
+            unsigned                                _prior_check_interval;
+            bool                                    _auto_burnin;
+            unsigned                                _burnin_window;
+            BurninMonitor                           _burnin_monitor;
+            std::vector<unsigned>                   _burnin_naccepts;       // filled by monitorBurnin for each chain in turn
+            std::vector<unsigned>                   _burnin_nupdates;
+            std::vector<double>                     _burnin_lambdas;
+            double                                  _mcse_target;
+            unsigned                                _mcse_check_interval;
+            unsigned                                _mcse_last_check;       // number of samples at the last check
+            LoRaDMonitor                            _lorad_monitor;
+            std::string                             _tuning_cache_file_name;
+            unsigned                                _cached_burnin_iter;    // burn-in iterations used when tuning parameters were loaded from the cache
+            std::string                             _cached_tuning;         // "damped" or "off": tuning during burn-in when tuning parameters were loaded from the cache
+            std::string                             _model_description;
+            TuningCache                             _tuning_cache;
+            bool                                    _tuning_cache_loaded;
+            bool                                    _balance_weights;
+            bool                                    _balancing_weights;     // true once the weight balancing window has started
 
             static std::string                      _program_name;
             static unsigned                         _major_version;
@@ -268,6 +337,50 @@ namespace lorad {
         _expected_log_likelihood     = 0.0;
         _data                        = nullptr;
         _use_underflow_scaling       = false;
+        _scaling_interval            = 0;
+        _use_preorder_partials       = true;
+        _memory_budget               = 0.0;
+        _revert_buffers              = "double";
+        _buffer_pool_size            = 0;
+        _check_allocs                = false;
+        _precision                   = "single";
+        _backend                     = "beagle";
+        _check_backend               = false;
+        _nbenchmark                  = 0;
+        _score_trees                 = false;
+        _find_mode_rounds            = 0;
+        _find_mode_tolerance         = 0.01;
+        _hmc_weight                  = 0.0;
+        _hmc_leapfrog_steps          = 10;
+        _model_block_weight          = 0.0;
+        _spr_weight                  = 0.0;
+        _spr_radius                  = 0;
+        _tbr_weight                  = 0.0;
+        _tbr_radius                  = 3;
+        _delayed_acceptance_updaters.clear();
+        _surrogate_fraction          = 0.1;
+        _surrogate_data              = nullptr;
+        _nthreads                    = 1;
+        _nshards                     = 1;
+        _thread_pool                 = nullptr;
+        _precision_check_interval    = 100;
+        _precision_tolerance         = 0.01;
+        _prior_check_interval        = 0;
+        _auto_burnin                 = false;
+        _burnin_window               = 1000;
+        _burnin_monitor.clear();
+        _mcse_target                 = 0.0;
+        _mcse_check_interval         = 1000;
+        _mcse_last_check             = 0;
+        _lorad_monitor.clear();
+        _tuning_cache_file_name      = "";
+        _cached_burnin_iter          = 100;
+        _cached_tuning               = "damped";
+        _model_description           = "";
+        _tuning_cache.clear();
+        _tuning_cache_loaded         = false;
+        _balance_weights             = false;
+        _balancing_weights           = false;
         _lot                         = nullptr;
         _fnprefix                    = "";
         _standard_param_file_name    = "";
@@ -287,6 +400,7 @@ namespace lorad {
 
         _using_stored_data           = true;
         _likelihoods.clear();
+        _batch_likelihoods.clear();
         _num_burnin_iter             = 1000;
         _heating_lambda              = 0.5;
         _nchains                     = 1;
@@ -390,11 +504,44 @@ namespace lorad {
             ("gsspower", boost::program_options::value(&_gss_power)->default_value(1.0), "GSS chain power (nchains should be set to 1 if power specified, and reference distrbutions must be specified)")
 #endif
             ("heatfactor", boost::program_options::value(&_heating_lambda)->default_value(0.5), "determines how hot the heated chains are")
-            ("burnin", boost::program_options::value(&_num_burnin_iter)->default_value(100), "number of iterations used to burn in chains")
+            ("burnin", boost::program_options::value(&_num_burnin_iter)->default_value(100), "number of iterations used to burn in chains (the maximum number if autoburnin is yes)")
+            ("autoburnin", boost::program_options::value(&_auto_burnin)->default_value(false), "if yes, end burn-in early once the log-likelihood, log-prior, tuning parameters and acceptance rates of all chains have stopped changing from one window of burninwindow iterations to the next")
+            ("burninwindow", boost::program_options::value(&_burnin_window)->default_value(1000), "number of iterations in each window compared by autoburnin")
+            ("tuningcache", boost::program_options::value(&_tuning_cache_file_name)->default_value(""), "name of a file in which the tuning parameter and weight of every updater (and the covariance learned by the block updater) are saved at the end of burnin; if the file exists and was saved for the same data, partition and model, the updaters start from the saved values and burnin is shortened to cachedburnin iterations")
+            ("cachedburnin", boost::program_options::value(&_cached_burnin_iter)->default_value(100), "number of burnin iterations when tuning parameters were loaded from tuningcache (never more than burnin)")
+            ("balanceweights", boost::program_options::value(&_balance_weights)->default_value(false), "if yes, measure the wall time of each update and how far each updater moves the continuous parameters during the second half of burnin (the last window if autoburnin is yes), then re-weight the updaters to maximize the smallest effective sample size per second (topology updaters keep their weights); final weights and timings are shown after sampling")
+            ("cachedtuning", boost::program_options::value(&_cached_tuning)->default_value("damped"), "tuning during burnin when tuning parameters were loaded from tuningcache: 'damped' continues the tuning schedule where the saved run left off, so only small adjustments are made; 'off' keeps the saved values")
+            ("findmode", boost::program_options::value(&_find_mode_rounds)->default_value(0), "if greater than 0, move the starting edge lengths of each chain towards the posterior mode using at most this many rounds of Newton-Raphson steps (each round visits every edge and then the tree length), so that a shorter burnin suffices (requires preorderpartials)")
+            ("findmodetol", boost::program_options::value(&_find_mode_tolerance)->default_value(0.01), "if findmode is greater than 0, stop once a round improves the log posterior by less than this amount")
+            ("hmcweight", boost::program_options::value(&_hmc_weight)->default_value(0.0), "if greater than 0, add an updater that proposes all edge lengths jointly by Hamiltonian Monte Carlo, chosen with this weight (the tree length updater has weight 1 and the edge length updater 10); each of its updates costs several likelihood gradients but mixes much better on large trees (requires preorderpartials and no polytomies)")
+            ("hmcsteps", boost::program_options::value(&_hmc_leapfrog_steps)->default_value(10), "maximum number of leapfrog steps in each HMC trajectory (the number used is chosen uniformly between 1 and this)")
+            ("blockweight", boost::program_options::value(&_model_block_weight)->default_value(0.0), "if greater than 0, add an updater that proposes all model parameters (subset rates, exchangeabilities, state frequencies, shape and pinvar) jointly using a proposal covariance learned during burnin, chosen with this weight (each parameter's own updater has weight 1); each update needs a single likelihood calculation (parameters may not be linked across subsets)")
+            ("sprweight", boost::program_options::value(&_spr_weight)->default_value(0.0), "if greater than 0, add an updater that prunes a random subtree and regrafts it elsewhere in the tree, chosen with this weight (the tree topology updater has weight 10); only partials between the old and new attachment points are recalculated (requires no polytomies)")
+            ("sprradius", boost::program_options::value(&_spr_radius)->default_value(0), "maximum number of edges between the old and new attachment points of subtrees moved by the sprweight updater (0 means no limit)")
+            ("tbrweight", boost::program_options::value(&_tbr_weight)->default_value(0.0), "if greater than 0, add an updater that prunes a random subtree, reroots it and regrafts it elsewhere in the tree (bounded tree bisection and reconnection), chosen with this weight (requires no polytomies)")
+            ("tbrradius", boost::program_options::value(&_tbr_radius)->default_value(3), "maximum number of edges a subtree moved by the tbrweight updater may be regrafted from its old attachment point, and rerooted from its old root (must be at least 1)")
+            ("delayedaccept", boost::program_options::value(&_delayed_acceptance_updaters), "name of an updater (e.g. 'Tree Length', or 'all') whose proposals are first screened using a cheap surrogate likelihood computed from a random subsample of site patterns; the full likelihood is only calculated for proposals that pass, and a second acceptance step keeps the chain exact (may be specified more than once; the HMC updater cannot be screened)")
+            ("surrogatefraction", boost::program_options::value(&_surrogate_fraction)->default_value(0.1), "fraction of the site patterns in each subset used by the delayed acceptance surrogate likelihood")
             ("usedata", boost::program_options::value(&_using_stored_data)->default_value(true), "use the stored data in calculating likelihoods (specify no to explore the prior)")
             ("gpu", boost::program_options::value(&_use_gpu)->default_value(true), "use GPU if available")
             ("ambigmissing", boost::program_options::value(&_ambig_missing)->default_value(true), "treat all ambiguities as missing data")
             ("underflowscaling", boost::program_options::value(&_use_underflow_scaling)->default_value(true),          "scale site-likelihoods to prevent underflow (slower but safer)")
+            ("scalinginterval", boost::program_options::value(&_scaling_interval)->default_value(0), "if underflowscaling is yes and this is greater than 0, recomputed partials reuse existing scale factors, which are recomputed only every scalinginterval likelihood evaluations or if a likelihood underflows (0 recomputes scale factors in every evaluation)")
+            ("preorderpartials", boost::program_options::value(&_use_preorder_partials)->default_value(true), "maintain pre-order partials so that single-edge proposals are scored at the focal edge (faster for large trees)")
+            ("memorybudget", boost::program_options::value(&_memory_budget)->default_value(0.0), "maximum memory (in MB) that the BeagleLib instances of each chain may use, including those used for precision checks and delayed acceptance and (for precision = auto) allowing for a switch to double precision; the program stops at startup if the estimate exceeds it (0 means no limit)")
+            ("revertbuffers", boost::program_options::value(&_revert_buffers)->default_value("double"), "how partials are kept for reverting rejected proposals: double (two buffers for every internal node, fastest), pool (one buffer per node plus a small pool of spares, for very large alignments), or auto (pool only if double would exceed memorybudget)")
+            ("bufferpool", boost::program_options::value(&_buffer_pool_size)->default_value(0), "if revertbuffers is pool, the number of spare partials buffers (0 means choose from the number of taxa)")
+            ("precision", boost::program_options::value(&_precision)->default_value("single"), "floating-point precision used by BeagleLib: single, double, or auto (single during burn-in, switching to double if needed)")
+            ("precisioncheck", boost::program_options::value(&_precision_check_interval)->default_value(100), "if precision is auto, compare with a double-precision likelihood every this many likelihood evaluations during burn-in (0 means only switch on floating-point range errors)")
+            ("precisiontol", boost::program_options::value(&_precision_tolerance)->default_value(0.01), "if precision is auto, switch to double precision if single and double precision log-likelihoods differ by more than this amount")
+            ("priorcheck", boost::program_options::value(&_prior_check_interval)->default_value(0), "debugging aid: every this many iterations, recalculate the log joint prior of each chain from scratch and stop with an error if it differs from the value maintained incrementally by the updaters (0 means never)")
+            ("backend", boost::program_options::value(&_backend)->default_value("beagle"), "likelihood calculator: beagle (BeagleLib) or native (built-in CPU kernels, always double precision)")
+            ("checkbackend", boost::program_options::value(&_check_backend)->default_value(false), "compare the starting log-likelihood with the one computed by the other backend and abort if they disagree (for testing, e.g. with rbcl10.nex)")
+            ("nthreads", boost::program_options::value(&_nthreads)->default_value(1), "number of threads used to evaluate BeagleLib instances concurrently (only helps if there is more than one instance, e.g. mixed data types, rate heterogeneity models, or nshards > 1; 0 means one thread per core)")
+            ("nshards", boost::program_options::value(&_nshards)->default_value(1), "split the patterns of each subset into this many shards, each with its own BeagleLib instance, so that long alignments can use nthreads threads (0 means choose from the number of patterns and threads)")
+            ("benchmark", boost::program_options::value(&_nbenchmark)->default_value(0), "if greater than 0, time this many full likelihood evaluations of the starting tree and quit without running MCMC (e.g. to compare backends on codon subsets)")
+            ("scoretrees", boost::program_options::value(&_score_trees)->default_value(false), "compute the log-likelihood of every tree in treefile using the starting parameter values, scoring nthreads trees at a time, and quit without running MCMC")
+            ("checkallocs", boost::program_options::value(&_check_allocs)->default_value(false), "abort if any heap allocation occurs while updating or swapping chains during burn-in or sampling (for testing; requires a build with LORAD_COUNT_ALLOCS defined)")
             ("nstones", boost::program_options::value(&_nstones)->default_value(0), "use heated chains to compute marginal likelihood with the steppingstone method using nstones steppingstone ratios")
             ("ssalpha", boost::program_options::value(&_ss_alpha)->default_value(0.25), "determines how bunched steppingstone chain powers are toward the prior: chain k of K total chains has power (k/K)^{1/ssalpha}")
             ("saverefdists", boost::program_options::value(&_save_refdists)->default_value(false),                   "compute and save reference distributions after MCMC")
@@ -415,6 +562,8 @@ namespace lorad {
             ("lorad", boost::program_options::value(&_lorad)->default_value(false), "use LoRaD marginal likelihood method")
             ("ghm", boost::program_options::value(&_ghm)->default_value(false), "use GHM marginal likelihood method")
             ("obstarget",  boost::program_options::value(&_obs_mcse_target), "the ratio of total sample size to batch sample size for overlapping batch statistics (obs) MCSE estimation")
+            ("mcsetarget", boost::program_options::value(&_mcse_target)->default_value(0.0), "if greater than 0, estimate the LoRaD log marginal likelihood (at the first coverage specified) and its batch means MCSE while sampling, and stop sampling as soon as the MCSE is no greater than this value (niter is then the maximum number of iterations; requires lorad and a fixed tree topology)")
+            ("mcsecheck", boost::program_options::value(&_mcse_check_interval)->default_value(1000), "if mcsetarget is greater than 0, check the MCSE every time this many more samples have been saved (or a quarter more than at the last check, if that is more)")
             ("coverage",  boost::program_options::value(&coverage_values), "the fraction of samples used to construct the working parameter space (can specify this option more than once to evaluate several coverage values)")
             ("useregression",  boost::program_options::value(&_use_regression)->default_value(false), "use regression to detrend differences between reference function and posterior kernel")
             ("linearregression",  boost::program_options::value(&_linear_regression)->default_value(true), "use linear regression rather than polynomial regression if useregression specified")
@@ -542,15 +691,52 @@ namespace lorad {
         // Be sure heatfactor is between 0 and 1
         if (_heating_lambda <= 0.0 || _heating_lambda > 1.0)
             throw XLorad("heatfactor must be a real number in the interval (0.0,1.0]");
+
+        if (_auto_burnin && _burnin_window < 10)
+            throw XLorad("burninwindow must be at least 10");
+
+        if (_cached_tuning != "damped" && _cached_tuning != "off")
+            throw XLorad(boost::format("cachedtuning must be either damped or off, not %s") % _cached_tuning);
+
+        if (_mcse_target > 0.0) {
+            if (!_lorad)
+                throw XLorad("mcsetarget requires lorad = yes");
+            if (_nstones > 0)
+                throw XLorad("mcsetarget cannot be used with the steppingstone method (nstones > 0)");
+            if (_mcse_check_interval == 0)
+                throw XLorad("mcsecheck must be greater than 0");
+        }
+
+#if !defined(LORAD_COUNT_ALLOCS)
+        if (_check_allocs)
+            throw XLorad("checkallocs requires a build in which LORAD_COUNT_ALLOCS is defined (e.g. -DLORAD_COUNT_ALLOCS)");
+#endif
+
+        // Be sure surrogatefraction is between 0 and 1
+        if (_surrogate_fraction <= 0.0 || _surrogate_fraction > 1.0)
+            throw XLorad("surrogatefraction must be a real number in the interval (0.0,1.0]");
         
         if (!_using_stored_data)
             ::om.outputConsole("\n*** Not using stored data (posterior = prior) ***\n\n");
             
-        // Allocate a separate model for each chain
-        for (unsigned c = 0; c < _nchains; c++) {
+        // Chains are updated one at a time, so all of their likelihoods can share one thread pool
+        if (_nthreads == 0)
+            _nthreads = std::max(1U, std::thread::hardware_concurrency());
+        if (_nthreads > 1)
+            _thread_pool.reset(new ThreadPool(_nthreads));
+            
+        // Allocate a separate model for each chain, and for each of the nthreads workers
+        // used to score trees if scoretrees was specified
+        unsigned nworkers = (_score_trees ? _nthreads : 0);
+        for (unsigned c = 0; c < _nchains + nworkers; c++) {
             Likelihood::SharedPtr likelihood = Likelihood::SharedPtr(new Likelihood());
+            likelihood->setThreadPool(_thread_pool);
+            likelihood->setNumShards(_nshards);
             likelihood->setPreferGPU(_use_gpu);
             likelihood->setAmbiguityEqualsMissing(_ambig_missing);
+            likelihood->setBackend(_backend);
+            likelihood->setPrecision(_precision);
+            likelihood->setPrecisionCheck(_precision_check_interval, _precision_tolerance);
             Model::SharedPtr m = likelihood->getModel();
             m->setSubsetDataTypes(_partition->getSubsetDataTypes());
             handleAssignmentStrings(m, vm, "statefreq", partition_statefreq, "default:equal");
@@ -583,7 +769,10 @@ namespace lorad {
                 handleReferenceDistributions(m, vm, "treelenrefdist",   refdist_treelen);
                 handleReferenceDistributions(m, vm, "relratesrefdist",  refdist_subsetrelrates);
             }
-            _likelihoods.push_back(likelihood);
+            if (c < _nchains)
+                _likelihoods.push_back(likelihood);
+            else
+                _batch_likelihoods.push_back(likelihood);
         }
 
         // The tree topology must be fixed if carrying out GHME marg. like. estim.
@@ -591,6 +780,11 @@ namespace lorad {
         if (_ghm && !_likelihoods[0]->getModel()->isFixedTree()) {
             throw XLorad("Tree topology must be fixed for GHME marginal likelihood method");
         }
+
+        // The LoRaD MCSE can only be monitored if all samples have the same parameters
+        if (_mcse_target > 0.0 && !_likelihoods[0]->getModel()->isFixedTree()) {
+            throw XLorad("Tree topology must be fixed if mcsetarget is greater than 0");
+        }
     }
     
     inline void LoRaD::handleReferenceDistributions(Model::SharedPtr m, const boost::program_options::variables_map & vm, std::string label, const std::vector<std::string> & definitions) {
@@ -979,7 +1173,7 @@ namespace lorad {
             bool time_to_report = (bool)(iteration % _print_freq == 0);
             if (time_to_report) {
                 double logLike = chain.getLogLikelihood();
-                double logPrior = chain.calcLogJointPrior();
+                double logPrior = chain.getLogJointPrior();
                 double TL = chain.getTreeManip()->calcTreeLength();
                 unsigned m = chain.getTreeManip()->calcResolutionClass();
                 if (time_to_report) {
@@ -996,7 +1190,7 @@ namespace lorad {
             bool time_to_report = (bool)(iteration % _print_freq == 0);
             if (time_to_sample || time_to_report) {
                 double logLike = chain.getLogLikelihood();
-                double logPrior = chain.calcLogJointPrior();
+                double logPrior = chain.getLogJointPrior();
                 double logRefDist = chain.calcLogReferenceDensity();
                 double TL = chain.getTreeManip()->calcTreeLength();
                 unsigned m = chain.getTreeManip()->calcResolutionClass();
@@ -1047,7 +1241,7 @@ namespace lorad {
 
             if (time_to_sample || time_to_report) {
                 double logLike = chain.getLogLikelihood();
-                double logPrior = chain.calcLogJointPrior();
+                double logPrior = chain.getLogJointPrior();
                 double TL = chain.getTreeManip()->calcTreeLength();
                 unsigned m = chain.getTreeManip()->calcResolutionClass();
                 if (time_to_report) {
@@ -1085,7 +1279,7 @@ namespace lorad {
                         // Save parameters and edge proportions/TL so that reference distributions
                         // can be computed at the end of a posterior sampling run
                         _sampled_loglikelihoods.push_back(chain.getLogLikelihood());
-                        _sampled_logpriors.push_back(chain.calcLogJointPrior());
+                        _sampled_logpriors.push_back(chain.getLogJointPrior());
 
                         chain.getModel()->sampleParams();
                         chain.getTreeManip()->sampleTree();
@@ -1147,16 +1341,100 @@ namespace lorad {
                     std::vector<double> lambdas    = c.getLambdas();
                     std::vector<double> accepts    = c.getAcceptPercentages();
                     std::vector<unsigned> nupdates = c.getNumUpdates();
+                    std::vector<bool> delayed      = c.getDelayedAcceptance();
+                    std::vector<double> screened   = c.getScreenedPercentages();
                     unsigned n = (unsigned)names.size();
-                    ::om.outputConsole(boost::str(boost::format("%35s %15s %15s %15s\n") % "Updater" % "Tuning Param." % "Accept %" % "No. Updates"));
-                    for (unsigned i = 0; i < n; ++i) {
-                        ::om.outputConsole(boost::str(boost::format("%35s %15.6f %15.1f %15d\n") % names[i] % lambdas[i] % accepts[i] % nupdates[i]));
+                    bool any_delayed = std::find(delayed.begin(), delayed.end(), true) != delayed.end();
+                    if (any_delayed) {
+                        // Screened % is the percentage of proposals rejected by the surrogate
+                        // likelihood, which did not need a full likelihood calculation
+                        ::om.outputConsole(boost::str(boost::format("%35s %15s %15s %15s %15s\n") % "Updater" % "Tuning Param." % "Accept %" % "No. Updates" % "Screened %"));
+                        for (unsigned i = 0; i < n; ++i) {
+                            if (delayed[i])
+                                ::om.outputConsole(boost::str(boost::format("%35s %15.6f %15.1f %15d %15.1f\n") % names[i] % lambdas[i] % accepts[i] % nupdates[i] % screened[i]));
+                            else
+                                ::om.outputConsole(boost::str(boost::format("%35s %15.6f %15.1f %15d %15s\n") % names[i] % lambdas[i] % accepts[i] % nupdates[i] % "---"));
+                        }
+                    }
+                    else {
+                        ::om.outputConsole(boost::str(boost::format("%35s %15s %15s %15s\n") % "Updater" % "Tuning Param." % "Accept %" % "No. Updates"));
+                        for (unsigned i = 0; i < n; ++i) {
+                            ::om.outputConsole(boost::str(boost::format("%35s %15.6f %15.1f %15d\n") % names[i] % lambdas[i] % accepts[i] % nupdates[i]));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    inline void LoRaD::showUpdaterWeights() const {
+        // Timings cover the whole run (burnin and sampling)
+        if (!_balance_weights)
+            return;
+        for (unsigned idx = 0; idx < _nchains; ++idx) {
+            for (auto & c : _chains) {
+                if (c.getChainIndex() == idx) {
+                    ::om.outputConsole(boost::str(boost::format("\nChain %d updater weights and costs\n") % idx));
+                    std::vector<std::string> names = c.getUpdaterNames();
+                    std::vector<double> weights    = c.getWeights();
+                    std::vector<double> seconds    = c.getSecondsPerUpdate();
+                    double sum_weights = 0.0;
+                    for (double w : weights)
+                        sum_weights += w;
+                    ::om.outputConsole(boost::str(boost::format("%35s %15s %15s %15s\n") % "Updater" % "Weight" % "Prob." % "usec/Update"));
+                    for (unsigned i = 0; i < names.size(); ++i) {
+                        ::om.outputConsole(boost::str(boost::format("%35s %15.4f %15.4f %15.1f\n") % names[i] % weights[i] % (weights[i]/sum_weights) % (1.0e6*seconds[i])));
+                    }
+                }
+            }
+        }
+    }
+
+    inline void LoRaD::showTopologyMoveInfo() const {
+        // Only the SPR and TBR updaters keep these statistics; partials recalculated (each subset
+        // counted separately) and times are per update, whether or not it changed the topology
+        if (_spr_weight <= 0.0 && _tbr_weight <= 0.0)
+            return;
+        for (unsigned idx = 0; idx < _nchains; ++idx) {
+            for (auto & c : _chains) {
+                if (c.getChainIndex() == idx) {
+                    auto updaters = c.getSubtreeRegraftUpdaters();
+                    if (updaters.empty())
+                        continue;
+                    ::om.outputConsole(boost::str(boost::format("\nChain %d topology moves\n") % idx));
+                    ::om.outputConsole(boost::str(boost::format("%35s %15s %15s %15s %15s %15s\n") % "Updater" % "Topol. Change %" % "Accept %" % "Mean Distance" % "Partials/Upd." % "usec/Update"));
+                    for (auto & u : updaters) {
+                        ::om.outputConsole(boost::str(boost::format("%35s %15.1f %15.1f %15.2f %15.1f %15.1f\n") % u->getUpdaterName() % u->getTopologyChangePct() % u->getTopologyAcceptPct() % u->getMeanMoveDistance() % u->getPartialsPerUpdate() % (1.0e6*u->getSecondsPerUpdate())));
                     }
                 }
             }
         }
     }
 
+    inline void LoRaD::showModelUploadInfo() const {
+        // Report number of times subset model parameters were sent to BeagleLib
+        // and the number of times this was avoided because they had not changed
+        ::om.outputConsole("\nBeagleLib model parameter uploads:\n");
+        ::om.outputConsole(boost::str(boost::format("%12s %15s %15s %15s\n") % "Chain" % "Uploads" % "Skipped" % "Skipped %"));
+        for (unsigned idx = 0; idx < _nchains; ++idx) {
+            unsigned long nuploads = _likelihoods[idx]->getNumModelUploads();
+            unsigned long nskipped = _likelihoods[idx]->getNumModelUploadsSkipped();
+            unsigned long total = nuploads + nskipped;
+            double pct_skipped = (total > 0 ? 100.0*nskipped/total : 0.0);
+            ::om.outputConsole(boost::str(boost::format("%12d %15d %15d %15.1f\n") % idx % nuploads % nskipped % pct_skipped));
+        }
+        
+        // Report average number of partials recalculated per likelihood evaluation
+        ::om.outputConsole("\nPartials recalculated (each subset counted separately):\n");
+        ::om.outputConsole(boost::str(boost::format("%12s %15s %15s %15s\n") % "Chain" % "Evaluations" % "Partials" % "Per eval."));
+        for (unsigned idx = 0; idx < _nchains; ++idx) {
+            unsigned long nevals = _likelihoods[idx]->getNumLikelihoodEvaluations();
+            unsigned long npartials = _likelihoods[idx]->getNumPartialsCalculated();
+            double per_eval = (nevals > 0 ? (double)npartials/nevals : 0.0);
+            ::om.outputConsole(boost::str(boost::format("%12d %15d %15d %15.1f\n") % idx % nevals % npartials % per_eval));
+        }
+    }
+
     inline void LoRaD::calcMarginalLikelihood() {
         if (_nstones > 0) {
             // Calculate the log ratio for each steppingstone
@@ -1221,31 +1499,252 @@ namespace lorad {
         }
     }
     
+    inline void LoRaD::loadTuningCache() {
+        // Starts each chain's updaters from the tuning parameters and weights saved in the
+        // tuning cache by an earlier run on the same data, partition and model
+        if (_tuning_cache_file_name.empty())
+            return;
+
+        // The key describes everything that determines which updaters exist and how bold
+        // their proposals can be; the model description includes starting parameter values
+        assert(_data);
+        std::string description = boost::str(boost::format("data file: %s\nusing data: %d\ntaxa: %d\n") % _data_file_name % _using_stored_data % _data->getNumTaxa());
+        for (unsigned s = 0; s < _partition->getNumSubsets(); s++)
+            description += boost::str(boost::format("subset %s: %s, %d sites, %d patterns\n") % _partition->getSubsetName(s) % _partition->getDataTypeForSubset(s).getDataTypeAsString() % _partition->numSitesInSubset(s) % _data->getNumPatternsInSubset(s));
+        description += _model_description;
+        for (unsigned i = 0; i < _nchains; i++)
+            description += boost::str(boost::format("chain %d: heating power %.17g\n") % i % _heating_powers[i]);
+        for (auto & name : _chains[0].getUpdaterNames())
+            description += boost::str(boost::format("updater: %s\n") % name);
+        _tuning_cache.setKey(description);
+
+        _tuning_cache_loaded = false;
+        if (!_tuning_cache.load(_tuning_cache_file_name)) {
+            ::om.outputConsole(boost::format("\nNo tuning parameters for this data, partition and model found in %s (they will be saved there after burnin)\n") % _tuning_cache_file_name);
+            return;
+        }
+
+        // Chain indices follow the heating power, which is what the tuning parameters depend on
+        unsigned nloaded = 0;
+        for (auto & c : _chains) {
+            unsigned chain_index = (unsigned)c.getChainIndex();
+            if (!_tuning_cache.hasChain(chain_index))
+                continue;
+            const TuningCache::chain_tuning_t & tuning = _tuning_cache.getChain(chain_index);
+            std::vector<std::string> names = c.getUpdaterNames();
+            if (tuning.size() != names.size())
+                continue;
+            std::vector<double> lambdas(names.size());
+            std::vector<double> weights(names.size());
+            std::vector<unsigned> offsets(names.size());
+            std::vector< std::vector<double> > adaptations(names.size());
+            bool names_match = true;
+            for (unsigned i = 0; i < names.size(); i++) {
+                names_match = names_match && (tuning[i]._name == names[i]);
+                lambdas[i] = tuning[i]._lambda;
+                weights[i] = tuning[i]._weight;
+                offsets[i] = tuning[i]._ntuned;
+                adaptations[i] = tuning[i]._adaptation;
+            }
+            if (!names_match)
+                continue;
+            
+            // A lambda is only meaningful with the state it was learned with (e.g. the block
+            // updater's covariance), so the chain is left untuned if that was not saved
+            if (!c.setAdaptations(adaptations))
+                continue;
+            c.setLambdas(lambdas);
+            c.setWeights(weights);
+            if (_cached_tuning == "damped")
+                c.setTuningOffsets(offsets);
+            nloaded++;
+        }
+
+        // Burn-in is only shortened if every chain starts out tuned
+        if (nloaded < _nchains) {
+            ::om.outputConsole(boost::format("\nTuning parameters for only %d of %d chains found in %s, so burnin is not shortened\n") % nloaded % _nchains % _tuning_cache_file_name);
+            return;
+        }
+        _tuning_cache_loaded = true;
+        _num_burnin_iter = std::min(_num_burnin_iter, _cached_burnin_iter);
+        ::om.outputConsole(boost::format("\nTuning parameters loaded from %s: burnin shortened to %d iterations (tuning %s)\n") % _tuning_cache_file_name % _num_burnin_iter % _cached_tuning);
+    }
+
+    inline void LoRaD::saveTuningCache() {
+        // Called at the end of burn-in, while the number of tuning updates is still available
+        if (_tuning_cache_file_name.empty())
+            return;
+
+        // Nothing was learned if the loaded tuning parameters were kept fixed
+        if (_tuning_cache_loaded && _cached_tuning == "off")
+            return;
+
+        for (auto & c : _chains) {
+            std::vector<std::string> names = c.getUpdaterNames();
+            std::vector<double> lambdas = c.getLambdas();
+            std::vector<double> weights = c.getWeights();
+            std::vector<unsigned> ntuned = c.getNumTuningUpdates();
+            std::vector< std::vector<double> > adaptations = c.getAdaptations();
+            TuningCache::chain_tuning_t tuning(names.size());
+            for (unsigned i = 0; i < names.size(); i++) {
+                tuning[i]._name = names[i];
+                tuning[i]._lambda = lambdas[i];
+                tuning[i]._weight = weights[i];
+                tuning[i]._ntuned = ntuned[i];
+                tuning[i]._adaptation = adaptations[i];
+            }
+            _tuning_cache.setChain((unsigned)c.getChainIndex(), tuning);
+        }
+        _tuning_cache.save(_tuning_cache_file_name);
+        ::om.outputConsole(boost::format("\nTuning parameters saved to %s\n") % _tuning_cache_file_name);
+    }
+
     inline void LoRaD::startTuningChains() {
         _swaps.assign(_nchains*_nchains, 0);
         for (auto & c : _chains) {
             c.startTuning();
+            if (_tuning_cache_loaded && _cached_tuning == "off")
+                c.stopTuning();
         }
     } 
     
+    inline void LoRaD::startBurninMonitor() {
+        // Sizes everything monitorBurnin uses, so that it does not allocate during burn-in
+        std::vector<std::string> names = _chains[0].getUpdaterNames();
+        _burnin_monitor.init(_nchains, _burnin_window, names);
+        _burnin_naccepts.assign(names.size(), 0);
+        _burnin_nupdates.assign(names.size(), 0);
+        _burnin_lambdas.assign(names.size(), 0.0);
+    }
+
+    inline bool LoRaD::monitorBurnin(unsigned iteration) {
+        // Returns true if burn-in can end before _num_burnin_iter iterations
+        unsigned long nallocs = AllocCounter::getCount();
+        for (unsigned i = 0; i < _nchains; ++i) {
+            Chain & c = _chains[i];
+            _burnin_monitor.recordState((unsigned)c.getChainIndex(), c.getLogLikelihood(), c.getLogJointPrior());
+            c.getAcceptanceCounts(_burnin_naccepts, _burnin_nupdates);
+            _burnin_monitor.recordAcceptances(i, (unsigned)c.getChainIndex(), _burnin_naccepts, _burnin_nupdates);
+        }
+        bool window_closed = _burnin_monitor.isWindowFull();
+        bool stabilized = false;
+        if (window_closed) {
+            for (auto & c : _chains) {
+                c.getLambdas(_burnin_lambdas);
+                _burnin_monitor.recordLambdas((unsigned)c.getChainIndex(), _burnin_lambdas);
+            }
+            stabilized = _burnin_monitor.closeWindow();
+
+            // Weights are balanced using the last window, in which the chains should be most settled
+            if (_balance_weights && !stabilized)
+                startWeightBalancing();
+        }
+        
+        // Only the messages below, each printed at most once, allocate
+        if (_check_allocs)
+            checkAllocations(nallocs, "monitoring burn-in");
+        if (stabilized) {
+            ::om.outputConsole(boost::format("\nBurn-in ended after %d iterations (%d windows) because the chains have stabilized\n") % iteration % _burnin_monitor.getNumWindows());
+            return true;
+        }
+        if (window_closed && iteration + _burnin_window > _num_burnin_iter)
+            ::om.outputConsole(boost::format("\nBurn-in will reach its limit of %d iterations before the chains have stabilized (%s)\n") % _num_burnin_iter % _burnin_monitor.getUnstableReason());
+        return false;
+    }
+
+    inline bool LoRaD::monitorMCSE(unsigned iteration) {
+        // Returns true if sampling can stop before _num_iter iterations. Each check passes over
+        // all samples, so checks are spaced geometrically (at least a quarter more samples than
+        // at the last check) to keep their total cost proportional to the number of samples.
+        unsigned nsamples = _lorad_monitor.getNumSamples();
+        if (nsamples < _mcse_last_check + std::max(_mcse_check_interval, _mcse_last_check/4))
+            return false;
+        _mcse_last_check = nsamples;
+
+        double coverage = _coverages[0];
+        unsigned nbatches = std::max(2U, (unsigned)_obs_mcse_target);
+        double log_marginal_likelihood = 0.0;
+        double mcse = 0.0;
+        if (!_lorad_monitor.estimate(coverage, nbatches, log_marginal_likelihood, mcse))
+            return false;
+        ::om.outputConsole(boost::format("LoRaD after %d samples (coverage %.3f): log marginal likelihood %.5f, MCSE %.5f\n") % nsamples % coverage % log_marginal_likelihood % mcse);
+        if (mcse > _mcse_target)
+            return false;
+        ::om.outputConsole(boost::format("\nSampling stopped after %d iterations because the LoRaD MCSE (%.5f) reached the target (%.5f)\n") % iteration % mcse % _mcse_target);
+        return true;
+    }
+
+    inline void LoRaD::startWeightBalancing() {
+        for (auto & c : _chains)
+            c.startWeightBalancing();
+        _balancing_weights = true;
+    }
+
+    inline void LoRaD::balanceChainWeights() {
+        if (!_balancing_weights)
+            return;
+        _balancing_weights = false;
+        ::om.outputConsole("\nUpdater weights balanced using burnin (smallest effective sample size per second, predicted):\n");
+        for (unsigned idx = 0; idx < _nchains; ++idx) {
+            for (auto & c : _chains) {
+                if (c.getChainIndex() == idx) {
+                    double ess_rate_before = 0.0;
+                    double ess_rate_after = 0.0;
+                    if (c.balanceWeights(ess_rate_before, ess_rate_after))
+                        ::om.outputConsole(boost::format("  chain %d: %.1f -> %.1f\n") % idx % ess_rate_before % ess_rate_after);
+                    else
+                        ::om.outputConsole(boost::format("  chain %d: weights not changed (too few updates measured)\n") % idx);
+                }
+            }
+        }
+    }
+
     inline void LoRaD::stopTuningChains() {
+        // Balanced weights are saved in the tuning cache along with the tuning parameters
+        balanceChainWeights();
+        saveTuningCache();
         _swaps.assign(_nchains*_nchains, 0);
         for (auto & c : _chains) {
             c.stopTuning();
         }
+        
+        // Burn-in has decided which precision each chain will use for sampling
+        if (_precision == "auto") {
+            ::om.outputConsole("\nPrecision used after burn-in:\n");
+            for (unsigned i = 0; i < _likelihoods.size(); i++) {
+                _likelihoods[i]->stopPrecisionChecks();
+                ::om.outputConsole(boost::format("  chain %d: %s\n") % i % _likelihoods[i]->describePrecision());
+            }
+        }
     }
     
     inline void LoRaD::stepChains(unsigned iteration, bool sampling) {
-        for (auto & c : _chains) {
-             c.nextStep(iteration);
+        for (unsigned i = 0; i < (unsigned)_chains.size(); i++) {
+            auto & c = _chains[i];
+            unsigned long nallocs = AllocCounter::getCount();
+            unsigned long promotion = _likelihoods[i]->getPromotionEvaluation();
+            c.nextStep(iteration);
+            
+            // Switching to double precision (precision = auto) recreates the instances, which
+            // happens at most once per chain, so that step is exempt from the allocation check
+            if (_check_allocs && _likelihoods[i]->getPromotionEvaluation() == promotion)
+                checkAllocations(nallocs, "updating a chain");
             if (sampling)
                 sampleChain(iteration, c);
         }
     }
 
+    inline void LoRaD::checkAllocations(unsigned long nallocs_before, const char * where) const {
+        unsigned long nallocs = AllocCounter::getCount() - nallocs_before;
+        if (nallocs > 0)
+            throw XLorad(boost::format("%d heap allocations occurred while %s (checkallocs = yes)") % nallocs % where);
+    }
+
     inline void LoRaD::swapChains() {
         if (_nchains == 1 || _nstones > 0)
             return;
+        
+        unsigned long nallocs = AllocCounter::getCount();
             
         // Select two chains at random to swap
         // If _nchains = 3...
@@ -1294,10 +1793,10 @@ namespace lorad {
         // log R = (a-b) [log(pj) - log(pi)]
 
         double heat_i       = _chains[i].getHeatingPower();
-        double log_kernel_i = _chains[i].calcLogLikelihood() + _chains[i].calcLogJointPrior();
+        double log_kernel_i = _chains[i].calcLogLikelihood() + _chains[i].getLogJointPrior();
 
         double heat_j       = _chains[j].getHeatingPower();
-        double log_kernel_j = _chains[j].calcLogLikelihood() + _chains[j].calcLogJointPrior();
+        double log_kernel_j = _chains[j].calcLogLikelihood() + _chains[j].getLogJointPrior();
 
         double logR = (heat_i - heat_j)*(log_kernel_j - log_kernel_i);
 
@@ -1309,11 +1808,11 @@ namespace lorad {
             _chains[i].setHeatingPower(heat_j);
             _chains[j].setChainIndex(index_i);
             _chains[i].setChainIndex(index_j);
-            std::vector<double> lambdas_i = _chains[i].getLambdas();
-            std::vector<double> lambdas_j = _chains[j].getLambdas();
-            _chains[i].setLambdas(lambdas_j);
-            _chains[j].setLambdas(lambdas_i);
+            _chains[i].swapLambdas(_chains[j]);
         }
+        
+        if (_check_allocs)
+            checkAllocations(nallocs, "swapping chains");
     }
 
     inline void LoRaD::stopChains() {
@@ -1375,26 +1874,33 @@ namespace lorad {
             auto likelihood = _likelihoods[chain_index];
             auto m          = likelihood->getModel();
             
-            // Finish setting up models
-            m->setTopologyPriorOptions(_allow_polytomies, _resolution_class_prior, _topo_prior_C);
-            m->setSubsetNumPatterns(_data->calcNumPatternsVect());
-            m->setSubsetSizes(_partition->calcSubsetSizes());
-            m->activate();
-            if (chain_index == 0)
-                ::om.outputConsole(boost::format("\n%s\n") % m->describeModel());
-            else
-                m->describeModel();
-                
-            // Finish setting up likelihoods
-            likelihood->setData(_data);
-            likelihood->useUnderflowScaling(_use_underflow_scaling);
-            likelihood->initBeagleLib();
-            likelihood->useStoredData(_using_stored_data);
+            // All chains screen delayed acceptance proposals using the same subsample of patterns
+            if (!_delayed_acceptance_updaters.empty() && _using_stored_data) {
+                if (!_surrogate_data)
+                    _surrogate_data = _data->createSubsample(_surrogate_fraction, _lot);
+                likelihood->setSurrogateData(_surrogate_data);
+            }
+            initLikelihood(likelihood, chain_index == 0);
             
             // Build list of updaters, one for each free parameter in the model
+            if (_hmc_weight > 0.0) {
+                if (!_use_preorder_partials)
+                    throw XLorad("hmcweight requires preorderpartials");
+                if (_gss)
+                    throw XLorad("hmcweight cannot be used with usegss");
+                c.setEdgeLengthHMC(_hmc_weight, _hmc_leapfrog_steps);
+            }
+            c.setModelBlockWeight(_model_block_weight);
+            if (_tbr_weight > 0.0 && _tbr_radius == 0)
+                throw XLorad("tbrradius must be at least 1");
+            c.setSubtreeRegraft(_spr_weight, _spr_radius, _tbr_weight, _tbr_radius);
+            c.setPriorCheckInterval(_prior_check_interval);
             unsigned num_free_parameters = c.createUpdaters(m, _lot, likelihood, _conditional_clade_store);
             if (num_free_parameters == 0)
                 throw XLorad("MCMC skipped because there are no free parameters in the model");
+            if (_using_stored_data)
+                c.setDelayedAcceptance(_delayed_acceptance_updaters);
+            c.setUpdateTiming(_balance_weights);
 
             // Tell the chain that it should adapt its updators (at least initially)
             c.startTuning();
@@ -1449,11 +1955,49 @@ namespace lorad {
             std::string newick = _tree_summary->getNewick(m->getTreeIndex());
             c.setTreeFromNewick(newick);
             
+            // Optionally start from (near) the posterior mode of the edge lengths
+            if (_find_mode_rounds > 0) {
+                if (!_using_stored_data || !_use_preorder_partials)
+                    ::om.outputConsole(boost::format("\nSkipping posterior mode search for chain %d (it needs usedata and preorderpartials)\n") % chain_index);
+                else {
+                    double start_log_likelihood = 0.0;
+                    double log_likelihood = 0.0;
+                    unsigned nrounds = c.findPosteriorMode(_find_mode_rounds, _find_mode_tolerance, start_log_likelihood, log_likelihood);
+                    ::om.outputConsole(boost::format("\nPosterior mode search for chain %d: %d rounds, log-likelihood %.5f -> %.5f\n") % chain_index % nrounds % start_log_likelihood % log_likelihood);
+                }
+            }
+            
             // Print headers in output files and make sure each updator has its starting value
             c.start();
         }
     }
 
+    inline void LoRaD::initLikelihood(Likelihood::SharedPtr likelihood, bool show_model) {
+        auto m = likelihood->getModel();
+        
+        // Finish setting up model
+        m->setTopologyPriorOptions(_allow_polytomies, _resolution_class_prior, _topo_prior_C);
+        m->setSubsetNumPatterns(_data->calcNumPatternsVect());
+        m->setSubsetSizes(_partition->calcSubsetSizes());
+        m->activate();
+        std::string model_description = m->describeModel();
+        if (show_model) {
+            ::om.outputConsole(boost::format("\n%s\n") % model_description);
+            _model_description = model_description;
+        }
+            
+        // Finish setting up likelihood
+        likelihood->setData(_data);
+        likelihood->useUnderflowScaling(_use_underflow_scaling);
+        likelihood->setScalingInterval(_scaling_interval);
+        likelihood->usePreorderPartials(_use_preorder_partials);
+        likelihood->setMemoryBudget(_memory_budget);
+        likelihood->setRevertBuffers(_revert_buffers);
+        likelihood->setBufferPoolSize(_buffer_pool_size);
+        likelihood->initBeagleLib();
+        likelihood->useStoredData(_using_stored_data);
+    }
+
     inline void LoRaD::readData() {
         ::om.outputConsole(boost::format("\n*** Reading and storing the data in the file %s\n") % _data_file_name);
         _data = Data::SharedPtr(new Data());
@@ -1494,12 +2038,109 @@ namespace lorad {
         assert(_likelihoods.size() > 0 && _likelihoods[0]);
         ::om.outputConsole(boost::format("\n*** BeagleLib %s resources:\n") % _likelihoods[0]->beagleLibVersion());
         ::om.outputConsole(boost::format("Preferred resource: %s\n") % (_use_gpu ? "GPU" : "CPU"));
+        ::om.outputConsole(boost::format("Pre-order partials: %s\n") % (_use_preorder_partials ? "yes" : "no"));
+        ::om.outputConsole(boost::format("Precision: %s\n") % _precision);
+        ::om.outputConsole(boost::format("Backend: %s\n") % _backend);
+        ::om.outputConsole(boost::format("Threads: %d\n") % _nthreads);
+        ::om.outputConsole(boost::format("Pattern shards: %d\n") % _likelihoods[0]->getNumShards());
+        ::om.outputConsole(boost::format("Memory: %s\n") % _likelihoods[0]->describeMemory());
         ::om.outputConsole("Available resources:\n");
         ::om.outputConsole(boost::format("%s\n") % _likelihoods[0]->availableResources());
         ::om.outputConsole("Resources used:\n");
         ::om.outputConsole(boost::format("%s\n") % _likelihoods[0]->usedResources());
     }
     
+    inline void LoRaD::checkBackend() {
+        // Recompute the starting log-likelihood of the cold chain using the other backend
+        assert(_likelihoods.size() > 0 && _likelihoods[0]);
+        Likelihood::SharedPtr primary = _likelihoods[0];
+        Likelihood::SharedPtr reference = Likelihood::SharedPtr(new Likelihood());
+        reference->setBackend(primary->getBackendName() == "native" ? "beagle" : "native");
+        reference->setPreferGPU(_use_gpu);
+        reference->setAmbiguityEqualsMissing(_ambig_missing);
+        reference->setPrecision("double");
+        reference->setData(_data);
+        reference->setModel(primary->getModel());
+        reference->useUnderflowScaling(_use_underflow_scaling);
+        reference->usePreorderPartials(false);
+        reference->initBeagleLib();
+        reference->useStoredData(_using_stored_data);
+
+        // Every partial and transition matrix must be computed from scratch; the selection is
+        // cleared again at the start of the next update
+        TreeManip::SharedPtr tm = _chains[0].getTreeManip();
+        tm->selectAllPartials();
+        tm->selectAllTMatrices();
+        double primary_lnL = _chains[0].getLogLikelihood();
+        double reference_lnL = reference->calcLogLikelihood(tm->getTree());
+        reference->finalizeBeagleLib(true);
+
+        // Single precision BeagleLib results can only be expected to agree to within the precision tolerance
+        double diff = std::fabs(primary_lnL - reference_lnL);
+        double tolerance = (_backend == "beagle" && _precision != "double" ? _precision_tolerance : 1.0e-6*std::fabs(reference_lnL));
+        ::om.outputConsole(boost::format("\n*** Backend check:\n  %s log-likelihood: %.8f\n  %s log-likelihood: %.8f\n  difference: %g (tolerance %g)\n") % primary->getBackendName() % primary_lnL % reference->getBackendName() % reference_lnL % diff % tolerance);
+        if (!(diff <= tolerance))
+            throw XLorad(boost::format("backend check failed: %s and %s log-likelihoods differ by %g") % primary->getBackendName() % reference->getBackendName() % diff);
+    }
+    
+    inline void LoRaD::benchmarkLikelihood() {
+        // Time full likelihood evaluations (every partial and transition matrix recomputed)
+        // of the cold chain's starting tree
+        assert(_likelihoods.size() > 0 && _likelihoods[0]);
+        Likelihood::SharedPtr likelihood = _likelihoods[0];
+        TreeManip::SharedPtr tm = _chains[0].getTreeManip();
+        Tree::SharedPtr tree = tm->getTree();
+        
+        double log_likelihood = 0.0;
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < _nbenchmark; i++) {
+            tm->selectAllPartials();
+            tm->selectAllTMatrices();
+            log_likelihood = likelihood->calcLogLikelihood(tree);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        
+        ::om.outputConsole("\n*** Likelihood benchmark:\n");
+        ::om.outputConsole(boost::format("  backend: %s") % likelihood->getBackendName());
+        if (likelihood->getBackendName() == "native")
+            ::om.outputConsole(boost::format(" (vectorization: %s)") % NativeEngine::describeVectorization());
+        ::om.outputConsole(boost::format("\n  precision: %s\n") % likelihood->describePrecision());
+        ::om.outputConsole(boost::format("  log-likelihood: %.8f\n") % log_likelihood);
+        ::om.outputConsole(boost::format("  evaluations: %d\n") % _nbenchmark);
+        ::om.outputConsole(boost::format("  total time: %.3f seconds\n") % elapsed.count());
+        ::om.outputConsole(boost::format("  time per evaluation: %.3f milliseconds\n") % (1000.0*elapsed.count()/_nbenchmark));
+    }
+    
+    inline void LoRaD::scoreTrees() {
+        // Compute the log-likelihood of every tree in the tree file. Each worker has its own
+        // model and BeagleLib instances, so nthreads trees are scored at the same time.
+        assert(_tree_summary);
+        assert(_batch_likelihoods.size() > 0);
+        LikelihoodBatch batch;
+        batch.setThreadPool(_thread_pool);
+        for (auto likelihood : _batch_likelihoods) {
+            initLikelihood(likelihood, false);
+            batch.addWorker(likelihood);
+        }
+        
+        unsigned ntrees = _tree_summary->getNumTrees();
+        std::vector<LikelihoodBatch::State> states(ntrees);
+        for (unsigned i = 0; i < ntrees; i++)
+            states[i].newick = _tree_summary->getNewick(i);
+        
+        std::vector<double> log_likelihoods;
+        auto start = std::chrono::steady_clock::now();
+        batch.calcLogLikelihoods(states, log_likelihoods);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        
+        ::om.outputConsole("\n*** Tree scores:\n");
+        ::om.outputConsole(boost::format("%12s %20s\n") % "tree" % "logLike");
+        for (unsigned i = 0; i < ntrees; i++)
+            ::om.outputConsole(boost::format("%12d %20.5f\n") % (i + 1) % log_likelihoods[i]);
+        ::om.outputConsole(boost::format("  trees scored: %d (%d workers)\n") % ntrees % batch.getNumWorkers());
+        ::om.outputConsole(boost::format("  total time: %.3f seconds\n") % elapsed.count());
+    }
+    
     inline void LoRaD::showMCMCInfo() {
         assert(_likelihoods.size() > 0 && _likelihoods[0]);
         ::om.outputConsole("\n*** MCMC analysis beginning...\n");
@@ -1628,52 +2269,72 @@ namespace lorad {
                 initChains();
                 
                 showBeagleInfo();
-                showMCMCInfo();
+                if (_check_backend)
+                    checkBackend();
+                if (_nbenchmark > 0)
+                    benchmarkLikelihood();
+                else if (_score_trees)
+                    scoreTrees();
+                else {
+                    showMCMCInfo();
 
 #if defined(SINGLE_CHAIN_POWER)
-                if (_gss_power < 1.0) {
-                    ::om.outputConsole(boost::str(boost::format("\n%12s %12s %12s %12s %12s %12s\n") % "iteration" % "m" % "logLike" % "logPrior" % "logRefDist" % "TL"));
-                }
-                else {
-                    ::om.outputConsole(boost::str(boost::format("\n%12s %12s %12s %12s %12s\n") % "iteration" % "m" % "logLike" % "logPrior" % "TL"));
-                }
+                    if (_gss_power < 1.0) {
+                        ::om.outputConsole(boost::str(boost::format("\n%12s %12s %12s %12s %12s %12s\n") % "iteration" % "m" % "logLike" % "logPrior" % "logRefDist" % "TL"));
+                    }
+                    else {
+                        ::om.outputConsole(boost::str(boost::format("\n%12s %12s %12s %12s %12s\n") % "iteration" % "m" % "logLike" % "logPrior" % "TL"));
+                    }
 #else
-                ::om.outputConsole(boost::str(boost::format("\n%12s %12s %12s %12s %12s\n") % "iteration" % "m" % "logLike" % "logPrior" % "TL"));
+                    ::om.outputConsole(boost::str(boost::format("\n%12s %12s %12s %12s %12s\n") % "iteration" % "m" % "logLike" % "logPrior" % "TL"));
 #endif
-                openParamAndTreeFiles();
-                sampleChain(0, _chains[0]);
+                    openParamAndTreeFiles();
+                    sampleChain(0, _chains[0]);
                 
-                // Burn-in the chains
-                startTuningChains();
-                for (unsigned iteration = 1; iteration <= _num_burnin_iter; ++iteration) {
-                    stepChains(iteration, false);
-                    swapChains();
-                }
-                stopTuningChains();
+                    // Burn-in the chains
+                    loadTuningCache();
+                    startTuningChains();
+                    if (_auto_burnin)
+                        startBurninMonitor();
+                    for (unsigned iteration = 1; iteration <= _num_burnin_iter; ++iteration) {
+                        if (_balance_weights && iteration == (_auto_burnin ? 1 : _num_burnin_iter/2 + 1))
+                            startWeightBalancing();
+                        stepChains(iteration, false);
+                        swapChains();
+                        if (_auto_burnin && monitorBurnin(iteration))
+                            break;
+                    }
+                    stopTuningChains();
 
-                _log_transformed_parameters.clear();
-                _sampled_loglikelihoods.clear();
-                _sampled_logpriors.clear();
+                    _log_transformed_parameters.clear();
+                    _sampled_loglikelihoods.clear();
+                    _sampled_logpriors.clear();
                 
-                // Sample the chains
-                for (unsigned iteration = 1; iteration <= _num_iter; ++iteration) {
-                    stepChains(iteration, true);
-                    swapChains();
-                }
-                showChainTuningInfo();
-                stopChains();
-                closeParamAndTreeFiles();
+                    // Sample the chains
+                    for (unsigned iteration = 1; iteration <= _num_iter; ++iteration) {
+                        stepChains(iteration, true);
+                        swapChains();
+                        if (_mcse_target > 0.0 && monitorMCSE(iteration))
+                            break;
+                    }
+                    showChainTuningInfo();
+                    showUpdaterWeights();
+                    showTopologyMoveInfo();
+                    showModelUploadInfo();
+                    stopChains();
+                    closeParamAndTreeFiles();
                 
-                // Create swap summary
-                swapSummary();
+                    // Create swap summary
+                    swapSummary();
                 
-                // Save reference distributions if requested
-                saveReferenceDistributions();
+                    // Save reference distributions if requested
+                    saveReferenceDistributions();
 
-                // Estimate the marginal likelihood if doing GSS or GHM
-                calcMarginalLikelihood();
+                    // Estimate the marginal likelihood if doing GSS or GHM
+                    calcMarginalLikelihood();
                 
-                _conditional_clade_store->summarize();
+                    _conditional_clade_store->summarize();
+                }
             }   // if (_treesummary) ... else
         }
         catch (XLorad & x) {
@@ -1740,6 +2401,19 @@ namespace lorad {
         std::cerr << boost::str(boost::format("%20.5f = log jacobian (everything)") % log_jacobian) << std::endl;
 #endif
         
+        // Keep the complete log-transformed parameter vector if the LoRaD MCSE is being monitored
+        if (_mcse_target > 0.0) {
+            std::vector<double> log_transformed;
+#if defined(HOLDER_ETAL_PRIOR)
+            // edgelens[0] is the (untransformed) tree length, which is redundant
+            log_transformed.assign(edgelens.begin() + 1, edgelens.end());
+#else
+            log_transformed.assign(edgelens.begin(), edgelens.end());
+#endif
+            log_transformed.insert(log_transformed.end(), params.begin(), params.end());
+            _lorad_monitor.addSample(log_transformed, logLike + logPrior + log_jacobian);
+        }
+
         v._iteration = iteration;
         v._kernel = Kernel(logLike, logPrior, log_jacobian, 0.0);
         v._param_vect = Eigen::Map<Eigen::VectorXd>(params.data(),_nparams);
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <Eigen/Dense>
+#include <boost/math/special_functions/gamma.hpp>
+#include "xlorad.hpp"
+
+namespace lorad {
+
+    // Keeps the log-transformed parameter vectors and log kernels sampled so far so that the
+    // LoRaD estimate of the marginal likelihood, and its Monte Carlo standard error (MCSE), can
+    // be calculated while the chain is running. Samples are standardized using the mean and
+    // covariance of all samples (both updated as samples are added, so that an estimate only
+    // needs one pass over the samples), and the MCSE is estimated by non-overlapping batch means: each
+    // batch of consecutive samples yields its own LoRaD estimate (using the samples of that batch
+    // closest to the mean) and the MCSE is the standard error of the mean of these estimates.
+    // The tree topology must be fixed so that all samples share the same parameters.
+    class LoRaDMonitor {
+
+        public:
+
+                                        LoRaDMonitor();
+                                        ~LoRaDMonitor();
+
+            void                        clear();
+            void                        addSample(const std::vector<double> & log_transformed, double log_kernel);
+            unsigned                    getNumSamples() const;
+            bool                        estimate(double coverage, unsigned nbatches, double & log_marginal_likelihood, double & mcse);
+
+            static const unsigned       _min_batch_size;
+
+        private:
+
+            void                        standardize();
+            double                      calcLogMarginalLikelihood(double coverage, unsigned begin, unsigned end);
+
+            unsigned                    _dim;
+            std::vector<double>         _samples;           // log-transformed parameter vectors, one after another
+            std::vector<double>         _log_kernels;       // log posterior kernel, including the Jacobian of the log transformation
+            std::vector<double>         _norms;             // of each standardized sample
+            std::vector<double>         _log_ratios;        // workspace
+            std::vector<unsigned>       _ndx;               // workspace
+            Eigen::VectorXd             _mean;              // of the samples
+            Eigen::MatrixXd             _sum_squares;       // sum of squared deviations from _mean
+            Eigen::VectorXd             _deviation;         // workspace
+            Eigen::VectorXd             _z;                 // workspace
+            double                      _log_det_sqrt_S;
+    };
+
+    inline LoRaDMonitor::LoRaDMonitor() {
+        clear();
+    }
+
+    inline LoRaDMonitor::~LoRaDMonitor() {
+    }
+
+    inline void LoRaDMonitor::clear() {
+        _dim = 0;
+        _samples.clear();
+        _log_kernels.clear();
+        _norms.clear();
+        _log_ratios.clear();
+        _ndx.clear();
+        _mean.resize(0);
+        _sum_squares.resize(0, 0);
+        _log_det_sqrt_S = 0.0;
+    }
+
+    inline void LoRaDMonitor::addSample(const std::vector<double> & log_transformed, double log_kernel) {
+        if (_dim == 0) {
+            _dim = (unsigned)log_transformed.size();
+            _mean.setZero(_dim);
+            _sum_squares.setZero(_dim, _dim);
+            _deviation.setZero(_dim);
+            _z.setZero(_dim);
+        }
+        if (log_transformed.size() != _dim)
+            throw XLorad("The number of parameters changed during sampling, so the LoRaD MCSE cannot be monitored");
+        _samples.insert(_samples.end(), log_transformed.begin(), log_transformed.end());
+        _log_kernels.push_back(log_kernel);
+
+        // Welford's online update of the mean and the sum of squared deviations
+        double n = (double)_log_kernels.size();
+        Eigen::Map<const Eigen::VectorXd> x(log_transformed.data(), _dim);
+        _deviation = x - _mean;
+        _mean += _deviation/n;
+        _sum_squares.noalias() += ((n - 1.0)/n)*_deviation*_deviation.transpose();
+    }
+
+    inline unsigned LoRaDMonitor::getNumSamples() const {
+        return (unsigned)_log_kernels.size();
+    }
+
+    inline void LoRaDMonitor::standardize() {
+        // Calculates the norm of every sample after standardization, z = S^{-1/2} (x - mean),
+        // one sample at a time
+        unsigned n = getNumSamples();
+        Eigen::Map<const Eigen::MatrixXd> X(_samples.data(), _dim, n);
+        Eigen::MatrixXd S = _sum_squares/(n - 1);
+
+        // Can use efficient eigensystem solver because S is positive definite symmetric
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> solver(S);
+        if (solver.info() != Eigen::Success)
+            throw XLorad("Error in the calculation of eigenvectors and eigenvalues of the variance-covariance matrix");
+        Eigen::VectorXd L = solver.eigenvalues().array().abs().sqrt();
+        if (L.minCoeff() <= 0.0)
+            throw XLorad("The variance-covariance matrix of the sampled parameters is singular, so the LoRaD MCSE cannot be monitored");
+        Eigen::MatrixXd V = solver.eigenvectors();
+        Eigen::MatrixXd inv_sqrt_S = V*L.cwiseInverse().asDiagonal()*V.transpose();
+        _log_det_sqrt_S = L.array().log().sum();
+
+        _norms.resize(n);
+        for (unsigned i = 0; i < n; i++) {
+            _deviation = X.col(i) - _mean;
+            _z.noalias() = inv_sqrt_S*_deviation;
+            _norms[i] = _z.norm();
+        }
+    }
+
+    inline double LoRaDMonitor::calcLogMarginalLikelihood(double coverage, unsigned begin, unsigned end) {
+        // Same calculation as LoRaD::loradMethod (without regression) using the samples in [begin,end).
+        // Only the set of retained samples matters, not their order, so they are selected
+        // rather than sorted.
+        unsigned nbatch = end - begin;
+        _ndx.resize(nbatch);
+        for (unsigned i = 0; i < nbatch; i++)
+            _ndx[i] = begin + i;
+
+        unsigned nretained = (unsigned)floor(coverage*nbatch);
+        assert(nretained > 1);
+        std::nth_element(_ndx.begin(), _ndx.begin() + (nretained - 1), _ndx.end(), [this](unsigned a, unsigned b){return _norms[a] < _norms[b];});
+        double norm_max = _norms[_ndx[nretained - 1]];
+
+        // Delta is the probability mass of the standard normal reference within the working space
+        double p = _dim;
+        double log_Delta = log(boost::math::gamma_p(p/2.0, norm_max*norm_max/2.0));
+        double log_mvnorm_constant = 0.5*p*log(2.*M_PI);
+
+        _log_ratios.resize(nretained);
+        double max_log_ratio = 0.0;
+        for (unsigned i = 0; i < nretained; i++) {
+            unsigned j = _ndx[i];
+            double log_kernel = _log_kernels[j] + _log_det_sqrt_S;
+            double log_reference = -0.5*_norms[j]*_norms[j] - log_mvnorm_constant;
+            _log_ratios[i] = log_reference - log_kernel;
+            if (i == 0 || _log_ratios[i] > max_log_ratio)
+                max_log_ratio = _log_ratios[i];
+        }
+        double sum_terms = 0.0;
+        for (double r : _log_ratios)
+            sum_terms += exp(r - max_log_ratio);
+        double log_sum_ratios = max_log_ratio + log(sum_terms);
+        return log_Delta - (log_sum_ratios - log(nbatch));
+    }
+
+    inline bool LoRaDMonitor::estimate(double coverage, unsigned nbatches, double & log_marginal_likelihood, double & mcse) {
+        // Returns false if there are not yet enough samples for each of the nbatches batches
+        unsigned n = getNumSamples();
+        assert(nbatches > 1);
+        unsigned batch_size = n/nbatches;
+        if (batch_size < _min_batch_size || n <= _dim)
+            return false;
+
+        standardize();
+        log_marginal_likelihood = calcLogMarginalLikelihood(coverage, 0, n);
+
+        std::vector<double> batch_estimates(nbatches);
+        double mean = 0.0;
+        for (unsigned b = 0; b < nbatches; b++) {
+            batch_estimates[b] = calcLogMarginalLikelihood(coverage, b*batch_size, (b + 1)*batch_size);
+            mean += batch_estimates[b];
+        }
+        mean /= nbatches;
+        double ss = 0.0;
+        for (double x : batch_estimates)
+            ss += (x - mean)*(x - mean);
+        mcse = sqrt(ss/(nbatches*(nbatches - 1)));
+        return true;
+    }
+
+}
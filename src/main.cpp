@@ -41,6 +41,8 @@
 
 #include <limits>
 #include <iostream>
+#include <cstdlib>
+#include <new>
 #include "lorad.hpp"
 
 using namespace lorad;
@@ -51,7 +53,24 @@ std::string  LoRaD::_program_name        = "lorad";
 unsigned     LoRaD::_major_version       = 1;
 unsigned     LoRaD::_minor_version       = 1;
 const double Node::_smallest_edge_length = 1.0e-12;
+const unsigned Node::_max_subset_bits = 64;
+const Node::subset_mask_t Node::_all_subsets = ~0ULL;
 const double Updater::_log_zero          = -std::numeric_limits<double>::max();
+const double ModelBlockUpdater::_initial_sd = 0.1;
+const double ModelBlockUpdater::_cov_ridge = 1.0e-6;
+const unsigned BurninMonitor::_nbatches = 10;
+const unsigned BurninMonitor::_nstable_required = 2;
+const unsigned BurninMonitor::_min_attempts = 20;
+const double BurninMonitor::_z_threshold = 3.0;
+const double BurninMonitor::_lambda_tolerance = 0.2;
+const unsigned LoRaDMonitor::_min_batch_size = 100;
+const unsigned WeightBalancer::_min_updates = 20;
+const double WeightBalancer::_min_share = 0.1;
+const unsigned WeightBalancer::_max_rounds = 500;
+const unsigned NativeEngine::_pattern_block = 64;
+const unsigned NativeEngine::_simd_level = NativeEngine::detectSimdLevel();
+const unsigned Likelihood::_min_shard_patterns = 500;
+std::vector< std::shared_ptr<NativeEngine::Instance> > NativeEngine::_instances;
 GeneticCode::genetic_code_definitions_t GeneticCode::_definitions = { // codon order is alphabetical: i.e. AAA, AAC, AAG, AAT, ACA, ..., TTT
     {"standard",             "KNKNTTTTRSRSIIMIQHQHPPPPRRRRLLLLEDEDAAAAGGGGVVVV*Y*YSSSS*CWCLFLF"},
     {"vertmito",             "KNKNTTTT*S*SMIMIQHQHPPPPRRRRLLLLEDEDAAAAGGGGVVVV*Y*YSSSSWCWCLFLF"},
@@ -74,6 +93,35 @@ GeneticCode::genetic_code_definitions_t GeneticCode::_definitions = { // codon o
 
 OutputManager om;
 
+std::atomic<unsigned long> AllocCounter::_count(0);
+
+#if defined(LORAD_COUNT_ALLOCS)
+// Replacements for the global allocation functions that count allocations so that
+// LoRaD can verify (if checkallocs = yes) that MCMC iterations do not allocate.
+// Only compiled into diagnostic builds (e.g. -DLORAD_COUNT_ALLOCS) because the
+// atomic increment would otherwise tax every allocation in production runs
+
+void * operator new(std::size_t size) {
+    AllocCounter::increment();
+    void * p = std::malloc(size == 0 ? 1 : size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void * operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void * p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void * p) noexcept {
+    std::free(p);
+}
+#endif
+
 int main(int argc, const char * argv[]) {
 
     LoRaD lorad;
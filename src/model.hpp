@@ -10,6 +10,7 @@
 #include "partition.hpp"
 #include "asrv.hpp"
 #include "libhmsbeagle/beagle.h"
+#include "backend.hpp"
 #include <boost/format.hpp>
 #include <boost/math/distributions/gamma.hpp>
 #include <Eigen/Dense>
@@ -71,6 +72,7 @@ namespace lorad {
 
             void                        setSubsetRelRates(const subset_relrate_vect_t & relrates, bool fixed);
             subset_relrate_vect_t &     getSubsetRelRates();
+            unsigned long               getSubsetRelRatesVersion() const;
             bool                        isFixedSubsetRelRates() const;
             double                      calcNormalizingConstantForSubsetRelRates() const;
 
@@ -152,11 +154,22 @@ namespace lorad {
             pinvar_params_t &           getPinvarParams();
 //            void                        setPinvarRefDistParams(std::vector<double> refdist_params);
 //            std::vector<double>         getPinvarRefDistParams();
+
+            std::vector<unsigned>       getStateFreqSubsets(QMatrix::SharedPtr q) const;
+            std::vector<unsigned>       getExchangeabilitySubsets(QMatrix::SharedPtr q) const;
+            std::vector<unsigned>       getOmegaSubsets(QMatrix::SharedPtr q) const;
+#if defined(HOLDER_ETAL_PRIOR)
+            std::vector<unsigned>       getShapeSubsets(ASRV::SharedPtr a) const;
+#else
+            std::vector<unsigned>       getRateVarSubsets(ASRV::SharedPtr a) const;
+#endif
+            std::vector<unsigned>       getPinvarSubsets(ASRV::SharedPtr a) const;
+            bool                        hasLinkedParameters() const;
         
-            int                         setBeagleEigenDecomposition(int beagle_instance, unsigned subset, unsigned instance_subset);
-            int                         setBeagleStateFrequencies(int beagle_instance, unsigned subset, unsigned instance_subset);
-            int                         setBeagleAmongSiteRateVariationRates(int beagle_instance, unsigned subset, unsigned instance_subset);
-            int                         setBeagleAmongSiteRateVariationProbs(int beagle_instance, unsigned subset, unsigned instance_subset);
+            int                         setBeagleEigenDecomposition(const Backend & backend, int beagle_instance, unsigned subset, unsigned instance_subset);
+            int                         setBeagleStateFrequencies(const Backend & backend, int beagle_instance, unsigned subset, unsigned instance_subset);
+            int                         setBeagleAmongSiteRateVariationRates(const Backend & backend, int beagle_instance, unsigned subset, unsigned instance_subset);
+            int                         setBeagleAmongSiteRateVariationProbs(const Backend & backend, int beagle_instance, unsigned subset, unsigned instance_subset);
 
             std::string                 paramNamesAsString(std::string sep, bool logscale) const;
             std::string                 paramValuesAsString(std::string sep, bool logscale, unsigned precision = 9) const;
@@ -188,6 +201,7 @@ namespace lorad {
 
             bool                        _subset_relrates_fixed;
             subset_relrate_vect_t       _subset_relrates;
+            unsigned long               _subset_relrates_version;
         
             state_freq_params_t         _state_freq_params;
             exchangeability_params_t    _exchangeability_params;
@@ -256,6 +270,7 @@ namespace lorad {
         _topo_prior_C = 1.0; 
         _subset_relrates_fixed = false;
         _subset_relrates.clear();
+        _subset_relrates_version = 1;
         _subset_sizes.clear();
         _subset_npatterns.clear();
         _subset_datatypes.clear();
@@ -662,6 +677,92 @@ namespace lorad {
         return _pinvar_params;
     }
     
+    // The functions below return the subsets that share the parameter of q or a (linked
+    // parameters share storage), and hence whose likelihood changes when it is updated
+
+    inline std::vector<unsigned> Model::getStateFreqSubsets(QMatrix::SharedPtr q) const {
+        std::vector<unsigned> subsets;
+        for (unsigned i = 0; i < _num_subsets; i++) {
+            if (_qmatrix[i]->getStateFreqs() == q->getStateFreqs())
+                subsets.push_back(i);
+        }
+        return subsets;
+    }
+    
+    inline std::vector<unsigned> Model::getExchangeabilitySubsets(QMatrix::SharedPtr q) const {
+        std::vector<unsigned> subsets;
+        for (unsigned i = 0; i < _num_subsets; i++) {
+            if (_subset_datatypes[i].isNucleotide() && _qmatrix[i]->getExchangeabilities() == q->getExchangeabilities())
+                subsets.push_back(i);
+        }
+        return subsets;
+    }
+    
+    inline std::vector<unsigned> Model::getOmegaSubsets(QMatrix::SharedPtr q) const {
+        std::vector<unsigned> subsets;
+        for (unsigned i = 0; i < _num_subsets; i++) {
+            if (_subset_datatypes[i].isCodon() && _qmatrix[i]->getOmegaSharedPtr() == q->getOmegaSharedPtr())
+                subsets.push_back(i);
+        }
+        return subsets;
+    }
+    
+#if defined(HOLDER_ETAL_PRIOR)
+    inline std::vector<unsigned> Model::getShapeSubsets(ASRV::SharedPtr a) const {
+        std::vector<unsigned> subsets;
+        for (unsigned i = 0; i < _num_subsets; i++) {
+            if (_asrv[i]->getShapeSharedPtr() == a->getShapeSharedPtr())
+                subsets.push_back(i);
+        }
+        return subsets;
+    }
+#else
+    inline std::vector<unsigned> Model::getRateVarSubsets(ASRV::SharedPtr a) const {
+        std::vector<unsigned> subsets;
+        for (unsigned i = 0; i < _num_subsets; i++) {
+            if (_asrv[i]->getRateVarSharedPtr() == a->getRateVarSharedPtr())
+                subsets.push_back(i);
+        }
+        return subsets;
+    }
+#endif
+    
+    inline std::vector<unsigned> Model::getPinvarSubsets(ASRV::SharedPtr a) const {
+        std::vector<unsigned> subsets;
+        for (unsigned i = 0; i < _num_subsets; i++) {
+            if (_asrv[i]->getPinvarSharedPtr() == a->getPinvarSharedPtr())
+                subsets.push_back(i);
+        }
+        return subsets;
+    }
+    
+    inline bool Model::hasLinkedParameters() const {
+        // True if any free parameter is shared by more than one subset (such a parameter
+        // appears once per subset in the vector produced by logTransformParameters)
+        for (auto q : _state_freq_params)
+            if (getStateFreqSubsets(q).size() > 1)
+                return true;
+        for (auto q : _exchangeability_params)
+            if (getExchangeabilitySubsets(q).size() > 1)
+                return true;
+        for (auto q : _omega_params)
+            if (getOmegaSubsets(q).size() > 1)
+                return true;
+#if defined(HOLDER_ETAL_PRIOR)
+        for (auto a : _shape_params)
+            if (getShapeSubsets(a).size() > 1)
+                return true;
+#else
+        for (auto a : _ratevar_params)
+            if (getRateVarSubsets(a).size() > 1)
+                return true;
+#endif
+        for (auto a : _pinvar_params)
+            if (getPinvarSubsets(a).size() > 1)
+                return true;
+        return false;
+    }
+    
 #if defined(RELRATE_DIRICHLET_PRIOR)
     // Relative rate parameters x must be normalized to sum to 1.0, e.g.
     //   x1 = 4, x2 = 5, x3 = 1
@@ -706,6 +807,7 @@ namespace lorad {
         _subset_sizes.resize(_num_subsets);
         std::copy(nsites_vect.begin(), nsites_vect.end(), _subset_sizes.begin());
         _num_sites = std::accumulate(_subset_sizes.begin(), _subset_sizes.end(), 0);
+        ++_subset_relrates_version;
     }
 
     inline void Model::setSubsetNumPatterns(const subset_sizes_t npatterns_vect) {
@@ -731,6 +833,7 @@ namespace lorad {
 #else
 		_subset_relrates.assign(_num_subsets, 1.0);
 #endif
+        ++_subset_relrates_version;
         
         for (unsigned s = 0; s < _num_subsets; s++) {
             _asrv[s].reset(new ASRV());
@@ -856,12 +959,12 @@ namespace lorad {
             q->setActive(false);
     }
 
-    inline int Model::setBeagleEigenDecomposition(int beagle_instance, unsigned subset, unsigned instance_subset) {
+    inline int Model::setBeagleEigenDecomposition(const Backend & backend, int beagle_instance, unsigned subset, unsigned instance_subset) {
         assert(subset < _qmatrix.size());
         const double * pevec = _qmatrix[subset]->getEigenvectors();
         const double * pivec = _qmatrix[subset]->getInverseEigenvectors();
         const double * pival = _qmatrix[subset]->getEigenvalues();
-        int code = beagleSetEigenDecomposition(
+        int code = backend.setEigenDecomposition(
             beagle_instance,    // Instance number (input)
             instance_subset,    // Index of eigen-decomposition buffer (input)
             pevec,              // Flattened matrix (stateCount x stateCount) of eigen-vectors (input)
@@ -871,10 +974,10 @@ namespace lorad {
         return code;
     }
     
-    inline int Model::setBeagleStateFrequencies(int beagle_instance, unsigned subset, unsigned instance_subset) {
+    inline int Model::setBeagleStateFrequencies(const Backend & backend, int beagle_instance, unsigned subset, unsigned instance_subset) {
         assert(subset < _qmatrix.size());
         const double * pfreq = _qmatrix[subset]->getStateFreqs();
-        int code = beagleSetStateFrequencies(
+        int code = backend.setStateFrequencies(
              beagle_instance,   // Instance number (input)
              instance_subset,   // Index of state frequencies buffer (input)
              pfreq);            // State frequencies array (stateCount) (input)
@@ -882,10 +985,10 @@ namespace lorad {
         return code;
     }
     
-    inline int Model::setBeagleAmongSiteRateVariationRates(int beagle_instance, unsigned subset, unsigned instance_subset) {
+    inline int Model::setBeagleAmongSiteRateVariationRates(const Backend & backend, int beagle_instance, unsigned subset, unsigned instance_subset) {
         assert(subset < _asrv.size());
         const double * prates = _asrv[subset]->getRates();
-        int code = beagleSetCategoryRatesWithIndex(
+        int code = backend.setCategoryRatesWithIndex(
             beagle_instance,    // Instance number (input)
             instance_subset,    // Index of category rates buffer (input)
             prates);            // Array containing categoryCount rate scalers (input)
@@ -893,10 +996,10 @@ namespace lorad {
         return code;
     }
     
-    inline int Model::setBeagleAmongSiteRateVariationProbs(int beagle_instance, unsigned subset, unsigned instance_subset) {
+    inline int Model::setBeagleAmongSiteRateVariationProbs(const Backend & backend, int beagle_instance, unsigned subset, unsigned instance_subset) {
         assert(subset < _asrv.size());
         const double * pprobs = _asrv[subset]->getProbs();
-        int code = beagleSetCategoryWeights(
+        int code = backend.setCategoryWeights(
             beagle_instance,    // Instance number (input)
             instance_subset,    // Index of category weights buffer (input)
             pprobs);            // Category weights array (categoryCount) (input)
@@ -1166,6 +1269,7 @@ namespace lorad {
         double normalizing_constant = calcNormalizingConstantForSubsetRelRates();
         std::transform(_subset_relrates.begin(), _subset_relrates.end(), _subset_relrates.begin(), [normalizing_constant](double v){return v/normalizing_constant;});
         _subset_relrates_fixed = fixed;
+        ++_subset_relrates_version;
     }
 #else
     // This function is used to set _subset_relrates using values supplied by the user in the conf file
@@ -1179,12 +1283,20 @@ namespace lorad {
         double normalizing_constant = calcNormalizingConstantForSubsetRelRates();
         std::transform(_subset_relrates.begin(), _subset_relrates.end(), _subset_relrates.begin(), [normalizing_constant](double v){return v/normalizing_constant;});
         _subset_relrates_fixed = fixed;
+        ++_subset_relrates_version;
     }
 #endif
 
     inline Model::subset_relrate_vect_t & Model::getSubsetRelRates() {
         return _subset_relrates;
     }
+
+    inline unsigned long Model::getSubsetRelRatesVersion() const {
+        // Incremented every time _subset_relrates (or the subset sizes used to
+        // normalize them) are changed, allowing Likelihood to avoid recomputing
+        // the normalizing constant when the relative rates have not changed
+        return _subset_relrates_version;
+    }
     inline bool Model::isFixedSubsetRelRates() const {
         return _subset_relrates_fixed;
     }
@@ -1484,7 +1596,7 @@ namespace lorad {
         unsigned k;
         unsigned cursor = first;
         double log_jacobian = 0.0;
-        if (_num_subsets > 1) {
+        if (_num_subsets > 1 && !isFixedSubsetRelRates()) {
             assert(param_vect.rows() >= cursor + _num_subsets - 1);
 
             // Copy log-ratio-transformed subset relative rates to temporary vector
@@ -1515,6 +1627,7 @@ namespace lorad {
             
             // Copy detransformed subset relative rates to model
             std::copy(tmp.begin(), tmp.end(), _subset_relrates.begin());
+            ++_subset_relrates_version;
             cursor += _num_subsets - 1;
         }
         for (k = 0; k < _num_subsets; k++) {
@@ -1630,6 +1743,7 @@ namespace lorad {
         assert(_sampled_subset_relrates.size() > i);
         assert(_sampled_subset_relrates[i].size() > 0);
         _subset_relrates.assign(_sampled_subset_relrates[i].begin(), _sampled_subset_relrates[i].end());
+        ++_subset_relrates_version;
     }
 
     inline void Model::setSampledExchangeabilities(unsigned subset, unsigned i) {
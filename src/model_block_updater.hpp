@@ -0,0 +1,227 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include "model.hpp"
+#include "updater.hpp"
+
+namespace lorad {
+
+    // Proposes new values for all free model parameters at once (adaptive Metropolis of
+    // Haario et al. 2001). The parameters are moved in the log-transformed space of
+    // Model::logTransformParameters by adding _lambda*L*z, where z is a vector of standard
+    // normal deviates and L L' is the covariance of the points visited so far. The covariance
+    // is only learned while tuning; until enough points have been seen, L is a multiple of
+    // the identity. The prior (and reference distribution) is the sum of those calculated by
+    // the updaters of the individual parameters.
+    class ModelBlockUpdater : public Updater {
+
+        public:
+
+            typedef std::shared_ptr< ModelBlockUpdater > SharedPtr;
+
+                                        ModelBlockUpdater(Model::SharedPtr model, const std::vector<Updater::SharedPtr> & parameter_updaters);
+                                        ~ModelBlockUpdater();
+
+            virtual void                clear();
+            virtual double              calcLogPrior();
+            virtual double              calcLogRefDist();
+            virtual void                swapLambda(Updater & other);
+            virtual void                getAdaptation(std::vector<double> & state) const;
+            virtual bool                setAdaptation(const std::vector<double> & state);
+
+        protected:
+
+            virtual void                reserveWorkspace();
+            virtual void                proposeNewState();
+            virtual void                revert();
+
+        private:
+
+            void                        recordPoint();
+            bool                        factorCovariance();
+
+            Model::SharedPtr            _model;
+            std::vector<Updater::SharedPtr> _parameter_updaters;
+            unsigned                    _dim;
+            unsigned                    _min_points;            // points needed before the learned covariance is used
+            unsigned                    _num_points;
+            bool                        _adapted;               // true once L comes from the learned covariance
+            std::vector<double>         _log_transformed;
+            Eigen::VectorXd             _prev_point;
+            Eigen::VectorXd             _curr_point;
+            Eigen::VectorXd             _mean;
+            Eigen::VectorXd             _deviates;
+            Eigen::MatrixXd             _sum_squares;           // sum of squared deviations from _mean
+            Eigen::MatrixXd             _cov;
+            Eigen::LLT<Eigen::MatrixXd> _cholesky;
+
+            static const double         _initial_sd;            // proposal standard deviation of each parameter before adaptation
+            static const double         _cov_ridge;             // added to the diagonal of the learned covariance
+    };
+
+    inline ModelBlockUpdater::ModelBlockUpdater(Model::SharedPtr model, const std::vector<Updater::SharedPtr> & parameter_updaters) {
+        clear();
+        _name = "Model Parameters (Block)";
+        assert(model);
+        _model = model;
+        _parameter_updaters = parameter_updaters;
+    }
+
+    inline ModelBlockUpdater::~ModelBlockUpdater() {
+        _model.reset();
+    }
+
+    inline void ModelBlockUpdater::clear() {
+        Updater::clear();
+        _model = nullptr;
+        _parameter_updaters.clear();
+        _dim = 0;
+        _min_points = 0;
+        _num_points = 0;
+        _adapted = false;
+        _log_transformed.clear();
+        reset();
+    }
+
+    inline void ModelBlockUpdater::reserveWorkspace() {
+        _log_transformed.clear();
+        _model->logTransformParameters(_log_transformed);
+        if (_dim == (unsigned)_log_transformed.size())
+            return;
+        _dim = (unsigned)_log_transformed.size();
+        _min_points = std::max(10*_dim, 100U);
+        _num_points = 0;
+        _adapted = false;
+        _prev_point.setZero(_dim);
+        _curr_point.setZero(_dim);
+        _mean.setZero(_dim);
+        _deviates.setZero(_dim);
+        _sum_squares.setZero(_dim, _dim);
+        _cov.setZero(_dim, _dim);
+        _cholesky = Eigen::LLT<Eigen::MatrixXd>(_dim);
+    }
+
+    inline double ModelBlockUpdater::calcLogPrior() {
+        double log_prior = 0.0;
+        for (auto & u : _parameter_updaters)
+            log_prior += u->calcLogPrior();
+        return log_prior;
+    }
+
+    inline double ModelBlockUpdater::calcLogRefDist() {
+        double log_refdist = 0.0;
+        for (auto & u : _parameter_updaters)
+            log_refdist += u->calcLogRefDist();
+        return log_refdist;
+    }
+
+    inline void ModelBlockUpdater::swapLambda(Updater & other) {
+        // _lambda means something different before and after adaptation (it multiplies
+        // _initial_sd before and L after), so the learned covariance goes along with it
+        ModelBlockUpdater & b = dynamic_cast<ModelBlockUpdater &>(other);
+        Updater::swapLambda(other);
+        assert(b._dim == _dim);
+        std::swap(_num_points, b._num_points);
+        std::swap(_adapted, b._adapted);
+        std::swap(_mean, b._mean);
+        std::swap(_sum_squares, b._sum_squares);
+        std::swap(_cov, b._cov);
+        std::swap(_cholesky, b._cholesky);
+    }
+
+    inline void ModelBlockUpdater::getAdaptation(std::vector<double> & state) const {
+        // The number of points, their mean and the sum of squared deviations (from which the
+        // covariance and L are recomputed), saved even before adaptation so that a cached
+        // _lambda is always accompanied by the state that says what it multiplies
+        state.clear();
+        state.reserve(1 + _dim + _dim*_dim);
+        state.push_back((double)_num_points);
+        for (unsigned i = 0; i < _dim; i++)
+            state.push_back(_mean(i));
+        for (unsigned j = 0; j < _dim; j++) {
+            for (unsigned i = 0; i < _dim; i++)
+                state.push_back(_sum_squares(i, j));
+        }
+    }
+
+    inline bool ModelBlockUpdater::setAdaptation(const std::vector<double> & state) {
+        // Must be called after reserveWorkspace; leaves _lambda alone, since it is set separately
+        if (state.size() != 1 + _dim + _dim*_dim)
+            return false;
+        _num_points = (unsigned)state[0];
+        unsigned k = 1;
+        for (unsigned i = 0; i < _dim; i++)
+            _mean(i) = state[k++];
+        for (unsigned j = 0; j < _dim; j++) {
+            for (unsigned i = 0; i < _dim; i++)
+                _sum_squares(i, j) = state[k++];
+        }
+        _adapted = (_num_points >= _min_points && factorCovariance());
+        return true;
+    }
+
+    inline bool ModelBlockUpdater::factorCovariance() {
+        // Returns false if the learned covariance could not be factored
+        _cov = _sum_squares/(_num_points - 1);
+        _cov.diagonal().array() += _cov_ridge;
+        _cholesky.compute(_cov);
+        return _cholesky.info() == Eigen::Success;
+    }
+
+    inline void ModelBlockUpdater::recordPoint() {
+        // Welford's online update of the mean and covariance of the points visited
+        _num_points++;
+        _deviates = _prev_point - _mean;
+        _mean += _deviates/_num_points;
+        _sum_squares += _deviates*(_prev_point - _mean).transpose();
+
+        if (_num_points >= _min_points) {
+            if (!factorCovariance())
+                _adapted = false;
+            else if (!_adapted) {
+                // Optimal scaling for a random walk on a Gaussian target (Gelman et al. 1996)
+                _lambda = 2.38/sqrt((double)_dim);
+                _adapted = true;
+            }
+        }
+    }
+
+    inline void ModelBlockUpdater::proposeNewState() {
+        // logTransformParameters returns the log of the Jacobian of the transformation back
+        // to the untransformed parameters, which is needed because the proposal is symmetric
+        // in the transformed space but the prior is a density of the untransformed parameters
+        _log_transformed.clear();
+        double prev_log_jacobian = _model->logTransformParameters(_log_transformed);
+        assert(_log_transformed.size() == _dim);
+        for (unsigned i = 0; i < _dim; i++)
+            _prev_point(i) = _log_transformed[i];
+
+        if (_tuning)
+            recordPoint();
+
+        for (unsigned i = 0; i < _dim; i++)
+            _deviates(i) = _lot->normal();
+        if (_adapted) {
+            _curr_point.noalias() = _cholesky.matrixL()*_deviates;
+            _curr_point = _prev_point + _lambda*_curr_point;
+        }
+        else
+            _curr_point = _prev_point + (_lambda*_initial_sd)*_deviates;
+        _model->setParametersFromLogTransformed(_curr_point, 0, _dim);
+
+        _log_transformed.clear();
+        double log_jacobian = _model->logTransformParameters(_log_transformed);
+        _log_hastings_ratio = 0.0;
+        _log_jacobian = log_jacobian - prev_log_jacobian;
+
+        // Every subset is affected by some parameter
+        _tree_manipulator->selectAllPartials();
+        _tree_manipulator->selectAllTMatrices();
+    }
+
+    inline void ModelBlockUpdater::revert() {
+        _curr_point = _prev_point;
+        _model->setParametersFromLogTransformed(_curr_point, 0, _dim);
+    }
+
+}
@@ -0,0 +1,1318 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <algorithm>
+#include <cassert>
+#include "libhmsbeagle/beagle.h"
+
+// The vector versions of matVec and matMatTile are compiled for AVX2 or AVX-512 using function
+// target attributes, so the rest of the executable (including Eigen, Boost and the beagle backend)
+// is built for the baseline instruction set and runs on any x86-64 CPU. The kernels that call them
+// are compiled for each instruction set by flattening them into per-level entry points (e.g.
+// updatePartialsAVX2), and the level used by an instance is chosen at run time from the
+// instruction sets the CPU supports (see NativeEngine::detectSimdLevel)
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#   include <immintrin.h>
+#   define NATIVE_SIMD_DISPATCH
+#   define NATIVE_TARGET_AVX2       __attribute__((target("avx2,fma")))
+#   define NATIVE_TARGET_AVX512     __attribute__((target("avx512f")))
+#   define NATIVE_FLATTEN           __attribute__((flatten))
+#endif
+
+namespace lorad {
+
+    // A CPU implementation of the subset of the BeagleLib API used by Likelihood and Model.
+    // Every function has the signature and return codes of the BeagleLib function of the same
+    // name (without the "beagle" prefix), so the two can be swapped through a Backend table.
+    // Only double precision, manual scaling and log scalers are supported.
+    //
+    // Partials are stored pattern-major (all rate categories of a pattern are adjacent) and the
+    // kernels process patterns in blocks, visiting every rate category for a block before moving
+    // on, so that one category's transition matrix stays in cache while it is applied to the block.
+    class NativeEngine {
+        public:
+            enum SimdLevel {
+                SIMD_NONE   = 0,
+                SIMD_AVX2   = 1,    // AVX2 with FMA, 4 doubles per vector
+                SIMD_AVX512 = 2     // AVX-512F, 8 doubles per vector
+            };
+
+            static const char *         getVersion();
+            static std::string          describeVectorization();
+            static unsigned             detectSimdLevel();
+
+            static int                  createInstance(int tipCount, int partialsBufferCount, int compactBufferCount, int stateCount, int patternCount, int eigenBufferCount, int matrixBufferCount, int categoryCount, int scaleBufferCount, int * resourceList, int resourceCount, long preferenceFlags, long requirementFlags, BeagleInstanceDetails * returnInfo);
+            static int                  finalizeInstance(int instance);
+
+            static int                  setTipStates(int instance, int tipIndex, const int * inStates);
+            static int                  setTipPartials(int instance, int tipIndex, const double * inPartials);
+            static int                  setPatternWeights(int instance, const double * inPatternWeights);
+            static int                  setPatternPartitions(int instance, int partitionCount, const int * inPatternPartitions);
+
+            static int                  setEigenDecomposition(int instance, int eigenIndex, const double * inEigenVectors, const double * inInverseEigenVectors, const double * inEigenValues);
+            static int                  setStateFrequencies(int instance, int stateFrequenciesIndex, const double * inStateFrequencies);
+            static int                  setCategoryWeights(int instance, int categoryWeightsIndex, const double * inCategoryWeights);
+            static int                  setCategoryRatesWithIndex(int instance, int categoryRatesIndex, const double * inCategoryRates);
+
+            static int                  setTransitionMatrix(int instance, int matrixIndex, const double * inMatrix, double paddedValue);
+            static int                  updateTransitionMatrices(int instance, int eigenIndex, const int * probabilityIndices, const int * firstDerivativeIndices, const int * secondDerivativeIndices, const double * edgeLengths, int count);
+            static int                  updateTransitionMatricesWithMultipleModels(int instance, const int * eigenIndices, const int * categoryRateIndices, const int * probabilityIndices, const int * firstDerivativeIndices, const int * secondDerivativeIndices, const double * edgeLengths, int count);
+
+            static int                  updatePartials(const int instance, const BeagleOperation * operations, int operationCount, int cumulativeScaleIndex);
+            static int                  updatePartialsByPartition(const int instance, const BeagleOperationByPartition * operations, int operationCount);
+
+            static int                  accumulateScaleFactors(int instance, const int * scaleIndices, int count, int cumulativeScaleIndex);
+            static int                  accumulateScaleFactorsByPartition(int instance, const int * scaleIndices, int count, int cumulativeScaleIndex, int partitionIndex);
+            static int                  removeScaleFactors(int instance, const int * scaleIndices, int count, int cumulativeScaleIndex);
+            static int                  removeScaleFactorsByPartition(int instance, const int * scaleIndices, int count, int cumulativeScaleIndex, int partitionIndex);
+            static int                  resetScaleFactors(int instance, int cumulativeScaleIndex);
+            static int                  resetScaleFactorsByPartition(int instance, int cumulativeScaleIndex, int partitionIndex);
+
+            static int                  calculateEdgeLogLikelihoods(int instance, const int * parentBufferIndices, const int * childBufferIndices, const int * probabilityIndices, const int * firstDerivativeIndices, const int * secondDerivativeIndices, const int * categoryWeightsIndices, const int * stateFrequenciesIndices, const int * cumulativeScaleIndices, int count, double * outSumLogLikelihood, double * outSumFirstDerivative, double * outSumSecondDerivative);
+            static int                  calculateEdgeLogLikelihoodsByPartition(int instance, const int * parentBufferIndices, const int * childBufferIndices, const int * probabilityIndices, const int * firstDerivativeIndices, const int * secondDerivativeIndices, const int * categoryWeightsIndices, const int * stateFrequenciesIndices, const int * cumulativeScaleIndices, const int * partitionIndices, int partitionCount, int count, double * outSumLogLikelihoodByPartition, double * outSumLogLikelihood, double * outSumFirstDerivativeByPartition, double * outSumFirstDerivative, double * outSumSecondDerivativeByPartition, double * outSumSecondDerivative);
+            static int                  getSiteLogLikelihoods(int instance, double * outLogLikelihoods);
+            static int                  getSiteDerivatives(int instance, double * outFirstDerivatives, double * outSecondDerivatives);
+
+        private:
+
+            struct Instance {
+                unsigned                                ntips;
+                unsigned                                nstates;
+                unsigned                                simd_level;     // SimdLevel of the kernels used for this instance
+                unsigned                                npadded;        // nstates rounded up to a multiple of simdWidth(simd_level)
+                unsigned                                npatterns;
+                unsigned                                ncateg;
+                std::vector< std::vector<int> >         tip_states;     // compact tips (empty for tips stored as partials)
+                std::vector< std::vector<double> >      partials;       // [pattern][category][state], states padded
+                std::vector< std::vector<double> >      matrices;       // [category][to state][from state], columns padded
+                std::vector< std::vector<double> >      eigenvectors;
+                std::vector< std::vector<double> >      inverse_eigenvectors;
+                std::vector< std::vector<double> >      eigenvalues;
+                std::vector< std::vector<double> >      state_freqs;
+                std::vector< std::vector<double> >      category_weights;
+                std::vector< std::vector<double> >      category_rates;
+                std::vector< std::vector<double> >      scalers;        // log scale factor for each pattern
+                std::vector<double>                     pattern_weights;
+                std::vector< std::vector<unsigned> >    partition_patterns;
+                std::vector<unsigned>                   all_patterns;
+                std::vector<double>                     site_log_likelihoods;
+                std::vector<double>                     site_first_derivatives;     // of site log-likelihoods, from the last edge derivatives
+                std::vector<double>                     site_second_derivatives;
+                std::vector<double>                     ones;           // child contribution of a missing state
+                std::vector<double>                     work;           // scratch space for kernels
+            };
+
+            static Instance *           getInstance(int instance);
+            static bool                 validIndex(int index, std::size_t n);
+
+            static unsigned             simdWidth(unsigned level);
+
+            template <unsigned S, unsigned L>
+            static void                 matVec(const double * m, const double * v, double * out, unsigned ns, unsigned np);
+            template <unsigned S>
+            static void                 matVecScalar(const double * m, const double * v, double * out, unsigned ns, unsigned np);
+
+            template <unsigned S, unsigned L>
+            static void                 matMatTile(const double * m, const double * const * v, double * out, unsigned ns, unsigned np);
+            template <unsigned S>
+            static void                 matMatTileScalar(const double * m, const double * const * v, double * out, unsigned ns, unsigned np);
+
+#if defined(NATIVE_SIMD_DISPATCH)
+            template <unsigned S>
+            NATIVE_TARGET_AVX2 static void      matVecAVX2(const double * m, const double * v, double * out, unsigned ns, unsigned np);
+            template <unsigned S>
+            NATIVE_TARGET_AVX512 static void    matVecAVX512(const double * m, const double * v, double * out, unsigned ns, unsigned np);
+            template <unsigned S>
+            NATIVE_TARGET_AVX2 static void      matMatTileAVX2(const double * m, const double * const * v, double * out, unsigned ns, unsigned np);
+            template <unsigned S>
+            NATIVE_TARGET_AVX512 static void    matMatTileAVX512(const double * m, const double * const * v, double * out, unsigned ns, unsigned np);
+#endif
+
+            template <unsigned S>
+            static void                 computeTransitionMatrix(Instance & inst, unsigned eigen, unsigned rates, unsigned matrix, double edgelen, unsigned order);
+
+            template <unsigned S, unsigned L>
+            static void                 updatePartialsKernel(Instance & inst, const int * op, const std::vector<unsigned> & patterns);
+
+            template <unsigned S, unsigned L>
+            static void                 updateCodonPartialsKernel(Instance & inst, const int * op, const std::vector<unsigned> & patterns);
+
+            template <unsigned S, unsigned L>
+            static double               edgeLogLikelihoodKernel(Instance & inst, int parent, int child, int matrix, int weights, int freqs, int scaler, const std::vector<unsigned> & patterns);
+
+            template <unsigned S, unsigned L>
+            static void                 edgeDerivativesKernel(Instance & inst, int parent, int child, const int * matrices, int weights, int freqs, const std::vector<unsigned> & patterns, double & d1, double & d2);
+
+            template <unsigned L>
+            static void                 updatePartialsForLevel(Instance & inst, const int * op, const std::vector<unsigned> & patterns);
+            template <unsigned L>
+            static double               edgeLogLikelihoodForLevel(Instance & inst, int parent, int child, int matrix, int weights, int freqs, int scaler, const std::vector<unsigned> & patterns);
+            template <unsigned L>
+            static void                 edgeDerivativesForLevel(Instance & inst, int parent, int child, const int * matrices, int weights, int freqs, const std::vector<unsigned> & patterns, double & d1, double & d2);
+
+#if defined(NATIVE_SIMD_DISPATCH)
+            NATIVE_TARGET_AVX2 NATIVE_FLATTEN static void       updatePartialsAVX2(Instance & inst, const int * op, const std::vector<unsigned> & patterns);
+            NATIVE_TARGET_AVX512 NATIVE_FLATTEN static void     updatePartialsAVX512(Instance & inst, const int * op, const std::vector<unsigned> & patterns);
+            NATIVE_TARGET_AVX2 NATIVE_FLATTEN static double     edgeLogLikelihoodAVX2(Instance & inst, int parent, int child, int matrix, int weights, int freqs, int scaler, const std::vector<unsigned> & patterns);
+            NATIVE_TARGET_AVX512 NATIVE_FLATTEN static double   edgeLogLikelihoodAVX512(Instance & inst, int parent, int child, int matrix, int weights, int freqs, int scaler, const std::vector<unsigned> & patterns);
+            NATIVE_TARGET_AVX2 NATIVE_FLATTEN static void       edgeDerivativesAVX2(Instance & inst, int parent, int child, const int * matrices, int weights, int freqs, const std::vector<unsigned> & patterns, double & d1, double & d2);
+            NATIVE_TARGET_AVX512 NATIVE_FLATTEN static void     edgeDerivativesAVX512(Instance & inst, int parent, int child, const int * matrices, int weights, int freqs, const std::vector<unsigned> & patterns, double & d1, double & d2);
+#endif
+
+            static void                 rescaleBlock(Instance & inst, const int * op, const std::vector<unsigned> & patterns, unsigned b, unsigned e);
+            static int                  checkOperation(Instance & inst, const int * op);
+            static int                  addScaleFactors(int instance, const int * scaleIndices, int count, int cumulativeScaleIndex, int partitionIndex, double sign);
+            static int                  doTransitionMatrix(Instance & inst, int eigen, int rates, int matrix, double edgelen, unsigned order);
+            static int                  doTransitionMatrices(Instance & inst, int eigen, int rates, int matrix, int first, int second, double edgelen);
+            static int                  doOperation(Instance & inst, const int * op, const std::vector<unsigned> & patterns);
+            static int                  doEdgeLogLikelihood(Instance & inst, int parent, int child, int matrix, int weights, int freqs, int scaler, const std::vector<unsigned> & patterns, double & lnL);
+            static int                  doEdgeDerivatives(Instance & inst, int parent, int child, int matrix, int first, int second, int weights, int freqs, const std::vector<unsigned> & patterns, double & d1, double & d2);
+
+            static const unsigned       _pattern_block;
+            static const unsigned       _simd_level;        // highest SimdLevel the CPU supports, from detectSimdLevel
+            static const unsigned       _codon_tile = 4;    // matMatTile is written for exactly 4 vectors
+            static std::vector< std::shared_ptr<Instance> > _instances;
+    };
+
+    inline const char * NativeEngine::getVersion() {
+        return "native";
+    }
+
+    inline std::string NativeEngine::describeVectorization() {
+        switch (_simd_level) {
+            case SIMD_AVX512:
+                return "AVX-512 (AVX2 for fewer than 8 states)";
+            case SIMD_AVX2:
+                return "AVX2";
+            default:
+                return "none";
+        }
+    }
+
+    inline unsigned NativeEngine::detectSimdLevel() {
+        // Only used to initialize _simd_level. The AVX-512 kernels use AVX-512F instructions only
+#if defined(NATIVE_SIMD_DISPATCH)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return SIMD_AVX512;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return SIMD_AVX2;
+#endif
+        return SIMD_NONE;
+    }
+
+    inline unsigned NativeEngine::simdWidth(unsigned level) {
+        // Number of doubles processed per vector instruction by the kernels of a SimdLevel. Each
+        // column of a transition matrix and each category of a partials vector is padded to a
+        // multiple of this, so that the kernels never need a scalar remainder loop
+        switch (level) {
+            case SIMD_AVX512:
+                return 8;
+            case SIMD_AVX2:
+                return 4;
+            default:
+                return 1;
+        }
+    }
+
+    inline NativeEngine::Instance * NativeEngine::getInstance(int instance) {
+        if (instance < 0 || instance >= (int)_instances.size())
+            return 0;
+        return _instances[instance].get();
+    }
+
+    inline bool NativeEngine::validIndex(int index, std::size_t n) {
+        return index >= 0 && index < (int)n;
+    }
+
+    inline int NativeEngine::createInstance(int tipCount, int partialsBufferCount, int compactBufferCount, int stateCount, int patternCount, int eigenBufferCount, int matrixBufferCount, int categoryCount, int scaleBufferCount, int * resourceList, int resourceCount, long preferenceFlags, long requirementFlags, BeagleInstanceDetails * returnInfo) {
+        if ((requirementFlags & BEAGLE_FLAG_PRECISION_SINGLE) || (requirementFlags & BEAGLE_FLAG_PROCESSOR_GPU))
+            return BEAGLE_ERROR_NO_IMPLEMENTATION;
+        
+        // The native engine is a single CPU resource, numbered 0 like BeagleLib's CPU resource, so
+        // a resource list must include 0. The kernels are chosen from the CPU and the number of
+        // states (see detectSimdLevel), so preferences (e.g. for single precision or a particular
+        // vectorization) cannot change them
+        (void)preferenceFlags;
+        if (resourceList && resourceCount > 0 && std::find(resourceList, resourceList + resourceCount, 0) == resourceList + resourceCount)
+            return BEAGLE_ERROR_NO_RESOURCE;
+        if (tipCount < 1 || stateCount < 1 || patternCount < 1 || categoryCount < 1 || eigenBufferCount < 1)
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+
+        std::shared_ptr<Instance> p = std::make_shared<Instance>();
+        Instance & inst = *p;
+        inst.ntips     = (unsigned)tipCount;
+        inst.nstates   = (unsigned)stateCount;
+        inst.simd_level = _simd_level;
+        if (inst.simd_level == SIMD_AVX512 && inst.nstates < 8)
+            inst.simd_level = SIMD_AVX2;    // padding 4 states to 8 would double the work
+        const unsigned w = simdWidth(inst.simd_level);
+        inst.npadded   = (inst.nstates + w - 1)/w*w;
+        inst.npatterns = (unsigned)patternCount;
+        inst.ncateg    = (unsigned)categoryCount;
+
+        // Buffer indices cover both compact tips and partials, as in BeagleLib
+        unsigned nbuffers = (unsigned)(partialsBufferCount + compactBufferCount);
+        unsigned partials_size = inst.npatterns*inst.ncateg*inst.npadded;
+        inst.tip_states.resize(nbuffers);
+        inst.partials.resize(nbuffers);
+        for (unsigned i = (unsigned)compactBufferCount; i < nbuffers; i++)
+            inst.partials[i].assign(partials_size, 0.0);
+
+        inst.matrices.assign(matrixBufferCount, std::vector<double>(inst.ncateg*inst.nstates*inst.npadded, 0.0));
+        inst.eigenvectors.assign(eigenBufferCount, std::vector<double>(inst.nstates*inst.nstates, 0.0));
+        inst.inverse_eigenvectors.assign(eigenBufferCount, std::vector<double>(inst.nstates*inst.nstates, 0.0));
+        inst.eigenvalues.assign(eigenBufferCount, std::vector<double>(inst.nstates, 0.0));
+        inst.state_freqs.assign(eigenBufferCount, std::vector<double>(inst.npadded, 0.0));
+        inst.category_weights.assign(eigenBufferCount, std::vector<double>(inst.ncateg, 1.0/inst.ncateg));
+        inst.category_rates.assign(eigenBufferCount, std::vector<double>(inst.ncateg, 1.0));
+        inst.scalers.assign(scaleBufferCount, std::vector<double>(inst.npatterns, 0.0));
+        inst.pattern_weights.assign(inst.npatterns, 1.0);
+        inst.all_patterns.resize(inst.npatterns);
+        for (unsigned i = 0; i < inst.npatterns; i++)
+            inst.all_patterns[i] = i;
+        inst.partition_patterns.assign(1, inst.all_patterns);
+        inst.site_log_likelihoods.assign(inst.npatterns, 0.0);
+        inst.site_first_derivatives.assign(inst.npatterns, 0.0);
+        inst.site_second_derivatives.assign(inst.npatterns, 0.0);
+        inst.ones.assign(inst.npadded, 0.0);
+        std::fill(inst.ones.begin(), inst.ones.begin() + inst.nstates, 1.0);
+        inst.work.assign(2*_codon_tile*inst.npadded + _pattern_block, 0.0);
+
+        int handle = (int)_instances.size();
+        _instances.push_back(p);
+
+        if (returnInfo) {
+            static char resource_name[] = "native CPU";
+            static char impl_name[]     = "lorad-native";
+            static char impl_desc[]     = "built-in CPU likelihood kernels";
+            returnInfo->resourceNumber  = 0;
+            returnInfo->resourceName    = resource_name;
+            returnInfo->implName        = impl_name;
+            returnInfo->implDescription = impl_desc;
+            returnInfo->flags = BEAGLE_FLAG_PRECISION_DOUBLE | BEAGLE_FLAG_PROCESSOR_CPU | BEAGLE_FLAG_FRAMEWORK_CPU | BEAGLE_FLAG_SCALING_MANUAL | BEAGLE_FLAG_SCALERS_LOG | BEAGLE_FLAG_EIGEN_REAL | BEAGLE_FLAG_THREADING_NONE;
+            returnInfo->flags |= (inst.simd_level != SIMD_NONE ? BEAGLE_FLAG_VECTOR_AVX : BEAGLE_FLAG_VECTOR_NONE);
+        }
+        return handle;
+    }
+
+    inline int NativeEngine::finalizeInstance(int instance) {
+        if (!getInstance(instance))
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        _instances[instance].reset();
+
+        // Handles are indices, so the registry can only shrink from the end
+        while (!_instances.empty() && !_instances.back())
+            _instances.pop_back();
+        return BEAGLE_SUCCESS;
+    }
+
+    inline int NativeEngine::setTipStates(int instance, int tipIndex, const int * inStates) {
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        if (!validIndex(tipIndex, inst->ntips))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        inst->tip_states[tipIndex].assign(inStates, inStates + inst->npatterns);
+        inst->partials[tipIndex].clear();
+        return BEAGLE_SUCCESS;
+    }
+
+    inline int NativeEngine::setTipPartials(int instance, int tipIndex, const double * inPartials) {
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        if (!validIndex(tipIndex, inst->ntips))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+
+        // Tip partials are supplied once per pattern and replicated across rate categories
+        unsigned ns = inst->nstates;
+        unsigned np = inst->npadded;
+        unsigned nc = inst->ncateg;
+        std::vector<double> & buffer = inst->partials[tipIndex];
+        buffer.assign(inst->npatterns*nc*np, 0.0);
+        for (unsigned p = 0; p < inst->npatterns; p++) {
+            for (unsigned c = 0; c < nc; c++)
+                std::copy(inPartials + p*ns, inPartials + (p + 1)*ns, buffer.begin() + (p*nc + c)*np);
+        }
+        inst->tip_states[tipIndex].clear();
+        return BEAGLE_SUCCESS;
+    }
+
+    inline int NativeEngine::setPatternWeights(int instance, const double * inPatternWeights) {
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        inst->pattern_weights.assign(inPatternWeights, inPatternWeights + inst->npatterns);
+        return BEAGLE_SUCCESS;
+    }
+
+    inline int NativeEngine::setPatternPartitions(int instance, int partitionCount, const int * inPatternPartitions) {
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        if (partitionCount < 1)
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        inst->partition_patterns.assign(partitionCount, std::vector<unsigned>());
+        for (unsigned p = 0; p < inst->npatterns; p++) {
+            if (!validIndex(inPatternPartitions[p], partitionCount))
+                return BEAGLE_ERROR_OUT_OF_RANGE;
+            inst->partition_patterns[inPatternPartitions[p]].push_back(p);
+        }
+        return BEAGLE_SUCCESS;
+    }
+
+    inline int NativeEngine::setEigenDecomposition(int instance, int eigenIndex, const double * inEigenVectors, const double * inInverseEigenVectors, const double * inEigenValues) {
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        if (!validIndex(eigenIndex, inst->eigenvalues.size()))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        unsigned ns = inst->nstates;
+        inst->eigenvectors[eigenIndex].assign(inEigenVectors, inEigenVectors + ns*ns);
+        inst->inverse_eigenvectors[eigenIndex].assign(inInverseEigenVectors, inInverseEigenVectors + ns*ns);
+        inst->eigenvalues[eigenIndex].assign(inEigenValues, inEigenValues + ns);
+        return BEAGLE_SUCCESS;
+    }
+
+    inline int NativeEngine::setStateFrequencies(int instance, int stateFrequenciesIndex, const double * inStateFrequencies) {
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        if (!validIndex(stateFrequenciesIndex, inst->state_freqs.size()))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        std::copy(inStateFrequencies, inStateFrequencies + inst->nstates, inst->state_freqs[stateFrequenciesIndex].begin());
+        return BEAGLE_SUCCESS;
+    }
+
+    inline int NativeEngine::setCategoryWeights(int instance, int categoryWeightsIndex, const double * inCategoryWeights) {
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        if (!validIndex(categoryWeightsIndex, inst->category_weights.size()))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        inst->category_weights[categoryWeightsIndex].assign(inCategoryWeights, inCategoryWeights + inst->ncateg);
+        return BEAGLE_SUCCESS;
+    }
+
+    inline int NativeEngine::setCategoryRatesWithIndex(int instance, int categoryRatesIndex, const double * inCategoryRates) {
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        if (!validIndex(categoryRatesIndex, inst->category_rates.size()))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        inst->category_rates[categoryRatesIndex].assign(inCategoryRates, inCategoryRates + inst->ncateg);
+        return BEAGLE_SUCCESS;
+    }
+
+    inline int NativeEngine::setTransitionMatrix(int instance, int matrixIndex, const double * inMatrix, double paddedValue) {
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        if (!validIndex(matrixIndex, inst->matrices.size()))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+
+        // The column of a missing state is implicitly all ones (Instance::ones), which is what
+        // paddedValue = 1 requests; BeagleLib's other use (0 for derivative matrices) is not needed
+        if (paddedValue != 1.0)
+            return BEAGLE_ERROR_NO_IMPLEMENTATION;
+
+        // inMatrix is row-major (from state, to state) for each category; store it by column
+        unsigned ns = inst->nstates;
+        unsigned np = inst->npadded;
+        std::vector<double> & m = inst->matrices[matrixIndex];
+        for (unsigned c = 0; c < inst->ncateg; c++) {
+            for (unsigned i = 0; i < ns; i++) {
+                for (unsigned j = 0; j < ns; j++)
+                    m[c*ns*np + j*np + i] = inMatrix[c*ns*ns + i*ns + j];
+            }
+        }
+        return BEAGLE_SUCCESS;
+    }
+
+    template <unsigned S>
+    inline void NativeEngine::computeTransitionMatrix(Instance & inst, unsigned eigen, unsigned rates, unsigned matrix, double edgelen, unsigned order) {
+        // order 0 computes the transition matrix P(t); orders 1 and 2 compute its first and
+        // second derivatives with respect to the edge length t
+        const unsigned ns = (S > 0 ? S : inst.nstates);
+        const unsigned np = inst.npadded;
+        const double * evec = &inst.eigenvectors[eigen][0];
+        const double * ivec = &inst.inverse_eigenvectors[eigen][0];
+        const double * eval = &inst.eigenvalues[eigen][0];
+        double * expt = &inst.work[0];
+        double * row = &inst.work[np];
+        double * m = &inst.matrices[matrix][0];
+        for (unsigned c = 0; c < inst.ncateg; c++) {
+            double rate = inst.category_rates[rates][c];
+            double r = rate*edgelen;
+            for (unsigned k = 0; k < ns; k++) {
+                expt[k] = std::exp(eval[k]*r);
+                for (unsigned i = 0; i < order; i++)
+                    expt[k] *= eval[k]*rate;
+            }
+
+            // P = V exp(Lambda r t) V^{-1}, stored by column: m[j*np + i] = P[i][j]. Row i of P
+            // is built as a sum of rows of V^{-1} so that the innermost loop is contiguous
+            double * mc = m + c*ns*np;
+            for (unsigned i = 0; i < ns; i++) {
+                const double * vi = evec + i*ns;
+                std::fill(row, row + ns, 0.0);
+                for (unsigned k = 0; k < ns; k++) {
+                    const double a = vi[k]*expt[k];
+                    const double * ivk = ivec + k*ns;
+                    for (unsigned j = 0; j < ns; j++)
+                        row[j] += a*ivk[j];
+                }
+                for (unsigned j = 0; j < ns; j++)
+                    mc[j*np + i] = (order > 0 || row[j] > 0.0 ? row[j] : 0.0);
+            }
+        }
+    }
+
+    inline int NativeEngine::doTransitionMatrix(Instance & inst, int eigen, int rates, int matrix, double edgelen, unsigned order) {
+        if (!validIndex(eigen, inst.eigenvalues.size()) || !validIndex(rates, inst.category_rates.size()) || !validIndex(matrix, inst.matrices.size()))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        switch (inst.nstates) {
+            case 4:
+                computeTransitionMatrix<4>(inst, eigen, rates, matrix, edgelen, order);
+                break;
+            case 61:
+                computeTransitionMatrix<61>(inst, eigen, rates, matrix, edgelen, order);
+                break;
+            case 62:
+                computeTransitionMatrix<62>(inst, eigen, rates, matrix, edgelen, order);
+                break;
+            default:
+                computeTransitionMatrix<0>(inst, eigen, rates, matrix, edgelen, order);
+        }
+        return BEAGLE_SUCCESS;
+    }
+
+    inline int NativeEngine::doTransitionMatrices(Instance & inst, int eigen, int rates, int matrix, int first, int second, double edgelen) {
+        // first and second are the derivative matrices to compute along with the transition
+        // matrix (BEAGLE_OP_NONE for neither)
+        int code = doTransitionMatrix(inst, eigen, rates, matrix, edgelen, 0);
+        if (code == BEAGLE_SUCCESS && first != BEAGLE_OP_NONE)
+            code = doTransitionMatrix(inst, eigen, rates, first, edgelen, 1);
+        if (code == BEAGLE_SUCCESS && second != BEAGLE_OP_NONE)
+            code = doTransitionMatrix(inst, eigen, rates, second, edgelen, 2);
+        return code;
+    }
+
+    inline int NativeEngine::updateTransitionMatrices(int instance, int eigenIndex, const int * probabilityIndices, const int * firstDerivativeIndices, const int * secondDerivativeIndices, const double * edgeLengths, int count) {
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        for (int i = 0; i < count; i++) {
+            int first = (firstDerivativeIndices ? firstDerivativeIndices[i] : BEAGLE_OP_NONE);
+            int second = (secondDerivativeIndices ? secondDerivativeIndices[i] : BEAGLE_OP_NONE);
+            int code = doTransitionMatrices(*inst, eigenIndex, 0, probabilityIndices[i], first, second, edgeLengths[i]);
+            if (code != BEAGLE_SUCCESS)
+                return code;
+        }
+        return BEAGLE_SUCCESS;
+    }
+
+    inline int NativeEngine::updateTransitionMatricesWithMultipleModels(int instance, const int * eigenIndices, const int * categoryRateIndices, const int * probabilityIndices, const int * firstDerivativeIndices, const int * secondDerivativeIndices, const double * edgeLengths, int count) {
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        for (int i = 0; i < count; i++) {
+            int first = (firstDerivativeIndices ? firstDerivativeIndices[i] : BEAGLE_OP_NONE);
+            int second = (secondDerivativeIndices ? secondDerivativeIndices[i] : BEAGLE_OP_NONE);
+            int code = doTransitionMatrices(*inst, eigenIndices[i], categoryRateIndices[i], probabilityIndices[i], first, second, edgeLengths[i]);
+            if (code != BEAGLE_SUCCESS)
+                return code;
+        }
+        return BEAGLE_SUCCESS;
+    }
+
+    template <unsigned S, unsigned L>
+    inline void NativeEngine::matVec(const double * m, const double * v, double * out, unsigned ns, unsigned np) {
+        // out = P v, where column j of P starts at m + j*np; padding rows of m are zero, so the
+        // padding entries of out are zero as well
+#if defined(NATIVE_SIMD_DISPATCH)
+        if (L == SIMD_AVX512)
+            matVecAVX512<S>(m, v, out, ns, np);
+        else if (L == SIMD_AVX2)
+            matVecAVX2<S>(m, v, out, ns, np);
+        else
+#endif
+            matVecScalar<S>(m, v, out, ns, np);
+    }
+
+    template <unsigned S>
+    inline void NativeEngine::matVecScalar(const double * m, const double * v, double * out, unsigned ns, unsigned np) {
+        const unsigned n = (S > 0 ? S : ns);
+        for (unsigned i = 0; i < np; i++)
+            out[i] = 0.0;
+        for (unsigned j = 0; j < n; j++) {
+            const double * mj = m + j*np;
+            double vj = v[j];
+            for (unsigned i = 0; i < np; i++)
+                out[i] += mj[i]*vj;
+        }
+    }
+
+#if defined(NATIVE_SIMD_DISPATCH)
+    template <unsigned S>
+    NATIVE_TARGET_AVX2 inline void NativeEngine::matVecAVX2(const double * m, const double * v, double * out, unsigned ns, unsigned np) {
+        const unsigned n = (S > 0 ? S : ns);
+        for (unsigned i = 0; i < np; i += 4) {
+            __m256d acc = _mm256_setzero_pd();
+            for (unsigned j = 0; j < n; j++)
+                acc = _mm256_fmadd_pd(_mm256_loadu_pd(m + j*np + i), _mm256_set1_pd(v[j]), acc);
+            _mm256_storeu_pd(out + i, acc);
+        }
+    }
+
+    template <unsigned S>
+    NATIVE_TARGET_AVX512 inline void NativeEngine::matVecAVX512(const double * m, const double * v, double * out, unsigned ns, unsigned np) {
+        const unsigned n = (S > 0 ? S : ns);
+        for (unsigned i = 0; i < np; i += 8) {
+            __m512d acc = _mm512_setzero_pd();
+            for (unsigned j = 0; j < n; j++)
+                acc = _mm512_fmadd_pd(_mm512_loadu_pd(m + j*np + i), _mm512_set1_pd(v[j]), acc);
+            _mm512_storeu_pd(out + i, acc);
+        }
+    }
+#endif
+
+    template <unsigned S, unsigned L>
+    inline void NativeEngine::matMatTile(const double * m, const double * const * v, double * out, unsigned ns, unsigned np) {
+        // out + t*np = P v[t] for the _codon_tile vectors v[t]. This is a small matrix-matrix
+        // product: every column of P that is loaded is applied to all of the vectors in the tile
+#if defined(NATIVE_SIMD_DISPATCH)
+        if (L == SIMD_AVX512)
+            matMatTileAVX512<S>(m, v, out, ns, np);
+        else if (L == SIMD_AVX2)
+            matMatTileAVX2<S>(m, v, out, ns, np);
+        else
+#endif
+            matMatTileScalar<S>(m, v, out, ns, np);
+    }
+
+    template <unsigned S>
+    inline void NativeEngine::matMatTileScalar(const double * m, const double * const * v, double * out, unsigned ns, unsigned np) {
+        const unsigned n = (S > 0 ? S : ns);
+        double * out0 = out;
+        double * out1 = out + np;
+        double * out2 = out + 2*np;
+        double * out3 = out + 3*np;
+        std::fill(out, out + 4*np, 0.0);
+        for (unsigned j = 0; j < n; j++) {
+            const double * mj = m + j*np;
+            const double b0 = v[0][j];
+            const double b1 = v[1][j];
+            const double b2 = v[2][j];
+            const double b3 = v[3][j];
+            for (unsigned i = 0; i < np; i++) {
+                const double x = mj[i];
+                out0[i] += x*b0;
+                out1[i] += x*b1;
+                out2[i] += x*b2;
+                out3[i] += x*b3;
+            }
+        }
+    }
+
+#if defined(NATIVE_SIMD_DISPATCH)
+    // The AVX2 and AVX-512 tiles differ only in the vector type and intrinsics, so their common
+    // body is written once in terms of the NATIVE_* macros defined before each use. It works on
+    // two vectors of rows by the four vectors of the tile: eight accumulators
+#   define NATIVE_MAT_MAT_TILE_BODY(w)                                                                  \
+        const unsigned n = (S > 0 ? S : ns);                                                            \
+        double * out0 = out;                                                                            \
+        double * out1 = out + np;                                                                       \
+        double * out2 = out + 2*np;                                                                     \
+        double * out3 = out + 3*np;                                                                     \
+        assert(np % (2*w) == 0);                                                                        \
+        for (unsigned i = 0; i < np; i += 2*w) {                                                        \
+            NATIVE_VEC a00 = NATIVE_ZERO(), a01 = NATIVE_ZERO(), a02 = NATIVE_ZERO(), a03 = NATIVE_ZERO();  \
+            NATIVE_VEC a10 = NATIVE_ZERO(), a11 = NATIVE_ZERO(), a12 = NATIVE_ZERO(), a13 = NATIVE_ZERO();  \
+            for (unsigned j = 0; j < n; j++) {                                                          \
+                NATIVE_VEC c0 = NATIVE_LOAD(m + j*np + i);                                              \
+                NATIVE_VEC c1 = NATIVE_LOAD(m + j*np + i + w);                                          \
+                NATIVE_VEC b = NATIVE_SET1(v[0][j]);                                                    \
+                a00 = NATIVE_FMA(c0, b, a00);                                                           \
+                a10 = NATIVE_FMA(c1, b, a10);                                                           \
+                b = NATIVE_SET1(v[1][j]);                                                               \
+                a01 = NATIVE_FMA(c0, b, a01);                                                           \
+                a11 = NATIVE_FMA(c1, b, a11);                                                           \
+                b = NATIVE_SET1(v[2][j]);                                                               \
+                a02 = NATIVE_FMA(c0, b, a02);                                                           \
+                a12 = NATIVE_FMA(c1, b, a12);                                                           \
+                b = NATIVE_SET1(v[3][j]);                                                               \
+                a03 = NATIVE_FMA(c0, b, a03);                                                           \
+                a13 = NATIVE_FMA(c1, b, a13);                                                           \
+            }                                                                                           \
+            NATIVE_STORE(out0 + i, a00);                                                                \
+            NATIVE_STORE(out0 + i + w, a10);                                                            \
+            NATIVE_STORE(out1 + i, a01);                                                                \
+            NATIVE_STORE(out1 + i + w, a11);                                                            \
+            NATIVE_STORE(out2 + i, a02);                                                                \
+            NATIVE_STORE(out2 + i + w, a12);                                                            \
+            NATIVE_STORE(out3 + i, a03);                                                                \
+            NATIVE_STORE(out3 + i + w, a13);                                                            \
+        }
+
+#   define NATIVE_VEC               __m256d
+#   define NATIVE_ZERO()            _mm256_setzero_pd()
+#   define NATIVE_LOAD(p)           _mm256_loadu_pd(p)
+#   define NATIVE_STORE(p, x)       _mm256_storeu_pd(p, x)
+#   define NATIVE_SET1(x)           _mm256_set1_pd(x)
+#   define NATIVE_FMA(a, b, c)      _mm256_fmadd_pd(a, b, c)
+    template <unsigned S>
+    NATIVE_TARGET_AVX2 inline void NativeEngine::matMatTileAVX2(const double * m, const double * const * v, double * out, unsigned ns, unsigned np) {
+        NATIVE_MAT_MAT_TILE_BODY(4u)
+    }
+#   undef NATIVE_VEC
+#   undef NATIVE_ZERO
+#   undef NATIVE_LOAD
+#   undef NATIVE_STORE
+#   undef NATIVE_SET1
+#   undef NATIVE_FMA
+
+#   define NATIVE_VEC               __m512d
+#   define NATIVE_ZERO()            _mm512_setzero_pd()
+#   define NATIVE_LOAD(p)           _mm512_loadu_pd(p)
+#   define NATIVE_STORE(p, x)       _mm512_storeu_pd(p, x)
+#   define NATIVE_SET1(x)           _mm512_set1_pd(x)
+#   define NATIVE_FMA(a, b, c)      _mm512_fmadd_pd(a, b, c)
+    template <unsigned S>
+    NATIVE_TARGET_AVX512 inline void NativeEngine::matMatTileAVX512(const double * m, const double * const * v, double * out, unsigned ns, unsigned np) {
+        NATIVE_MAT_MAT_TILE_BODY(8u)
+    }
+#   undef NATIVE_VEC
+#   undef NATIVE_ZERO
+#   undef NATIVE_LOAD
+#   undef NATIVE_STORE
+#   undef NATIVE_SET1
+#   undef NATIVE_FMA
+#   undef NATIVE_MAT_MAT_TILE_BODY
+#endif
+
+    inline int NativeEngine::checkOperation(Instance & inst, const int * op) {
+        std::size_t nbuffers = inst.partials.size();
+        if (!validIndex(op[0], nbuffers) || !validIndex(op[3], nbuffers) || !validIndex(op[5], nbuffers))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        if (!validIndex(op[4], inst.matrices.size()) || !validIndex(op[6], inst.matrices.size()))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        if (op[1] != BEAGLE_OP_NONE && !validIndex(op[1], inst.scalers.size()))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        if (op[2] != BEAGLE_OP_NONE && !validIndex(op[2], inst.scalers.size()))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        if (inst.partials[op[0]].empty())
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        return BEAGLE_SUCCESS;
+    }
+
+    template <unsigned S, unsigned L>
+    inline void NativeEngine::updatePartialsKernel(Instance & inst, const int * op, const std::vector<unsigned> & patterns) {
+        // op holds the first seven fields of a BeagleOperation
+        const unsigned ns = (S > 0 ? S : inst.nstates);
+        const unsigned np = inst.npadded;
+        const unsigned nc = inst.ncateg;
+        const unsigned npatterns = (unsigned)patterns.size();
+        double * dest = &inst.partials[op[0]][0];
+        const int * states1 = (inst.tip_states[op[3]].empty() ? 0 : &inst.tip_states[op[3]][0]);
+        const int * states2 = (inst.tip_states[op[5]].empty() ? 0 : &inst.tip_states[op[5]][0]);
+        const double * partials1 = (states1 ? 0 : &inst.partials[op[3]][0]);
+        const double * partials2 = (states2 ? 0 : &inst.partials[op[5]][0]);
+        const double * m1 = &inst.matrices[op[4]][0];
+        const double * m2 = &inst.matrices[op[6]][0];
+        double * tmp1 = &inst.work[0];
+        double * tmp2 = &inst.work[np];
+
+        for (unsigned b = 0; b < npatterns; b += _pattern_block) {
+            unsigned e = std::min(b + _pattern_block, npatterns);
+            for (unsigned c = 0; c < nc; c++) {
+                const double * m1c = m1 + c*ns*np;
+                const double * m2c = m2 + c*ns*np;
+                for (unsigned k = b; k < e; k++) {
+                    unsigned p = patterns[k];
+                    unsigned offset = (p*nc + c)*np;
+
+                    // A compact tip contributes the column of P for its observed state
+                    const double * x1 = tmp1;
+                    if (states1)
+                        x1 = ((unsigned)states1[p] < ns ? m1c + states1[p]*np : &inst.ones[0]);
+                    else
+                        matVec<S, L>(m1c, partials1 + offset, tmp1, ns, np);
+
+                    const double * x2 = tmp2;
+                    if (states2)
+                        x2 = ((unsigned)states2[p] < ns ? m2c + states2[p]*np : &inst.ones[0]);
+                    else
+                        matVec<S, L>(m2c, partials2 + offset, tmp2, ns, np);
+
+                    double * d = dest + offset;
+                    for (unsigned i = 0; i < np; i++)
+                        d[i] = x1[i]*x2[i];
+                }
+            }
+
+            rescaleBlock(inst, op, patterns, b, e);
+        }
+    }
+
+    template <unsigned S, unsigned L>
+    inline void NativeEngine::updateCodonPartialsKernel(Instance & inst, const int * op, const std::vector<unsigned> & patterns) {
+        // Codon version (S is 61 for the standard genetic code, 62 for the invertebrate
+        // mitochondrial code): partials children are multiplied by their SxS transition matrix
+        // _codon_tile patterns at a time (see matMatTile), so each matrix column is loaded
+        // once per tile rather than once per pattern. The tile does not span rate categories:
+        // each category has its own transition matrix (P for rate r_c times the edge length),
+        // so vectors from different categories share no operand that could be reused from
+        // registers. Categories are instead the middle loop, so that each category's matrices
+        // stay in cache for a whole block of patterns
+        const unsigned ns = S;
+        const unsigned np = inst.npadded;
+        const unsigned nc = inst.ncateg;
+        const unsigned nt = _codon_tile;
+        const unsigned npatterns = (unsigned)patterns.size();
+        double * dest = &inst.partials[op[0]][0];
+        const int * states1 = (inst.tip_states[op[3]].empty() ? 0 : &inst.tip_states[op[3]][0]);
+        const int * states2 = (inst.tip_states[op[5]].empty() ? 0 : &inst.tip_states[op[5]][0]);
+        const double * partials1 = (states1 ? 0 : &inst.partials[op[3]][0]);
+        const double * partials2 = (states2 ? 0 : &inst.partials[op[5]][0]);
+        const double * m1 = &inst.matrices[op[4]][0];
+        const double * m2 = &inst.matrices[op[6]][0];
+        double * tmp1 = &inst.work[0];
+        double * tmp2 = &inst.work[nt*np];
+
+        const double * in1[_codon_tile];
+        const double * in2[_codon_tile];
+        const double * x1[_codon_tile];
+        const double * x2[_codon_tile];
+        unsigned offset[_codon_tile];
+
+        for (unsigned b = 0; b < npatterns; b += _pattern_block) {
+            unsigned e = std::min(b + _pattern_block, npatterns);
+            for (unsigned c = 0; c < nc; c++) {
+                const double * m1c = m1 + c*ns*np;
+                const double * m2c = m2 + c*ns*np;
+                for (unsigned k = b; k < e; k += nt) {
+                    // A short final tile repeats its last pattern; the extra results are discarded
+                    unsigned n = std::min(nt, e - k);
+                    for (unsigned t = 0; t < nt; t++) {
+                        unsigned p = patterns[k + std::min(t, n - 1)];
+                        offset[t] = (p*nc + c)*np;
+                        if (states1)
+                            x1[t] = ((unsigned)states1[p] < ns ? m1c + states1[p]*np : &inst.ones[0]);
+                        else {
+                            in1[t] = partials1 + offset[t];
+                            x1[t] = tmp1 + t*np;
+                        }
+                        if (states2)
+                            x2[t] = ((unsigned)states2[p] < ns ? m2c + states2[p]*np : &inst.ones[0]);
+                        else {
+                            in2[t] = partials2 + offset[t];
+                            x2[t] = tmp2 + t*np;
+                        }
+                    }
+                    if (!states1)
+                        matMatTile<S, L>(m1c, in1, tmp1, ns, np);
+                    if (!states2)
+                        matMatTile<S, L>(m2c, in2, tmp2, ns, np);
+
+                    for (unsigned t = 0; t < n; t++) {
+                        double * d = dest + offset[t];
+                        const double * a = x1[t];
+                        const double * z = x2[t];
+                        for (unsigned i = 0; i < np; i++)
+                            d[i] = a[i]*z[i];
+                    }
+                }
+            }
+            rescaleBlock(inst, op, patterns, b, e);
+        }
+    }
+
+    inline void NativeEngine::rescaleBlock(Instance & inst, const int * op, const std::vector<unsigned> & patterns, unsigned b, unsigned e) {
+        // Rescale each pattern in patterns[b..e) by its largest partial across all categories
+        if (op[1] == BEAGLE_OP_NONE && op[2] == BEAGLE_OP_NONE)
+            return;
+        const unsigned n = inst.ncateg*inst.npadded;
+        double * dest = &inst.partials[op[0]][0];
+        for (unsigned k = b; k < e; k++) {
+            unsigned p = patterns[k];
+            double * d = dest + p*n;
+            double logscale = 0.0;
+            if (op[1] != BEAGLE_OP_NONE) {
+                double maxpartial = *std::max_element(d, d + n);
+                logscale = (maxpartial > 0.0 ? std::log(maxpartial) : 0.0);
+                inst.scalers[op[1]][p] = logscale;
+            }
+            else
+                logscale = inst.scalers[op[2]][p];
+            if (logscale != 0.0) {
+                double factor = std::exp(-logscale);
+                for (unsigned i = 0; i < n; i++)
+                    d[i] *= factor;
+            }
+        }
+    }
+
+    inline int NativeEngine::doOperation(Instance & inst, const int * op, const std::vector<unsigned> & patterns) {
+        int code = checkOperation(inst, op);
+        if (code != BEAGLE_SUCCESS)
+            return code;
+        switch (inst.simd_level) {
+#if defined(NATIVE_SIMD_DISPATCH)
+            case SIMD_AVX512:
+                updatePartialsAVX512(inst, op, patterns);
+                break;
+            case SIMD_AVX2:
+                updatePartialsAVX2(inst, op, patterns);
+                break;
+#endif
+            default:
+                updatePartialsForLevel<SIMD_NONE>(inst, op, patterns);
+        }
+        return BEAGLE_SUCCESS;
+    }
+
+    template <unsigned L>
+    inline void NativeEngine::updatePartialsForLevel(Instance & inst, const int * op, const std::vector<unsigned> & patterns) {
+        switch (inst.nstates) {
+            case 4:
+                updatePartialsKernel<4, L>(inst, op, patterns);
+                break;
+            case 61:
+                updateCodonPartialsKernel<61, L>(inst, op, patterns);
+                break;
+            case 62:
+                updateCodonPartialsKernel<62, L>(inst, op, patterns);
+                break;
+            default:
+                updatePartialsKernel<0, L>(inst, op, patterns);
+        }
+    }
+
+#if defined(NATIVE_SIMD_DISPATCH)
+    NATIVE_TARGET_AVX2 NATIVE_FLATTEN inline void NativeEngine::updatePartialsAVX2(Instance & inst, const int * op, const std::vector<unsigned> & patterns) {
+        updatePartialsForLevel<SIMD_AVX2>(inst, op, patterns);
+    }
+
+    NATIVE_TARGET_AVX512 NATIVE_FLATTEN inline void NativeEngine::updatePartialsAVX512(Instance & inst, const int * op, const std::vector<unsigned> & patterns) {
+        updatePartialsForLevel<SIMD_AVX512>(inst, op, patterns);
+    }
+#endif
+
+    inline int NativeEngine::updatePartials(const int instance, const BeagleOperation * operations, int operationCount, int cumulativeScaleIndex) {
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        const int * ops = (const int *)operations;
+        for (int i = 0; i < operationCount; i++) {
+            const int * op = ops + 7*i;
+            int code = doOperation(*inst, op, inst->all_patterns);
+            if (code != BEAGLE_SUCCESS)
+                return code;
+            if (cumulativeScaleIndex != BEAGLE_OP_NONE && op[1] != BEAGLE_OP_NONE) {
+                code = accumulateScaleFactors(instance, op + 1, 1, cumulativeScaleIndex);
+                if (code != BEAGLE_SUCCESS)
+                    return code;
+            }
+        }
+        return BEAGLE_SUCCESS;
+    }
+
+    inline int NativeEngine::updatePartialsByPartition(const int instance, const BeagleOperationByPartition * operations, int operationCount) {
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        const int * ops = (const int *)operations;
+        for (int i = 0; i < operationCount; i++) {
+            const int * op = ops + 9*i;
+            if (!validIndex(op[7], inst->partition_patterns.size()))
+                return BEAGLE_ERROR_OUT_OF_RANGE;
+            int code = doOperation(*inst, op, inst->partition_patterns[op[7]]);
+            if (code != BEAGLE_SUCCESS)
+                return code;
+            if (op[8] != BEAGLE_OP_NONE && op[1] != BEAGLE_OP_NONE) {
+                code = accumulateScaleFactorsByPartition(instance, op + 1, 1, op[8], op[7]);
+                if (code != BEAGLE_SUCCESS)
+                    return code;
+            }
+        }
+        return BEAGLE_SUCCESS;
+    }
+
+    inline int NativeEngine::accumulateScaleFactors(int instance, const int * scaleIndices, int count, int cumulativeScaleIndex) {
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        return accumulateScaleFactorsByPartition(instance, scaleIndices, count, cumulativeScaleIndex, -1);
+    }
+
+    inline int NativeEngine::accumulateScaleFactorsByPartition(int instance, const int * scaleIndices, int count, int cumulativeScaleIndex, int partitionIndex) {
+        return addScaleFactors(instance, scaleIndices, count, cumulativeScaleIndex, partitionIndex, 1.0);
+    }
+
+    inline int NativeEngine::removeScaleFactors(int instance, const int * scaleIndices, int count, int cumulativeScaleIndex) {
+        return removeScaleFactorsByPartition(instance, scaleIndices, count, cumulativeScaleIndex, -1);
+    }
+
+    inline int NativeEngine::removeScaleFactorsByPartition(int instance, const int * scaleIndices, int count, int cumulativeScaleIndex, int partitionIndex) {
+        return addScaleFactors(instance, scaleIndices, count, cumulativeScaleIndex, partitionIndex, -1.0);
+    }
+
+    inline int NativeEngine::addScaleFactors(int instance, const int * scaleIndices, int count, int cumulativeScaleIndex, int partitionIndex, double sign) {
+        // A partitionIndex of -1 means all patterns; sign is 1 to accumulate or -1 to remove
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        if (!validIndex(cumulativeScaleIndex, inst->scalers.size()))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        if (partitionIndex != -1 && !validIndex(partitionIndex, inst->partition_patterns.size()))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        const std::vector<unsigned> & patterns = (partitionIndex == -1 ? inst->all_patterns : inst->partition_patterns[partitionIndex]);
+        std::vector<double> & cumulative = inst->scalers[cumulativeScaleIndex];
+        for (int i = 0; i < count; i++) {
+            if (!validIndex(scaleIndices[i], inst->scalers.size()))
+                return BEAGLE_ERROR_OUT_OF_RANGE;
+            const std::vector<double> & scaler = inst->scalers[scaleIndices[i]];
+            for (unsigned p : patterns)
+                cumulative[p] += sign*scaler[p];
+        }
+        return BEAGLE_SUCCESS;
+    }
+
+    inline int NativeEngine::resetScaleFactors(int instance, int cumulativeScaleIndex) {
+        return resetScaleFactorsByPartition(instance, cumulativeScaleIndex, -1);
+    }
+
+    inline int NativeEngine::resetScaleFactorsByPartition(int instance, int cumulativeScaleIndex, int partitionIndex) {
+        // A partitionIndex of -1 means all patterns
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        if (!validIndex(cumulativeScaleIndex, inst->scalers.size()))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        if (partitionIndex != -1 && !validIndex(partitionIndex, inst->partition_patterns.size()))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        const std::vector<unsigned> & patterns = (partitionIndex == -1 ? inst->all_patterns : inst->partition_patterns[partitionIndex]);
+        std::vector<double> & cumulative = inst->scalers[cumulativeScaleIndex];
+        for (unsigned p : patterns)
+            cumulative[p] = 0.0;
+        return BEAGLE_SUCCESS;
+    }
+
+    template <unsigned S, unsigned L>
+    inline double NativeEngine::edgeLogLikelihoodKernel(Instance & inst, int parent, int child, int matrix, int weights, int freqs, int scaler, const std::vector<unsigned> & patterns) {
+        const unsigned ns = (S > 0 ? S : inst.nstates);
+        const unsigned np = inst.npadded;
+        const unsigned nc = inst.ncateg;
+        const unsigned npatterns = (unsigned)patterns.size();
+        const int * child_states = (inst.tip_states[child].empty() ? 0 : &inst.tip_states[child][0]);
+        const int * parent_states = (inst.tip_states[parent].empty() ? 0 : &inst.tip_states[parent][0]);
+        const double * child_partials = (child_states ? 0 : &inst.partials[child][0]);
+        const double * parent_partials = (parent_states ? 0 : &inst.partials[parent][0]);
+        const double * m = &inst.matrices[matrix][0];
+        const double * f = &inst.state_freqs[freqs][0];
+        const double * w = &inst.category_weights[weights][0];
+        double * tmp = &inst.work[0];
+        double * unit = &inst.work[np];
+        double * site = &inst.work[3*np];
+
+        double lnL = 0.0;
+        for (unsigned b = 0; b < npatterns; b += _pattern_block) {
+            unsigned e = std::min(b + _pattern_block, npatterns);
+            std::fill(site, site + (e - b), 0.0);
+            for (unsigned c = 0; c < nc; c++) {
+                const double * mc = m + c*ns*np;
+                for (unsigned k = b; k < e; k++) {
+                    unsigned p = patterns[k];
+                    unsigned offset = (p*nc + c)*np;
+
+                    const double * x = tmp;
+                    if (child_states)
+                        x = ((unsigned)child_states[p] < ns ? mc + child_states[p]*np : &inst.ones[0]);
+                    else
+                        matVec<S, L>(mc, child_partials + offset, tmp, ns, np);
+
+                    const double * y = unit;
+                    if (parent_states) {
+                        if ((unsigned)parent_states[p] < ns) {
+                            std::fill(unit, unit + np, 0.0);
+                            unit[parent_states[p]] = 1.0;
+                        }
+                        else
+                            y = &inst.ones[0];
+                    }
+                    else
+                        y = parent_partials + offset;
+
+                    double sum = 0.0;
+                    for (unsigned i = 0; i < np; i++)
+                        sum += f[i]*y[i]*x[i];
+                    site[k - b] += w[c]*sum;
+                }
+            }
+            for (unsigned k = b; k < e; k++) {
+                unsigned p = patterns[k];
+                double site_lnL = std::log(site[k - b]);
+                if (scaler != BEAGLE_OP_NONE)
+                    site_lnL += inst.scalers[scaler][p];
+                inst.site_log_likelihoods[p] = site_lnL;
+                lnL += inst.pattern_weights[p]*site_lnL;
+            }
+        }
+        return lnL;
+    }
+
+    inline int NativeEngine::doEdgeLogLikelihood(Instance & inst, int parent, int child, int matrix, int weights, int freqs, int scaler, const std::vector<unsigned> & patterns, double & lnL) {
+        std::size_t nbuffers = inst.partials.size();
+        if (!validIndex(parent, nbuffers) || !validIndex(child, nbuffers) || !validIndex(matrix, inst.matrices.size()))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        if (!validIndex(weights, inst.category_weights.size()) || !validIndex(freqs, inst.state_freqs.size()))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        if (scaler != BEAGLE_OP_NONE && !validIndex(scaler, inst.scalers.size()))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        switch (inst.simd_level) {
+#if defined(NATIVE_SIMD_DISPATCH)
+            case SIMD_AVX512:
+                lnL = edgeLogLikelihoodAVX512(inst, parent, child, matrix, weights, freqs, scaler, patterns);
+                break;
+            case SIMD_AVX2:
+                lnL = edgeLogLikelihoodAVX2(inst, parent, child, matrix, weights, freqs, scaler, patterns);
+                break;
+#endif
+            default:
+                lnL = edgeLogLikelihoodForLevel<SIMD_NONE>(inst, parent, child, matrix, weights, freqs, scaler, patterns);
+        }
+        return (std::isfinite(lnL) ? BEAGLE_SUCCESS : BEAGLE_ERROR_FLOATING_POINT);
+    }
+
+    template <unsigned L>
+    inline double NativeEngine::edgeLogLikelihoodForLevel(Instance & inst, int parent, int child, int matrix, int weights, int freqs, int scaler, const std::vector<unsigned> & patterns) {
+        switch (inst.nstates) {
+            case 4:
+                return edgeLogLikelihoodKernel<4, L>(inst, parent, child, matrix, weights, freqs, scaler, patterns);
+            case 61:
+                return edgeLogLikelihoodKernel<61, L>(inst, parent, child, matrix, weights, freqs, scaler, patterns);
+            case 62:
+                return edgeLogLikelihoodKernel<62, L>(inst, parent, child, matrix, weights, freqs, scaler, patterns);
+            default:
+                return edgeLogLikelihoodKernel<0, L>(inst, parent, child, matrix, weights, freqs, scaler, patterns);
+        }
+    }
+
+#if defined(NATIVE_SIMD_DISPATCH)
+    NATIVE_TARGET_AVX2 NATIVE_FLATTEN inline double NativeEngine::edgeLogLikelihoodAVX2(Instance & inst, int parent, int child, int matrix, int weights, int freqs, int scaler, const std::vector<unsigned> & patterns) {
+        return edgeLogLikelihoodForLevel<SIMD_AVX2>(inst, parent, child, matrix, weights, freqs, scaler, patterns);
+    }
+
+    NATIVE_TARGET_AVX512 NATIVE_FLATTEN inline double NativeEngine::edgeLogLikelihoodAVX512(Instance & inst, int parent, int child, int matrix, int weights, int freqs, int scaler, const std::vector<unsigned> & patterns) {
+        return edgeLogLikelihoodForLevel<SIMD_AVX512>(inst, parent, child, matrix, weights, freqs, scaler, patterns);
+    }
+#endif
+
+    template <unsigned S, unsigned L>
+    inline void NativeEngine::edgeDerivativesKernel(Instance & inst, int parent, int child, const int * matrices, int weights, int freqs, const std::vector<unsigned> & patterns, double & d1, double & d2) {
+        // Sums over patterns of the first and second derivatives of the site log-likelihoods
+        // with respect to the edge length. matrices holds the transition matrix and its first
+        // and second derivatives. Called only occasionally (e.g. to find a posterior mode), so
+        // patterns are visited one at a time rather than in blocks.
+        const unsigned ns = (S > 0 ? S : inst.nstates);
+        const unsigned np = inst.npadded;
+        const unsigned nc = inst.ncateg;
+        const int * child_states = (inst.tip_states[child].empty() ? 0 : &inst.tip_states[child][0]);
+        const int * parent_states = (inst.tip_states[parent].empty() ? 0 : &inst.tip_states[parent][0]);
+        const double * child_partials = (child_states ? 0 : &inst.partials[child][0]);
+        const double * parent_partials = (parent_states ? 0 : &inst.partials[parent][0]);
+        const double * f = &inst.state_freqs[freqs][0];
+        const double * w = &inst.category_weights[weights][0];
+        double * tmp = &inst.work[0];           // P, P' and P'' applied to the child
+        double * unit = &inst.work[3*np];
+        double * zeros = &inst.work[4*np];
+        std::fill(zeros, zeros + np, 0.0);
+
+        d1 = d2 = 0.0;
+        for (unsigned p : patterns) {
+            double site[3] = {0.0, 0.0, 0.0};
+            for (unsigned c = 0; c < nc; c++) {
+                unsigned offset = (p*nc + c)*np;
+                const double * y = unit;
+                if (parent_states) {
+                    if ((unsigned)parent_states[p] < ns) {
+                        std::fill(unit, unit + np, 0.0);
+                        unit[parent_states[p]] = 1.0;
+                    }
+                    else
+                        y = &inst.ones[0];
+                }
+                else
+                    y = parent_partials + offset;
+                    
+                for (unsigned k = 0; k < 3; k++) {
+                    const double * mc = &inst.matrices[matrices[k]][c*ns*np];
+                    const double * x = tmp + k*np;
+                    if (child_states) {
+                        if ((unsigned)child_states[p] < ns)
+                            x = mc + child_states[p]*np;
+                        else
+                            x = (k == 0 ? &inst.ones[0] : zeros);   // rows of P sum to 1
+                    }
+                    else
+                        matVec<S, L>(mc, child_partials + offset, tmp + k*np, ns, np);
+                        
+                    double sum = 0.0;
+                    for (unsigned i = 0; i < np; i++)
+                        sum += f[i]*y[i]*x[i];
+                    site[k] += w[c]*sum;
+                }
+            }
+            double g = site[1]/site[0];
+            double h = site[2]/site[0] - g*g;
+            inst.site_first_derivatives[p] = g;
+            inst.site_second_derivatives[p] = h;
+            d1 += inst.pattern_weights[p]*g;
+            d2 += inst.pattern_weights[p]*h;
+        }
+    }
+
+    inline int NativeEngine::doEdgeDerivatives(Instance & inst, int parent, int child, int matrix, int first, int second, int weights, int freqs, const std::vector<unsigned> & patterns, double & d1, double & d2) {
+        std::size_t nbuffers = inst.partials.size();
+        std::size_t nmatrices = inst.matrices.size();
+        if (!validIndex(parent, nbuffers) || !validIndex(child, nbuffers))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        if (!validIndex(matrix, nmatrices) || !validIndex(first, nmatrices) || !validIndex(second, nmatrices))
+            return BEAGLE_ERROR_OUT_OF_RANGE;
+        int matrices[3] = {matrix, first, second};
+        switch (inst.simd_level) {
+#if defined(NATIVE_SIMD_DISPATCH)
+            case SIMD_AVX512:
+                edgeDerivativesAVX512(inst, parent, child, matrices, weights, freqs, patterns, d1, d2);
+                break;
+            case SIMD_AVX2:
+                edgeDerivativesAVX2(inst, parent, child, matrices, weights, freqs, patterns, d1, d2);
+                break;
+#endif
+            default:
+                edgeDerivativesForLevel<SIMD_NONE>(inst, parent, child, matrices, weights, freqs, patterns, d1, d2);
+        }
+        return (std::isfinite(d1) && std::isfinite(d2) ? BEAGLE_SUCCESS : BEAGLE_ERROR_FLOATING_POINT);
+    }
+
+    template <unsigned L>
+    inline void NativeEngine::edgeDerivativesForLevel(Instance & inst, int parent, int child, const int * matrices, int weights, int freqs, const std::vector<unsigned> & patterns, double & d1, double & d2) {
+        switch (inst.nstates) {
+            case 4:
+                edgeDerivativesKernel<4, L>(inst, parent, child, matrices, weights, freqs, patterns, d1, d2);
+                break;
+            case 61:
+                edgeDerivativesKernel<61, L>(inst, parent, child, matrices, weights, freqs, patterns, d1, d2);
+                break;
+            case 62:
+                edgeDerivativesKernel<62, L>(inst, parent, child, matrices, weights, freqs, patterns, d1, d2);
+                break;
+            default:
+                edgeDerivativesKernel<0, L>(inst, parent, child, matrices, weights, freqs, patterns, d1, d2);
+        }
+    }
+
+#if defined(NATIVE_SIMD_DISPATCH)
+    NATIVE_TARGET_AVX2 NATIVE_FLATTEN inline void NativeEngine::edgeDerivativesAVX2(Instance & inst, int parent, int child, const int * matrices, int weights, int freqs, const std::vector<unsigned> & patterns, double & d1, double & d2) {
+        edgeDerivativesForLevel<SIMD_AVX2>(inst, parent, child, matrices, weights, freqs, patterns, d1, d2);
+    }
+
+    NATIVE_TARGET_AVX512 NATIVE_FLATTEN inline void NativeEngine::edgeDerivativesAVX512(Instance & inst, int parent, int child, const int * matrices, int weights, int freqs, const std::vector<unsigned> & patterns, double & d1, double & d2) {
+        edgeDerivativesForLevel<SIMD_AVX512>(inst, parent, child, matrices, weights, freqs, patterns, d1, d2);
+    }
+#endif
+
+    inline int NativeEngine::calculateEdgeLogLikelihoods(int instance, const int * parentBufferIndices, const int * childBufferIndices, const int * probabilityIndices, const int * firstDerivativeIndices, const int * secondDerivativeIndices, const int * categoryWeightsIndices, const int * stateFrequenciesIndices, const int * cumulativeScaleIndices, int count, double * outSumLogLikelihood, double * outSumFirstDerivative, double * outSumSecondDerivative) {
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        if (count != 1)
+            return BEAGLE_ERROR_NO_IMPLEMENTATION;
+        if ((firstDerivativeIndices != 0) != (secondDerivativeIndices != 0))
+            return BEAGLE_ERROR_NO_IMPLEMENTATION;
+        int scaler = (cumulativeScaleIndices ? cumulativeScaleIndices[0] : BEAGLE_OP_NONE);
+        int code = doEdgeLogLikelihood(*inst, parentBufferIndices[0], childBufferIndices[0], probabilityIndices[0], categoryWeightsIndices[0], stateFrequenciesIndices[0], scaler, inst->all_patterns, *outSumLogLikelihood);
+        if (code != BEAGLE_SUCCESS || !firstDerivativeIndices)
+            return code;
+        double d1 = 0.0;
+        double d2 = 0.0;
+        code = doEdgeDerivatives(*inst, parentBufferIndices[0], childBufferIndices[0], probabilityIndices[0], firstDerivativeIndices[0], secondDerivativeIndices[0], categoryWeightsIndices[0], stateFrequenciesIndices[0], inst->all_patterns, d1, d2);
+        if (outSumFirstDerivative)
+            *outSumFirstDerivative = d1;
+        if (outSumSecondDerivative)
+            *outSumSecondDerivative = d2;
+        return code;
+    }
+
+    inline int NativeEngine::calculateEdgeLogLikelihoodsByPartition(int instance, const int * parentBufferIndices, const int * childBufferIndices, const int * probabilityIndices, const int * firstDerivativeIndices, const int * secondDerivativeIndices, const int * categoryWeightsIndices, const int * stateFrequenciesIndices, const int * cumulativeScaleIndices, const int * partitionIndices, int partitionCount, int count, double * outSumLogLikelihoodByPartition, double * outSumLogLikelihood, double * outSumFirstDerivativeByPartition, double * outSumFirstDerivative, double * outSumSecondDerivativeByPartition, double * outSumSecondDerivative) {
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        if (count != 1)
+            return BEAGLE_ERROR_NO_IMPLEMENTATION;
+        if ((firstDerivativeIndices != 0) != (secondDerivativeIndices != 0))
+            return BEAGLE_ERROR_NO_IMPLEMENTATION;
+        int result = BEAGLE_SUCCESS;
+        *outSumLogLikelihood = 0.0;
+        if (outSumFirstDerivative)
+            *outSumFirstDerivative = 0.0;
+        if (outSumSecondDerivative)
+            *outSumSecondDerivative = 0.0;
+        for (int s = 0; s < partitionCount; s++) {
+            int partition = partitionIndices[s];
+            if (!validIndex(partition, inst->partition_patterns.size()))
+                return BEAGLE_ERROR_OUT_OF_RANGE;
+            int scaler = (cumulativeScaleIndices ? cumulativeScaleIndices[s] : BEAGLE_OP_NONE);
+            int code = doEdgeLogLikelihood(*inst, parentBufferIndices[s], childBufferIndices[s], probabilityIndices[s], categoryWeightsIndices[s], stateFrequenciesIndices[s], scaler, inst->partition_patterns[partition], outSumLogLikelihoodByPartition[s]);
+            if (code == BEAGLE_ERROR_FLOATING_POINT)
+                result = code;
+            else if (code != BEAGLE_SUCCESS)
+                return code;
+            *outSumLogLikelihood += outSumLogLikelihoodByPartition[s];
+            
+            if (firstDerivativeIndices) {
+                double d1 = 0.0;
+                double d2 = 0.0;
+                code = doEdgeDerivatives(*inst, parentBufferIndices[s], childBufferIndices[s], probabilityIndices[s], firstDerivativeIndices[s], secondDerivativeIndices[s], categoryWeightsIndices[s], stateFrequenciesIndices[s], inst->partition_patterns[partition], d1, d2);
+                if (code == BEAGLE_ERROR_FLOATING_POINT)
+                    result = code;
+                else if (code != BEAGLE_SUCCESS)
+                    return code;
+                if (outSumFirstDerivativeByPartition)
+                    outSumFirstDerivativeByPartition[s] = d1;
+                if (outSumSecondDerivativeByPartition)
+                    outSumSecondDerivativeByPartition[s] = d2;
+                if (outSumFirstDerivative)
+                    *outSumFirstDerivative += d1;
+                if (outSumSecondDerivative)
+                    *outSumSecondDerivative += d2;
+            }
+        }
+        return result;
+    }
+
+    inline int NativeEngine::getSiteLogLikelihoods(int instance, double * outLogLikelihoods) {
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        std::copy(inst->site_log_likelihoods.begin(), inst->site_log_likelihoods.end(), outLogLikelihoods);
+        return BEAGLE_SUCCESS;
+    }
+
+    inline int NativeEngine::getSiteDerivatives(int instance, double * outFirstDerivatives, double * outSecondDerivatives) {
+        Instance * inst = getInstance(instance);
+        if (!inst)
+            return BEAGLE_ERROR_UNINITIALIZED_INSTANCE;
+        if (outFirstDerivatives)
+            std::copy(inst->site_first_derivatives.begin(), inst->site_first_derivatives.end(), outFirstDerivatives);
+        if (outSecondDerivatives)
+            std::copy(inst->site_second_derivatives.begin(), inst->site_second_derivatives.end(), outSecondDerivatives);
+        return BEAGLE_SUCCESS;
+    }
+
+}
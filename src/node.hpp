@@ -12,6 +12,8 @@ namespace lorad {
     class Likelihood;
     class Updater;
     class EdgeProportionUpdater;
+    class EdgeLengthHMCUpdater;
+    class SubtreeRegraftUpdater;
 
     class Node {
         friend class Tree;
@@ -19,8 +21,12 @@ namespace lorad {
         friend class Likelihood;
         friend class Updater;
         friend class EdgeProportionUpdater;
+        friend class EdgeLengthHMCUpdater;
+        friend class SubtreeRegraftUpdater;
 
         public:
+            typedef unsigned long long  subset_mask_t;  // one bit per data subset
+
                                         Node();
                                         ~Node();
 
@@ -35,24 +41,31 @@ namespace lorad {
                     void                select()                    {_flags |= Flag::Selected;}
                     void                deselect()                  {_flags &= ~Flag::Selected;}
 
-                    bool                isSelPartial()              {return _flags & Flag::SelPartial;}
-                    void                selectPartial()             {_flags |= Flag::SelPartial;}
-                    void                deselectPartial()           {_flags &= ~Flag::SelPartial;}
-
-                    bool                isSelTMatrix()              {return _flags & Flag::SelTMatrix;}
-                    void                selectTMatrix()             {_flags |= Flag::SelTMatrix;}
-                    void                deselectTMatrix()           {_flags &= ~Flag::SelTMatrix;}
-
-                    bool                isAltPartial()              {return _flags & Flag::AltPartial;}
-                    void                setAltPartial()             {_flags |= Flag::AltPartial;}
-                    void                clearAltPartial()           {_flags &= ~Flag::AltPartial;}
-
-                    bool                isAltTMatrix()              {return _flags & Flag::AltTMatrix;}
-                    void                setAltTMatrix()             {_flags |= Flag::AltTMatrix;}
-                    void                clearAltTMatrix()           {_flags &= ~Flag::AltTMatrix;}
+                    // Partials and transition matrices are selected and double-buffered separately
+                    // for each data subset, so that a proposal affecting only some subsets leaves the
+                    // buffers of the others alone. Subsets share a bit if they are equal modulo
+                    // _max_subset_bits, and such subsets are always recalculated together.
+                    bool                isSelPartial()                              {return _sel_partials != 0;}
+                    bool                isSelPartial(unsigned subset)               {return (_sel_partials & getSubsetMask(subset)) != 0;}
+                    void                selectPartial(subset_mask_t subsets)        {_sel_partials |= subsets;}
+                    void                selectPartial()                             {_sel_partials = _all_subsets;}
+                    void                deselectPartial()                           {_sel_partials = 0;}
+
+                    bool                isSelTMatrix()                              {return _sel_tmatrices != 0;}
+                    bool                isSelTMatrix(unsigned subset)               {return (_sel_tmatrices & getSubsetMask(subset)) != 0;}
+                    void                selectTMatrix(subset_mask_t subsets)        {_sel_tmatrices |= subsets;}
+                    void                selectTMatrix()                             {_sel_tmatrices = _all_subsets;}
+                    void                deselectTMatrix()                           {_sel_tmatrices = 0;}
+
+                    bool                isAltPartial(unsigned subset)               {return (_alt_partials & getSubsetMask(subset)) != 0;}
+                    bool                isAltTMatrix(unsigned subset)               {return (_alt_tmatrices & getSubsetMask(subset)) != 0;}
                     
-                    void                flipTMatrix()               {isAltTMatrix() ? clearAltTMatrix() : setAltTMatrix();}
-                    void                flipPartial()               {isAltPartial() ? clearAltPartial() : setAltPartial();}
+                    // Only the buffers of selected subsets are flipped
+                    void                flipTMatrix()                               {_alt_tmatrices ^= _sel_tmatrices;}
+                    void                flipPartial()                               {_alt_partials ^= _sel_partials;}
+
+                    static unsigned     getSubsetBit(unsigned subset)               {return subset % _max_subset_bits;}
+                    static subset_mask_t getSubsetMask(unsigned subset)             {return subset_mask_t(1) << getSubsetBit(subset);}
 
                     double              getEdgeLength()             {return _edge_length;}
                     void                setEdgeLength(double v);
@@ -60,6 +73,8 @@ namespace lorad {
                     void                clearPointers()             {_left_child = _right_sib = _parent = 0;}   
                                         
             static const double _smallest_edge_length;
+            static const unsigned _max_subset_bits;
+            static const subset_mask_t _all_subsets;
 
             typedef std::vector<Node>    Vector;
             typedef std::vector<Node *>  PtrVector;
@@ -67,11 +82,7 @@ namespace lorad {
         private:
         
             enum Flag {
-                Selected   = (1 << 0),
-                SelPartial = (1 << 1),
-                SelTMatrix = (1 << 2),
-                AltPartial = (1 << 3),
-                AltTMatrix = (1 << 4)
+                Selected   = (1 << 0)
             };
 
             void                clear();
@@ -84,6 +95,10 @@ namespace lorad {
             double              _edge_length;
             Split               _split;
             int                 _flags;
+            subset_mask_t       _sel_partials;
+            subset_mask_t       _sel_tmatrices;
+            subset_mask_t       _alt_partials;
+            subset_mask_t       _alt_tmatrices;
     };
     
     
@@ -96,6 +111,10 @@ namespace lorad {
 
     inline void Node::clear() { 
         _flags = 0;
+        _sel_partials = 0;
+        _sel_tmatrices = 0;
+        _alt_partials = 0;
+        _alt_tmatrices = 0;
         clearPointers();    
         //_left_child = 0;
         //_right_sib = 0;
@@ -112,9 +112,10 @@ namespace lorad {
         
         _log_hastings_ratio = 0.0;  //symmetric proposal
         
-        // This proposal invalidates all transition matrices and partials
-        _tree_manipulator->selectAllPartials();
-        _tree_manipulator->selectAllTMatrices();
+        // This proposal invalidates all transition matrices and partials of the subsets
+        // that use the parameter
+        _tree_manipulator->selectAllPartials(_subset_mask);
+        _tree_manipulator->selectAllTMatrices(_subset_mask);
     }
 
 }
@@ -29,15 +29,24 @@ namespace lorad {
             virtual void                        revert();
             virtual void                        proposeNewState();
             virtual void                        reset();
+            virtual void                        reserveWorkspace();
+            virtual Node *                      getEvaluationNode() const;
+            virtual bool                        providesLogPriorDelta() const;
             
             void                                proposeAddEdgeMove(Node * nd);
             void                                proposeDeleteEdgeMove(Node * nd);
             
             _partition_vect_t &                 computePolytomyDistribution(unsigned nspokes);
+            void                                fillPolytomyDistribution(unsigned nspokes, _partition_vect_t & v) const;
+            double                              calcLogNumPolytomyResolutions(unsigned nspokes) const;
             void                                refreshPolytomies();
 
             _partition_map_t                    _poly_prob;
+            _partition_vect_t                   _poly_prob_scratch;
+            unsigned                            _max_stored_polytomy;
             _polytomy_vect_t                    _polytomies;
+            _polytomy_vect_t                    _uspokes;
+            _polytomy_vect_t                    _vspokes;
             
             Node *                              _orig_par;
             Node *                              _orig_lchild;
@@ -61,6 +70,7 @@ namespace lorad {
     inline PolytomyUpdater::PolytomyUpdater() { 
         Updater::clear();
         _name = "Polytomies";
+        _max_stored_polytomy = 0;
         reset();
     }   
 
@@ -81,6 +91,47 @@ namespace lorad {
         _polytomies.clear();
     }   
 
+    inline void PolytomyUpdater::reserveWorkspace() {
+        // A polytomy can have at most as many spokes as there are leaves (the star tree)
+        Tree::SharedPtr tree = _tree_manipulator->getTree();
+        unsigned nleaves = tree->numLeaves();
+        unsigned nnodes = (unsigned)tree->_nodes.size();
+        _polytomies.reserve(nnodes);
+        _uspokes.reserve(nnodes);
+        _vspokes.reserve(nnodes);
+        
+        // Store the partition distribution for polytomies up to 32 spokes larger than the
+        // largest polytomy in the starting tree now rather than the first time a polytomy of
+        // that size is encountered. Storing every size up to nleaves would take O(nleaves^2)
+        // memory for sizes that almost never occur; the distribution for a larger polytomy
+        // is instead recomputed in _poly_prob_scratch (reserved here) whenever it is needed
+        refreshPolytomies();
+        unsigned largest = 3;
+        for (auto nd : _polytomies)
+            largest = std::max(largest, 1 + _tree_manipulator->countChildren(nd));
+        _polytomies.clear();
+        _max_stored_polytomy = std::min(nleaves, largest + 32);
+        for (unsigned nspokes = 3; nspokes <= _max_stored_polytomy; ++nspokes)
+            computePolytomyDistribution(nspokes);
+        _poly_prob_scratch.reserve(nleaves);
+    }
+
+    inline Node * PolytomyUpdater::getEvaluationNode() const {
+        // Both add-edge and delete-edge moves only change partials at or below _orig_par
+        return _orig_par;
+    }
+
+    inline bool PolytomyUpdater::providesLogPriorDelta() const {
+        // Add-edge and delete-edge moves keep the tree length and change the number of edges
+        // by one, so the prior changes only by the topology prior ratio and one edge's worth of
+        // edge length prior (unless edge proportions have a non-flat Dirichlet prior)
+#if defined(HOLDER_ETAL_PRIOR)
+        return true;
+#else
+        return _prior_parameters[2] == 1.0;
+#endif
+    }
+
     inline double PolytomyUpdater::calcLogPrior() {   
         double log_prior = 0.0;
         log_prior += Updater::calcLogTopologyPrior();
@@ -97,31 +148,51 @@ namespace lorad {
     inline PolytomyUpdater::_partition_vect_t & PolytomyUpdater::computePolytomyDistribution(unsigned nspokes) {    
         assert(nspokes > 2);
                 
+        // Polytomies larger than any stored by reserveWorkspace are handled in the scratch
+        // vector so that the MCMC loop neither allocates nor stores them
+        if (_max_stored_polytomy > 0 && nspokes > _max_stored_polytomy) {
+            fillPolytomyDistribution(nspokes, _poly_prob_scratch);
+            return _poly_prob_scratch;
+        }
+
         // Only compute it if it isn't already stored in the _poly_prob map
         auto iter = _poly_prob.find(nspokes);
         if (iter == _poly_prob.end()) {
             // There is no existing probability distribution vector corresponding to nspokes
-            double ln_denom = std::log(pow(2.0,nspokes-1) - nspokes - 1.0);
-            _partition_vect_t v(nspokes - 3);
-            unsigned first = 2;
-            unsigned last = nspokes/2;
-            bool nspokes_even = nspokes % 2 == 0;
-            double total_prob = 0.0;
-            for (unsigned x = first; x <= last; ++x) {
-                double ln_numer = std::lgamma(nspokes + 1) - std::lgamma(x + 1) - std::lgamma(nspokes - x + 1);
-                if (nspokes_even && x == last)
-                    ln_numer -= std::log(2);
-                double prob_x = exp(ln_numer - ln_denom);
-                if (prob_x > 1.0)
-                    prob_x = 1.0;
-                total_prob += prob_x;
-                v[x-first] = prob_x;
-                }
-            assert(std::fabs(total_prob - 1.0) < 1.e-8);
+            _partition_vect_t v;
+            fillPolytomyDistribution(nspokes, v);
             _poly_prob[nspokes] = v;
         }
         return _poly_prob[nspokes];
     } 
+
+    inline void PolytomyUpdater::fillPolytomyDistribution(unsigned nspokes, _partition_vect_t & v) const {
+        double ln_denom = calcLogNumPolytomyResolutions(nspokes);
+        v.resize(nspokes - 3);
+        unsigned first = 2;
+        unsigned last = nspokes/2;
+        bool nspokes_even = nspokes % 2 == 0;
+        double total_prob = 0.0;
+        for (unsigned x = first; x <= last; ++x) {
+            double ln_numer = std::lgamma(nspokes + 1) - std::lgamma(x + 1) - std::lgamma(nspokes - x + 1);
+            if (nspokes_even && x == last)
+                ln_numer -= std::log(2);
+            double prob_x = exp(ln_numer - ln_denom);
+            if (prob_x > 1.0)
+                prob_x = 1.0;
+            total_prob += prob_x;
+            v[x-first] = prob_x;
+        }
+        assert(std::fabs(total_prob - 1.0) < 1.e-8);
+    }
+
+    inline double PolytomyUpdater::calcLogNumPolytomyResolutions(unsigned nspokes) const {
+        // Returns log(2^(nspokes-1) - nspokes - 1), the log of the number of ways to split a
+        // polytomy with nspokes spokes by adding one edge, computed in log space because
+        // 2^(nspokes-1) overflows a double once nspokes exceeds 1024
+        double log_pow2 = (nspokes - 1)*std::log(2.0);
+        return log_pow2 + std::log1p(-(nspokes + 1.0)*std::exp(-log_pow2));
+    }
         
     inline void PolytomyUpdater::proposeNewState() {    
         Tree::SharedPtr tree = _tree_manipulator->getTree();
@@ -138,8 +209,9 @@ namespace lorad {
         else
             num_internals_in_fully_resolved_tree = tree->numLeaves() - 2;
             
-        // Compute tree length before proposed move
+        // Compute tree length and topology prior before proposed move
         _tree_length = _tree_manipulator->calcTreeLength();
+        double log_topology_prior_before = (providesLogPriorDelta() ? Updater::calcLogTopologyPrior() : 0.0);
 
         // Determine whether starting tree is fully resolved or the star tree
         unsigned num_internals_before = tree->numInternals();
@@ -177,7 +249,7 @@ namespace lorad {
             // Compute the log of the Hastings ratio
             _log_hastings_ratio  = 0.0;
             _log_hastings_ratio += std::log(_num_polytomies);
-            _log_hastings_ratio += std::log(pow(2.0, _polytomy_size - 1) - _polytomy_size - 1);
+            _log_hastings_ratio += calcLogNumPolytomyResolutions(_polytomy_size);
             _log_hastings_ratio -= std::log(num_internal_edges_before + 1);
 
             // Now multiply by the value of the quantity labeled gamma_b in the Lewis-Holder-Holsinger (2005) paper
@@ -221,7 +293,7 @@ namespace lorad {
             _log_hastings_ratio  = 0.0;
             _log_hastings_ratio += std::log(num_internal_edges_before);
             _log_hastings_ratio -= std::log(_num_polytomies);
-            _log_hastings_ratio -= std::log(pow(2.0, _polytomy_size - 1) - _polytomy_size - 1);
+            _log_hastings_ratio -= calcLogNumPolytomyResolutions(_polytomy_size);
 
             // Now multiply by the value of the quantity labeled gamma_b in the Lewis-Holder-Holsinger (2005) paper
             // Now multiply by the value of the quantity labeled gamma_d in the paper
@@ -253,6 +325,12 @@ namespace lorad {
             _orig_lchild->selectTMatrix();
             _orig_lchild->selectPartial();
         }
+        
+        // The tree length is unchanged, so only the topology prior and the number of edges matter
+        if (providesLogPriorDelta()) {
+            _log_prior_delta  = Updater::calcLogTopologyPrior() - log_topology_prior_before;
+            _log_prior_delta += calcLogEdgeLengthPriorDelta(_add_edge_proposed ? 1 : -1);
+        }
     }   
     
     inline void PolytomyUpdater::proposeAddEdgeMove(Node * u) {    
@@ -304,17 +382,17 @@ namespace lorad {
         // Otherwise, move the k spokes to _orig_lchild leaving _polytomy_size - k spokes behind.
         
         // Create vector of valid spokes (parent and all children of _orig_par except _orig_lchild)
-        std::vector<Node *> uspokes;
-        uspokes.push_back(_orig_par->getParent());
+        _uspokes.clear();
+        _uspokes.push_back(_orig_par->getParent());
         for (Node * child = _orig_par->getLeftChild(); child; child = child->getRightSib()) {
             if (child != _orig_lchild)
-                uspokes.push_back(child);
+                _uspokes.push_back(child);
         }
-        assert (uspokes.size() == _polytomy_size);
+        assert (_uspokes.size() == _polytomy_size);
         
         // Choose one of the candidates as the edge to break
-        unsigned i = (unsigned)_lot->randint(0, (int)uspokes.size()-1);
-        _chosen_node = uspokes[i];
+        unsigned i = (unsigned)_lot->randint(0, (int)_uspokes.size()-1);
+        _chosen_node = _uspokes[i];
         if (_chosen_node == _orig_par->getParent())
             _chosen_node = _orig_par;
 
@@ -329,30 +407,30 @@ namespace lorad {
         _orig_lchild->setEdgeLength(_remainder_proportion*_tree_length);
 
         bool reverse_polarity = false;
-        std::vector<Node *> vspokes;
+        _vspokes.clear();
         typedef std::vector<Node *>::iterator::difference_type vec_it_diff;
         for (unsigned i = 0; i < k; ++i) {
-            unsigned num_u_spokes = (unsigned)uspokes.size();
+            unsigned num_u_spokes = (unsigned)_uspokes.size();
             assert(num_u_spokes > 0);
             unsigned j = (unsigned)_lot->randint(0, num_u_spokes-1);
-            Node * s = uspokes[j];
+            Node * s = _uspokes[j];
             if (s == _orig_par->getParent())
                 reverse_polarity = true;
-            vspokes.push_back(s);
-            uspokes.erase(uspokes.begin() + (vec_it_diff)j);
+            _vspokes.push_back(s);
+            _uspokes.erase(_uspokes.begin() + (vec_it_diff)j);
         }
-        assert(uspokes.size() + vspokes.size() == _polytomy_size);
+        assert(_uspokes.size() + _vspokes.size() == _polytomy_size);
 
         if (reverse_polarity) {
-            // transfer nodes in uspokes to _orig_lchild
-            for (auto s = uspokes.begin(); s != uspokes.end(); ++s) {
+            // transfer nodes in _uspokes to _orig_lchild
+            for (auto s = _uspokes.begin(); s != _uspokes.end(); ++s) {
                 _tree_manipulator->detachSubtree(*s);
                 _tree_manipulator->insertSubtreeOnRight(*s, _orig_lchild);
             }
         }
         else {
-            // transfer nodes in vspokes to _orig_lchild
-            for (auto s = vspokes.begin(); s != vspokes.end(); ++s) {
+            // transfer nodes in _vspokes to _orig_lchild
+            for (auto s = _vspokes.begin(); s != _vspokes.end(); ++s) {
                 _tree_manipulator->detachSubtree(*s);
                 _tree_manipulator->insertSubtreeOnRight(*s, _orig_lchild);
             }
@@ -425,17 +503,17 @@ namespace lorad {
         _tree_manipulator->refreshNavigationPointers();
         
         // Create vector of valid spokes
-        std::vector<Node *> spokes;
-        spokes.push_back(_orig_par->getParent());
+        _uspokes.clear();
+        _uspokes.push_back(_orig_par->getParent());
         for (Node * child = _orig_par->getLeftChild(); child; child = child->getRightSib()) {
             if (child != _orig_par)
-                spokes.push_back(child);
+                _uspokes.push_back(child);
         }
-        assert (spokes.size() == _polytomy_size);
+        assert (_uspokes.size() == _polytomy_size);
         
         // Choose one of the candidates as the edge to absorb the deleted edge
-        unsigned i = (unsigned)_lot->randint(0, (int)spokes.size()-1);
-        _chosen_node = spokes[i];
+        unsigned i = (unsigned)_lot->randint(0, (int)_uspokes.size()-1);
+        _chosen_node = _uspokes[i];
         if (_chosen_node == _orig_par->getParent())
             _chosen_node = _orig_par;
         _chosen_edgelen = _chosen_node->getEdgeLength();
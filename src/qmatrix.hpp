@@ -55,6 +55,7 @@ namespace lorad {
             virtual const double *                  getEigenvalues() const = 0;
 
             void                                    setActive(bool activate);
+            unsigned long                           getVersion() const;
         
         protected:
         
@@ -62,6 +63,7 @@ namespace lorad {
             void                                    normalizeFreqsOrExchangeabilities(freq_xchg_ptr_t v);
 
             bool                                    _is_active;
+            unsigned long                           _version;
             bool                                    _state_freqs_fixed;
             bool                                    _exchangeabilities_fixed;
             bool                                    _omega_fixed;
@@ -71,6 +73,9 @@ namespace lorad {
     };
     
     inline QMatrix::QMatrix() {
+        // Version 0 is never assigned, so anything recorded as version 0
+        // is known to be out of date
+        _version = 1;
     }
     
     inline QMatrix::~QMatrix() {
@@ -81,6 +86,13 @@ namespace lorad {
         recalcRateMatrix();
     }
 
+    inline unsigned long QMatrix::getVersion() const {
+        // Incremented every time the rate matrix is recalculated, allowing Likelihood
+        // to avoid sending state frequencies and eigensystems to BeagleLib if they
+        // have not changed since they were last sent
+        return _version;
+    }
+
     inline void QMatrix::clear() {
         _is_active = false;
         _state_freqs_fixed = false;
@@ -318,7 +330,10 @@ namespace lorad {
         // Must have assigned both _state_freqs and _exchangeabilities to recalculate rate matrix
         if (!_is_active || !(_state_freqs && _exchangeabilities))
             return;
-        
+
+        // Invalidate copies of the eigensystem and frequencies held by BeagleLib
+        ++_version;
+
         double piA = (*_state_freqs)[0];
         double piC = (*_state_freqs)[1];
         double piG = (*_state_freqs)[2];
@@ -556,7 +571,10 @@ namespace lorad {
         // Must have assigned both _state_freqs and _omega to recalculate rate matrix
         if (!_is_active || !(_state_freqs && _omega))
             return;
-        
+
+        // Invalidate copies of the eigensystem and frequencies held by BeagleLib
+        ++_version;
+
         unsigned nstates = _genetic_code->getNumNonStopCodons();
         assert(_state_freqs->size() == nstates);
         const double * pi = getStateFreqs();
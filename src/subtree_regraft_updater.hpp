@@ -0,0 +1,489 @@
+#pragma once
+
+#include "conditionals.hpp"
+#include <chrono>
+#include "updater.hpp"
+
+namespace lorad {
+
+    class Chain;
+
+    // Subtree prune-and-regraft (SPR) proposals and, if reroot is true, bounded tree bisection
+    // and reconnection (TBR) proposals. A random subtree s is pruned along with its parent p,
+    // whose two edges are merged into one, and p is regrafted onto a random edge of the rest of
+    // the tree (splitting that edge at a uniform point) at most _radius edges from where s was
+    // attached (0 means no limit). A TBR proposal also reroots the pruned subtree on one of its
+    // own edges within _radius edges of the old root edge. The tree length does not change, and
+    // the Hastings ratio accounts for the number of edges within reach before and after the move.
+    // Only partials on the paths from the old and new attachment points (and, for TBR, along the
+    // rerooting path) up to their common ancestor are recalculated, and the likelihood is scored
+    // at that ancestor's edge. The tree must be bifurcating.
+    class SubtreeRegraftUpdater : public Updater {
+
+        friend class Chain;
+
+        public:
+
+            typedef std::shared_ptr< SubtreeRegraftUpdater > SharedPtr;
+
+                                                SubtreeRegraftUpdater(bool reroot, unsigned radius);
+                                                ~SubtreeRegraftUpdater();
+
+            virtual double                      update(double prev_lnL);
+            virtual double                      calcLogPrior();
+            virtual double                      calcLogRefDist();
+
+            double                              getTopologyChangePct() const;
+            double                              getTopologyAcceptPct() const;
+            double                              getMeanMoveDistance() const;
+            double                              getPartialsPerUpdate() const;
+            double                              getSecondsPerUpdate() const;
+
+        private:
+
+            struct SavedNode {
+                Node *                          _parent;
+                Node *                          _left_child;
+                Node *                          _right_sib;
+                double                          _edge_length;
+            };
+
+            virtual void                        revert();
+            virtual void                        proposeNewState();
+            virtual void                        reset();
+            virtual void                        tune(bool accepted);
+            virtual void                        reserveWorkspace();
+            virtual Node *                      getEvaluationNode() const;
+            virtual bool                        providesLogPriorDelta() const;
+
+            void                                saveTree();
+            void                                restoreTree();
+            unsigned                            collectRegraftTargets(Node * start, bool keep);
+            unsigned                            collectRerootTargets(bool keep);
+            double                              rerootSubtree(Node * q);
+            Node *                              findCommonAncestor(Node * a, Node * b) const;
+
+            bool                                _reroot;
+            unsigned                            _radius;
+
+            Node *                              _s;             // root of the subtree moved
+            Node *                              _p;             // parent of _s, which moves with it
+            Node *                              _g;             // parent of _p before the move
+            Node *                              _evaluation_node;
+            bool                                _topology_changed;
+            unsigned                            _move_distance;
+
+            std::vector<SavedNode>              _saved;         // indexed by node number
+            std::vector<Node *>                 _targets;       // workspace
+            std::vector<unsigned>               _distances;     // workspace, parallel to _targets
+            std::vector<Node *>                 _path;          // workspace
+            std::vector<unsigned>               _visited;       // indexed by node number, holds _visit_stamp if visited
+            unsigned                            _visit_stamp;
+
+            // Statistics cover the same updates as the acceptance percentage
+            unsigned                            _ntopology_proposed;
+            unsigned                            _ntopology_accepted;
+            double                              _sum_move_distance;     // of accepted topology changes
+            unsigned long                       _npartials;
+            double                              _seconds;
+    };
+
+    inline SubtreeRegraftUpdater::SubtreeRegraftUpdater(bool reroot, unsigned radius) {
+        Updater::clear();
+        _reroot = reroot;
+        _radius = radius;
+        _name = (reroot ? "Bounded TBR" : "Subtree Prune-Regraft");
+        _visit_stamp        = 0;
+        _topology_changed   = false;
+        _move_distance      = 0;
+        _ntopology_proposed = 0;
+        _ntopology_accepted = 0;
+        _sum_move_distance  = 0.0;
+        _npartials          = 0;
+        _seconds            = 0.0;
+        reset();
+    }
+
+    inline SubtreeRegraftUpdater::~SubtreeRegraftUpdater() {
+    }
+
+    inline void SubtreeRegraftUpdater::reset() {
+        _log_hastings_ratio = 0.0;
+        _log_jacobian       = 0.0;
+        _log_prior_delta    = 0.0;
+        _s                  = 0;
+        _p                  = 0;
+        _g                  = 0;
+        _evaluation_node    = 0;
+    }
+
+    inline void SubtreeRegraftUpdater::tune(bool) {
+        // _lambda is not used, so only the attempt is counted (a drifting _lambda would
+        // also keep autoburnin from deciding that the chains had stabilized)
+        _nattempts++;
+    }
+
+    inline void SubtreeRegraftUpdater::reserveWorkspace() {
+        unsigned nnodes = (unsigned)_tree_manipulator->getTree()->_nodes.size();
+        _saved.resize(nnodes);
+        _targets.reserve(nnodes);
+        _distances.reserve(nnodes);
+        _path.reserve(nnodes);
+        _visited.assign(nnodes, 0);
+        _visit_stamp = 0;
+    }
+
+    inline double SubtreeRegraftUpdater::calcLogPrior() {
+        double log_topology_prior    = Updater::calcLogTopologyPrior();
+#if defined(HOLDER_ETAL_PRIOR)
+        double log_edge_length_prior = Updater::calcLogEdgeLengthPrior();
+#else
+        auto TL_edgeprop_prior = Updater::calcLogEdgeLengthPrior();
+        double log_edge_length_prior = TL_edgeprop_prior.first + TL_edgeprop_prior.second;
+#endif
+        return log_topology_prior + log_edge_length_prior;
+    }
+
+    inline double SubtreeRegraftUpdater::calcLogRefDist() {
+        return _tree_manipulator->calcLogReferenceCladeProb(_conditional_clade_store);
+    }
+
+    inline bool SubtreeRegraftUpdater::providesLogPriorDelta() const {
+        // Moves keep the tree length, the number of edges and the resolution class, so the
+        // prior is unchanged unless edge proportions have a non-flat Dirichlet prior
+#if defined(HOLDER_ETAL_PRIOR)
+        return true;
+#else
+        return _prior_parameters[2] == 1.0;
+#endif
+    }
+
+    inline Node * SubtreeRegraftUpdater::getEvaluationNode() const {
+        return _evaluation_node;
+    }
+
+    inline double SubtreeRegraftUpdater::update(double prev_lnL) {
+        // Statistics are restarted whenever setTuning restarts the acceptance counts
+        if (_nattempts == 0) {
+            _ntopology_proposed = 0;
+            _ntopology_accepted = 0;
+            _sum_move_distance  = 0.0;
+            _npartials          = 0;
+            _seconds            = 0.0;
+        }
+
+        // _topology_changed and _move_distance are set by proposeNewState (reset leaves them alone)
+        unsigned naccepts = _naccepts;
+        unsigned long npartials = _likelihood->getNumPartialsCalculated();
+        auto start = std::chrono::steady_clock::now();
+        double log_likelihood = Updater::update(prev_lnL);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        _seconds += elapsed.count();
+        _npartials += _likelihood->getNumPartialsCalculated() - npartials;
+        if (_topology_changed) {
+            _ntopology_proposed++;
+            if (_naccepts > naccepts) {
+                _ntopology_accepted++;
+                _sum_move_distance += _move_distance;
+            }
+        }
+        return log_likelihood;
+    }
+
+    inline double SubtreeRegraftUpdater::getTopologyChangePct() const {
+        return (_nattempts == 0 ? 0.0 : 100.0*_ntopology_proposed/_nattempts);
+    }
+
+    inline double SubtreeRegraftUpdater::getTopologyAcceptPct() const {
+        return (_ntopology_proposed == 0 ? 0.0 : 100.0*_ntopology_accepted/_ntopology_proposed);
+    }
+
+    inline double SubtreeRegraftUpdater::getMeanMoveDistance() const {
+        return (_ntopology_accepted == 0 ? 0.0 : _sum_move_distance/_ntopology_accepted);
+    }
+
+    inline double SubtreeRegraftUpdater::getPartialsPerUpdate() const {
+        return (_nattempts == 0 ? 0.0 : (double)_npartials/_nattempts);
+    }
+
+    inline double SubtreeRegraftUpdater::getSecondsPerUpdate() const {
+        return (_nattempts == 0 ? 0.0 : _seconds/_nattempts);
+    }
+
+    inline void SubtreeRegraftUpdater::saveTree() {
+        // Rejected proposals restore the links and edge lengths of every node, which costs
+        // far less than the likelihood calculation and is simpler than undoing a TBR move
+        for (auto & nd : _tree_manipulator->getTree()->_nodes) {
+            SavedNode & sn = _saved[nd._number];
+            sn._parent      = nd._parent;
+            sn._left_child  = nd._left_child;
+            sn._right_sib   = nd._right_sib;
+            sn._edge_length = nd._edge_length;
+        }
+    }
+
+    inline void SubtreeRegraftUpdater::restoreTree() {
+        for (auto & nd : _tree_manipulator->getTree()->_nodes) {
+            SavedNode & sn = _saved[nd._number];
+            nd._parent      = sn._parent;
+            nd._left_child  = sn._left_child;
+            nd._right_sib   = sn._right_sib;
+            nd._edge_length = sn._edge_length;
+        }
+        _tree_manipulator->refreshNavigationPointers();
+    }
+
+    inline unsigned SubtreeRegraftUpdater::collectRegraftTargets(Node * start, bool keep) {
+        // Counts the edges (each identified by the node below it) within _radius edges of the
+        // edge above start, including that edge itself, in the tree from which _s has been
+        // pruned. Edges sharing a node are adjacent; the root tip ends the edge above the
+        // subroot. If keep is true, the edges and their distances are left in _targets
+        // and _distances.
+        unsigned stamp = ++_visit_stamp;
+        _targets.clear();
+        _distances.clear();
+        _targets.push_back(start);
+        _distances.push_back(0);
+        _visited[start->_number] = stamp;
+        for (unsigned i = 0; i < _targets.size(); i++) {
+            Node * nd = _targets[i];
+            unsigned d = _distances[i] + 1;
+            if (_radius > 0 && d > _radius)
+                continue;
+            for (Node * child = nd->_left_child; child; child = child->_right_sib) {
+                if (_visited[child->_number] != stamp) {
+                    _visited[child->_number] = stamp;
+                    _targets.push_back(child);
+                    _distances.push_back(d);
+                }
+            }
+            Node * par = nd->_parent;
+            if (par->_parent) {
+                for (Node * sib = par->_left_child; sib; sib = sib->_right_sib) {
+                    if (_visited[sib->_number] != stamp) {
+                        _visited[sib->_number] = stamp;
+                        _targets.push_back(sib);
+                        _distances.push_back(d);
+                    }
+                }
+                if (_visited[par->_number] != stamp) {
+                    _visited[par->_number] = stamp;
+                    _targets.push_back(par);
+                    _distances.push_back(d);
+                }
+            }
+        }
+        unsigned n = (unsigned)_targets.size();
+        if (!keep) {
+            _targets.clear();
+            _distances.clear();
+        }
+        return n;
+    }
+
+    inline unsigned SubtreeRegraftUpdater::collectRerootTargets(bool keep) {
+        // Counts the ways of rerooting the pruned subtree (root _s, which has no parent): on any
+        // edge within _radius edges of its root edge, which joins _s's two children, plus not
+        // rerooting it at all. An edge is identified by the node below it, which lies at a depth
+        // of 2 to _radius + 1 below _s. If keep is true, the nodes are left in _targets, with
+        // their depth less one (the number of edges moved across) in _distances.
+        _targets.clear();
+        _distances.clear();
+        for (Node * child = _s->_left_child; child; child = child->_right_sib) {
+            _targets.push_back(child);
+            _distances.push_back(0);
+        }
+        unsigned first = (unsigned)_targets.size();
+        for (unsigned i = 0; i < _targets.size(); i++) {
+            unsigned d = _distances[i] + 1;
+            if (d > _radius)
+                continue;
+            for (Node * child = _targets[i]->_left_child; child; child = child->_right_sib) {
+                _targets.push_back(child);
+                _distances.push_back(d);
+            }
+        }
+        _targets.erase(_targets.begin(), _targets.begin() + first);
+        _distances.erase(_distances.begin(), _distances.begin() + first);
+        unsigned n = (unsigned)_targets.size() + 1;
+        if (!keep) {
+            _targets.clear();
+            _distances.clear();
+        }
+        return n;
+    }
+
+    inline double SubtreeRegraftUpdater::rerootSubtree(Node * q) {
+        // Reroots the pruned subtree on the edge above q, where q lies at least two edges
+        // below _s. The edges above _s's children v1 and w are merged, the edges along the path
+        // from v1 down to q's parent r are reversed, and _s is placed on the edge above q:
+        //
+        //            q                         w  x
+        //            |                          \ |
+        //        x   r                           v1
+        //         \ /                             |
+        //      w   v1            ==>          q   r
+        //       \ /                            \ /
+        //        s                              s
+        //
+        // Returns the log Jacobian, the log of the ratio of the split edge's length to the
+        // merged one's.
+        _path.clear();
+        for (Node * nd = q; nd != _s; nd = nd->_parent)
+            _path.push_back(nd);
+        unsigned k = (unsigned)_path.size();
+        assert(k > 1);
+        Node * v1 = _path[k-1];
+        Node * r  = _path[1];
+        Node * w  = (_s->_left_child == v1 ? v1->_right_sib : _s->_left_child);
+        assert(w && w != v1);
+
+        // Merge the edges above v1 and w, making v1 the root
+        double merged_edgelen = v1->_edge_length + w->_edge_length;
+        _tree_manipulator->detachSubtree(v1);
+        _tree_manipulator->detachSubtree(w);
+        _tree_manipulator->insertSubtreeOnRight(w, v1);
+        w->setEdgeLength(merged_edgelen);
+        w->selectTMatrix();
+
+        // Reverse each edge on the path from v1 down to r, moving the root down to r
+        for (unsigned j = k - 1; j > 1; j--) {
+            Node * par   = _path[j];
+            Node * child = _path[j-1];
+            double edgelen = child->_edge_length;
+            _tree_manipulator->detachSubtree(child);
+            _tree_manipulator->insertSubtreeOnRight(par, child);
+            par->setEdgeLength(edgelen);
+            par->selectTMatrix();
+        }
+
+        // Place _s on the edge above q
+        double split_edgelen = q->_edge_length;
+        _tree_manipulator->detachSubtree(q);
+        _tree_manipulator->insertSubtreeOnLeft(r, _s);
+        _tree_manipulator->insertSubtreeOnLeft(q, _s);
+        double u = _lot->uniform();
+        q->setEdgeLength(u*split_edgelen);
+        r->setEdgeLength((1.0 - u)*split_edgelen);
+        q->selectTMatrix();
+        r->selectTMatrix();
+
+        return log(split_edgelen) - log(merged_edgelen);
+    }
+
+    inline Node * SubtreeRegraftUpdater::findCommonAncestor(Node * a, Node * b) const {
+        unsigned depth_a = 0;
+        for (Node * nd = a; nd->_parent; nd = nd->_parent)
+            depth_a++;
+        unsigned depth_b = 0;
+        for (Node * nd = b; nd->_parent; nd = nd->_parent)
+            depth_b++;
+        for (; depth_a > depth_b; depth_a--)
+            a = a->_parent;
+        for (; depth_b > depth_a; depth_b--)
+            b = b->_parent;
+        while (a != b) {
+            a = a->_parent;
+            b = b->_parent;
+        }
+        return a;
+    }
+
+    inline void SubtreeRegraftUpdater::proposeNewState() {
+        Tree::SharedPtr tree = _tree_manipulator->getTree();
+        assert(!tree->isRooted());
+        assert(_saved.size() == tree->_nodes.size());
+        saveTree();
+        _log_prior_delta = 0.0;
+
+        // Choose the subtree s to move: any node other than the subroot (_preorder[0]), so the
+        // parent p of s is an internal node (possibly the subroot). Let c be the sibling of s
+        // and g the parent of p. Pruning s removes p, joining c to g by an edge whose length is
+        // the sum of the edges above c and p. Then p is regrafted onto the edge above t, whose
+        // parent is x, splitting it at a uniform point:
+        //
+        //      s   c                                         t   s
+        //       \ /                                           \ /
+        //        p   t                                 c       p
+        //         \ /                                   \     /
+        //          g ... x            ==>                g ... x
+        //
+        // If t is c, the topology is unchanged and only the edges above c and p change.
+        unsigned nchoices = (unsigned)tree->_preorder.size() - 1;
+        assert(nchoices > 0);
+        unsigned i = std::min((unsigned)(_lot->uniform()*nchoices), nchoices - 1);
+        _s = tree->_preorder[1 + i];
+        _p = _s->_parent;
+        _g = _p->_parent;
+        Node * c = (_p->_left_child == _s ? _s->_right_sib : _p->_left_child);
+        assert(c && c != _s);
+        if (_tree_manipulator->countChildren(_p) != 2)
+            throw XLorad(boost::format("The %s updater requires a bifurcating tree") % _name);
+
+        // Prune
+        double merged_edgelen = c->_edge_length + _p->_edge_length;
+        _tree_manipulator->detachSubtree(_s);
+        _tree_manipulator->detachSubtree(c);
+        _tree_manipulator->detachSubtree(_p);
+        _tree_manipulator->insertSubtreeOnRight(c, _g);
+        c->setEdgeLength(merged_edgelen);
+
+        // Choose the edge to regraft onto, then count the edges within reach of it
+        // (the edges within reach of the old attachment point after the reverse move)
+        unsigned nforward = collectRegraftTargets(c, true);
+        i = std::min((unsigned)(_lot->uniform()*nforward), nforward - 1);
+        Node * t = _targets[i];
+        _move_distance = _distances[i];
+        unsigned nreverse = (t == c ? nforward : collectRegraftTargets(t, false));
+        _log_hastings_ratio = log(nforward) - log(nreverse);
+
+        // A TBR move also reroots the pruned subtree (or leaves it as it is)
+        Node * rerooted = 0;
+        _log_jacobian = 0.0;
+        if (_reroot) {
+            nforward = collectRerootTargets(true);
+            i = std::min((unsigned)(_lot->uniform()*nforward), nforward - 1);
+            if (i < nforward - 1) {
+                Node * q = _targets[i];
+                _move_distance += _distances[i];
+                _log_jacobian += rerootSubtree(q);
+                rerooted = _path.back();    // v1, the deepest node on the reversed path
+                nreverse = collectRerootTargets(false);
+                _log_hastings_ratio += log(nforward) - log(nreverse);
+            }
+        }
+
+        // Regraft
+        Node * x = t->_parent;
+        double split_edgelen = t->_edge_length;
+        _tree_manipulator->detachSubtree(t);
+        _tree_manipulator->insertSubtreeOnLeft(_s, _p);
+        _tree_manipulator->insertSubtreeOnLeft(t, _p);
+        _tree_manipulator->insertSubtreeOnRight(_p, x);
+        double u = _lot->uniform();
+        t->setEdgeLength(u*split_edgelen);
+        _p->setEdgeLength((1.0 - u)*split_edgelen);
+        _log_jacobian += log(split_edgelen) - log(merged_edgelen);
+        _tree_manipulator->refreshNavigationPointers();
+        _topology_changed = (t != c || rerooted);
+
+        // Flag partials and transition matrices for recalculation: the partials of g and p and
+        // of their ancestors (and those along the rerooting path) change, and the edges above
+        // c, t and p (and those on the rerooting path) have new lengths
+        _tree_manipulator->selectPartialsHereToRoot(rerooted ? rerooted : _p);
+        if (_g->_parent)
+            _tree_manipulator->selectPartialsHereToRoot(_g);
+        c->selectTMatrix();
+        t->selectTMatrix();
+        _p->selectTMatrix();
+
+        // Everything that changed is within the subtree of the common ancestor of g and p
+        // (the root tip, if g was the root tip, means the likelihood must be fully recalculated)
+        _evaluation_node = (_g->_parent ? findCommonAncestor(_g, _p) : 0);
+    }
+
+    inline void SubtreeRegraftUpdater::revert() {
+        restoreTree();
+    }
+
+}
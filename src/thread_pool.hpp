@@ -0,0 +1,144 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+namespace lorad {
+
+    // A fixed set of worker threads used to run the iterations 0, 1, ..., ntasks-1 of a parallel
+    // loop. The calling thread takes part in the loop and run returns only when every iteration
+    // has finished; the first exception thrown by an iteration is rethrown in the calling thread.
+    // Dispatching a loop does not allocate, so run may be called during MCMC iterations.
+    class ThreadPool {
+        public:
+                                        ThreadPool(unsigned nthreads);
+                                        ~ThreadPool();
+
+            unsigned                    getNumThreads() const;
+
+            template <class F>
+            void                        run(unsigned ntasks, F & task);
+
+        private:
+
+            typedef void (*invoker_t)(void *, unsigned);
+
+            template <class F>
+            static void                 invoke(void * task, unsigned i);
+
+            void                        dispatch(unsigned ntasks, invoker_t invoker, void * task);
+            void                        work();
+            void                        runTasks(std::unique_lock<std::mutex> & lock);
+
+            std::vector<std::thread>    _workers;
+            std::mutex                  _mutex;
+            std::condition_variable     _start;
+            std::condition_variable     _finished;
+            invoker_t                   _invoker;
+            void *                      _task;
+            unsigned                    _ntasks;
+            unsigned                    _next_task;
+            unsigned                    _ndone;
+            unsigned long               _loop;          // incremented each time a loop is dispatched
+            bool                        _stopping;
+            std::exception_ptr          _exception;
+
+        public:
+
+            typedef std::shared_ptr< ThreadPool >   SharedPtr;
+    };
+
+    inline ThreadPool::ThreadPool(unsigned nthreads) : _invoker(0), _task(0), _ntasks(0), _next_task(0), _ndone(0), _loop(0), _stopping(false) {
+        // The calling thread counts as one of the nthreads
+        for (unsigned i = 1; i < nthreads; i++)
+            _workers.push_back(std::thread(&ThreadPool::work, this));
+    }
+
+    inline ThreadPool::~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+            _stopping = true;
+        }
+        _start.notify_all();
+        for (auto & w : _workers)
+            w.join();
+    }
+
+    inline unsigned ThreadPool::getNumThreads() const {
+        return (unsigned)_workers.size() + 1;
+    }
+
+    template <class F>
+    inline void ThreadPool::invoke(void * task, unsigned i) {
+        (*static_cast<F *>(task))(i);
+    }
+
+    template <class F>
+    inline void ThreadPool::run(unsigned ntasks, F & task) {
+        if (_workers.empty() || ntasks < 2) {
+            for (unsigned i = 0; i < ntasks; i++)
+                task(i);
+        }
+        else
+            dispatch(ntasks, &ThreadPool::invoke<F>, &task);
+    }
+
+    inline void ThreadPool::dispatch(unsigned ntasks, invoker_t invoker, void * task) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _invoker   = invoker;
+        _task      = task;
+        _ntasks    = ntasks;
+        _next_task = 0;
+        _ndone     = 0;
+        _exception = nullptr;
+        ++_loop;
+        _start.notify_all();
+
+        runTasks(lock);
+        _finished.wait(lock, [this]{return _ndone == _ntasks;});
+
+        if (_exception) {
+            std::exception_ptr e = _exception;
+            _exception = nullptr;
+            lock.unlock();
+            std::rethrow_exception(e);
+        }
+    }
+
+    inline void ThreadPool::work() {
+        unsigned long seen = 0;
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;) {
+            _start.wait(lock, [this, &seen]{return _stopping || _loop != seen;});
+            if (_stopping)
+                return;
+            seen = _loop;
+            runTasks(lock);
+        }
+    }
+
+    inline void ThreadPool::runTasks(std::unique_lock<std::mutex> & lock) {
+        // Called with the lock held; the lock is released while an iteration runs
+        while (_next_task < _ntasks) {
+            unsigned i = _next_task++;
+            lock.unlock();
+            std::exception_ptr e;
+            try {
+                _invoker(_task, i);
+            }
+            catch (...) {
+                e = std::current_exception();
+            }
+            lock.lock();
+            if (e && !_exception)
+                _exception = e;
+            if (++_ndone == _ntasks)
+                _finished.notify_all();
+        }
+    }
+
+}
@@ -13,6 +13,9 @@ namespace lorad {
     class TreeUpdater;
     class PolytomyUpdater;  
     class EdgeProportionUpdater;
+    class EdgeLengthHMCUpdater;
+    class SubtreeRegraftUpdater;
+    class Chain;
 
     class Tree {
 
@@ -22,6 +25,9 @@ namespace lorad {
             friend class TreeUpdater;
             friend class PolytomyUpdater;   
             friend class EdgeProportionUpdater;
+            friend class EdgeLengthHMCUpdater;
+            friend class SubtreeRegraftUpdater;
+            friend class Chain;
 
         public:
 
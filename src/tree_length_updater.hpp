@@ -17,6 +17,7 @@ namespace lorad {
             virtual void                clear();
             virtual void                proposeNewState();
             virtual void                revert();
+            virtual bool                providesLogPriorDelta() const;
 
             virtual double              calcLogPrior();
             double                      calcLogRefDist();
@@ -59,9 +60,19 @@ namespace lorad {
         // calculate log of Hastings ratio under independent exponential priors
         double num_edges = _tree_manipulator->countEdges();
         _log_hastings_ratio = num_edges*log(m);
+
+        // Scaling all edges changes the sum of independent Exp(r) edge length priors
+        // only through the tree length
+        double exponential_rate = _prior_parameters[0];
+        _log_prior_delta = -exponential_rate*(_curr_point - _prev_point);
 #else
         // calculate log of Hastings ratio under GammaDir parameterization
         _log_hastings_ratio = log(m);
+
+        // Edge length proportions are unchanged, so only the Gamma(a,b) prior on TL changes
+        double a = _prior_parameters[0];
+        double b = _prior_parameters[1];
+        _log_prior_delta = (a - 1.0)*log(m) - (_curr_point - _prev_point)/b;
 #endif
 
         // This proposal invalidates all transition matrices and partials
@@ -78,6 +89,10 @@ namespace lorad {
         pushToModel();
     }
 
+    inline bool TreeLengthUpdater::providesLogPriorDelta() const {
+        return true;
+    }
+
     inline double TreeLengthUpdater::calcLogPrior() {
 #if defined(HOLDER_ETAL_PRIOR)
         return Updater::calcLogEdgeLengthPrior();
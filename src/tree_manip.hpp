@@ -7,7 +7,6 @@
 #include <cassert>
 #include <memory>
 #include <stack>
-#include <queue>
 #include <set>
 #include <regex>
 #include <boost/range/adaptor/reversed.hpp>
@@ -68,9 +67,9 @@ namespace lorad {
             
             void                        selectAll();
             void                        deselectAll();
-            void                        selectAllPartials();
+            void                        selectAllPartials(Node::subset_mask_t subsets = Node::_all_subsets);
             void                        deselectAllPartials();
-            void                        selectAllTMatrices();
+            void                        selectAllTMatrices(Node::subset_mask_t subsets = Node::_all_subsets);
             void                        deselectAllTMatrices();
             void                        selectPartialsHereToRoot(Node * a);
             void                        flipPartialsAndTMatrices();
@@ -498,10 +497,9 @@ namespace lorad {
         if (!_tree->_root)
             return;
 
-        // q is the buffer queue
-        std::queue<Node *> q;
-
-        // _tree->_levelorder is the stack vector
+        // _tree->_levelorder is the stack vector, and the portion of it beyond
+        // position next serves as the buffer queue (so no separate queue needs
+        // to be allocated each time the level order is refreshed)
         _tree->_levelorder.clear();
         _tree->_levelorder.reserve(_tree->_nodes.size() - 1);
 
@@ -511,26 +509,19 @@ namespace lorad {
         assert(nd->_right_sib == 0);
 
         // Push nd onto back of queue
-        q.push(nd);
-
-        while (!q.empty()) {
-            // pop nd off front of queue
-            nd = q.front(); q.pop();
+        _tree->_levelorder.push_back(nd);
 
-            // and push it onto the stack
-            _tree->_levelorder.push_back(nd);
+        for (unsigned next = 0; next < _tree->_levelorder.size(); ++next) {
+            // pop nd off front of queue (it is already in its place on the stack)
+            nd = _tree->_levelorder[next];
 
             // add all children of nd to back of queue
             Node * child = nd->_left_child;
-            if (child) {
-                q.push(child);
+            while (child) {
+                _tree->_levelorder.push_back(child);
                 child = child->_right_sib;
-                while (child) {
-                    q.push(child);
-                    child = child->_right_sib;
-                }
             }
-        }   // end while loop
+        }   // end for loop
     }
 
     inline void TreeManip::renumberInternals() {    
@@ -1290,86 +1281,55 @@ namespace lorad {
             //          (b)                 (b)
             assert(b == y->_parent);
             
-            // Remove x's children from tree and store in xchildren stack
-            std::stack<Node *> xchildren;
-            Node * child = x->_left_child;
-            Node * prevchild = 0;
-            while (child) {
-                if (child == a) {
-                    prevchild = child;
+            // Remove a from x's children, leaving the rest of x's children as a list
+            // linked through _right_sib (no stack is needed to hold them)
+            Node * xchildren = x->_left_child;
+            if (a == xchildren) {
+                xchildren = a->_right_sib;
+            } else {
+                Node * child = xchildren;
+                while (child->_right_sib != a)
                     child = child->_right_sib;
-                } else {
-                    if (child == x->_left_child) {
-                        x->_left_child = child->_right_sib;
-                        child->_right_sib = 0;
-                        child->_parent = 0;
-                        xchildren.push(child);
-                        child = x->_left_child;
-                    } else if (child->_right_sib) {
-                        prevchild->_right_sib = child->_right_sib;
-                        child->_right_sib = 0;
-                        child->_parent = 0;
-                        xchildren.push(child);
-                        child = prevchild->_right_sib;
-                    } else {
-                        assert(prevchild == a);
-                        a->_right_sib = 0;
-                        child->_parent = 0;
-                        xchildren.push(child);
-                        child = 0;
-                        prevchild = 0;
-                    }
-                }
+                child->_right_sib = a->_right_sib;
             }
+            a->_right_sib = 0;
+            x->_left_child = a;
             
-            // Remove y's children from tree and store in ychildren stack
-            std::stack<Node *> ychildren;
-            child = y->_left_child;
-            prevchild = 0;
-            while (child) {
-                if (child == x) {
-                    prevchild = child;
+            // Remove x from y's children, leaving the rest of y's children as a list
+            Node * ychildren = y->_left_child;
+            if (x == ychildren) {
+                ychildren = x->_right_sib;
+            } else {
+                Node * child = ychildren;
+                while (child->_right_sib != x)
                     child = child->_right_sib;
-                } else {
-                    if (child == y->_left_child) {
-                        y->_left_child = child->_right_sib;
-                        child->_right_sib = 0;
-                        child->_parent = 0;
-                        ychildren.push(child);
-                        child = y->_left_child;
-                    } else if (child->_right_sib) {
-                        prevchild->_right_sib = child->_right_sib;
-                        child->_right_sib = 0;
-                        child->_parent = 0;
-                        ychildren.push(child);
-                        child = prevchild->_right_sib;
-                    } else {
-                        assert(prevchild == x);
-                        x->_right_sib = 0;
-                        child->_parent = 0;
-                        ychildren.push(child);
-                        child = 0;
-                        prevchild = 0;
-                    }
-                }
+                child->_right_sib = x->_right_sib;
             }
+            x->_right_sib = 0;
+            y->_left_child = x;
             
-            // Reattach xchildren to y
-            while (!xchildren.empty()) {
-                Node * popped = xchildren.top();
-                xchildren.pop();
-                popped->_right_sib = y->_left_child;
-                y->_left_child = popped;
-                popped->_parent = y;
+            // Reattach xchildren to y (in their original order, ahead of x)
+            if (xchildren) {
+                Node * last = xchildren;
+                last->_parent = y;
+                while (last->_right_sib) {
+                    last = last->_right_sib;
+                    last->_parent = y;
+                }
+                last->_right_sib = x;
+                y->_left_child = xchildren;
             }
 
-            // Reattach ychildren to x
-            while (!ychildren.empty()) {
-                Node * popped = ychildren.top();
-                ychildren.pop();
-                popped->_right_sib = x->_left_child;
-                x->_left_child = popped;
-                popped->_parent = x;
+            // Reattach ychildren to x (in their original order, ahead of a)
+            if (ychildren) {
+                Node * last = ychildren;
+                last->_parent = x;
+                while (last->_right_sib) {
+                    last = last->_right_sib;
+                    last->_parent = x;
+                }
+                last->_right_sib = a;
+                x->_left_child = ychildren;
             }
         }
         
@@ -1389,9 +1349,9 @@ namespace lorad {
         }
     }
 
-    inline void TreeManip::selectAllPartials() {
+    inline void TreeManip::selectAllPartials(Node::subset_mask_t subsets) {
         for (auto & nd : _tree->_nodes)
-            nd.selectPartial();
+            nd.selectPartial(subsets);
     }
 
     inline void TreeManip::deselectAllPartials() {
@@ -1400,9 +1360,9 @@ namespace lorad {
         }
     }
 
-    inline void TreeManip::selectAllTMatrices() {
+    inline void TreeManip::selectAllTMatrices(Node::subset_mask_t subsets) {
         for (auto & nd : _tree->_nodes)
-            nd.selectTMatrix();
+            nd.selectTMatrix(subsets);
     }
 
     inline void TreeManip::deselectAllTMatrices() {
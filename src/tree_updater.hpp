@@ -28,6 +28,8 @@ namespace lorad {
             void                                starTreeMove(); 
 
             virtual void                        reset();
+            virtual Node *                      getEvaluationNode() const;
+            virtual bool                        providesLogPriorDelta() const;
 
             double                              _orig_edgelen_top;
             double                              _orig_edgelen_middle;
@@ -53,6 +55,7 @@ namespace lorad {
     
     inline void TreeUpdater::reset() {
         _topology_changed       = false;
+        _star_tree_move         = false;
         _orig_edgelen_top       = 0.0;
         _orig_edgelen_middle    = 0.0;
         _orig_edgelen_bottom    = 0.0;
@@ -75,6 +78,25 @@ namespace lorad {
         return log_topology_prior + log_edge_length_prior;
     }
 
+    inline Node * TreeUpdater::getEvaluationNode() const {
+        // A Larget-Simon move only changes partials at or below _y (and the edges above _a, _x
+        // and either _b or _y), so nothing outside the subtree rooted at _y needs to be
+        // recalculated if it is scored at _y's edge (_y is 0 after a star tree move, which is
+        // therefore scored by the full calculation)
+        return _y;
+    }
+
+    inline bool TreeUpdater::providesLogPriorDelta() const {
+        // Both moves keep the tree length (apart from edges held at Node::_smallest_edge_length),
+        // the number of edges and the resolution class, so the prior is unchanged unless edge
+        // proportions have a non-flat Dirichlet prior
+#if defined(HOLDER_ETAL_PRIOR)
+        return true;
+#else
+        return _prior_parameters[2] == 1.0;
+#endif
+    }
+    
     inline void TreeUpdater::starTreeMove() {    
         // Choose focal 2-edge segment to modify
         _orig_edgelen_middle = 0.0;
@@ -110,6 +132,7 @@ namespace lorad {
     inline void TreeUpdater::proposeNewState() {    
         _case = 0;
         _topology_changed = false;
+        _log_prior_delta = 0.0;
         assert(!_tree_manipulator->getTree()->isRooted());
 
         // Choose random internal node x that is not the root and has parent y that is also not the root.
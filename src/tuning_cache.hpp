@@ -0,0 +1,191 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <cassert>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <boost/format.hpp>
+#include "xlorad.hpp"
+
+namespace lorad {
+
+    // Stores the tuning parameters (lambdas) and weights reached by each chain's updaters at
+    // the end of burn-in so that a later run on the same data, partition and model can start
+    // from them instead of tuning from scratch. The cache is a plain text file identified by a
+    // key, a hash of a text description of the data, partition and model; a file whose key
+    // differs from the current one is ignored. The number of tuning updates each updater has
+    // already made is saved too, so that tuning can resume where the Robbins-Monro schedule
+    // of Updater::tune left off rather than making large early adjustments again. Updaters
+    // whose lambda depends on other learned quantities (see Updater::getAdaptation) have
+    // those saved in an adapt record following their updater record.
+    //
+    // File format (one record per line, fields separated by tabs, updater name last because
+    // names contain spaces):
+    //
+    //   key      <16 hex digits>
+    //   chain    <chain index>
+    //   updater  <lambda> <weight> <number of tuning updates> <updater name>
+    //   adapt    <number of values> <values>
+    class TuningCache {
+
+        public:
+
+            typedef std::shared_ptr< TuningCache > SharedPtr;
+
+            struct UpdaterTuning {
+                UpdaterTuning() : _lambda(0.0), _weight(0.0), _ntuned(0) {}
+                std::string             _name;
+                double                  _lambda;
+                double                  _weight;
+                unsigned                _ntuned;
+                std::vector<double>     _adaptation;
+            };
+            typedef std::vector<UpdaterTuning> chain_tuning_t;
+
+                                        TuningCache();
+                                        ~TuningCache();
+
+            void                        clear();
+            void                        setKey(const std::string & description);
+            const std::string &         getKey() const;
+
+            bool                        load(const std::string & filename);
+            void                        save(const std::string & filename) const;
+
+            bool                        hasChain(unsigned chain_index) const;
+            const chain_tuning_t &      getChain(unsigned chain_index) const;
+            void                        setChain(unsigned chain_index, const chain_tuning_t & tuning);
+
+        private:
+
+            static std::string          calcHash(const std::string & s);
+
+            std::string                 _key;
+            std::map<unsigned, chain_tuning_t> _chains;
+    };
+
+    inline TuningCache::TuningCache() {
+        clear();
+    }
+
+    inline TuningCache::~TuningCache() {
+    }
+
+    inline void TuningCache::clear() {
+        _key.clear();
+        _chains.clear();
+    }
+
+    inline std::string TuningCache::calcHash(const std::string & s) {
+        // 64-bit FNV-1a, used (rather than std::hash) because the key must not change between builds
+        std::uint64_t h = 14695981039346656037ULL;
+        for (unsigned char ch : s) {
+            h ^= ch;
+            h *= 1099511628211ULL;
+        }
+        return boost::str(boost::format("%016x") % h);
+    }
+
+    inline void TuningCache::setKey(const std::string & description) {
+        _key = calcHash(description);
+    }
+
+    inline const std::string & TuningCache::getKey() const {
+        return _key;
+    }
+
+    inline bool TuningCache::load(const std::string & filename) {
+        // Returns false if the file does not exist or was made for different data, partition or model
+        assert(!_key.empty());
+        _chains.clear();
+        std::ifstream inf(filename.c_str());
+        if (!inf.good())
+            return false;
+
+        std::string line;
+        std::string file_key;
+        chain_tuning_t * curr_chain = nullptr;
+        unsigned line_number = 0;
+        while (std::getline(inf, line)) {
+            line_number++;
+            if (line.empty() || line[0] == '#')
+                continue;
+            std::istringstream iss(line);
+            std::string record;
+            iss >> record;
+            if (record == "key")
+                iss >> file_key;
+            else if (record == "chain") {
+                unsigned chain_index = 0;
+                if (!(iss >> chain_index))
+                    throw XLorad(boost::format("Bad chain record on line %d of the tuning cache file %s") % line_number % filename);
+                curr_chain = &_chains[chain_index];
+                curr_chain->clear();
+            }
+            else if (record == "updater") {
+                UpdaterTuning u;
+                if (!curr_chain || !(iss >> u._lambda >> u._weight >> u._ntuned))
+                    throw XLorad(boost::format("Bad updater record on line %d of the tuning cache file %s") % line_number % filename);
+                std::getline(iss >> std::ws, u._name);
+                curr_chain->push_back(u);
+            }
+            else if (record == "adapt") {
+                unsigned n = 0;
+                if (!curr_chain || curr_chain->empty() || !(iss >> n))
+                    throw XLorad(boost::format("Bad adapt record on line %d of the tuning cache file %s") % line_number % filename);
+                std::vector<double> & adaptation = curr_chain->back()._adaptation;
+                adaptation.resize(n);
+                for (unsigned i = 0; i < n; i++) {
+                    if (!(iss >> adaptation[i]))
+                        throw XLorad(boost::format("Bad adapt record on line %d of the tuning cache file %s") % line_number % filename);
+                }
+            }
+            else
+                throw XLorad(boost::format("Unknown record \"%s\" on line %d of the tuning cache file %s") % record % line_number % filename);
+        }
+
+        if (file_key != _key) {
+            _chains.clear();
+            return false;
+        }
+        return true;
+    }
+
+    inline void TuningCache::save(const std::string & filename) const {
+        std::ofstream outf(filename.c_str());
+        if (!outf.good())
+            throw XLorad(boost::format("Could not open the tuning cache file %s for writing") % filename);
+        outf << "# LoRaD tuning cache: lambda, weight, number of tuning updates and name of each updater (adapt: learned state of the updater above)\n";
+        outf << "key\t" << _key << "\n";
+        for (auto & c : _chains) {
+            outf << "chain\t" << c.first << "\n";
+            for (auto & u : c.second) {
+                outf << boost::format("updater\t%.17g\t%.17g\t%d\t%s\n") % u._lambda % u._weight % u._ntuned % u._name;
+                if (!u._adaptation.empty()) {
+                    outf << "adapt\t" << u._adaptation.size();
+                    for (double x : u._adaptation)
+                        outf << boost::format("\t%.17g") % x;
+                    outf << "\n";
+                }
+            }
+        }
+    }
+
+    inline bool TuningCache::hasChain(unsigned chain_index) const {
+        return _chains.count(chain_index) > 0;
+    }
+
+    inline const TuningCache::chain_tuning_t & TuningCache::getChain(unsigned chain_index) const {
+        assert(hasChain(chain_index));
+        return _chains.at(chain_index);
+    }
+
+    inline void TuningCache::setChain(unsigned chain_index, const chain_tuning_t & tuning) {
+        _chains[chain_index] = tuning;
+    }
+
+}
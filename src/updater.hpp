@@ -29,15 +29,21 @@ namespace lorad {
             void                                    setTreeManip(TreeManip::SharedPtr treemanip);
             void                                    setLot(Lot::SharedPtr lot);
             void                                    setLambda(double lambda);
+            virtual void                            swapLambda(Updater & other);
+            virtual void                            getAdaptation(std::vector<double> & state) const;
+            virtual bool                            setAdaptation(const std::vector<double> & state);
             void                                    setHeatingPower(double p);
             void                                    setSteppingstoneMode(unsigned mode);
             void                                    setTuning(bool on);
+            void                                    setTuningOffset(unsigned n);
             void                                    setTargetAcceptanceRate(double target);
             void                                    setPriorParameters(const std::vector<double> & c);
             void                                    setConditionalCladeStore(ConditionalCladeStore::SharedPtr ccs);
             void                                    setRefDistParameters(const std::vector<double> & c);
             void                                    setTopologyPriorOptions(bool resclass, double C);
             void                                    setWeight(double w);
+            void                                    setDelayedAcceptance(bool on);
+            void                                    setSubsets(const std::vector<unsigned> & subsets);
             void                                    calcProb(double wsum);
 
             double                                  getLambda() const;
@@ -45,6 +51,11 @@ namespace lorad {
             double                                  getProb() const;
             double                                  getAcceptPct() const;
             double                                  getNumUpdates() const;
+            unsigned                                getNumAccepts() const;
+            unsigned                                getNumTuningUpdates() const;
+            bool                                    isDelayedAcceptance() const;
+            double                                  getScreenedPct() const;
+            double                                  getLogPriorDelta() const;
             std::string                             getUpdaterName() const;
 
             virtual void                            clear();
@@ -57,6 +68,8 @@ namespace lorad {
 #else
             std::pair<double,double>                calcLogEdgeLengthPrior() const;
 #endif
+            void                                    calcEdgeLengthPriorDerivatives(double edge_length, double tree_length, double & d1, double & d2) const;
+            void                                    calcTreeLengthPriorDerivatives(double tree_length, double & d1, double & d2) const;
             //double                                  calcLogEdgeLengthRefDist() const;
             virtual double                          calcLogRefDist() = 0;
             double                                  calcLogLikelihood() const;
@@ -68,9 +81,15 @@ namespace lorad {
 
             virtual void                            reset();
             virtual void                            tune(bool accepted);
+            virtual void                            reserveWorkspace();
 
             virtual void                            revert() = 0;
             virtual void                            proposeNewState() = 0;
+            virtual Node *                          getEvaluationNode() const;
+            virtual bool                            providesLogPriorDelta() const;
+            double                                  calcLogAcceptanceRatio(double delta_log_likelihood, double delta_log_prior, double delta_log_refdist) const;
+            double                                  calcLogEdgeLengthPriorDelta(int delta_edges) const;
+            double                                  abandonProposal(bool screen, double prev_surrogate_lnL);
 
             Lot::SharedPtr                          _lot;
             Likelihood::SharedPtr                   _likelihood;
@@ -81,9 +100,13 @@ namespace lorad {
             double                                  _lambda;
             double                                  _log_hastings_ratio;
             double                                  _log_jacobian;
+            double                                  _log_prior_delta;   // change in log prior made by the last proposal (after update, 0 if it was rejected)
             double                                  _target_acceptance;
             unsigned                                _naccepts;
             unsigned                                _nattempts;
+            unsigned                                _nscreened;     // proposals rejected by the surrogate likelihood (delayed acceptance)
+            unsigned                                _tuning_offset; // tuning updates made before _nattempts began counting (e.g. in an earlier run)
+            bool                                    _delayed_acceptance;
             bool                                    _tuning;
             std::vector<double>                     _prior_parameters;
             ConditionalCladeStore::SharedPtr        _conditional_clade_store;
@@ -91,6 +114,7 @@ namespace lorad {
             unsigned                                _ss_mode;
             double                                  _heating_power;
             mutable PolytomyTopoPriorCalculator     _topo_prior_calculator;
+            Node::subset_mask_t                     _subset_mask;   // data subsets whose likelihood depends on the parameter updated
             
             static const double                     _log_zero;
     }; 
@@ -111,10 +135,15 @@ namespace lorad {
         _target_acceptance      = 0.3;
         _naccepts               = 0;
         _nattempts              = 0;
+        _nscreened              = 0;
+        _tuning_offset          = 0;
+        _delayed_acceptance     = false;
+        _log_prior_delta        = 0.0;
         _heating_power          = 1.0;
         _prior_parameters.clear();
         _refdist_parameters.clear();
         _ss_mode                = 0;    // no steppingstone
+        _subset_mask            = Node::_all_subsets;
         reset();
     } 
 
@@ -155,16 +184,39 @@ namespace lorad {
         _lambda = lambda;
     } 
 
+    inline void Updater::swapLambda(Updater & other) {
+        // Exchanges the tuned proposal scale with other (the updater in the same position in
+        // another chain) when the two chains swap heating powers
+        std::swap(_lambda, other._lambda);
+    }
+
+    inline void Updater::getAdaptation(std::vector<double> & state) const {
+        // Updaters whose _lambda only makes sense together with other learned quantities
+        // override this and setAdaptation so that the tuning cache can save them as well
+        state.clear();
+    }
+
+    inline bool Updater::setAdaptation(const std::vector<double> & state) {
+        // Returns false if state cannot be used, in which case the cached _lambda must not be either
+        return state.empty();
+    }
+
     void Updater::setTuning(bool do_tune) { 
         _tuning = do_tune;
         _naccepts = 0;
         _nattempts = 0;
+        _nscreened = 0;
     } 
 
+    inline void Updater::setTuningOffset(unsigned n) {
+        // Tuning continues the Robbins-Monro schedule as if n tuning updates had already been made
+        _tuning_offset = n;
+    }
+
     inline void Updater::tune(bool accepted) { 
         _nattempts++;
         if (_tuning) {
-            double gamma_n = 10.0/(100.0 + (double)_nattempts);
+            double gamma_n = 10.0/(100.0 + (double)(_tuning_offset + _nattempts));
             if (accepted)
                 _lambda *= 1.0 + gamma_n*(1.0 - _target_acceptance)/(2.0*_target_acceptance);
             else
@@ -198,6 +250,19 @@ namespace lorad {
         _weight = w;
     } 
     
+    inline void Updater::setDelayedAcceptance(bool on) {
+        // Proposals are screened using the likelihood's surrogate (if it has one) before
+        // the full likelihood is calculated
+        _delayed_acceptance = on;
+    }
+
+    inline void Updater::setSubsets(const std::vector<unsigned> & subsets) {
+        // Proposals select partials and transition matrices for these subsets only
+        _subset_mask = 0;
+        for (unsigned s : subsets)
+            _subset_mask |= Node::getSubsetMask(s);
+    }
+
     inline void Updater::calcProb(double wsum) { 
         assert(wsum > 0.0);
         _prob = _weight/wsum;
@@ -223,16 +288,81 @@ namespace lorad {
         return _nattempts;
     } 
 
+    inline unsigned Updater::getNumAccepts() const {
+        return _naccepts;
+    }
+
+    inline unsigned Updater::getNumTuningUpdates() const {
+        return (_tuning ? _tuning_offset + _nattempts : _tuning_offset);
+    }
+
+    inline bool Updater::isDelayedAcceptance() const {
+        return _delayed_acceptance;
+    }
+
+    inline double Updater::getScreenedPct() const {
+        return (_nattempts == 0 ? 0.0 : (100.0*_nscreened/_nattempts));
+    }
+
+    inline double Updater::getLogPriorDelta() const {
+        return _log_prior_delta;
+    }
+
     inline std::string Updater::getUpdaterName() const { 
         return _name;
     } 
 
+    inline void Updater::reserveWorkspace() {
+        // Updaters that need scratch storage during proposals override this to allocate
+        // it up front, so that no heap allocation occurs once the chain is running
+    }
+
+    inline Node * Updater::getEvaluationNode() const {
+        // Updaters that modify a small part of the tree override this to return the node
+        // whose edge is closest to the change; 0 means evaluate at the subroot's edge
+        return 0;
+    }
+
+    inline bool Updater::providesLogPriorDelta() const {
+        // Updaters whose proposals change the prior in a simple way override this to return
+        // true and set _log_prior_delta in proposeNewState, so that update need not calculate
+        // the prior before and after the proposal
+        return false;
+    }
+
     inline double Updater::calcLogLikelihood() const { 
-        return _likelihood->calcLogLikelihood(_tree_manipulator->getTree());
+        // Partials between the change and the evaluation edge are recalculated, but those
+        // beyond it are only marked stale and the pre-order partial at the edge is used instead
+        return _likelihood->calcLogLikelihoodAtEdge(_tree_manipulator->getTree(), getEvaluationNode());
     } 
 
+    inline double Updater::calcLogAcceptanceRatio(double delta_log_likelihood, double delta_log_prior, double delta_log_refdist) const {
+        double log_R = 0.0;
+        if (_ss_mode == 1) {
+            // Xie et al. 2011 steppingstone
+            log_R += _heating_power*delta_log_likelihood;
+            log_R += delta_log_prior;
+        }
+        else if (_ss_mode == 2) {
+            // Fan et al. 2011 generalized steppingstone
+            log_R += _heating_power*delta_log_likelihood;
+            log_R += _heating_power*delta_log_prior;
+            log_R += (1.0 - _heating_power)*delta_log_refdist;
+        }
+        else {
+            // normal heated chain
+            assert(_ss_mode == 0);
+            log_R += _heating_power*delta_log_likelihood;
+            log_R += _heating_power*delta_log_prior;
+        }
+        log_R += _log_hastings_ratio;
+        log_R += _log_jacobian;
+        return log_R;
+    }
+
     inline double Updater::update(double prev_lnL) { 
-        double prev_log_prior = calcLogPrior();
+        bool incremental_prior = providesLogPriorDelta();
+        double prev_log_prior = (incremental_prior ? 0.0 : calcLogPrior());
         double prev_log_refdist = 0.0;
         if (_ss_mode == 2) {
             // Steppingstone mode:
@@ -242,6 +372,15 @@ namespace lorad {
             prev_log_refdist = calcLogRefDist();
         }
         
+        // Delayed acceptance (Christen and Fox 2005): a proposal must first pass a
+        // Metropolis-Hastings test in which the surrogate likelihood stands in for the
+        // likelihood, and only then is the full likelihood calculated
+        Tree::SharedPtr tree = _tree_manipulator->getTree();
+        bool screen = (_delayed_acceptance && _likelihood->usingStoredData() && _likelihood->hasSurrogate());
+        double prev_surrogate_lnL = 0.0;
+        if (screen)
+            prev_surrogate_lnL = _likelihood->getCurrentSurrogateLogLikelihood(tree);
+        
         // Clear any nodes previously selected so that we can detect those nodes
         // whose partials and/or transition probabilities need to be recalculated
         _tree_manipulator->deselectAllPartials();
@@ -254,56 +393,93 @@ namespace lorad {
         // This allows us to easily revert to the previous values if the move is rejected
         _tree_manipulator->flipPartialsAndTMatrices();
 
-        // Calculate the log-likelihood and log-prior for the proposed state
-        double log_likelihood = calcLogLikelihood();
-        double log_prior = calcLogPrior();
+        // Calculate the change in log-prior caused by the proposal
+        double log_prior_delta = _log_prior_delta;
+        if (!incremental_prior) {
+            double log_prior = calcLogPrior();
+            log_prior_delta = (log_prior > _log_zero ? log_prior - prev_log_prior : _log_zero);
+        }
         
         // Decide whether to accept or reject the proposed state
-        bool accept = true;
-        if (log_prior > _log_zero) {
-            double log_R = 0.0;
-            if (_ss_mode == 1) {
-                // Xie et al. 2011 steppingstone
-                log_R += _heating_power*(log_likelihood - prev_lnL);
-                log_R += (log_prior - prev_log_prior);
-            }
-            else if (_ss_mode == 2) {
-                // Fan et al. 2011 generalized steppingstone
-                double log_refdist = calcLogRefDist();
-                log_R += _heating_power*(log_likelihood - prev_lnL);
-                log_R += _heating_power*(log_prior - prev_log_prior);
-                log_R += (1.0 - _heating_power)*(log_refdist - prev_log_refdist);
+        bool accept = (log_prior_delta > _log_zero);
+        double log_likelihood = prev_lnL;
+        double log_refdist = 0.0;
+        if (accept && _ss_mode == 2)
+            log_refdist = calcLogRefDist();
+        
+        double surrogate_lnL = 0.0;
+        if (accept && screen) {
+            surrogate_lnL = _likelihood->calcSurrogateLogLikelihood(tree);
+            double log_R = calcLogAcceptanceRatio(surrogate_lnL - prev_surrogate_lnL, log_prior_delta, log_refdist - prev_log_refdist);
+            double logu = _lot->logUniform();
+            if (logu > log_R) {
+                accept = false;
+                _nscreened++;
             }
-            else {
-                // normal heated chain
-                assert(_ss_mode == 0);
-                log_R += _heating_power*(log_likelihood - prev_lnL);
-                log_R += _heating_power*(log_prior - prev_log_prior);
+        }
+        
+        if (accept) {
+            // Calculate the log-likelihood for the proposed state
+            unsigned long promotion = _likelihood->getPromotionEvaluation();
+            log_likelihood = calcLogLikelihood();
+            if (_likelihood->getPromotionEvaluation() != promotion)
+                return abandonProposal(screen, prev_surrogate_lnL);
+            
+            double log_R = 0.0;
+            if (screen) {
+                // The second stage corrects for the error in the surrogate, so that the
+                // chain still has the exact posterior as its stationary distribution
+                log_R = _heating_power*((log_likelihood - prev_lnL) - (surrogate_lnL - prev_surrogate_lnL));
             }
-            log_R += _log_hastings_ratio;
-            log_R += _log_jacobian;
+            else
+                log_R = calcLogAcceptanceRatio(log_likelihood - prev_lnL, log_prior_delta, log_refdist - prev_log_refdist);
 
             double logu = _lot->logUniform();
             if (logu > log_R)
                 accept = false;
+            if (screen)
+                _likelihood->setCurrentSurrogateLogLikelihood(accept ? surrogate_lnL : prev_surrogate_lnL);
         }
-        else
-            accept = false;
 
         if (accept) {
             _naccepts++;
+            _log_prior_delta = log_prior_delta;
         }
         else {
             revert();
             _tree_manipulator->flipPartialsAndTMatrices();
             log_likelihood = prev_lnL;
+            _log_prior_delta = 0.0;
         }
+        
+        // Partials kept only in case the proposal was rejected are no longer needed
+        _likelihood->releaseSavedPartials();
 
         tune(accept);
         reset();
 
         return log_likelihood;
     } 
+
+    inline double Updater::abandonProposal(bool screen, double prev_surrogate_lnL) {
+        // The likelihood switched from single to double precision while the proposed state was
+        // being scored, so the proposed log-likelihood cannot be compared with the current one.
+        // A proposal cannot be replayed, so it is abandoned (neither accepted nor counted) and
+        // the current state is rescored in double precision; the chain then carries on from an
+        // unchanged state with a log-likelihood of the same precision as all later ones
+        revert();
+        _tree_manipulator->flipPartialsAndTMatrices();
+        _likelihood->releaseSavedPartials();
+        _tree_manipulator->deselectAllPartials();
+        _tree_manipulator->deselectAllTMatrices();
+        Tree::SharedPtr tree = _tree_manipulator->getTree();
+        double log_likelihood = _likelihood->calcLogLikelihood(tree);
+        if (screen)
+            _likelihood->setCurrentSurrogateLogLikelihood(prev_surrogate_lnL);
+        _log_prior_delta = 0.0;
+        reset();
+        return log_likelihood;
+    }
     
     inline void Updater::setTopologyPriorOptions(bool resclass, double C) {
         _topo_prior_calculator.setC(C);
@@ -453,6 +629,62 @@ namespace lorad {
 #endif
     }
 
+    inline double Updater::calcLogEdgeLengthPriorDelta(int delta_edges) const {
+        // Change in the log edge length prior made by a proposal that adds delta_edges edges
+        // (removes them if negative) but keeps the tree length; the tree must be in its proposed
+        // state. Under the Gamma-Dirichlet prior this is only valid if c == 1, because the
+        // Dirichlet term then depends on the number of edges alone
+#if defined(HOLDER_ETAL_PRIOR)
+        double exponential_rate = _prior_parameters[0];
+        return delta_edges*log(exponential_rate);
+#else
+        double c = _prior_parameters[2];
+        if (c != 1.0)
+            throw XLorad(boost::format("the change in the edge length prior from adding or removing edges is only available if the Dirichlet parameter is 1 (it is %g)") % c);
+        double num_edges = _tree_manipulator->countEdges();
+        return std::lgamma(num_edges*c) - std::lgamma((num_edges - delta_edges)*c);
+#endif
+    }
+
+    inline void Updater::calcEdgeLengthPriorDerivatives(double edge_length, double tree_length, double & d1, double & d2) const {
+        // First and second derivatives of the log edge length prior (the sum of the terms
+        // returned by calcLogEdgeLengthPrior) with respect to a single edge length
+#if defined(HOLDER_ETAL_PRIOR)
+        // Each edge length has its own Exponential prior, so neither length matters
+        (void)edge_length;
+        (void)tree_length;
+        double exponential_rate = _prior_parameters[0];
+        d1 = -exponential_rate;
+        d2 = 0.0;
+#else
+        double a = _prior_parameters[0];    // shape of Gamma prior on TL
+        double b = _prior_parameters[1];    // scale of Gamma prior on TL
+        double c = _prior_parameters[2];    // parameter of Dirichlet prior on edge length proportions
+        double TL = tree_length;
+        double n = _tree_manipulator->countEdges();
+        d1 = (a - 1.0)/TL - 1.0/b + (c - 1.0)/edge_length - n*(c - 1.0)/TL;
+        d2 = -(a - 1.0)/(TL*TL) - (c - 1.0)/(edge_length*edge_length) + n*(c - 1.0)/(TL*TL);
+#endif
+    }
+
+    inline void Updater::calcTreeLengthPriorDerivatives(double tree_length, double & d1, double & d2) const {
+        // First and second derivatives of the log edge length prior with respect to the tree
+        // length when all edge lengths are scaled together (edge length proportions do not change)
+#if defined(HOLDER_ETAL_PRIOR)
+        // Scaling every edge changes the sum of the Exponential terms at the same rate
+        (void)tree_length;
+        d1 = -_prior_parameters[0];
+        d2 = 0.0;
+#else
+        // Only the Gamma prior on TL changes; the Dirichlet term depends only on proportions
+        double a = _prior_parameters[0];    // shape of Gamma prior on TL
+        double b = _prior_parameters[1];    // scale of Gamma prior on TL
+        double TL = tree_length;
+        d1 = (a - 1.0)/TL - 1.0/b;
+        d2 = -(a - 1.0)/(TL*TL);
+#endif
+    }
+
     inline double Updater::getLogZero() {
         return _log_zero;
     }
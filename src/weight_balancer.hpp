@@ -0,0 +1,302 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+#include <limits>
+
+namespace lorad {
+
+    // Chooses updater weights that maximize the smallest effective sample size (ESS) per second
+    // over the continuous parameters of a chain. During a measurement window (part of burn-in)
+    // the chain reports, after every update, which updater was used, how long it took and the
+    // current (log-transformed) parameter values. From these the balancer estimates, for each
+    // updater i and parameter j,
+    //   a_ij = E[(x_j' - x_j)^2 | updater i] / (2 Var(x_j)),
+    // the expected squared jump distance of one update relative to that of an independent draw,
+    // and c_i, the mean wall time of one update. If updater i is chosen with probability p_i,
+    // the lag-1 autocorrelation of x_j per step is about 1 - r_j, where r_j = sum_i p_i a_ij,
+    // so ESS/N is about r_j/(2 - r_j) (treating x_j as an AR(1) process), and the time per step
+    // is sum_i p_i c_i. Squared jumps are used rather than autocorrelations or ESSs measured in
+    // the window because they can be estimated precisely from a short window. The smallest ESS
+    // per second is maximized by exponentiated gradient ascent on a soft minimum. Updaters whose
+    // moves are not reflected in the continuous parameters (topology moves) keep their
+    // probabilities, as do updaters used too rarely to be measured, and every balanced updater
+    // keeps at least _min_share of an equal split of the balanced probability.
+    class WeightBalancer {
+
+        public:
+
+            typedef std::shared_ptr< WeightBalancer > SharedPtr;
+
+                                        WeightBalancer();
+                                        ~WeightBalancer();
+
+            void                        clear();
+            void                        init(unsigned nupdaters, const std::vector<double> & params);
+            void                        recordStep(unsigned updater_index, double seconds, const std::vector<double> & params);
+            unsigned                    getNumSteps() const;
+
+            double                      calcMinESSPerSecond(const std::vector<double> & probs) const;
+            bool                        balance(const std::vector<double> & probs, const std::vector<bool> & fixed, std::vector<double> & new_probs);
+
+            static const unsigned       _min_updates;       // updates an updater needs during the window to be balanced
+            static const double         _min_share;
+            static const unsigned       _max_rounds;        // of exponentiated gradient ascent
+
+        private:
+
+            bool                        calcJumpRatios();
+            double                      calcMinESSPerSecond(const std::vector<double> & probs, std::vector<double> & ess_rates) const;
+
+            unsigned                    _nupdaters;
+            unsigned                    _dim;
+            unsigned                    _nsteps;
+            std::vector<unsigned>       _nupdates;          // per updater
+            std::vector<double>         _seconds;           // per updater
+            std::vector<double>         _sum_sq_jumps;      // updater i, parameter j at i*_dim + j
+            std::vector<double>         _prev_params;
+            std::vector<double>         _means;             // Welford, per parameter
+            std::vector<double>         _sum_sq_devs;       // Welford, per parameter
+            std::vector<double>         _costs;             // c_i (workspace)
+            std::vector<double>         _jump_ratios;       // a_ij (workspace); parameters that do not vary are dropped
+            unsigned                    _nvarying;          // number of parameters in _jump_ratios
+    };
+
+    inline WeightBalancer::WeightBalancer() {
+        clear();
+    }
+
+    inline WeightBalancer::~WeightBalancer() {
+    }
+
+    inline void WeightBalancer::clear() {
+        _nupdaters = 0;
+        _dim = 0;
+        _nsteps = 0;
+        _nupdates.clear();
+        _seconds.clear();
+        _sum_sq_jumps.clear();
+        _prev_params.clear();
+        _means.clear();
+        _sum_sq_devs.clear();
+        _costs.clear();
+        _jump_ratios.clear();
+        _nvarying = 0;
+    }
+
+    inline void WeightBalancer::init(unsigned nupdaters, const std::vector<double> & params) {
+        // Starts a new measurement window at the parameter values params
+        clear();
+        _nupdaters = nupdaters;
+        _dim = (unsigned)params.size();
+        _nupdates.assign(_nupdaters, 0);
+        _seconds.assign(_nupdaters, 0.0);
+        _sum_sq_jumps.assign(_nupdaters*_dim, 0.0);
+        _prev_params = params;
+        _means.assign(_dim, 0.0);
+        _sum_sq_devs.assign(_dim, 0.0);
+    }
+
+    inline void WeightBalancer::recordStep(unsigned updater_index, double seconds, const std::vector<double> & params) {
+        assert(updater_index < _nupdaters);
+
+        // Steps after which the number of parameters changed (e.g. a polytomy was
+        // resolved) cannot be compared with the previous step
+        if (params.size() != _dim) {
+            _prev_params = params;
+            return;
+        }
+
+        _nsteps++;
+        _nupdates[updater_index]++;
+        _seconds[updater_index] += seconds;
+        double * sum_sq_jumps = &_sum_sq_jumps[updater_index*_dim];
+        for (unsigned j = 0; j < _dim; j++) {
+            double jump = params[j] - _prev_params[j];
+            sum_sq_jumps[j] += jump*jump;
+            double dev = params[j] - _means[j];
+            _means[j] += dev/_nsteps;
+            _sum_sq_devs[j] += dev*(params[j] - _means[j]);
+        }
+        _prev_params = params;
+    }
+
+    inline unsigned WeightBalancer::getNumSteps() const {
+        return _nsteps;
+    }
+
+    inline bool WeightBalancer::calcJumpRatios() {
+        // Computes _costs and _jump_ratios; returns false if the window was too short
+        if (_nsteps < 2)
+            return false;
+        double total_seconds = 0.0;
+        for (double s : _seconds)
+            total_seconds += s;
+        double mean_cost = total_seconds/_nsteps;
+
+        _costs.resize(_nupdaters);
+        for (unsigned i = 0; i < _nupdaters; i++)
+            _costs[i] = (_nupdates[i] > 0 ? _seconds[i]/_nupdates[i] : mean_cost);
+
+        _nvarying = 0;
+        _jump_ratios.clear();
+        std::vector<unsigned> varying;
+        for (unsigned j = 0; j < _dim; j++) {
+            if (_sum_sq_devs[j]/(_nsteps - 1) > 0.0)
+                varying.push_back(j);
+        }
+        _nvarying = (unsigned)varying.size();
+        if (_nvarying == 0)
+            return false;
+        _jump_ratios.assign(_nupdaters*_nvarying, 0.0);
+        for (unsigned i = 0; i < _nupdaters; i++) {
+            if (_nupdates[i] == 0)
+                continue;
+            for (unsigned k = 0; k < _nvarying; k++) {
+                unsigned j = varying[k];
+                double var = _sum_sq_devs[j]/(_nsteps - 1);
+                double a = _sum_sq_jumps[i*_dim + j]/_nupdates[i]/(2.0*var);
+
+                // An update cannot do better than an independent draw
+                _jump_ratios[i*_nvarying + k] = std::min(a, 1.0);
+            }
+        }
+        return true;
+    }
+
+    inline double WeightBalancer::calcMinESSPerSecond(const std::vector<double> & probs, std::vector<double> & ess_rates) const {
+        // ESS per second of each parameter, and the smallest of these, when updaters are chosen
+        // with probabilities probs (only parameters that some updater moves are considered)
+        assert(probs.size() == _nupdaters);
+        double seconds_per_step = 0.0;
+        for (unsigned i = 0; i < _nupdaters; i++)
+            seconds_per_step += probs[i]*_costs[i];
+        double min_rate = std::numeric_limits<double>::max();
+        ess_rates.assign(_nvarying, 0.0);
+        for (unsigned k = 0; k < _nvarying; k++) {
+            double r = 0.0;
+            double rmax = 0.0;
+            for (unsigned i = 0; i < _nupdaters; i++) {
+                r += probs[i]*_jump_ratios[i*_nvarying + k];
+                rmax = std::max(rmax, _jump_ratios[i*_nvarying + k]);
+            }
+            if (rmax == 0.0)
+                continue;
+            r = std::min(r, 1.0);
+            ess_rates[k] = r/(2.0 - r)/seconds_per_step;
+            min_rate = std::min(min_rate, ess_rates[k]);
+        }
+        return (min_rate == std::numeric_limits<double>::max() ? 0.0 : min_rate);
+    }
+
+    inline double WeightBalancer::calcMinESSPerSecond(const std::vector<double> & probs) const {
+        std::vector<double> ess_rates;
+        return calcMinESSPerSecond(probs, ess_rates);
+    }
+
+    inline bool WeightBalancer::balance(const std::vector<double> & probs, const std::vector<bool> & fixed, std::vector<double> & new_probs) {
+        // Returns false (leaving new_probs equal to probs) if there is nothing that can be balanced
+        assert(probs.size() == _nupdaters && fixed.size() == _nupdaters);
+        new_probs = probs;
+        if (!calcJumpRatios())
+            return false;
+
+        // Balanced updaters share the probability of the current balanced updaters
+        std::vector<unsigned> balanced;
+        double mass = 0.0;
+        for (unsigned i = 0; i < _nupdaters; i++) {
+            if (!fixed[i] && _nupdates[i] >= _min_updates) {
+                balanced.push_back(i);
+                mass += probs[i];
+            }
+        }
+        unsigned nbalanced = (unsigned)balanced.size();
+        if (nbalanced < 2)
+            return false;
+        double floor = _min_share*mass/nbalanced;
+        double free_mass = mass - nbalanced*floor;
+
+        std::vector<double> ess_rates;
+        double start_rate = calcMinESSPerSecond(probs, ess_rates);
+        if (start_rate <= 0.0)
+            return false;
+
+        // Soft minimum of ESS rates scaled by the starting minimum; beta controls its sharpness
+        const double beta = 20.0;
+        // Ascent starts from the current probabilities (as nearly as the floor allows)
+        std::vector<double> w(nbalanced);
+        double sum_w = 0.0;
+        for (unsigned b = 0; b < nbalanced; b++) {
+            w[b] = std::max(probs[balanced[b]] - floor, 0.01*free_mass/nbalanced);
+            sum_w += w[b];
+        }
+        for (unsigned b = 0; b < nbalanced; b++)
+            w[b] /= sum_w;
+        std::vector<double> p = probs;
+        std::vector<double> best_p = probs;
+        double best_rate = start_rate;
+        std::vector<double> softmin_weights(_nvarying);
+        std::vector<double> gradient(nbalanced);
+        for (unsigned round = 0; round < _max_rounds; round++) {
+            for (unsigned b = 0; b < nbalanced; b++)
+                p[balanced[b]] = floor + free_mass*w[b];
+            double rate = calcMinESSPerSecond(p, ess_rates);
+            if (rate > best_rate) {
+                best_rate = rate;
+                best_p = p;
+            }
+
+            // Gradient of the soft minimum with respect to each balanced probability
+            double seconds_per_step = 0.0;
+            for (unsigned i = 0; i < _nupdaters; i++)
+                seconds_per_step += p[i]*_costs[i];
+            double min_scaled = std::numeric_limits<double>::max();
+            for (unsigned k = 0; k < _nvarying; k++) {
+                if (ess_rates[k] > 0.0)
+                    min_scaled = std::min(min_scaled, ess_rates[k]/start_rate);
+            }
+            double sum_softmin = 0.0;
+            for (unsigned k = 0; k < _nvarying; k++) {
+                softmin_weights[k] = (ess_rates[k] > 0.0 ? exp(-beta*(ess_rates[k]/start_rate - min_scaled)) : 0.0);
+                sum_softmin += softmin_weights[k];
+            }
+            double max_abs_gradient = 0.0;
+            for (unsigned b = 0; b < nbalanced; b++) {
+                unsigned i = balanced[b];
+                double g = 0.0;
+                for (unsigned k = 0; k < _nvarying; k++) {
+                    if (softmin_weights[k] == 0.0)
+                        continue;
+                    double r = 0.0;
+                    for (unsigned m = 0; m < _nupdaters; m++)
+                        r += p[m]*_jump_ratios[m*_nvarying + k];
+                    r = std::min(r, 1.0);
+                    double h = r/(2.0 - r);
+                    double dh = 2.0/((2.0 - r)*(2.0 - r));
+                    double d = (dh*_jump_ratios[i*_nvarying + k]*seconds_per_step - h*_costs[i])/(seconds_per_step*seconds_per_step);
+                    g += softmin_weights[k]*d;
+                }
+                gradient[b] = free_mass*g/(sum_softmin*start_rate);
+                max_abs_gradient = std::max(max_abs_gradient, std::fabs(gradient[b]));
+            }
+            if (max_abs_gradient == 0.0)
+                break;
+
+            // Exponentiated gradient step, normalized so that no weight changes by more than 10%
+            sum_w = 0.0;
+            for (unsigned b = 0; b < nbalanced; b++) {
+                w[b] *= exp(0.1*gradient[b]/max_abs_gradient);
+                sum_w += w[b];
+            }
+            for (unsigned b = 0; b < nbalanced; b++)
+                w[b] /= sum_w;
+        }
+
+        new_probs = best_p;
+        return true;
+    }
+
+}